@@ -68,6 +68,10 @@ enum
 
     UPKEEP_INTERVAL_SECS = 1,
 
+    /* the longest announceMore () goes without looking at every tier,
+       even if it thinks none of them need anything */
+    MAX_ANNOUNCE_MORE_INTERVAL_SECS = 60,
+
     /* this is how often to call the UDP tracker upkeep */
     TAU_UPKEEP_INTERVAL_SECS = 5
 };
@@ -149,9 +153,22 @@ typedef struct tr_announcer
     int slotsAvailable;
     int key;
     time_t tauUpkeepAt;
+
+    /* announceMore () has nothing to do until then, so it can skip
+       walking through all the tiers. zero means "look now" */
+    time_t announceMoreAt;
 }
 tr_announcer;
 
+/* call this when a tier might need to announce or scrape sooner
+   than announceMore () thinks */
+static void
+announcerWake (tr_announcer * announcer)
+{
+    if (announcer != NULL)
+        announcer->announceMoreAt = 0;
+}
+
 bool
 tr_announcerHasBacklog (const struct tr_announcer * announcer)
 {
@@ -703,6 +720,7 @@ tr_announcerAddTorrent (tr_torrent           * tor,
     tiers->callbackData = callbackData;
 
     addTorrentToTier (tiers, tor);
+    announcerWake (tor->session->announcer);
 
     return tiers;
 }
@@ -828,6 +846,7 @@ tier_announce_event_push (tr_tier            * tier,
     /* add it */
     tier->announce_events[tier->announce_event_count++] = e;
     tier->announceAt = announceAt;
+    announcerWake (tier->tor->session->announcer);
 
     dbgmsg_tier_announce_queue (tier);
     dbgmsg (tier, "announcing in %d seconds", (int)difftime (announceAt,tr_time ()));
@@ -1057,6 +1076,7 @@ on_announce_done (const tr_announce_response  * response,
         tier->lastAnnounceSucceeded = false;
         tier->isAnnouncing = false;
         tier->manualAnnounceAllowedAt = now + tier->announceMinIntervalSec;
+        tr_torrentSetChanged (tier->tor);
 
         if (!response->did_connect)
         {
@@ -1186,6 +1206,9 @@ on_announce_done (const tr_announce_response  * response,
         }
     }
 
+    /* the tier isn't announcing anymore, and a slot is free */
+    announcerWake (announcer);
+
     tr_free (data);
 }
 
@@ -1257,6 +1280,7 @@ tierAnnounce (tr_announcer * announcer, tr_tier * tier)
 
     tier->isAnnouncing = true;
     tier->lastAnnounceStartTime = now;
+    tr_torrentSetChanged (tor);
     --announcer->slotsAvailable;
 
     announce_request_delegate (announcer, req, on_announce_done, data);
@@ -1348,6 +1372,7 @@ on_scrape_done (const tr_scrape_response * response, void * vsession)
 
                 tier->isScraping = false;
                 tier->lastScrapeTime = now;
+                tr_torrentSetChanged (tier->tor);
                 tier->lastScrapeSucceeded = false;
                 tier->lastScrapeTimedOut = response->did_timeout;
 
@@ -1392,6 +1417,9 @@ on_scrape_done (const tr_scrape_response * response, void * vsession)
 
     if (announcer)
         ++announcer->slotsAvailable;
+
+    /* the tiers aren't scraping anymore, and a slot is free */
+    announcerWake (announcer);
 }
 
 static void
@@ -1441,6 +1469,7 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
             memcpy (req->info_hash[req->info_hash_count++], hash, SHA_DIGEST_LENGTH);
             tier->isScraping = true;
             tier->lastScrapeStartTime = now;
+            tr_torrentSetChanged (tier->tor);
             break;
         }
 
@@ -1454,6 +1483,7 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
             memcpy (req->info_hash[req->info_hash_count++], hash, SHA_DIGEST_LENGTH);
             tier->isScraping = true;
             tier->lastScrapeStartTime = now;
+            tr_torrentSetChanged (tier->tor);
         }
     }
 
@@ -1497,6 +1527,26 @@ tierNeedsToScrape (const tr_tier * tier, const time_t now)
         && (tier->currentTracker->scrape != NULL);
 }
 
+/* when tierNeedsToAnnounce () or tierNeedsToScrape () will next be true
+   if nothing else changes, or zero if the tier is busy or has nothing to do */
+static time_t
+tierGetNextUpkeepTime (const tr_tier * tier)
+{
+    time_t ret = 0;
+
+    if (tier->isScraping)
+        return 0;
+
+    if (!tier->isAnnouncing && tier->announceAt && (tier->announce_event_count > 0))
+        ret = tier->announceAt;
+
+    if (tier->scrapeAt && (tier->currentTracker != NULL) && (tier->currentTracker->scrape != NULL))
+        if (!ret || (tier->scrapeAt < ret))
+            ret = tier->scrapeAt;
+
+    return ret;
+}
+
 static int
 compareTiers (const void * va, const void * vb)
 {
@@ -1521,6 +1571,7 @@ announceMore (tr_announcer * announcer)
     int i;
     int n;
     tr_torrent * tor;
+    time_t nextAt;
     tr_ptrArray announceMe = TR_PTR_ARRAY_INIT;
     tr_ptrArray scrapeMe = TR_PTR_ARRAY_INIT;
     const time_t now = tr_time ();
@@ -1530,7 +1581,12 @@ announceMore (tr_announcer * announcer)
     if (announcer->slotsAvailable < 1)
         return;
 
-    /* build a list of tiers that need to be announced */
+    if (now < announcer->announceMoreAt)
+        return;
+
+    /* build a list of tiers that need to be announced,
+       and find out when the next of the others will need it */
+    nextAt = 0;
     tor = NULL;
     while ((tor = tr_torrentNext (announcer->session, tor))) {
         struct tr_torrent_tiers * tt = tor->tiers;
@@ -1540,6 +1596,11 @@ announceMore (tr_announcer * announcer)
                 tr_ptrArrayAppend (&announceMe, tier);
             else if (tierNeedsToScrape (tier, now))
                 tr_ptrArrayAppend (&scrapeMe, tier);
+            else {
+                const time_t at = tierGetNextUpkeepTime (tier);
+                if (at && (!nextAt || (at < nextAt)))
+                    nextAt = at;
+            }
         }
     }
 
@@ -1560,6 +1621,18 @@ announceMore (tr_announcer * announcer)
     /* scrape some */
     multiscrape (announcer, &scrapeMe);
 
+    /* if there wasn't room for all of them, try again next time */
+    if (n < tr_ptrArraySize (&announceMe))
+        nextAt = now;
+    for (i=0; i<tr_ptrArraySize (&scrapeMe); ++i)
+        if (!((tr_tier*)tr_ptrArrayNth (&scrapeMe, i))->isScraping)
+            nextAt = now;
+
+    /* the tiers that are announcing or scraping wake us when they're done */
+    if (!nextAt || (nextAt > now + MAX_ANNOUNCE_MORE_INTERVAL_SECS))
+        nextAt = now + MAX_ANNOUNCE_MORE_INTERVAL_SECS;
+    announcer->announceMoreAt = nextAt;
+
     /* cleanup */
     tr_ptrArrayDestruct (&scrapeMe, NULL);
     tr_ptrArrayDestruct (&announceMe, NULL);
@@ -1750,7 +1823,7 @@ copy_tier_attributes (struct tr_torrent_tiers * tt, const tr_tier * src)
 }
 
 void
-tr_announcerResetTorrent (tr_announcer * announcer UNUSED, tr_torrent * tor)
+tr_announcerResetTorrent (tr_announcer * announcer, tr_torrent * tor)
 {
     int i;
     const time_t now = tr_time ();
@@ -1779,6 +1852,8 @@ tr_announcerResetTorrent (tr_announcer * announcer UNUSED, tr_torrent * tor)
             if (!tt->tiers[i].wasCopied)
                 tier_announce_event_push (&tt->tiers[i], TR_ANNOUNCE_EVENT_STARTED, now);
 
+    announcerWake (announcer);
+
     /* cleanup */
     tiersDestruct (&old);
 }
@@ -0,0 +1,202 @@
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "bandwidth.h"
+
+#include "libtransmission-test.h"
+
+/***
+****  Simulated peers: each has some data queued, and they all share
+****  one speed limit, the way the session's bandwidth would clamp them.
+***/
+
+struct sim_peer
+{
+  size_t queued;
+  size_t sent;
+  size_t flushes;
+};
+
+static size_t budget_left = 0;
+
+static int
+simFlush (void * vpeer, tr_direction dir UNUSED, size_t byteCount)
+{
+  struct sim_peer * peer = vpeer;
+  const size_t n = MIN (byteCount, MIN (peer->queued, budget_left));
+
+  peer->queued -= n;
+  peer->sent += n;
+  ++peer->flushes;
+  budget_left -= n;
+
+  return n;
+}
+
+static size_t
+simPulse (struct sim_peer * peers, const tr_priority_t * priorities,
+          int peerCount, size_t budget)
+{
+  int i;
+  size_t flushes;
+  void ** ptrs = tr_new (void*, peerCount);
+
+  for (i=0; i<peerCount; ++i)
+    ptrs[i] = &peers[i];
+
+  budget_left = budget;
+  flushes = tr_bandwidthRoundRobin (ptrs, priorities, peerCount, TR_UP, budget, simFlush);
+
+  tr_free (ptrs);
+  return flushes;
+}
+
+/* with no limit, every peer gets to send everything it has */
+static int
+test_unlimited (void)
+{
+  int i;
+  size_t flushes;
+  size_t total = 0;
+  const int peerCount = 2000;
+  struct sim_peer * peers = tr_new0 (struct sim_peer, peerCount);
+  tr_priority_t * priorities = tr_new0 (tr_priority_t, peerCount);
+
+  for (i=0; i<peerCount; ++i)
+    {
+      peers[i].queued = (i % 16) * 4096 + 1;
+      total += peers[i].queued;
+    }
+
+  flushes = simPulse (peers, priorities, peerCount, SIZE_MAX);
+
+  for (i=0; i<peerCount; ++i)
+    {
+      check_int_eq (0, peers[i].queued);
+      check_int_eq ((i % 16) * 4096 + 1, peers[i].sent);
+    }
+  check_int_eq (0, SIZE_MAX - budget_left - total);
+
+  /* 3000-byte passes would have needed one flush per 3000 bytes */
+  check (flushes < total / 3000);
+  check (flushes <= (size_t)peerCount * 4);
+
+  tr_free (priorities);
+  tr_free (peers);
+  return 0;
+}
+
+/* with a limit, equal peers get equal shares and the budget gets used up */
+static int
+test_fairness (void)
+{
+  int i;
+  int pulse;
+  size_t least = SIZE_MAX;
+  size_t most = 0;
+  size_t total = 0;
+  const int peerCount = 200;
+  const int pulseCount = 200;
+  const size_t budget = 1000000;
+  struct sim_peer * peers = tr_new0 (struct sim_peer, peerCount);
+  tr_priority_t * priorities = tr_new0 (tr_priority_t, peerCount);
+
+  for (pulse=0; pulse<pulseCount; ++pulse)
+    {
+      for (i=0; i<peerCount; ++i)
+        peers[i].queued = SIZE_MAX / 2;
+
+      simPulse (peers, priorities, peerCount, budget);
+      check_int_eq (0, budget_left);
+    }
+
+  for (i=0; i<peerCount; ++i)
+    {
+      least = MIN (least, peers[i].sent);
+      most = MAX (most, peers[i].sent);
+      total += peers[i].sent;
+    }
+
+  check_int_eq (budget * pulseCount, total);
+  check (least * 5 >= total / peerCount * 4);
+  check (most * 5 <= total / peerCount * 6);
+
+  tr_free (priorities);
+  tr_free (peers);
+  return 0;
+}
+
+/* higher-priority peers get a bigger share, but the others aren't starved */
+static int
+test_priorities (void)
+{
+  int i;
+  int pulse;
+  size_t sent[3];
+  const int peerCount = 90;
+  const int pulseCount = 100;
+  const size_t budget = 2000000;
+  struct sim_peer * peers = tr_new0 (struct sim_peer, peerCount);
+  tr_priority_t * priorities = tr_new0 (tr_priority_t, peerCount);
+
+  for (i=0; i<peerCount; ++i)
+    priorities[i] = TR_PRI_LOW + (i % 3);
+
+  for (pulse=0; pulse<pulseCount; ++pulse)
+    {
+      for (i=0; i<peerCount; ++i)
+        peers[i].queued = SIZE_MAX / 2;
+
+      simPulse (peers, priorities, peerCount, budget);
+    }
+
+  memset (sent, 0, sizeof (sent));
+  for (i=0; i<peerCount; ++i)
+    sent[priorities[i] - TR_PRI_LOW] += peers[i].sent;
+
+  /* about 1:2:4 */
+  check (sent[0] > 0);
+  check (sent[1] * 10 >= sent[0] * 17 && sent[1] * 10 <= sent[0] * 23);
+  check (sent[2] * 10 >= sent[1] * 17 && sent[2] * 10 <= sent[1] * 23);
+
+  tr_free (priorities);
+  tr_free (peers);
+  return 0;
+}
+
+/* a peer that runs out of data drops out without holding up the others */
+static int
+test_short_peers (void)
+{
+  int i;
+  const int peerCount = 10;
+  struct sim_peer peers[10];
+  tr_priority_t priorities[10];
+
+  memset (peers, 0, sizeof (peers));
+  memset (priorities, 0, sizeof (priorities));
+  for (i=0; i<peerCount; ++i)
+    peers[i].queued = i == 0 ? 1000000 : 100;
+
+  simPulse (peers, priorities, peerCount, SIZE_MAX);
+
+  for (i=1; i<peerCount; ++i)
+    {
+      check_int_eq (100, peers[i].sent);
+      check_int_eq (1, peers[i].flushes);
+    }
+  check_int_eq (1000000, peers[0].sent);
+
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_unlimited,
+                             test_fairness,
+                             test_priorities,
+                             test_short_peers };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
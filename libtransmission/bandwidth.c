@@ -205,41 +205,101 @@ allocateBandwidth (tr_bandwidth  * b,
     }
 }
 
-static void
-phaseOne (tr_ptrArray * peerArray, tr_direction dir)
+/* the TCP payload of a full-size frame on a 1500-byte MTU, less the
+ * timestamp option. uTP's frames are a little smaller than this */
+#define FRAME_BYTES 1448
+
+/* a quantum of two frames lets uTP send a full-size frame right away and
+ * leave enough buffered for the next one to go out in a timely manner.
+ * The upper bound keeps one turn from holding up the rest of the round */
+#define MIN_QUANTUM (2 * FRAME_BYTES)
+#define MAX_QUANTUM (16 * FRAME_BYTES)
+
+struct rr_peer
 {
-  int n;
-  int peerCount = tr_ptrArraySize (peerArray);
-  struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase (peerArray);
+  void * peer;
+  size_t quantum;
+};
 
-  /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-   * peers from starving the others. Loop through the peers, giving each a
-   * small chunk of bandwidth. Keep looping until we run out of bandwidth
-   * and/or peers that can use it */
-  n = peerCount;
-  dbgmsg ("%d peers to go round-robin for %s", n, (dir==TR_UP?"upload":"download"));
-  while (n > 0)
+static unsigned int
+priorityWeight (tr_priority_t priority)
+{
+  switch (priority)
     {
-      const int i = tr_cryptoWeakRandInt (n); /* pick a peer at random */
+      case TR_PRI_HIGH:   return 4;
+      case TR_PRI_NORMAL: return 2;
+      default:            return 1;
+    }
+}
+
+/* This is deficit round-robin, but since a peer can use any number of
+ * the bytes it's offered, a deficit never carries over to the next round:
+ * a peer that leaves part of its quantum unused has nothing left to send
+ * or has hit a limit further up the tree, and it's done for this pulse. */
+size_t
+tr_bandwidthRoundRobin (void                  ** peers,
+                        const tr_priority_t    * priorities,
+                        int                      peerCount,
+                        tr_direction             dir,
+                        size_t                   budget,
+                        tr_bandwidthFlushFunc    flush)
+{
+  int i, n;
+  size_t quantum;
+  size_t flushCount = 0;
+  unsigned int weights = 0;
+  struct rr_peer * active;
+  int start;
+
+  if (peerCount < 1)
+    return 0;
+
+  /* start each pulse at a random peer, so that no one is always first */
+  active = tr_new (struct rr_peer, peerCount);
+  start = tr_cryptoWeakRandInt (peerCount);
+  for (i=0; i<peerCount; ++i)
+    {
+      const int j = (start + i) % peerCount;
+      active[i].peer = peers[j];
+      active[i].quantum = priorityWeight (priorities[j]);
+      weights += active[i].quantum;
+    }
 
-      /* value of 3000 bytes chosen so that when using uTP we'll send a full-size
-       * frame right away and leave enough buffered data for the next frame to go
-       * out in a timely manner. */
-      const size_t increment = 3000;
+  /* aim to spend the budget in about one round, in whole frames */
+  quantum = budget / weights;
+  quantum -= quantum % FRAME_BYTES;
+  quantum = MAX (MIN_QUANTUM, MIN (quantum, MAX_QUANTUM));
+  for (i=0; i<peerCount; ++i)
+    active[i].quantum *= quantum;
 
-      const int bytesUsed = tr_peerIoFlush (peers[i], dir, increment);
+  dbgmsg ("%d peers to go round-robin for %s, %zu bytes per turn",
+          peerCount, (dir==TR_UP?"upload":"download"), quantum);
 
-      dbgmsg ("peer #%d of %d used %d bytes in this pass", i, n, bytesUsed);
+  for (n=peerCount; n>0; )
+    {
+      int kept = 0;
 
-      if (bytesUsed != (int)increment)
+      for (i=0; i<n; ++i)
         {
-          /* peer is done writing for now; move it to the end of the list */
-          tr_peerIo * pio = peers[i];
-          peers[i] = peers[n-1];
-          peers[n-1] = pio;
-          --n;
+          const int bytesUsed = flush (active[i].peer, dir, active[i].quantum);
+
+          ++flushCount;
+
+          if (bytesUsed == (int)active[i].quantum)
+            active[kept++] = active[i];
         }
+
+      n = kept;
     }
+
+  tr_free (active);
+  return flushCount;
+}
+
+static int
+flushPeerIo (void * io, tr_direction dir, size_t byteCount)
+{
+  return tr_peerIoFlush (io, dir, byteCount);
 }
 
 void
@@ -249,9 +309,7 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
 {
   int i, peerCount;
   tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
-  tr_ptrArray low = TR_PTR_ARRAY_INIT;
-  tr_ptrArray high = TR_PTR_ARRAY_INIT;
-  tr_ptrArray normal = TR_PTR_ARRAY_INIT;
+  tr_priority_t * priorities;
   struct tr_peerIo ** peers;
 
   /* allocateBandwidth () is a helper function with two purposes:
@@ -260,6 +318,7 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
   allocateBandwidth (b, TR_PRI_LOW, dir, period_msec, &tmp);
   peers = (struct tr_peerIo**) tr_ptrArrayBase (&tmp);
   peerCount = tr_ptrArraySize (&tmp);
+  priorities = tr_new (tr_priority_t, peerCount);
 
   for (i=0; i<peerCount; ++i)
     {
@@ -268,21 +327,16 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
 
       tr_peerIoFlushOutgoingProtocolMsgs (io);
 
-      switch (io->priority)
-        {
-          case TR_PRI_HIGH:   tr_ptrArrayAppend (&high,   io); /* fall through */
-          case TR_PRI_NORMAL: tr_ptrArrayAppend (&normal, io); /* fall through */
-          default:            tr_ptrArrayAppend (&low,    io);
-        }
+      priorities[i] = io->priority;
     }
 
   /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-   * peers from starving the others. Loop through the peers, giving each a
-   * small chunk of bandwidth. Keep looping until we run out of bandwidth
-   * and/or peers that can use it */
-  phaseOne (&high, dir);
-  phaseOne (&normal, dir);
-  phaseOne (&low, dir);
+   * peers from starving the others. Go round the peers, giving each a
+   * quantum of bandwidth that depends on its priority. Keep going round
+   * until we run out of bandwidth and/or peers that can use it */
+  tr_bandwidthRoundRobin ((void**)peers, priorities, peerCount, dir,
+                          b->band[dir].isLimited ? b->band[dir].bytesLeft : SIZE_MAX,
+                          flushPeerIo);
 
   /* Second phase of IO. To help us scale in high bandwidth situations,
    * enable on-demand IO for peers with bandwidth left to burn.
@@ -295,9 +349,7 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
     tr_peerIoUnref (peers[i]);
 
   /* cleanup */
-  tr_ptrArrayDestruct (&normal, NULL);
-  tr_ptrArrayDestruct (&high, NULL);
-  tr_ptrArrayDestruct (&low, NULL);
+  tr_free (priorities);
   tr_ptrArrayDestruct (&tmp, NULL);
 }
 
@@ -197,6 +197,29 @@ void tr_bandwidthAllocate (tr_bandwidth  * bandwidth,
                            tr_direction    direction,
                            unsigned int    period_msec);
 
+/** @brief give one peer a turn. Returns how many of the bytes it used */
+typedef int (*tr_bandwidthFlushFunc)(void * peer, tr_direction dir, size_t byteCount);
+
+/**
+ * @brief share out a pulse's worth of bandwidth among peers, round-robin.
+ *
+ * Each peer is offered a quantum of bytes per round, weighted by its
+ * priority, until it uses less than it's offered. Quanta are sized from
+ * the budget and rounded to whole network frames; the budget itself is
+ * enforced by the flush function. Pass SIZE_MAX if there's no limit.
+ *
+ * This is tr_bandwidthAllocate ()'s first phase of IO, exposed so that
+ * it can be run against simulated peers.
+ *
+ * @return the number of times flush was called
+ */
+size_t tr_bandwidthRoundRobin (void                  ** peers,
+                               const tr_priority_t    * priorities,
+                               int                      peerCount,
+                               tr_direction             dir,
+                               size_t                   budget,
+                               tr_bandwidthFlushFunc    flush);
+
 /**
  * @brief clamps byteCount down to a number that this bandwidth will allow to be consumed
  */
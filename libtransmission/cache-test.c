@@ -0,0 +1,459 @@
+#include <stdio.h> /* fopen() */
+#include <string.h> /* memcmp() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "cache.h"
+#include "crypto.h" /* tr_sha1() */
+#include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread() */
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+struct cache_test
+{
+  tr_session * session;
+  tr_torrent * tor;
+  tr_cache * cache;
+
+  /* the block being read or written */
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t len;
+  uint8_t buf[MAX_BLOCK_SIZE];
+  int err;
+
+  /* the piece whose checksum is wanted */
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  bool has_hash;
+
+  volatile bool done;
+};
+
+static void
+getBlockLocation (const tr_torrent * tor, tr_block_index_t block,
+                  tr_piece_index_t * piece, uint32_t * offset, uint32_t * len)
+{
+  const uint64_t pos = (uint64_t)block * tor->blockSize;
+
+  *piece = pos / tor->info.pieceSize;
+  *offset = pos - (uint64_t)*piece * tor->info.pieceSize;
+  *len = tr_torBlockCountBytes (tor, block);
+}
+
+/* the contents we give the first file, so that each block is different */
+static uint8_t
+getByte (uint64_t i, int seed)
+{
+  return (uint8_t)((i * 7) + (i / MAX_BLOCK_SIZE) + seed);
+}
+
+static void
+getBlockContents (const tr_torrent * tor, tr_block_index_t block, int seed, uint8_t * setme)
+{
+  uint32_t i;
+  const uint64_t pos = (uint64_t)block * tor->blockSize;
+
+  for (i=0; i<tor->blockSize; ++i)
+    setme[i] = getByte (pos + i, seed);
+}
+
+/* write the first `n' blocks straight to the torrent's first file */
+static void
+writeFile (tr_torrent * tor, tr_block_index_t n, int seed)
+{
+  uint64_t i;
+  char * path = tr_torrentFindFile (tor, 0);
+  FILE * fp = fopen (path, "r+b");
+
+  for (i=0; i<(uint64_t)n*tor->blockSize; ++i)
+    fputc (getByte (i, seed), fp);
+  fclose (fp);
+
+  tr_free (path);
+}
+
+static void
+runInEventThread (struct cache_test * test, void (*func)(void*))
+{
+  test->done = false;
+  tr_runInEventThread (test->session, func, test);
+  while (!test->done)
+    tr_wait_msec (10);
+}
+
+static void
+readImpl (void * vtest)
+{
+  struct cache_test * test = vtest;
+
+  test->err = tr_cacheReadBlock (test->cache, test->tor, test->piece,
+                                 test->offset, test->len, test->buf);
+
+  test->done = true;
+}
+
+/* read part of a piece through the cache */
+static int
+readBytes (struct cache_test * test, tr_piece_index_t piece, uint32_t offset, uint32_t len)
+{
+  test->piece = piece;
+  test->offset = offset;
+  test->len = len;
+  runInEventThread (test, readImpl);
+
+  return test->err;
+}
+
+/* read a block through the cache, and check that it's got `seed''s contents */
+static bool
+readBlock (struct cache_test * test, tr_block_index_t block, int seed)
+{
+  uint8_t expected[MAX_BLOCK_SIZE];
+
+  getBlockLocation (test->tor, block, &test->piece, &test->offset, &test->len);
+  runInEventThread (test, readImpl);
+  getBlockContents (test->tor, block, seed, expected);
+
+  return !test->err && !memcmp (expected, test->buf, test->len);
+}
+
+static void
+writeImpl (void * vtest)
+{
+  struct cache_test * test = vtest;
+  struct evbuffer * buf = evbuffer_new ();
+
+  evbuffer_add (buf, test->buf, test->len);
+  test->err = tr_cacheWriteBlock (test->cache, test->tor, test->piece,
+                                  test->offset, test->len, buf);
+  evbuffer_free (buf);
+
+  test->done = true;
+}
+
+/* write a block with `seed''s contents through the cache */
+static int
+writeBlock (struct cache_test * test, tr_block_index_t block, int seed)
+{
+  getBlockLocation (test->tor, block, &test->piece, &test->offset, &test->len);
+  getBlockContents (test->tor, block, seed, test->buf);
+  runInEventThread (test, writeImpl);
+
+  return test->err;
+}
+
+/* write a block of zeroes, which is what the zero torrent's files hold */
+static int
+writeZeroBlock (struct cache_test * test, tr_block_index_t block)
+{
+  getBlockLocation (test->tor, block, &test->piece, &test->offset, &test->len);
+  memset (test->buf, 0, sizeof (test->buf));
+  runInEventThread (test, writeImpl);
+
+  return test->err;
+}
+
+static void
+getPieceHashImpl (void * vtest)
+{
+  struct cache_test * test = vtest;
+
+  test->has_hash = tr_cacheGetPieceHash (test->cache, test->tor, test->piece, test->hash);
+
+  test->done = true;
+}
+
+/* get the checksum the cache computed for a piece as its blocks were written */
+static bool
+getPieceHash (struct cache_test * test, tr_piece_index_t piece)
+{
+  test->piece = piece;
+  runInEventThread (test, getPieceHashImpl);
+
+  return test->has_hash;
+}
+
+/* checksum the piece's bytes that are on disk, the way it used to be done */
+static void
+readBackPieceHash (tr_torrent * tor, tr_piece_index_t piece, uint8_t * setme)
+{
+  const size_t len = tor->info.pieceSize;
+  uint8_t * buf = tr_new (uint8_t, len);
+  char * path = tr_torrentFindFile (tor, 0);
+  FILE * fp = fopen (path, "rb");
+
+  fseek (fp, (long)piece * len, SEEK_SET);
+  if (fread (buf, 1, len, fp) == len)
+    tr_sha1 (setme, buf, len, NULL);
+  fclose (fp);
+
+  tr_free (path);
+  tr_free (buf);
+}
+
+static void
+flushImpl (void * vtest)
+{
+  struct cache_test * test = vtest;
+
+  test->err = tr_cacheFlushTorrent (test->cache, test->tor);
+
+  test->done = true;
+}
+
+static void
+freeImpl (void * vtest)
+{
+  struct cache_test * test = vtest;
+
+  tr_cacheFree (test->cache);
+
+  test->done = true;
+}
+
+static void
+cacheTestInit (struct cache_test * test, int max_blocks)
+{
+  memset (test, 0, sizeof (struct cache_test));
+  test->session = libttest_session_init (NULL);
+  test->tor = libttest_zero_torrent_init (test->session);
+  libttest_zero_torrent_populate (test->tor, true);
+  test->cache = tr_cacheNew ((int64_t)max_blocks * MAX_BLOCK_SIZE);
+}
+
+static void
+cacheTestFree (struct cache_test * test)
+{
+  runInEventThread (test, freeImpl);
+  tr_torrentRemove (test->tor, false, NULL);
+  libttest_session_close (test->session);
+}
+
+/***
+****
+***/
+
+static int
+test_read_cache (void)
+{
+  tr_block_index_t i;
+  tr_cache_stats stats;
+  struct cache_test test;
+
+  cacheTestInit (&test, 3);
+  writeFile (test.tor, 16, 1);
+
+  /* a block that's read twice is read from disk once */
+  check (readBlock (&test, 0, 1));
+  writeFile (test.tor, 1, 2);
+  check (readBlock (&test, 0, 1));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (1, stats.hits);
+  check_int_eq (1, stats.misses);
+  check_int_eq (1, stats.clean_blocks);
+  check_int_eq (0, stats.dirty_blocks);
+  writeFile (test.tor, 16, 1);
+
+  /* the newest blocks push out the oldest ones
+     that haven't been read again */
+  check (readBlock (&test, 1, 1));
+  check (readBlock (&test, 2, 1));
+  check (readBlock (&test, 3, 1));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (1, stats.evictions);
+  check_int_eq (3, stats.clean_blocks);
+  check (readBlock (&test, 3, 1));
+  check (readBlock (&test, 2, 1));
+  check (readBlock (&test, 1, 1));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (3, stats.hits);
+  check_int_eq (5, stats.misses);
+  check_int_eq (2, stats.evictions);
+
+  /* a scan of blocks that are read once doesn't
+     push out the ones that have been read again */
+  check (readBlock (&test, 0, 1));
+  for (i=4; i<16; ++i)
+    check (readBlock (&test, i, 1));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (3, stats.clean_blocks);
+  check_int_eq (4, stats.hits);
+  check_int_eq (17, stats.misses);
+  check (readBlock (&test, 0, 1));
+  check (readBlock (&test, 2, 1));
+  check (readBlock (&test, 4, 1));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (6, stats.hits);
+  check_int_eq (18, stats.misses);
+
+  cacheTestFree (&test);
+  return 0;
+}
+
+static int
+test_read_cache_partial (void)
+{
+  tr_cache_stats stats;
+  struct cache_test test;
+
+  cacheTestInit (&test, 3);
+  writeFile (test.tor, 1, 1);
+
+  /* only whole blocks are kept */
+  check (!readBytes (&test, 0, 100, 100));
+  check (!readBytes (&test, 0, 100, 100));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (0, stats.hits);
+  check_int_eq (2, stats.misses);
+  check_int_eq (0, stats.clean_blocks);
+
+  /* but a whole block can answer a read of its start */
+  check (readBlock (&test, 0, 1));
+  check (!readBytes (&test, 0, 0, 100));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (1, stats.hits);
+  check_int_eq (1, stats.clean_blocks);
+
+  cacheTestFree (&test);
+  return 0;
+}
+
+static int
+test_dirty_blocks (void)
+{
+  tr_cache_stats stats;
+  struct cache_test test;
+
+  cacheTestInit (&test, 3);
+  writeFile (test.tor, 16, 1);
+
+  /* fill the cache with clean blocks */
+  check (readBlock (&test, 0, 1));
+  check (readBlock (&test, 1, 1));
+  check (readBlock (&test, 2, 1));
+
+  /* a written block pushes out a clean one,
+     and is read from the cache until it's flushed */
+  check (!writeBlock (&test, 5, 2));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (1, stats.dirty_blocks);
+  check_int_eq (2, stats.clean_blocks);
+  check_int_eq (1, stats.evictions);
+  check (readBlock (&test, 5, 2));
+
+  /* overwriting a cached clean block makes it dirty again */
+  check (!writeBlock (&test, 2, 2));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (2, stats.dirty_blocks);
+  check_int_eq (1, stats.clean_blocks);
+  check (readBlock (&test, 2, 2));
+
+  /* flushing the torrent writes the dirty blocks to disk
+     and forgets all of its blocks */
+  runInEventThread (&test, flushImpl);
+  check (!test.err);
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (0, stats.dirty_blocks);
+  check_int_eq (0, stats.clean_blocks);
+  check (readBlock (&test, 5, 2));
+  check (readBlock (&test, 2, 2));
+  check (readBlock (&test, 1, 1));
+  tr_cacheGetStats (test.cache, &stats);
+  check_int_eq (3, stats.clean_blocks);
+  check_int_eq (2, stats.hits);
+  check_int_eq (6, stats.misses);
+
+  cacheTestFree (&test);
+  return 0;
+}
+
+/***
+****
+***/
+
+static int
+test_piece_hash (void)
+{
+  uint8_t expected[SHA_DIGEST_LENGTH];
+  tr_piece_index_t last_piece;
+  struct cache_test test;
+
+  cacheTestInit (&test, 16);
+  last_piece = test.tor->info.pieceCount - 1;
+  writeFile (test.tor, 16, 1);
+
+  /* a piece whose blocks are written in order is hashed as they arrive,
+     and the checksum's the same as one of what's written to disk */
+  check (!writeBlock (&test, 2, 2));
+  check (!writeBlock (&test, 3, 2));
+  check (getPieceHash (&test, 1));
+  runInEventThread (&test, flushImpl);
+  readBackPieceHash (test.tor, 1, expected);
+  check (!memcmp (expected, test.hash, SHA_DIGEST_LENGTH));
+
+  /* a checksum is only handed out once */
+  check (!getPieceHash (&test, 1));
+
+  /* a block that arrives early is hashed when the gap in front of it is filled */
+  check (!writeBlock (&test, 5, 2));
+  check (!getPieceHash (&test, 2));
+  check (!writeBlock (&test, 4, 2));
+  check (getPieceHash (&test, 2));
+  runInEventThread (&test, flushImpl);
+  readBackPieceHash (test.tor, 2, expected);
+  check (!memcmp (expected, test.hash, SHA_DIGEST_LENGTH));
+
+  /* rewriting the first block starts the checksum over */
+  check (!writeBlock (&test, 6, 2));
+  check (!writeBlock (&test, 7, 2));
+  check (!writeBlock (&test, 6, 3));
+  check (getPieceHash (&test, 3));
+  runInEventThread (&test, flushImpl);
+  readBackPieceHash (test.tor, 3, expected);
+  check (!memcmp (expected, test.hash, SHA_DIGEST_LENGTH));
+
+  /* but rewriting a later block that's been hashed means
+     that the piece has to be read back to be checked */
+  check (!writeBlock (&test, 8, 2));
+  check (!writeBlock (&test, 9, 2));
+  check (!writeBlock (&test, 9, 3));
+  check (!getPieceHash (&test, 4));
+  runInEventThread (&test, flushImpl);
+
+  /* the checksum of good blocks matches the torrent's,
+     even for the short last piece that spans two files */
+  check (!writeZeroBlock (&test, 10));
+  check (!writeZeroBlock (&test, 11));
+  check (getPieceHash (&test, 5));
+  check (!memcmp (test.tor->info.pieces[5].hash, test.hash, SHA_DIGEST_LENGTH));
+  check (!writeZeroBlock (&test, test.tor->blockCount - 1));
+  check (getPieceHash (&test, last_piece));
+  check (!memcmp (test.tor->info.pieces[last_piece].hash, test.hash, SHA_DIGEST_LENGTH));
+  runInEventThread (&test, flushImpl);
+
+  cacheTestFree (&test);
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_read_cache,
+                             test_read_cache_partial,
+                             test_dirty_blocks,
+                             test_piece_hash };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -10,16 +10,21 @@
  * $Id: cache.c 13909 2013-01-31 17:39:06Z jordan $
  */
 
+#include <assert.h>
 #include <stdlib.h> /* qsort () */
 
 #include <event2/buffer.h>
 
+#include <openssl/sha.h>
+
 #include "transmission.h"
 #include "cache.h"
+#include "disk-queue.h"
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "ptrarray.h"
+#include "session.h"
 #include "torrent.h"
 #include "trevent.h"
 #include "utils.h"
@@ -38,6 +43,35 @@
 *****
 ****/
 
+/* The cache holds two kinds of blocks:
+ *
+ * - dirty blocks that we've downloaded but haven't written to disk yet.
+ *   They're kept in the order they were last written to, and the oldest
+ *   ones are flushed first.
+ *
+ * - clean blocks whose contents match what's on disk: blocks that
+ *   were flushed, and blocks that were read for peers. They're kept in
+ *   a segmented LRU so that a burst of one-off reads can't push out the
+ *   pieces that are popular with the swarm: new clean blocks go into
+ *   the probation segment, and are promoted to the protected segment
+ *   when they're read again. Clean blocks are evicted from the LRU end
+ *   of probation first.
+ *
+ * Every block is also in a hash table keyed by (torrent, block index).
+ *
+ * A block's bytes are always kept contiguous in its evbuf. That way the
+ * disk queue can write them in place while the cache goes on reading
+ * them, since evbuffer_pullup () on a single-chain evbuf changes nothing.
+ */
+
+enum
+{
+  LIST_DIRTY,
+  LIST_PROBATION,
+  LIST_PROTECTED,
+  LIST_COUNT
+};
+
 struct cache_block
 {
   tr_torrent * tor;
@@ -50,11 +84,76 @@ struct cache_block
   tr_block_index_t block;
 
   struct evbuffer * evbuf;
+
+  /* the pending write that's using evbuf, if any */
+  struct cache_flush * flush;
+
+  /* which list the block is in */
+  int list;
+
+  /* the list's links, from least to most recently used */
+  struct cache_block * prev;
+  struct cache_block * next;
+
+  /* the next block in the same hash bucket */
+  struct cache_block * hash_next;
+};
+
+struct block_list
+{
+  struct cache_block * head; /* least recently used */
+  struct cache_block * tail; /* most recently used */
+  int count;
+};
+
+/* a piece whose checksum is being computed as its blocks arrive */
+struct piece_hash
+{
+  tr_torrent * tor;
+  tr_piece_index_t piece;
+
+  /* the blocks before this offset have been hashed */
+  uint32_t next_offset;
+
+  SHA_CTX sha;
+};
+
+/* a write of a run of blocks that's waiting on the disk queue.
+   The disk queue writes straight from the blocks' evbufs, so a block
+   that's overwritten or freed in the meantime hands its evbuf over
+   to the flush, which frees it when the write is done. */
+struct cache_flush
+{
+  tr_cache * cache;
+  tr_diskQueue * queue;
+
+  int n;
+  struct cache_block ** blocks; /* NULL if the block let go of its evbuf */
+  struct evbuffer ** evbufs;
+};
+
+/* a read that's waiting on the disk queue */
+struct cache_read
+{
+  tr_cache * cache;
+  tr_diskQueue * queue;
+  tr_disk_done_func callback;
+  void * user_data;
 };
 
 struct tr_cache
 {
-  tr_ptrArray blocks;
+  struct cache_block ** buckets;
+  size_t bucket_count;
+
+  struct block_list lists[LIST_COUNT];
+
+  tr_ptrArray reads;
+  tr_ptrArray flushes;
+
+  /* struct piece_hash, sorted by torrent and piece */
+  tr_ptrArray piece_hashes;
+
   int max_blocks;
   size_t max_bytes;
 
@@ -62,160 +161,467 @@ struct tr_cache
   size_t disk_write_bytes;
   size_t cache_writes;
   size_t cache_write_bytes;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
 };
 
-/****
-*****
-****/
+/***
+****  Hash Index
+***/
 
-struct run_info
+enum
 {
-  int pos;
-  int rank;
-  time_t last_block_time;
-  bool is_multi_piece;
-  bool is_piece_done;
-  unsigned len;
+  MIN_BUCKET_COUNT = 256
 };
 
+static size_t
+getBucket (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  uint32_t h = ((uint32_t)tor->uniqueId << 24) ^ (uint32_t)block;
+
+  h *= 2654435761u;
+  h ^= h >> 16;
+
+  return h & (cache->bucket_count - 1);
+}
 
-/* return a count of how many contiguous blocks there are starting at this pos */
 static int
-getBlockRun (const tr_cache * cache, int pos, struct run_info * info)
+getBlockCount (const tr_cache * cache)
 {
   int i;
-  const int n = tr_ptrArraySize (&cache->blocks);
-  const struct cache_block ** blocks = (const struct cache_block**) tr_ptrArrayBase (&cache->blocks);
-  const struct cache_block * ref = blocks[pos];
-  tr_block_index_t block = ref->block;
+  int n = 0;
 
-  for (i=pos; i<n; ++i, ++block)
-    {
-      const struct cache_block * b = blocks[i];
-      if (b->block != block)
-        break;
-      if (b->tor != ref->tor)
-        break;
-      //fprintf (stderr, "pos %d tor %d block %zu time %zu\n", i, b->tor->uniqueId, (size_t)b->block, (size_t)b->time);
-    }
+  for (i=0; i<LIST_COUNT; ++i)
+    n += cache->lists[i].count;
+
+  return n;
+}
+
+static void
+indexRehash (tr_cache * cache, size_t bucket_count)
+{
+  size_t i;
+  struct cache_block ** old_buckets = cache->buckets;
+  const size_t old_bucket_count = cache->bucket_count;
 
-  //fprintf (stderr, "run is %d long from [%d to %d)\n", (int)(i-pos), i, (int)pos);
+  cache->buckets = tr_new0 (struct cache_block*, bucket_count);
+  cache->bucket_count = bucket_count;
 
-  if (info != NULL)
+  for (i=0; i<old_bucket_count; ++i)
     {
-      const struct cache_block * b = blocks[i-1];
-      info->last_block_time = b->time;
-      info->is_piece_done = tr_cpPieceIsComplete (&b->tor->completion, b->piece);
-      info->is_multi_piece = b->piece != blocks[pos]->piece ? true : false;
-      info->len = i - pos;
-      info->pos = pos;
+      struct cache_block * b = old_buckets[i];
+
+      while (b != NULL)
+        {
+          struct cache_block * next = b->hash_next;
+          const size_t pos = getBucket (cache, b->tor, b->block);
+          b->hash_next = cache->buckets[pos];
+          cache->buckets[pos] = b;
+          b = next;
+        }
     }
 
-  return i-pos;
+  tr_free (old_buckets);
 }
 
-/* higher rank comes before lower rank */
-static int
-compareRuns (const void * va, const void * vb)
+static void
+indexAdd (tr_cache * cache, struct cache_block * b)
 {
-  const struct run_info * a = va;
-  const struct run_info * b = vb;
-  return b->rank - a->rank;
+  size_t pos;
+
+  if ((size_t)getBlockCount (cache) >= cache->bucket_count)
+    indexRehash (cache, cache->bucket_count * 2);
+
+  pos = getBucket (cache, b->tor, b->block);
+  b->hash_next = cache->buckets[pos];
+  cache->buckets[pos] = b;
 }
 
-enum
+static void
+indexRemove (tr_cache * cache, struct cache_block * b)
 {
-  MULTIFLAG   = 0x1000,
-  DONEFLAG    = 0x2000,
-  SESSIONFLAG = 0x4000
-};
+  struct cache_block ** walk = &cache->buckets[getBucket (cache, b->tor, b->block)];
 
-/* Calculte runs
- *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
- *     Returns number of runs.
- */
-static int
-calcRuns (tr_cache * cache, struct run_info * runs)
+  while (*walk != b)
+    walk = &(*walk)->hash_next;
+
+  *walk = b->hash_next;
+  b->hash_next = NULL;
+}
+
+static struct cache_block *
+indexFind (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
 {
-  const int n = tr_ptrArraySize (&cache->blocks);
-  int i = 0, pos;
-  const time_t now = tr_time ();
+  struct cache_block * b = cache->buckets[getBucket (cache, tor, block)];
 
-  for (pos = 0; pos < n; pos += runs[i++].len)
-    {
-      int rank = getBlockRun (cache, pos, &runs[i]);
+  while ((b != NULL) && ((b->tor != tor) || (b->block != block)))
+    b = b->hash_next;
+
+  return b;
+}
+
+/***
+****  LRU Lists
+***/
+
+static void
+listRemove (tr_cache * cache, struct cache_block * b)
+{
+  struct block_list * l = &cache->lists[b->list];
+
+  if (b->prev != NULL)
+    b->prev->next = b->next;
+  else
+    l->head = b->next;
+
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+  else
+    l->tail = b->prev;
 
-      /* This adds ~2 to the relative length of a run for every minute it has
-       * languished in the cache. */
-      rank += (now - runs[i].last_block_time) / 32;
+  b->prev = b->next = NULL;
+  --l->count;
+}
+
+static void
+listAppend (tr_cache * cache, struct cache_block * b, int list)
+{
+  struct block_list * l = &cache->lists[list];
+
+  b->list = list;
+  b->prev = l->tail;
+  b->next = NULL;
+
+  if (l->tail != NULL)
+    l->tail->next = b;
+  else
+    l->head = b;
+
+  l->tail = b;
+  ++l->count;
+}
+
+static void
+listMove (tr_cache * cache, struct cache_block * b, int list)
+{
+  listRemove (cache, b);
+  listAppend (cache, b, list);
+}
 
-      /* Flushing stale blocks should be a top priority as the probability of them
-       * growing is very small, for blocks on piece boundaries, and nonexistant for
-       * blocks inside pieces. */
-      rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+static inline bool
+blockIsDirty (const struct cache_block * b)
+{
+  return b->list == LIST_DIRTY;
+}
 
-      /* Move the multi piece runs higher */
-      rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+/***
+****
+***/
 
-      runs[i].rank = rank;
+static struct cache_block *
+blockNew (tr_cache         * cache,
+          tr_torrent       * tor,
+          tr_piece_index_t   piece,
+          uint32_t           offset,
+          uint32_t           length,
+          int                list)
+{
+  struct cache_block * b = tr_new0 (struct cache_block, 1);
+
+  b->tor = tor;
+  b->piece = piece;
+  b->offset = offset;
+  b->length = length;
+  b->block = _tr_block (tor, piece, offset);
+  b->time = tr_time ();
+  b->evbuf = evbuffer_new ();
+
+  indexAdd (cache, b);
+  listAppend (cache, b, list);
+  return b;
+}
 
-      //fprintf (stderr,"block run at pos %d of length %d and age %ld adjusted +%d\n",runs[i].pos,runs[i].len,now-runs[i].last_block_time,rank-runs[i].len);
+/* stop `b' from using its evbuf; the pending flush owns it now */
+static void
+blockLeaveFlush (struct cache_block * b)
+{
+  int i;
+  struct cache_flush * flush = b->flush;
+
+  for (i=0; i<flush->n; ++i)
+    if (flush->blocks[i] == b)
+      flush->blocks[i] = NULL;
+
+  b->flush = NULL;
+  b->evbuf = NULL;
+}
+
+static void
+blockFree (tr_cache * cache, struct cache_block * b)
+{
+  indexRemove (cache, b);
+  listRemove (cache, b);
+
+  if (b->flush != NULL)
+    blockLeaveFlush (b);
+  else
+    evbuffer_free (b->evbuf);
+
+  tr_free (b);
+}
+
+/* a clean block was used again, so move it up in the LRU */
+static void
+blockTouch (tr_cache * cache, struct cache_block * b)
+{
+  if (!blockIsDirty (b))
+    listMove (cache, b, LIST_PROTECTED);
+}
+
+/* keep the protected segment from crowding out new blocks,
+   and evict clean blocks until we're back under the limit */
+static void
+enforceLimits (tr_cache * cache)
+{
+  const int max_protected = (cache->max_blocks * 2) / 3;
+  struct block_list * probation = &cache->lists[LIST_PROBATION];
+  struct block_list * protected = &cache->lists[LIST_PROTECTED];
+
+  while (protected->count > max_protected)
+    listMove (cache, protected->head, LIST_PROBATION);
+
+  while ((getBlockCount (cache) > cache->max_blocks) && (probation->count + protected->count > 0))
+    {
+      struct cache_block * b = probation->head ? probation->head : protected->head;
+      blockFree (cache, b);
+      ++cache->evictions;
     }
+}
 
-  //fprintf (stderr, "%d block runs\n", i);
-  qsort (runs, i, sizeof (struct run_info), compareRuns);
-  return i;
+/***
+****  Flushing
+***/
+
+static void
+flushFree (struct cache_flush * flush)
+{
+  int i;
+
+  for (i=0; i<flush->n; ++i)
+    {
+      if (flush->blocks[i] != NULL)
+        flush->blocks[i]->flush = NULL;
+      else
+        evbuffer_free (flush->evbufs[i]);
+    }
+
+  tr_free (flush->evbufs);
+  tr_free (flush->blocks);
+  tr_free (flush);
 }
 
+static void
+onFlushDone (tr_torrent            * tor UNUSED,
+             const tr_disk_result  * result UNUSED,
+             void                  * vflush)
+{
+  int i;
+  struct cache_flush * flush = vflush;
+  tr_ptrArray * flushes = &flush->cache->flushes;
+
+  for (i=0; i<tr_ptrArraySize (flushes); ++i)
+    if (tr_ptrArrayNth (flushes, i) == flush)
+      break;
+  tr_ptrArrayRemove (flushes, i);
+
+  flushFree (flush);
+}
+
+/* write out a run of contiguous dirty blocks.
+   Afterwards they're kept as clean blocks. */
 static int
-flushContiguous (tr_cache * cache, int pos, int n)
+flushRun (tr_cache * cache, struct cache_block ** blocks, int n)
 {
   int i;
   int err = 0;
-  uint8_t * buf = tr_new (uint8_t, n * MAX_BLOCK_SIZE);
-  uint8_t * walk = buf;
-  struct cache_block ** blocks = (struct cache_block**) tr_ptrArrayBase (&cache->blocks);
+  uint32_t len = 0;
+  tr_torrent * tor = blocks[0]->tor;
+  tr_diskQueue * q = tor->session->diskQueue;
+  struct evbuffer_iovec * iov = tr_new (struct evbuffer_iovec, n);
 
-  struct cache_block * b = blocks[pos];
-  tr_torrent * tor = b->tor;
-  const tr_piece_index_t piece = b->piece;
-  const uint32_t offset = b->offset;
-
-  for (i=pos; i<pos+n; ++i)
+  for (i=0; i<n; ++i)
     {
-      b = blocks[i];
-      evbuffer_copyout (b->evbuf, walk, b->length);
-      walk += b->length;
-      evbuffer_free (b->evbuf);
-      tr_free (b);
+      struct cache_block * b = blocks[i];
+
+      assert (blockIsDirty (b));
+      assert (b->flush == NULL);
+      assert (b->tor == tor);
+      assert (b->block == blocks[0]->block + i);
+
+      iov[i].iov_base = evbuffer_pullup (b->evbuf, -1);
+      iov[i].iov_len = b->length;
+      len += b->length;
+      listMove (cache, b, LIST_PROBATION);
     }
-  tr_ptrArrayErase (&cache->blocks, pos, pos+n);
 
-  err = tr_ioWrite (tor, piece, offset, walk-buf, buf);
-  tr_free (buf);
+  /* hand the write to the disk queue if there is one.
+     It writes from the blocks' own memory, so they're lent to it until it's done. */
+  if (q != NULL)
+    {
+      struct cache_flush * flush = tr_new (struct cache_flush, 1);
+
+      flush->cache = cache;
+      flush->queue = q;
+      flush->n = n;
+      flush->blocks = tr_memdup (blocks, sizeof (struct cache_block*) * n);
+      flush->evbufs = tr_new (struct evbuffer*, n);
+      for (i=0; i<n; ++i)
+        {
+          flush->evbufs[i] = blocks[i]->evbuf;
+          blocks[i]->flush = flush;
+        }
+
+      tr_ptrArrayAppend (&cache->flushes, flush);
+      tr_diskQueueWrite (q, tor, blocks[0]->piece, blocks[0]->offset, len, iov, n, onFlushDone, flush);
+    }
+  else
+    {
+      err = tr_ioWritev (tor, blocks[0]->piece, blocks[0]->offset, iov, n);
+    }
 
   ++cache->disk_writes;
-  cache->disk_write_bytes += walk-buf;
+  cache->disk_write_bytes += len;
+  tr_free (iov);
   return err;
 }
 
+/* starting from a dirty block, find the run of contiguous
+   dirty blocks around it. Returns the run's length. */
 static int
-flushRuns (tr_cache * cache, struct run_info * runs, int n)
+getDirtyRun (tr_cache * cache, struct cache_block * b, tr_ptrArray * setme)
 {
-  int i;
-  int err = 0;
+  tr_block_index_t first = b->block;
+  tr_block_index_t last = b->block;
+  tr_block_index_t i;
+  struct cache_block * walk;
+
+  while ((first > 0)
+      && ((walk = indexFind (cache, b->tor, first - 1)))
+      && blockIsDirty (walk))
+    --first;
+
+  while (((walk = indexFind (cache, b->tor, last + 1)))
+      && blockIsDirty (walk))
+    ++last;
+
+  tr_ptrArrayClear (setme);
+  for (i=first; i<=last; ++i)
+    tr_ptrArrayAppend (setme, indexFind (cache, b->tor, i));
+
+  return tr_ptrArraySize (setme);
+}
+
+static int
+compareBlocks (const void * va, const void * vb)
+{
+  const struct cache_block * a = *(const struct cache_block**) va;
+  const struct cache_block * b = *(const struct cache_block**) vb;
+
+  /* primary key: torrent id */
+  if (a->tor->uniqueId != b->tor->uniqueId)
+    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+
+  /* secondary key: block # */
+  if (a->block != b->block)
+    return a->block < b->block ? -1 : 1;
+
+  /* they're equal */
+  return 0;
+}
+
+/* find the blocks in [first..last] of a torrent (or of all torrents
+   if tor is NULL), sorted by torrent and block index. */
+static struct cache_block **
+getBlocks (tr_cache         * cache,
+           const tr_torrent * tor,
+           tr_block_index_t   first,
+           tr_block_index_t   last,
+           bool               dirty_only,
+           int              * setme_count)
+{
+  int n = 0;
+  struct cache_block ** ret = tr_new (struct cache_block*, getBlockCount (cache));
+
+  /* use whichever is smaller: the range of blocks, or the cache */
+  if ((tor != NULL) && ((uint64_t)last - first < (uint64_t)getBlockCount (cache)))
+    {
+      tr_block_index_t i;
+
+      for (i=first; i<=last; ++i)
+        {
+          struct cache_block * b = indexFind (cache, tor, i);
 
-  for (i=0; !err && i<n; i++)
+          if ((b != NULL) && (!dirty_only || blockIsDirty (b)))
+            ret[n++] = b;
+        }
+    }
+  else
     {
-      int j;
+      int list;
+
+      for (list=0; list<LIST_COUNT; ++list)
+        {
+          struct cache_block * b;
 
-      err = flushContiguous (cache, runs[i].pos, runs[i].len);
+          if (dirty_only && (list != LIST_DIRTY))
+            continue;
 
-      for (j=i+1; j<n; j++)
-        if (runs[j].pos > runs[i].pos)
-          runs[j].pos -= runs[i].len;
+          for (b=cache->lists[list].head; b!=NULL; b=b->next)
+            if ((tor == NULL) || ((b->tor == tor) && (first <= b->block) && (b->block <= last)))
+              ret[n++] = b;
+        }
+
+      qsort (ret, n, sizeof (struct cache_block*), compareBlocks);
     }
 
+  *setme_count = n;
+  return ret;
+}
+
+/* length of the run of contiguous blocks starting at blocks[pos] */
+static int
+getRunLength (struct cache_block ** blocks, int pos, int n)
+{
+  int i;
+
+  for (i=pos+1; i<n; ++i)
+    if ((blocks[i]->tor != blocks[pos]->tor) || (blocks[i]->block != blocks[pos]->block + (i-pos)))
+      break;
+
+  return i - pos;
+}
+
+static int
+flushRange (tr_cache         * cache,
+            tr_torrent       * tor,
+            tr_block_index_t   first,
+            tr_block_index_t   last)
+{
+  int n;
+  int pos;
+  int err = 0;
+  struct cache_block ** blocks = getBlocks (cache, tor, first, last, true, &n);
+
+  for (pos=0; !err && pos<n; )
+    {
+      const int len = getRunLength (blocks, pos, n);
+      err = flushRun (cache, blocks+pos, len);
+      pos += len;
+    }
+
+  tr_free (blocks);
   return err;
 }
 
@@ -223,22 +629,28 @@ static int
 cacheTrim (tr_cache * cache)
 {
   int err = 0;
+  struct block_list * dirty = &cache->lists[LIST_DIRTY];
 
-  if (tr_ptrArraySize (&cache->blocks) > cache->max_blocks)
+  if (dirty->count > cache->max_blocks)
     {
       /* Amount of cache that should be removed by the flush. This influences how large
        * runs can grow as well as how often flushes will happen. */
       const int cacheCutoff = 1 + cache->max_blocks / 4;
-      struct run_info * runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
-      int i=0, j=0;
-
-      calcRuns (cache, runs);
-      while (j < cacheCutoff)
-        j += runs[i++].len;
-      err = flushRuns (cache, runs, i);
-      tr_free (runs);
+      tr_ptrArray run = TR_PTR_ARRAY_INIT;
+      int flushed = 0;
+
+      /* flush the stalest blocks first, along with their neighbors */
+      while (!err && (flushed < cacheCutoff) && (dirty->head != NULL))
+        {
+          const int n = getDirtyRun (cache, dirty->head, &run);
+          err = flushRun (cache, (struct cache_block**) tr_ptrArrayBase (&run), n);
+          flushed += n;
+        }
+
+      tr_ptrArrayDestruct (&run, NULL);
     }
 
+  enforceLimits (cache);
   return err;
 }
 
@@ -276,7 +688,11 @@ tr_cache *
 tr_cacheNew (int64_t max_bytes)
 {
   tr_cache * cache = tr_new0 (tr_cache, 1);
-  cache->blocks = TR_PTR_ARRAY_INIT;
+  cache->buckets = tr_new0 (struct cache_block*, MIN_BUCKET_COUNT);
+  cache->bucket_count = MIN_BUCKET_COUNT;
+  cache->reads = TR_PTR_ARRAY_INIT;
+  cache->flushes = TR_PTR_ARRAY_INIT;
+  cache->piece_hashes = TR_PTR_ARRAY_INIT;
   cache->max_bytes = max_bytes;
   cache->max_blocks = getMaxBlocks (max_bytes);
   return cache;
@@ -285,45 +701,214 @@ tr_cacheNew (int64_t max_bytes)
 void
 tr_cacheFree (tr_cache * cache)
 {
-  assert (tr_ptrArrayEmpty (&cache->blocks));
-  tr_ptrArrayDestruct (&cache->blocks, NULL);
+  int i;
+
+  assert (cache->lists[LIST_DIRTY].count == 0);
+
+  for (i=0; i<LIST_COUNT; ++i)
+    while (cache->lists[i].head != NULL)
+      blockFree (cache, cache->lists[i].head);
+
+  for (i=0; i<tr_ptrArraySize (&cache->reads); ++i)
+    {
+      struct cache_read * read = tr_ptrArrayNth (&cache->reads, i);
+      tr_diskQueueCancel (read->queue, read);
+      tr_free (read);
+    }
+
+  /* the flushes' callbacks won't be invoked now,
+     so wait for their writes and then clean up after them */
+  for (i=0; i<tr_ptrArraySize (&cache->flushes); ++i)
+    {
+      struct cache_flush * flush = tr_ptrArrayNth (&cache->flushes, i);
+      tr_diskQueueCancel (flush->queue, flush);
+      tr_diskQueueWait (flush->queue, NULL);
+      flushFree (flush);
+    }
+
+  tr_ptrArrayDestruct (&cache->reads, NULL);
+  tr_ptrArrayDestruct (&cache->flushes, NULL);
+  tr_ptrArrayDestruct (&cache->piece_hashes, tr_free);
+  tr_free (cache->buckets);
   tr_free (cache);
 }
 
+void
+tr_cacheGetStats (const tr_cache * cache, tr_cache_stats * setme)
+{
+  setme->hits = cache->hits;
+  setme->misses = cache->misses;
+  setme->evictions = cache->evictions;
+  setme->dirty_blocks = cache->lists[LIST_DIRTY].count;
+  setme->clean_blocks = cache->lists[LIST_PROBATION].count
+                      + cache->lists[LIST_PROTECTED].count;
+}
+
 /***
 ****
 ***/
 
+/* find a block that can answer a read of [offset...offset+len) */
+static struct cache_block *
+findBlock (tr_cache           * cache,
+           tr_torrent         * torrent,
+           tr_piece_index_t     piece,
+           uint32_t             offset,
+           uint32_t             len)
+{
+  struct cache_block * b = indexFind (cache, torrent, _tr_block (torrent, piece, offset));
+
+  if ((b != NULL) && ((b->offset != offset) || (b->length < len)))
+    b = NULL;
+
+  return b;
+}
+
+/* remember a block that was read from disk, if it's a whole block */
+static void
+addCleanBlock (tr_cache         * cache,
+               tr_torrent       * torrent,
+               tr_piece_index_t   piece,
+               uint32_t           offset,
+               uint32_t           len,
+               const void       * data)
+{
+  const tr_block_index_t block = _tr_block (torrent, piece, offset);
+
+  if ((cache->max_blocks > 0)
+      && (tr_pieceOffset (torrent, piece, offset, 0) == (uint64_t)block * torrent->blockSize)
+      && (len == tr_torBlockCountBytes (torrent, block))
+      && (indexFind (cache, torrent, block) == NULL))
+    {
+      struct cache_block * b = blockNew (cache, torrent, piece, offset, len, LIST_PROBATION);
+      evbuffer_add (b->evbuf, data, len);
+      enforceLimits (cache);
+    }
+}
+
+/***
+****  Piece Hashes
+***/
+
 static int
-cache_block_compare (const void * va, const void * vb)
+comparePieceHashes (const void * va, const void * vb)
 {
-  const struct cache_block * a = va;
-  const struct cache_block * b = vb;
+  const struct piece_hash * a = va;
+  const struct piece_hash * b = vb;
 
-  /* primary key: torrent id */
   if (a->tor->uniqueId != b->tor->uniqueId)
     return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
 
-  /* secondary key: block # */
-  if (a->block != b->block)
-    return a->block < b->block ? -1 : 1;
+  if (a->piece != b->piece)
+    return a->piece < b->piece ? -1 : 1;
 
-  /* they're equal */
   return 0;
 }
 
-static struct cache_block *
-findBlock (tr_cache           * cache,
-           tr_torrent         * torrent,
-           tr_piece_index_t     piece,
-           uint32_t             offset)
+static struct piece_hash *
+findPieceHash (tr_cache * cache, tr_torrent * tor, tr_piece_index_t piece)
+{
+  struct piece_hash key;
+  key.tor = tor;
+  key.piece = piece;
+  return tr_ptrArrayFindSorted (&cache->piece_hashes, &key, comparePieceHashes);
+}
+
+static void
+removePieceHash (tr_cache * cache, struct piece_hash * ph)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = _tr_block (torrent, piece, offset);
-  return tr_ptrArrayFindSorted (&cache->blocks, &key, cache_block_compare);
+  tr_ptrArrayRemoveSorted (&cache->piece_hashes, ph, comparePieceHashes);
+  tr_free (ph);
 }
 
+/* Fold a newly-written block into its piece's checksum if it's the
+ * next one the checksum needs. Blocks that arrive early are picked up
+ * from the cache when the gap in front of them is filled. If the gap
+ * is never filled while they're still cached, the piece is checked
+ * the old way, by reading it back. */
+static void
+updatePieceHash (tr_cache * cache, struct cache_block * b)
+{
+  struct piece_hash * ph = findPieceHash (cache, b->tor, b->piece);
+
+  if (b->offset == 0)
+    {
+      if (ph == NULL)
+        {
+          ph = tr_new (struct piece_hash, 1);
+          ph->tor = b->tor;
+          ph->piece = b->piece;
+          tr_ptrArrayInsertSorted (&cache->piece_hashes, ph, comparePieceHashes);
+        }
+
+      ph->next_offset = 0;
+      SHA1_Init (&ph->sha);
+    }
+  else if ((ph != NULL) && (b->offset < ph->next_offset))
+    {
+      /* a block we've already hashed was overwritten */
+      removePieceHash (cache, ph);
+      return;
+    }
+
+  while ((ph != NULL)
+      && (b != NULL)
+      && (b->piece == ph->piece)
+      && (b->offset == ph->next_offset))
+    {
+      SHA1_Update (&ph->sha, evbuffer_pullup (b->evbuf, -1), b->length);
+      ph->next_offset += b->length;
+      b = indexFind (cache, b->tor, b->block + 1);
+    }
+}
+
+bool
+tr_cacheGetPieceHash (tr_cache         * cache,
+                      tr_torrent       * torrent,
+                      tr_piece_index_t   piece,
+                      uint8_t          * setme)
+{
+  bool done = false;
+  struct piece_hash * ph = findPieceHash (cache, torrent, piece);
+
+  if (ph != NULL)
+    {
+      done = ph->next_offset == tr_torPieceCountBytes (torrent, piece);
+
+      if (done)
+        SHA1_Final (setme, &ph->sha);
+
+      removePieceHash (cache, ph);
+    }
+
+  return done;
+}
+
+static void
+removeTorrentPieceHashes (tr_cache * cache, const tr_torrent * tor)
+{
+  int i;
+
+  for (i=0; i<tr_ptrArraySize (&cache->piece_hashes); )
+    {
+      struct piece_hash * ph = tr_ptrArrayNth (&cache->piece_hashes, i);
+
+      if (ph->tor != tor)
+        {
+          ++i;
+        }
+      else
+        {
+          tr_ptrArrayRemove (&cache->piece_hashes, i);
+          tr_free (ph);
+        }
+    }
+}
+
+/***
+****
+***/
+
 int
 tr_cacheWriteBlock (tr_cache         * cache,
                     tr_torrent       * torrent,
@@ -332,20 +917,20 @@ tr_cacheWriteBlock (tr_cache         * cache,
                     uint32_t           length,
                     struct evbuffer  * writeme)
 {
-  struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  struct cache_block * cb = indexFind (cache, torrent, _tr_block (torrent, piece, offset));
 
   assert (tr_amInEventThread (torrent->session));
 
   if (cb == NULL)
+    cb = blockNew (cache, torrent, piece, offset, length, LIST_DIRTY);
+  else
+    listMove (cache, cb, LIST_DIRTY);
+
+  /* don't touch an evbuf that a pending flush is writing from */
+  if (cb->flush != NULL)
     {
-      cb = tr_new (struct cache_block, 1);
-      cb->tor = torrent;
-      cb->piece = piece;
-      cb->offset = offset;
-      cb->length = length;
-      cb->block = _tr_block (torrent, piece, offset);
+      blockLeaveFlush (cb);
       cb->evbuf = evbuffer_new ();
-      tr_ptrArrayInsertSorted (&cache->blocks, cb, cache_block_compare);
     }
 
   cb->time = tr_time ();
@@ -353,10 +938,13 @@ tr_cacheWriteBlock (tr_cache         * cache,
   assert (cb->length == length);
   evbuffer_drain (cb->evbuf, evbuffer_get_length (cb->evbuf));
   evbuffer_remove_buffer (writeme, cb->evbuf, cb->length);
+  evbuffer_pullup (cb->evbuf, -1);
 
   cache->cache_writes++;
   cache->cache_write_bytes += cb->length;
 
+  updatePieceHash (cache, cb);
+
   return cacheTrim (cache);
 }
 
@@ -369,16 +957,129 @@ tr_cacheReadBlock (tr_cache         * cache,
                    uint8_t          * setme)
 {
   int err = 0;
-  struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  struct cache_block * cb = findBlock (cache, torrent, piece, offset, len);
 
-  if (cb)
-    evbuffer_copyout (cb->evbuf, setme, len);
+  if (cb != NULL)
+    {
+      ++cache->hits;
+      blockTouch (cache, cb);
+      evbuffer_copyout (cb->evbuf, setme, len);
+    }
   else
-    err = tr_ioRead (torrent, piece, offset, len, setme);
+    {
+      ++cache->misses;
+
+      if ((torrent->session->diskQueue == NULL)
+          || !tr_diskQueueFindWrite (torrent->session->diskQueue, torrent, piece, offset, len, setme))
+        err = tr_ioRead (torrent, piece, offset, len, setme);
+
+      if (!err)
+        addCleanBlock (cache, torrent, piece, offset, len, setme);
+    }
 
   return err;
 }
 
+static void
+onDiskReadDone (tr_torrent * tor, const tr_disk_result * result, void * vread)
+{
+  int i;
+  struct cache_read * read = vread;
+  tr_cache * cache = read->cache;
+
+  for (i=0; i<tr_ptrArraySize (&cache->reads); ++i)
+    if (tr_ptrArrayNth (&cache->reads, i) == read)
+      break;
+  tr_ptrArrayRemove (&cache->reads, i);
+
+  if ((tor != NULL)
+      && !result->err
+      && (!result->hash_tested || result->hash_passed)
+      && (evbuffer_get_length (result->data) == result->length))
+    addCleanBlock (cache, tor, result->piece, result->offset, result->length,
+                   evbuffer_pullup (result->data, -1));
+
+  read->callback (tor, result, read->user_data);
+  tr_free (read);
+}
+
+bool
+tr_cacheReadBlockAsync (tr_cache           * cache,
+                        tr_torrent         * torrent,
+                        tr_piece_index_t     piece,
+                        uint32_t             offset,
+                        uint32_t             len,
+                        bool                 check_piece,
+                        bool                 by_reference,
+                        struct evbuffer    * setme,
+                        tr_disk_done_func    callback,
+                        void               * user_data)
+{
+  struct cache_block * cb;
+  struct cache_read * read;
+  tr_diskQueue * q = torrent->session->diskQueue;
+
+  assert (q != NULL);
+
+  /* the checksum has to be computed from what's on disk,
+     so write out the piece's cached blocks first */
+  if (check_piece)
+    {
+      tr_block_index_t first, last;
+      tr_torGetPieceBlockRange (torrent, piece, &first, &last);
+      flushRange (cache, torrent, first, last);
+    }
+  else if ((cb = findBlock (cache, torrent, piece, offset, len)))
+    {
+      ++cache->hits;
+      blockTouch (cache, cb);
+      evbuffer_add (setme, evbuffer_pullup (cb->evbuf, -1), len);
+      return true;
+    }
+
+  ++cache->misses;
+
+  /* if the file's already open and the disk has the latest bytes,
+     let the kernel send them straight from its page cache */
+  if (by_reference
+      && !check_piece
+      && !tr_diskQueueHasWrite (q, torrent, piece, offset, len)
+      && !tr_ioAddFileRef (torrent, piece, offset, len, setme))
+    return true;
+
+  read = tr_new (struct cache_read, 1);
+  read->cache = cache;
+  read->queue = q;
+  read->callback = callback;
+  read->user_data = user_data;
+  tr_ptrArrayAppend (&cache->reads, read);
+
+  tr_diskQueueRead (q, torrent, piece, offset, len, check_piece, onDiskReadDone, read);
+  return false;
+}
+
+void
+tr_cacheCancelReads (tr_cache * cache, const void * user_data)
+{
+  int i;
+
+  for (i=0; i<tr_ptrArraySize (&cache->reads); )
+    {
+      struct cache_read * read = tr_ptrArrayNth (&cache->reads, i);
+
+      if (read->user_data != user_data)
+        {
+          ++i;
+        }
+      else
+        {
+          tr_diskQueueCancel (read->queue, read);
+          tr_ptrArrayRemove (&cache->reads, i);
+          tr_free (read);
+        }
+    }
+}
+
 int
 tr_cachePrefetchBlock (tr_cache         * cache,
                        tr_torrent       * torrent,
@@ -387,7 +1088,7 @@ tr_cachePrefetchBlock (tr_cache         * cache,
                        uint32_t           len)
 {
   int err = 0;
-  struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  struct cache_block * cb = findBlock (cache, torrent, piece, offset, len);
 
   if (cb == NULL)
     err = tr_ioPrefetch (torrent, piece, offset, len);
@@ -399,82 +1100,73 @@ tr_cachePrefetchBlock (tr_cache         * cache,
 ****
 ***/
 
-static int
-findBlockPos (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t block)
-{
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = block;
-  return tr_ptrArrayLowerBound (&cache->blocks, &key, cache_block_compare, NULL);
-}
-
 int tr_cacheFlushDone (tr_cache * cache)
 {
+  int n;
+  int pos;
   int err = 0;
+  struct cache_block ** blocks = getBlocks (cache, NULL, 0, 0, true, &n);
 
-  if (tr_ptrArraySize (&cache->blocks) > 0)
+  /* flush the runs that are done growing:
+     ones that complete a piece, or that span more than one piece */
+  for (pos=0; !err && pos<n; )
     {
-      int i, n;
-      struct run_info * runs;
-
-      runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
-      i = 0;
-      n = calcRuns (cache, runs);
+      const int len = getRunLength (blocks, pos, n);
+      const struct cache_block * last = blocks[pos+len-1];
 
-      while (i < n && (runs[i].is_piece_done || runs[i].is_multi_piece))
-        runs[i++].rank |= SESSIONFLAG;
+      if ((last->piece != blocks[pos]->piece)
+          || tr_cpPieceIsComplete (&last->tor->completion, last->piece))
+        err = flushRun (cache, blocks+pos, len);
 
-      err = flushRuns (cache, runs, i);
-      tr_free (runs);
+      pos += len;
     }
 
+  tr_free (blocks);
+  enforceLimits (cache);
   return err;
 }
 
 int
 tr_cacheFlushFile (tr_cache * cache, tr_torrent * torrent, tr_file_index_t i)
 {
-  int pos;
-  int err = 0;
+  int err;
   tr_block_index_t first;
   tr_block_index_t last;
 
   tr_torGetFileBlockRange (torrent, i, &first, &last);
-  pos = findBlockPos (cache, torrent, first);
   dbgmsg ("flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last);
 
   /* flush out all the blocks in that file */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
-    {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
+  err = flushRange (cache, torrent, first, last);
+  enforceLimits (cache);
 
-      if (b->tor != torrent)
-        break;
-      if ((b->block < first) || (b->block > last))
-        break;
-
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
-    }
+  /* the caller is about to close or move the file,
+     so wait for the queued writes to land */
+  if (torrent->session->diskQueue != NULL)
+    tr_diskQueueWait (torrent->session->diskQueue, torrent);
 
-    return err;
+  return err;
 }
 
 int
 tr_cacheFlushTorrent (tr_cache * cache, tr_torrent * torrent)
 {
-  int err = 0;
-  const int pos = findBlockPos (cache, torrent, 0);
+  int i, n;
+  int err;
+  struct cache_block ** blocks;
 
   /* flush out all the blocks in that torrent */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
-    {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
+  err = flushRange (cache, torrent, 0, torrent->blockCount - 1);
 
-      if (b->tor != torrent)
-        break;
+  /* and forget the clean ones */
+  removeTorrentPieceHashes (cache, torrent);
+  blocks = getBlocks (cache, torrent, 0, torrent->blockCount - 1, false, &n);
+  for (i=0; i<n; ++i)
+    blockFree (cache, blocks[i]);
+  tr_free (blocks);
 
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
-    }
+  if (torrent->session->diskQueue != NULL)
+    tr_diskQueueWait (torrent->session->diskQueue, torrent);
 
   return err;
 }
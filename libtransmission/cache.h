@@ -17,10 +17,29 @@
 #ifndef TR_CACHE_H
 #define TR_CACHE_H
 
+#include "disk-queue.h" /* tr_disk_done_func */
+
 struct evbuffer;
 
 typedef struct tr_cache tr_cache;
 
+typedef struct tr_cache_stats
+{
+  /* reads that were / weren't answered from the cache */
+  uint64_t hits;
+  uint64_t misses;
+
+  /* clean blocks that were dropped to make room */
+  uint64_t evictions;
+
+  /* blocks waiting to be written to disk */
+  int dirty_blocks;
+
+  /* blocks whose contents are already on disk */
+  int clean_blocks;
+}
+tr_cache_stats;
+
 /***
 ****
 ***/
@@ -37,6 +56,8 @@ int tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes);
 
 int64_t tr_cacheGetLimit (const tr_cache *);
 
+void tr_cacheGetStats (const tr_cache * cache, tr_cache_stats * setme);
+
 int tr_cacheWriteBlock (tr_cache         * cache,
                         tr_torrent       * torrent,
                         tr_piece_index_t   piece,
@@ -51,18 +72,56 @@ int tr_cacheReadBlock (tr_cache         * cache,
                        uint32_t           len,
                        uint8_t          * setme);
 
+/**
+ * @brief read a block without blocking the libevent thread.
+ *
+ * If the block is in the cache and `check_piece' is false, it's
+ * appended to `setme' and true is returned. Otherwise the read is
+ * handed to the disk queue, false is returned, and `callback' is
+ * invoked when the read is done.
+ *
+ * If `by_reference' is true, a block that isn't cached may instead be
+ * appended to `setme' as a reference to its file (see tr_ioAddFileRef ()).
+ * Only pass true if `setme' is going to be written to a socket as-is.
+ */
+bool tr_cacheReadBlockAsync (tr_cache           * cache,
+                             tr_torrent         * torrent,
+                             tr_piece_index_t     piece,
+                             uint32_t             offset,
+                             uint32_t             len,
+                             bool                 check_piece,
+                             bool                 by_reference,
+                             struct evbuffer    * setme,
+                             tr_disk_done_func    callback,
+                             void               * user_data);
+
+/** @brief forget the pending tr_cacheReadBlockAsync () calls made with `user_data' */
+void tr_cacheCancelReads (tr_cache * cache, const void * user_data);
+
 int tr_cachePrefetchBlock (tr_cache         * cache,
                            tr_torrent       * torrent,
                            tr_piece_index_t   piece,
                            uint32_t           offset,
                            uint32_t           len);
 
+/**
+ * @brief get the checksum of a piece whose blocks were hashed as they
+ *        were written to the cache.
+ * @return false if the piece's blocks weren't all seen in order,
+ *         in which case it has to be read back from disk to be checked
+ */
+bool tr_cacheGetPieceHash (tr_cache         * cache,
+                           tr_torrent       * torrent,
+                           tr_piece_index_t   piece,
+                           uint8_t          * setme);
+
 /***
 ****
 ***/
 
 int tr_cacheFlushDone (tr_cache * cache);
 
+/** @brief write out the torrent's blocks and forget the ones already on disk */
 int tr_cacheFlushTorrent (tr_cache    * cache,
                           tr_torrent  * torrent);
 
@@ -0,0 +1,191 @@
+#include "transmission.h"
+#include "connect-rate.h"
+
+#include "libtransmission-test.h"
+
+/***
+****  A simulated network: some of the peers are always unreachable, and
+****  if we connect faster than it can take, nearly all of them are.
+***/
+
+struct network
+{
+  int unreachable_percent;
+  uint64_t connect_msec;
+
+  /* attempts per second that overwhelm it, or 0 for none */
+  int overload_rate;
+  int overload_unreachable_percent;
+  uint64_t overload_connect_msec;
+
+  /* when false, there are no candidates to connect to */
+  bool demand;
+};
+
+static uint64_t now_msec = 0;
+static int unreachable_debt = 0;
+
+static void
+runSeconds (tr_connect_rate * cr, const struct network * net, int seconds)
+{
+  int i;
+  int j;
+
+  /* the reconnect pulse runs twice a second */
+  for (i=0; i<seconds*2; ++i)
+    {
+      bool overloaded;
+      const int allowed = tr_connectRateAllowed (cr, now_msec);
+      const int attempted = net->demand ? allowed : 0;
+
+      tr_connectRateAttempted (cr, allowed, attempted);
+
+      overloaded = (net->overload_rate > 0) && (attempted * 2 > net->overload_rate);
+
+      for (j=0; j<attempted; ++j)
+        {
+          const int percent = overloaded ? net->overload_unreachable_percent : net->unreachable_percent;
+
+          /* spread the unreachable ones out evenly */
+          unreachable_debt += percent;
+          if (unreachable_debt >= 100)
+            {
+              unreachable_debt -= 100;
+              tr_connectRateAddResult (cr, TR_CONNECT_UNREACHABLE, 0);
+            }
+          else
+            tr_connectRateAddResult (cr, TR_CONNECT_CONNECTED,
+                                     overloaded ? net->overload_connect_msec : net->connect_msec);
+        }
+
+      now_msec += 500;
+    }
+}
+
+static double
+getRate (const tr_connect_rate * cr)
+{
+  tr_connect_rate_stats stats;
+  tr_connectRateGetStats (cr, &stats);
+  return stats.attempts_per_second;
+}
+
+/* a healthy network gets the whole rate, quickly */
+static int
+test_ramp_up (void)
+{
+  tr_connect_rate cr;
+  tr_connect_rate_stats stats;
+  const struct network net = { 60, 100, 0, 0, 0, true };
+
+  tr_connectRateConstruct (&cr, now_msec);
+  check_int_eq (TR_CONNECT_RATE_INITIAL, (int)getRate (&cr));
+
+  runSeconds (&cr, &net, 40);
+  tr_connectRateGetStats (&cr, &stats);
+  check_int_eq (TR_CONNECT_RATE_MAX, (int)stats.attempts_per_second);
+  check_int_eq (0, stats.backoffs);
+  check_int_eq (stats.attempts, stats.connected + stats.unreachable);
+  check_int_eq (100, stats.connect_msec);
+
+  return 0;
+}
+
+/* an overwhelmed network gets backed off from, but not starved */
+static int
+test_overload (void)
+{
+  int i;
+  double most = 0;
+  tr_connect_rate cr;
+  tr_connect_rate_stats stats;
+  const struct network net = { 60, 100, 50, 95, 100, true };
+
+  tr_connectRateConstruct (&cr, now_msec);
+  runSeconds (&cr, &net, 30);
+
+  for (i=0; i<60; ++i)
+    {
+      runSeconds (&cr, &net, 5);
+      most = MAX (most, getRate (&cr));
+    }
+
+  tr_connectRateGetStats (&cr, &stats);
+  check (stats.backoffs > 0);
+  check (most < 50 * 2);
+  check (stats.attempts_per_second >= TR_CONNECT_RATE_MIN);
+
+  return 0;
+}
+
+/* handshakes that slow down are a sign of trouble too */
+static int
+test_latency (void)
+{
+  int i;
+  double before = 0;
+  tr_connect_rate cr;
+  tr_connect_rate_stats stats;
+  struct network net = { 60, 100, 0, 0, 0, true };
+
+  tr_connectRateConstruct (&cr, now_msec);
+  runSeconds (&cr, &net, 20);
+
+  net.connect_msec = 1000;
+  tr_connectRateGetStats (&cr, &stats);
+  for (i=0; (i<20) && (stats.backoffs==0); ++i)
+    {
+      before = stats.attempts_per_second;
+      runSeconds (&cr, &net, 1);
+      tr_connectRateGetStats (&cr, &stats);
+    }
+
+  check_int_eq (1, stats.backoffs);
+  check (stats.attempts_per_second < before);
+
+  return 0;
+}
+
+/* a socket that couldn't be opened cuts the rate right away */
+static int
+test_local_error (void)
+{
+  tr_connect_rate cr;
+
+  tr_connectRateConstruct (&cr, now_msec);
+  tr_connectRateAddResult (&cr, TR_CONNECT_LOCAL_ERROR, 0);
+  now_msec += TR_CONNECT_RATE_PERIOD_MSEC;
+  tr_connectRateAllowed (&cr, now_msec);
+  check_int_eq (TR_CONNECT_RATE_INITIAL / 2, (int)getRate (&cr));
+
+  return 0;
+}
+
+/* with nobody to connect to, the rate doesn't grow */
+static int
+test_no_demand (void)
+{
+  tr_connect_rate cr;
+  const struct network net = { 0, 100, 0, 0, 0, false };
+
+  tr_connectRateConstruct (&cr, now_msec);
+  runSeconds (&cr, &net, 60);
+  check_int_eq (TR_CONNECT_RATE_INITIAL, (int)getRate (&cr));
+
+  /* and unused allowance doesn't pile up into a burst */
+  check (tr_connectRateAllowed (&cr, now_msec) <= TR_CONNECT_RATE_INITIAL);
+
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_ramp_up,
+                             test_overload,
+                             test_latency,
+                             test_local_error,
+                             test_no_demand };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
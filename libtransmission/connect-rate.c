@@ -0,0 +1,191 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "connect-rate.h"
+#include "log.h"
+#include "utils.h"
+
+enum
+{
+  /* don't judge a period on fewer outcomes than this */
+  MIN_RESULTS = 8,
+
+  /* the most that unused credit can pile up, in seconds of the rate */
+  MAX_CREDIT_SECS = 1
+};
+
+/* how much worse than usual a period can be and still be healthy */
+#define UNREACHABLE_SLACK 0.15
+#define CONNECT_MSEC_FACTOR 2.0
+#define CONNECT_MSEC_SLACK 50.0
+
+#define dbgmsg(...) \
+  do \
+    { \
+      if (tr_logGetDeepEnabled ()) \
+        tr_logAddDeep (__FILE__, __LINE__, "connect-rate", __VA_ARGS__); \
+    } \
+  while (0)
+
+void
+tr_connectRateConstruct (tr_connect_rate * cr, uint64_t now_msec)
+{
+  memset (cr, 0, sizeof (tr_connect_rate));
+
+  cr->rate = TR_CONNECT_RATE_INITIAL;
+  cr->slow_start = true;
+  cr->credit_msec = now_msec;
+  cr->period_msec = now_msec;
+  cr->usual_unreachable = -1;
+  cr->usual_connect_msec = -1;
+  cr->stats.attempts_per_second = cr->rate;
+}
+
+/* @return false if it's too soon to tell, and the period should go on */
+static bool
+endPeriod (tr_connect_rate * cr)
+{
+  bool healthy;
+  double unreachable;
+  double connect_msec;
+  const int results = cr->connected + cr->failed + cr->unreachable + cr->local_errors;
+
+  if (cr->local_errors > 0)
+    {
+      /* no need to wait for more results to know this is too fast */
+      healthy = false;
+    }
+  else if (results < MIN_RESULTS)
+    {
+      return false;
+    }
+  else
+    {
+      unreachable = (double)cr->unreachable / results;
+      connect_msec = cr->connected > 0 ? (double)cr->connect_msec / cr->connected
+                                       : cr->usual_connect_msec;
+
+      if (cr->usual_unreachable < 0)
+        cr->usual_unreachable = unreachable;
+      if (cr->usual_connect_msec < 0)
+        cr->usual_connect_msec = connect_msec;
+
+      healthy = (unreachable <= cr->usual_unreachable + UNREACHABLE_SLACK)
+             && (connect_msec <= cr->usual_connect_msec * CONNECT_MSEC_FACTOR + CONNECT_MSEC_SLACK);
+
+      /* the usual unreachable fraction drifts as the candidates get
+         worse, so it follows every period. the usual connect time tracks
+         the quickest periods and only creeps up */
+      cr->usual_unreachable += (unreachable - cr->usual_unreachable) / 8;
+      if ((connect_msec >= 0) && (connect_msec < cr->usual_connect_msec))
+        cr->usual_connect_msec = connect_msec;
+      else if (connect_msec >= 0)
+        cr->usual_connect_msec += (connect_msec - cr->usual_connect_msec) / 16;
+    }
+
+  if (!healthy)
+    {
+      cr->rate = MAX (TR_CONNECT_RATE_MIN, cr->rate / 2);
+      cr->slow_start = false;
+      ++cr->stats.backoffs;
+    }
+  else if (cr->attempts * 2 >= cr->allowed)
+    {
+      /* only grow if we were using most of what we had */
+      cr->rate = MIN (TR_CONNECT_RATE_MAX, cr->rate * (cr->slow_start ? 2 : 1.25));
+    }
+
+  dbgmsg ("%d attempts of %d allowed: %d connected, %d failed, %d unreachable, %d local errors. "
+          "usually %.0f%% unreachable and %.0f msec to connect. rate is now %.1f/sec",
+          cr->attempts, cr->allowed, cr->connected, cr->failed, cr->unreachable, cr->local_errors,
+          cr->usual_unreachable * 100, cr->usual_connect_msec, cr->rate);
+
+  cr->stats.attempts_per_second = cr->rate;
+  cr->stats.connect_msec = MAX (0, cr->usual_connect_msec);
+
+  cr->allowed = 0;
+  cr->attempts = 0;
+  cr->connected = 0;
+  cr->failed = 0;
+  cr->unreachable = 0;
+  cr->local_errors = 0;
+  cr->connect_msec = 0;
+  return true;
+}
+
+int
+tr_connectRateAllowed (tr_connect_rate * cr, uint64_t now_msec)
+{
+  if ((now_msec >= cr->period_msec + TR_CONNECT_RATE_PERIOD_MSEC) && endPeriod (cr))
+    cr->period_msec = now_msec;
+
+  if (now_msec > cr->credit_msec)
+    {
+      cr->credit += cr->rate * (now_msec - cr->credit_msec) / 1000.0;
+      cr->credit = MIN (cr->credit, cr->rate * MAX_CREDIT_SECS);
+      cr->credit_msec = now_msec;
+    }
+
+  return (int) cr->credit;
+}
+
+void
+tr_connectRateAttempted (tr_connect_rate * cr, int allowed, int attempted)
+{
+  assert (0 <= attempted);
+  assert (attempted <= allowed);
+
+  cr->credit -= attempted;
+  cr->allowed += allowed;
+  cr->attempts += attempted;
+  cr->stats.attempts += attempted;
+}
+
+void
+tr_connectRateAddResult (tr_connect_rate   * cr,
+                         tr_connect_result   result,
+                         uint64_t            connect_msec)
+{
+  switch (result)
+    {
+      case TR_CONNECT_CONNECTED:
+        ++cr->connected;
+        ++cr->stats.connected;
+        cr->connect_msec += connect_msec;
+        break;
+
+      case TR_CONNECT_FAILED:
+        ++cr->failed;
+        ++cr->stats.failed;
+        break;
+
+      case TR_CONNECT_UNREACHABLE:
+        ++cr->unreachable;
+        ++cr->stats.unreachable;
+        break;
+
+      case TR_CONNECT_LOCAL_ERROR:
+        ++cr->local_errors;
+        ++cr->stats.local_errors;
+        break;
+    }
+}
+
+void
+tr_connectRateGetStats (const tr_connect_rate * cr, tr_connect_rate_stats * setme)
+{
+  *setme = cr->stats;
+}
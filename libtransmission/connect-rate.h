@@ -0,0 +1,130 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_CONNECT_RATE_H
+#define TR_CONNECT_RATE_H
+
+#include <inttypes.h> /* uint64_t */
+
+/**
+ * Decides how many outgoing peer connections to attempt per second.
+ *
+ * It starts out at the rate that used to be hardcoded, doubles it every
+ * period while the outcomes look healthy and there's enough demand to use
+ * it, and halves it when they stop looking healthy. After the first
+ * backoff it grows by a quarter at a time instead of doubling.
+ *
+ * Healthy means that no sockets failed to open, that no more of the
+ * handshakes timed out or were refused than usual, and that the handshakes
+ * that did connect didn't take much longer than usual. "Usual" is smoothed
+ * over earlier periods, since plenty of the addresses in a swarm are
+ * always unreachable and that alone isn't a reason to slow down.
+ */
+
+enum
+{
+  /* the rate that we start at, which used to be a fixed limit */
+  TR_CONNECT_RATE_INITIAL = 12,
+
+  TR_CONNECT_RATE_MIN = 2,
+  TR_CONNECT_RATE_MAX = 300,
+
+  /* how often the rate is adjusted */
+  TR_CONNECT_RATE_PERIOD_MSEC = 5000
+};
+
+typedef enum
+{
+  TR_CONNECT_CONNECTED,   /* the handshake finished */
+  TR_CONNECT_FAILED,      /* the peer answered, but the handshake failed */
+  TR_CONNECT_UNREACHABLE, /* the peer never answered: a timeout or refusal */
+  TR_CONNECT_LOCAL_ERROR  /* we couldn't even open a socket */
+}
+tr_connect_result;
+
+typedef struct tr_connect_rate_stats
+{
+  /* the attempts per second allowed right now */
+  double attempts_per_second;
+
+  /* how many attempts ended each way since the session started */
+  uint64_t attempts;
+  uint64_t connected;
+  uint64_t failed;
+  uint64_t unreachable;
+  uint64_t local_errors;
+
+  /* how many times the rate was cut back */
+  uint64_t backoffs;
+
+  /* how long a handshake that connects usually takes */
+  unsigned int connect_msec;
+}
+tr_connect_rate_stats;
+
+typedef struct tr_connect_rate
+{
+  /* these are PRIVATE IMPLEMENTATION details included for composition only.
+   * Don't access these directly! */
+
+  double rate;
+  double credit;
+  bool slow_start;
+  uint64_t credit_msec;
+  uint64_t period_msec;
+
+  /* this period's outcomes */
+  int allowed;
+  int attempts;
+  int connected;
+  int failed;
+  int unreachable;
+  int local_errors;
+  uint64_t connect_msec;
+
+  /* what healthy has looked like. negative until first measured */
+  double usual_unreachable;
+  double usual_connect_msec;
+
+  tr_connect_rate_stats stats;
+}
+tr_connect_rate;
+
+void tr_connectRateConstruct (tr_connect_rate * cr, uint64_t now_msec);
+
+/**
+ * @brief how many connections may be attempted now.
+ * @param now_msec the current time, such as from tr_time_msec ()
+ */
+int  tr_connectRateAllowed (tr_connect_rate * cr, uint64_t now_msec);
+
+/**
+ * @brief note that `attempted' connections were started after
+ *        tr_connectRateAllowed () returned `allowed'.
+ */
+void tr_connectRateAttempted (tr_connect_rate * cr, int allowed, int attempted);
+
+/**
+ * @brief note how an attempt ended.
+ * @param connect_msec how long it took, for TR_CONNECT_CONNECTED
+ */
+void tr_connectRateAddResult (tr_connect_rate   * cr,
+                              tr_connect_result   result,
+                              uint64_t            connect_msec);
+
+void tr_connectRateGetStats (const tr_connect_rate * cr, tr_connect_rate_stats * setme);
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/*
+ * Compares the disk queue's two ways of doing block I/O: one pread ()
+ * or pwrite () per block, and batches of blocks submitted to an io_uring.
+ * Blocks are written and then read back in random order, and each pass
+ * reports its IOPS and the CPU time it needed per GiB moved.
+ *
+ * Run it once with a directory on a local disk and once with a directory
+ * on tmpfs. The read passes mostly hit the page cache unless the file is
+ * bigger than RAM, so they measure syscall overhead rather than the disk.
+ */
+
+#include <errno.h>
+#include <fcntl.h> /* open () */
+#include <stdio.h>
+#include <stdlib.h> /* strtoul (), EXIT_FAILURE */
+#include <string.h> /* memset () */
+#include <sys/resource.h> /* getrusage () */
+#include <unistd.h> /* pread (), pwrite (), ftruncate (), fdatasync () */
+
+#include "transmission.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt () */
+#include "tr-getopt.h"
+#include "uring.h"
+#include "utils.h"
+
+#define MY_NAME "disk-bench"
+
+static const char * dir = ".";
+static size_t file_mib = 256;
+static size_t block_kib = 16;
+static int batch_size = 16;
+
+static tr_option options[] =
+{
+  { 'd', "dir", "Where to create the test file", "d", 1, "<dir>" },
+  { 's', "size", "Test file size in MiB", "s", 1, "<MiB>" },
+  { 'b', "block", "Block size in KiB", "b", 1, "<KiB>" },
+  { 'q', "batch", "Blocks per io_uring submission", "q", 1, "<count>" },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int
+parseCommandLine (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 'd': dir = optarg; break;
+          case 's': file_mib = strtoul (optarg, NULL, 10); break;
+          case 'b': block_kib = strtoul (optarg, NULL, 10); break;
+          case 'q': batch_size = atoi (optarg); break;
+          default: return 1;
+        }
+    }
+
+  return (file_mib > 0) && (block_kib > 0) && (batch_size > 0) ? 0 : 1;
+}
+
+/***
+****
+***/
+
+struct pass
+{
+  uint64_t wall_msec;
+  uint64_t cpu_usec;
+};
+
+static uint64_t
+cpuUsec (void)
+{
+  struct rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+  return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+       + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void
+passStart (struct pass * p)
+{
+  p->wall_msec = tr_time_msec ();
+  p->cpu_usec = cpuUsec ();
+}
+
+static void
+passEnd (struct pass * p, const char * name, size_t block_count, size_t block_size)
+{
+  const double secs = MAX (1, tr_time_msec () - p->wall_msec) / 1000.0;
+  const double cpu = (cpuUsec () - p->cpu_usec) / 1000000.0;
+  const double gib = ((double)block_count * block_size) / (1024.0 * 1024.0 * 1024.0);
+
+  printf ("%-16s %10.0f IOPS %9.1f MiB/s %8.3f CPU s/GiB\n",
+          name, block_count / secs, (gib * 1024.0) / secs, cpu / gib);
+}
+
+static int
+runSync (int fd, bool do_write, const uint64_t * offsets, size_t n, uint8_t * buf, size_t len)
+{
+  size_t i;
+
+  for (i=0; i<n; ++i)
+    {
+      const ssize_t rc = do_write ? pwrite (fd, buf, len, offsets[i])
+                                  : pread (fd, buf, len, offsets[i]);
+      if (rc < 0)
+        return errno;
+    }
+
+  return 0;
+}
+
+static int
+runRing (tr_uring * ring, int fd, bool do_write, const uint64_t * offsets, size_t n, uint8_t * bufs, size_t len)
+{
+  size_t i;
+  tr_uring_op * ops = tr_new0 (tr_uring_op, batch_size);
+  int err = 0;
+
+  for (i=0; !err && i<n; i+=batch_size)
+    {
+      int j;
+      const int count = MIN ((size_t)batch_size, n - i);
+
+      for (j=0; j<count; ++j)
+        {
+          ops[j].fd = fd;
+          ops[j].do_write = do_write;
+          ops[j].buf = bufs + j * len;
+          ops[j].len = len;
+          ops[j].offset = offsets[i + j];
+        }
+
+      if (tr_uringRun (ring, ops, count))
+        for (j=0; !err && j<count; ++j)
+          err = ops[j].err;
+    }
+
+  tr_free (ops);
+  return err;
+}
+
+int
+main (int argc, char ** argv)
+{
+  int fd;
+  int err = 0;
+  size_t i;
+  char * filename;
+  struct pass p;
+  tr_uring * ring;
+  uint64_t * offsets;
+  uint8_t * bufs;
+  const size_t block_size = block_kib * 1024;
+  size_t block_count;
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  block_count = (file_mib * 1024 * 1024) / (block_kib * 1024);
+  filename = tr_buildPath (dir, MY_NAME ".dat", NULL);
+  fd = open (filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if ((fd < 0) || ftruncate (fd, (off_t)block_count * block_size))
+    {
+      fprintf (stderr, "Couldn't create \"%s\": %s\n", filename, tr_strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  /* visit the blocks in random order, like a swarm does */
+  offsets = tr_new (uint64_t, block_count);
+  for (i=0; i<block_count; ++i)
+    offsets[i] = (uint64_t)i * block_size;
+  for (i=block_count-1; i>0; --i)
+    {
+      const size_t j = tr_cryptoWeakRandInt (i + 1);
+      const uint64_t tmp = offsets[i];
+      offsets[i] = offsets[j];
+      offsets[j] = tmp;
+    }
+
+  bufs = tr_valloc (block_size * batch_size);
+  memset (bufs, 'x', block_size * batch_size);
+
+  printf ("%s: %zu MiB in %zu KiB blocks, %d blocks per batch\n",
+          filename, file_mib, block_kib, batch_size);
+
+  passStart (&p);
+  if (!err) err = runSync (fd, true, offsets, block_count, bufs, block_size);
+  if (!err) err = fdatasync (fd) ? errno : 0;
+  passEnd (&p, "pwrite", block_count, block_size);
+
+  passStart (&p);
+  if (!err) err = runSync (fd, false, offsets, block_count, bufs, block_size);
+  passEnd (&p, "pread", block_count, block_size);
+
+  if ((ring = tr_uringNew (64)) == NULL)
+    {
+      printf ("io_uring isn't available: %s\n", tr_strerror (errno));
+    }
+  else
+    {
+      passStart (&p);
+      if (!err) err = runRing (ring, fd, true, offsets, block_count, bufs, block_size);
+      if (!err) err = fdatasync (fd) ? errno : 0;
+      passEnd (&p, "io_uring write", block_count, block_size);
+
+      passStart (&p);
+      if (!err) err = runRing (ring, fd, false, offsets, block_count, bufs, block_size);
+      passEnd (&p, "io_uring read", block_count, block_size);
+
+      tr_uringFree (ring);
+    }
+
+  if (err)
+    fprintf (stderr, "I/O failed: %s\n", tr_strerror (err));
+
+  close (fd);
+  unlink (filename);
+  tr_free (bufs);
+  tr_free (offsets);
+  tr_free (filename);
+  return err ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,420 @@
+#include <errno.h>
+#include <fcntl.h> /* open() */
+#include <string.h> /* memset(), memcmp() */
+#include <time.h> /* time() */
+
+#include <sys/types.h> /* mkfifo() */
+#include <sys/stat.h> /* mkfifo() */
+#include <unistd.h> /* unlink(), close() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "disk-queue.h"
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread() */
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+enum
+{
+  MAX_JOBS = 16,
+
+  /* the zero torrent's last piece is 4608 bytes long and is
+     split across its last two files, so it's small and unaligned */
+  LAST_PIECE_LEN = 4608
+};
+
+struct queue_test
+{
+  tr_session * session;
+  tr_torrent * tor;
+  tr_piece_index_t last_piece;
+
+  /* the tags of the jobs whose callbacks were invoked, in order */
+  int done_count;
+  int done_tags[MAX_JOBS];
+  bool done_in_event_thread;
+  bool done_with_torrent;
+
+  /* what each read job read */
+  uint8_t read_data[MAX_JOBS][LAST_PIECE_LEN];
+
+  /* a write's bytes have to outlive the write */
+  uint8_t write_data[MAX_JOBS][LAST_PIECE_LEN];
+  struct evbuffer_iovec iov[MAX_JOBS];
+
+  /* the callbacks' user_data */
+  struct queue_job
+  {
+    struct queue_test * test;
+    int tag;
+  }
+  jobs[MAX_JOBS];
+
+  volatile bool done;
+};
+
+static void
+onJobDone (tr_torrent * tor, const tr_disk_result * result, void * vjob)
+{
+  struct queue_job * job = vjob;
+  struct queue_test * test = job->test;
+
+  test->done_in_event_thread &= tr_amInEventThread (test->session);
+  test->done_with_torrent &= tor == test->tor;
+  test->done_tags[test->done_count++] = job->tag;
+
+  if ((result->type == TR_DISK_READ) && (result->data != NULL))
+    evbuffer_remove (result->data, test->read_data[job->tag], result->length);
+}
+
+static void
+queueTestInit (struct queue_test * test, tr_session * session, tr_torrent * tor)
+{
+  int i;
+
+  memset (test, 0, sizeof (struct queue_test));
+  test->session = session;
+  test->tor = tor;
+  test->last_piece = tor->info.pieceCount - 1;
+  test->done_in_event_thread = true;
+  test->done_with_torrent = true;
+
+  for (i=0; i<MAX_JOBS; ++i)
+    {
+      test->jobs[i].test = test;
+      test->jobs[i].tag = i;
+    }
+}
+
+/* queue a write of `len' bytes of `c' to the last piece, tagged `tag' */
+static void
+queueWrite (struct queue_test * test, int tag, uint32_t offset, uint32_t len, uint8_t c)
+{
+  memset (test->write_data[tag], c, len);
+  test->iov[tag].iov_base = test->write_data[tag];
+  test->iov[tag].iov_len = len;
+  tr_diskQueueWrite (test->session->diskQueue, test->tor, test->last_piece, offset, len,
+                     &test->iov[tag], 1, onJobDone, &test->jobs[tag]);
+}
+
+static void
+queueRead (struct queue_test * test, int tag, uint32_t offset, uint32_t len)
+{
+  tr_diskQueueRead (test->session->diskQueue, test->tor, test->last_piece, offset, len,
+                    false, onJobDone, &test->jobs[tag]);
+}
+
+static void
+runInEventThread (struct queue_test * test, void (*func)(void*))
+{
+  test->done = false;
+  tr_runInEventThread (test->session, func, test);
+  while (!test->done)
+    tr_wait_msec (10);
+}
+
+static void
+waitForJobs (struct queue_test * test, int n)
+{
+  const time_t deadline = time (NULL) + 10;
+
+  while ((test->done_count < n) && (time (NULL) <= deadline))
+    tr_wait_msec (10);
+}
+
+static tr_session *
+sessionInit (void)
+{
+  tr_session * session;
+  tr_variant settings;
+
+  /* one worker, so that a stuck job holds up the ones behind it */
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_disk_threads, 1);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  return session;
+}
+
+/***
+****  The queue's only worker can be kept busy by asking it to hash the
+****  first piece after its file has been replaced by a FIFO: opening it
+****  blocks until someone opens the other end.
+***/
+
+static char *
+stallerInit (tr_torrent * tor)
+{
+  char * path = tr_torrentFindFile (tor, 0);
+
+  unlink (path);
+  if (mkfifo (path, 0600))
+    {
+      tr_free (path);
+      return NULL;
+    }
+
+  return path;
+}
+
+static void
+stallWorker (struct queue_test * test)
+{
+  tr_diskQueueHash (test->session->diskQueue, test->tor, 0, NULL, NULL);
+}
+
+static void
+unstallWorker (const char * fifo)
+{
+  const int fd = open (fifo, O_WRONLY);
+
+  if (fd >= 0)
+    close (fd);
+}
+
+/***
+****
+***/
+
+static void
+test_order_impl (void * vtest)
+{
+  struct queue_test * test = vtest;
+
+  /* overlapping jobs run in the order they were queued */
+  queueRead  (test, 0, 0, 1024);
+  queueWrite (test, 1, 0, 1024, 'a');
+  queueWrite (test, 2, 512, 1024, 'b');
+  queueRead  (test, 3, 0, 2048);
+  queueWrite (test, 4, 0, LAST_PIECE_LEN, 'c');
+  queueRead  (test, 5, 0, LAST_PIECE_LEN);
+
+  test->done = true;
+}
+
+static int
+test_order (void)
+{
+  int i;
+  uint8_t expected[LAST_PIECE_LEN];
+  struct queue_test test;
+  tr_session * session = sessionInit ();
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+
+  libttest_zero_torrent_populate (tor, true);
+  tr_diskQueueSetWorkerCount (session->diskQueue, 4);
+
+  queueTestInit (&test, session, tor);
+  runInEventThread (&test, test_order_impl);
+  waitForJobs (&test, 6);
+
+  /* every callback was invoked once, in order, in the libevent thread */
+  check_int_eq (6, test.done_count);
+  for (i=0; i<6; ++i)
+    check_int_eq (i, test.done_tags[i]);
+  check (test.done_in_event_thread);
+  check (test.done_with_torrent);
+
+  /* each read saw the writes queued before it, and none after it */
+  memset (expected, 0, sizeof (expected));
+  check (!memcmp (expected, test.read_data[0], 1024));
+  memset (expected, 'a', 512);
+  memset (expected+512, 'b', 1024);
+  check (!memcmp (expected, test.read_data[3], 2048));
+  memset (expected, 'c', LAST_PIECE_LEN);
+  check (!memcmp (expected, test.read_data[5], LAST_PIECE_LEN));
+
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static void
+test_cancel_impl (void * vtest)
+{
+  struct queue_test * test = vtest;
+
+  stallWorker (test);
+  queueRead (test, 0, 0, 512);
+  queueWrite (test, 1, 0, 512, 'a');
+  queueRead (test, 2, 512, 512);
+  queueRead (test, 3, 1024, 512);
+
+  /* only the jobs with this user_data are cancelled */
+  tr_diskQueueCancel (test->session->diskQueue, &test->jobs[1]);
+  tr_diskQueueCancel (test->session->diskQueue, &test->jobs[3]);
+
+  test->done = true;
+}
+
+static void
+test_read_back_impl (void * vtest)
+{
+  struct queue_test * test = vtest;
+
+  queueRead (test, 0, 0, 512);
+
+  test->done = true;
+}
+
+static void
+test_remove_impl (void * vtest)
+{
+  struct queue_test * test = vtest;
+
+  /* the jobs of a torrent that's removed still finish, but their
+     callbacks are told that the torrent is gone */
+  queueWrite (test, 0, 0, 512, 'a');
+  queueRead (test, 1, 0, 512);
+  tr_torrentRemove (test->tor, false, NULL);
+
+  test->done = true;
+}
+
+static int
+test_cancel (void)
+{
+  char * fifo;
+  uint8_t expected[512];
+  struct queue_test test;
+  tr_session * session = sessionInit ();
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+
+  libttest_zero_torrent_populate (tor, true);
+  fifo = stallerInit (tor);
+  check (fifo != NULL);
+
+  queueTestInit (&test, session, tor);
+  runInEventThread (&test, test_cancel_impl);
+  unstallWorker (fifo);
+  tr_diskQueueWait (session->diskQueue, tor);
+  waitForJobs (&test, 2);
+  tr_wait_msec (100);
+
+  /* the cancelled jobs' callbacks weren't invoked */
+  check_int_eq (2, test.done_count);
+  check_int_eq (0, test.done_tags[0]);
+  check_int_eq (2, test.done_tags[1]);
+
+  /* but the cancelled write was still written */
+  queueTestInit (&test, session, tor);
+  runInEventThread (&test, test_read_back_impl);
+  waitForJobs (&test, 1);
+  check_int_eq (1, test.done_count);
+  memset (expected, 'a', sizeof (expected));
+  check (!memcmp (expected, test.read_data[0], sizeof (expected)));
+
+  /* removing the torrent doesn't lose its jobs' callbacks */
+  queueTestInit (&test, session, tor);
+  runInEventThread (&test, test_remove_impl);
+  waitForJobs (&test, 2);
+  check_int_eq (2, test.done_count);
+  check (test.done_in_event_thread);
+  check (!test.done_with_torrent);
+
+  tr_free (fifo);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static void
+test_find_write_impl (void * vtest)
+{
+  struct queue_test * test = vtest;
+
+  stallWorker (test);
+  queueWrite (test, 0, 0, 1024, 'a');
+  queueWrite (test, 1, 512, 1024, 'b');
+
+  test->done = true;
+}
+
+static int
+test_find_write (void)
+{
+  char * fifo;
+  uint8_t buf[LAST_PIECE_LEN];
+  uint8_t expected[LAST_PIECE_LEN];
+  struct queue_test test;
+  tr_session * session = sessionInit ();
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+  tr_diskQueue * q = session->diskQueue;
+  const tr_piece_index_t piece = tor->info.pieceCount - 1;
+
+  libttest_zero_torrent_populate (tor, true);
+  fifo = stallerInit (tor);
+  check (fifo != NULL);
+
+  /* the writes are stuck behind the stalled hash */
+  queueTestInit (&test, session, tor);
+  runInEventThread (&test, test_find_write_impl);
+
+  /* a block inside one queued write is copied from it */
+  memset (buf, 0, sizeof (buf));
+  memset (expected, 'a', 512);
+  check (tr_diskQueueFindWrite (q, tor, piece, 0, 512, buf));
+  check (!memcmp (expected, buf, 512));
+
+  /* where two writes cover the block, the newer one wins */
+  memset (expected, 'b', 100);
+  check (tr_diskQueueFindWrite (q, tor, piece, 600, 100, buf));
+  check (!memcmp (expected, buf, 100));
+
+  /* a block that no single write covers isn't found... */
+  check (!tr_diskQueueFindWrite (q, tor, piece, 0, 2048, buf));
+  check (!tr_diskQueueFindWrite (q, tor, piece, 2048, 512, buf));
+  check (!tr_diskQueueFindWrite (q, tor, 0, 0, 512, buf));
+
+  /* ...but one that any write overlaps has to wait for it */
+  check (tr_diskQueueHasWrite (q, tor, piece, 0, 2048));
+  check (tr_diskQueueHasWrite (q, tor, piece, 1500, 100));
+  check (!tr_diskQueueHasWrite (q, tor, piece, 1536, 512));
+  check (!tr_diskQueueHasWrite (q, tor, 0, 0, 512));
+  check_int_eq (0, test.done_count);
+
+  /* once the writes are on disk, the queue forgets them */
+  unstallWorker (fifo);
+  tr_diskQueueWait (q, tor);
+  check (!tr_diskQueueFindWrite (q, tor, piece, 0, 512, buf));
+  check (!tr_diskQueueHasWrite (q, tor, piece, 0, 2048));
+  waitForJobs (&test, 2);
+  check_int_eq (2, test.done_count);
+  check (test.done_in_event_thread);
+
+  tr_torrentRemove (tor, false, NULL);
+  tr_free (fifo);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_order,
+                             test_cancel,
+                             test_find_write };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,1053 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h> /* memcmp (), memcpy () */
+
+#include <event2/buffer.h>
+
+#include <openssl/sha.h>
+
+#include "transmission.h"
+#include "disk-queue.h"
+#include "inout.h"
+#include "log.h"
+#include "platform.h" /* tr_lock, tr_cond, tr_threadNew () */
+#include "ptrarray.h"
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h"
+#include "uring.h"
+#include "utils.h"
+
+#define MY_NAME "Disk"
+
+#define dbgmsg(...) \
+  do \
+    { \
+      if (tr_logGetDeepEnabled ()) \
+        tr_logAddDeep (__FILE__, __LINE__, MY_NAME, __VA_ARGS__); \
+    } \
+  while (0)
+
+enum
+{
+  MAX_WORKERS = 32,
+
+  /* how many ops each worker's io_uring can have in flight */
+  RING_ENTRIES = 64,
+
+  /* how many jobs a worker submits to its io_uring at once */
+  MAX_BATCH_JOBS = 16
+};
+
+/***
+****
+***/
+
+struct disk_job
+{
+  tr_disk_result      result;
+
+  bool                is_cancelled;
+  bool                check_piece;
+
+  /* the order it was queued in */
+  uint64_t            seq;
+
+  /* its neighbors in its torrent's waiting or running list */
+  struct disk_job   * prev;
+  struct disk_job   * next;
+
+  /* only valid until the job's I/O is done.
+     after that, the torrent is looked up by its id */
+  tr_torrent        * tor;
+  int                 torrent_id;
+
+  /* the bytes of the torrent this job touches, for ordering */
+  uint64_t            begin;
+  uint64_t            end;
+
+  /* a write's buffers. The memory they point to belongs to
+     whoever queued the write, but this array is ours */
+  struct evbuffer_iovec * iov;
+  int                 iov_count;
+
+  uint64_t            queued_at_msec;
+
+  tr_disk_done_func   callback;
+  void              * user_data;
+};
+
+struct job_list
+{
+  struct disk_job * head;
+  struct disk_job * tail;
+};
+
+/* a torrent's jobs. Jobs only have to wait for jobs of the same
+   torrent, so this is all that getNextJob () has to look at */
+struct disk_torrent
+{
+  int torrent_id;
+
+  /* in the order they were queued */
+  struct job_list waiting;
+
+  /* in no particular order */
+  struct job_list running;
+
+  int job_count;
+  int write_count;
+  int flush_count;
+};
+
+struct tr_diskQueue
+{
+  tr_session * session;
+
+  tr_lock * lock;
+  tr_cond * cond;
+
+  /* struct disk_torrent, sorted by torrent_id, for the torrents
+     that have jobs waiting or running */
+  tr_ptrArray torrents;
+  int next_torrent;
+  int job_count;
+  uint64_t next_seq;
+
+  /* jobs whose I/O is done, waiting to be delivered in the libevent thread */
+  tr_ptrArray done;
+  bool delivery_pending;
+
+  int worker_count;
+  int max_workers;
+  bool is_closing;
+
+  bool use_uring;
+  bool uring_unavailable;
+
+  tr_disk_stats stats;
+};
+
+/***
+****
+***/
+
+static void
+jobListAppend (struct job_list * list, struct disk_job * job)
+{
+  job->prev = list->tail;
+  job->next = NULL;
+
+  if (list->tail != NULL)
+    list->tail->next = job;
+  else
+    list->head = job;
+
+  list->tail = job;
+}
+
+static void
+jobListRemove (struct job_list * list, struct disk_job * job)
+{
+  if (job->prev != NULL)
+    job->prev->next = job->next;
+  else
+    list->head = job->next;
+
+  if (job->next != NULL)
+    job->next->prev = job->prev;
+  else
+    list->tail = job->prev;
+
+  job->prev = NULL;
+  job->next = NULL;
+}
+
+static int
+compareDiskTorrents (const void * va, const void * vb)
+{
+  const struct disk_torrent * a = va;
+  const struct disk_torrent * b = vb;
+
+  if (a->torrent_id != b->torrent_id)
+    return a->torrent_id < b->torrent_id ? -1 : 1;
+
+  return 0;
+}
+
+static struct disk_torrent *
+getDiskTorrent (tr_diskQueue * q, int torrent_id, bool create_if_missing)
+{
+  struct disk_torrent key;
+  struct disk_torrent * t;
+
+  key.torrent_id = torrent_id;
+  t = tr_ptrArrayFindSorted (&q->torrents, &key, compareDiskTorrents);
+
+  if ((t == NULL) && create_if_missing)
+    {
+      t = tr_new0 (struct disk_torrent, 1);
+      t->torrent_id = torrent_id;
+      tr_ptrArrayInsertSorted (&q->torrents, t, compareDiskTorrents);
+    }
+
+  return t;
+}
+
+static bool
+jobsOverlap (const struct disk_job * a, const struct disk_job * b)
+{
+  return (a->torrent_id == b->torrent_id)
+      && (a->begin < b->end)
+      && (b->begin < a->end);
+}
+
+static bool
+jobIsWrite (const struct disk_job * job)
+{
+  return job->result.type == TR_DISK_WRITE;
+}
+
+/* a flush has to wait for all the earlier jobs of its torrent;
+   otherwise, only reads and writes of the same bytes are ordered */
+static bool
+jobMustWaitFor (const struct disk_job * job, const struct disk_job * earlier)
+{
+  if (job->result.type == TR_DISK_FLUSH)
+    return true;
+
+  return (jobIsWrite (job) || jobIsWrite (earlier)) && jobsOverlap (job, earlier);
+}
+
+/* @return the torrent's first waiting job that can run now, or NULL */
+static struct disk_job *
+getRunnableJob (const struct disk_torrent * t)
+{
+  struct disk_job * job;
+
+  /* reads and hashes don't have to wait for each other */
+  if ((t->write_count == 0) && (t->flush_count == 0))
+    return t->waiting.head;
+
+  for (job=t->waiting.head; job!=NULL; job=job->next)
+    {
+      const struct disk_job * walk;
+      bool runnable = true;
+
+      for (walk=t->running.head; runnable && walk!=NULL; walk=walk->next)
+        if ((walk->seq < job->seq) && jobMustWaitFor (job, walk))
+          runnable = false;
+
+      for (walk=t->waiting.head; runnable && walk!=job; walk=walk->next)
+        if (jobMustWaitFor (job, walk))
+          runnable = false;
+
+      if (runnable)
+        return job;
+    }
+
+  return NULL;
+}
+
+/* take turns between the torrents so that one with a deep queue
+   doesn't hold up the others */
+static struct disk_job *
+getNextJob (tr_diskQueue * q)
+{
+  int i;
+  const int n = tr_ptrArraySize (&q->torrents);
+
+  for (i=0; i<n; ++i)
+    {
+      const int pos = (q->next_torrent + i) % n;
+      struct disk_job * job = getRunnableJob (tr_ptrArrayNth (&q->torrents, pos));
+
+      if (job != NULL)
+        {
+          q->next_torrent = pos + 1;
+          return job;
+        }
+    }
+
+  return NULL;
+}
+
+static void
+startJob (tr_diskQueue * q, struct disk_job * job)
+{
+  struct disk_torrent * t = getDiskTorrent (q, job->torrent_id, false);
+
+  jobListRemove (&t->waiting, job);
+  jobListAppend (&t->running, job);
+}
+
+/***
+****
+***/
+
+static int
+hashPiece (tr_torrent * tor, tr_piece_index_t piece, bool * passed)
+{
+  SHA_CTX sha;
+  int err = 0;
+  uint32_t offset = 0;
+  const uint32_t buflen = tor->blockSize;
+  uint8_t * buf = tr_valloc (buflen);
+  uint32_t bytesLeft = tr_torPieceCountBytes (tor, piece);
+  uint8_t hash[SHA_DIGEST_LENGTH];
+
+  SHA1_Init (&sha);
+
+  while (!err && bytesLeft)
+    {
+      const uint32_t len = MIN (bytesLeft, buflen);
+
+      if (!(err = tr_ioRead (tor, piece, offset, len, buf)))
+        {
+          SHA1_Update (&sha, buf, len);
+          offset += len;
+          bytesLeft -= len;
+        }
+    }
+
+  SHA1_Final (hash, &sha);
+  *passed = !err && !memcmp (hash, tor->info.pieces[piece].hash, SHA_DIGEST_LENGTH);
+
+  tr_free (buf);
+  return err;
+}
+
+/* runs in a worker thread without the queue's lock */
+static void
+runJob (struct disk_job * job)
+{
+  tr_disk_result * r = &job->result;
+
+  switch (r->type)
+    {
+      case TR_DISK_WRITE:
+        r->err = tr_ioWritev (job->tor, r->piece, r->offset, job->iov, job->iov_count);
+        break;
+
+      case TR_DISK_READ:
+        if (job->is_cancelled)
+          break;
+
+        if (job->check_piece)
+          {
+            r->hash_tested = true;
+            r->err = hashPiece (job->tor, r->piece, &r->hash_passed);
+          }
+
+        if (!r->err && (!r->hash_tested || r->hash_passed))
+          {
+            struct evbuffer_iovec iovec[1];
+
+            r->data = evbuffer_new ();
+            evbuffer_reserve_space (r->data, r->length, iovec, 1);
+            r->err = tr_ioRead (job->tor, r->piece, r->offset, r->length, iovec[0].iov_base);
+            iovec[0].iov_len = r->err ? 0 : r->length;
+            evbuffer_commit_space (r->data, iovec, 1);
+          }
+        break;
+
+      case TR_DISK_HASH:
+        if (!job->is_cancelled)
+          {
+            r->hash_tested = true;
+            r->err = hashPiece (job->tor, r->piece, &r->hash_passed);
+          }
+        break;
+
+      case TR_DISK_FLUSH:
+        /* nothing to do; it only had to wait its turn */
+        break;
+
+      default:
+        assert (0);
+    }
+}
+
+/* writes, and reads that don't check their piece, can be batched */
+static bool
+jobIsBatchable (const struct disk_job * job)
+{
+  switch (job->result.type)
+    {
+      case TR_DISK_WRITE:
+        return true;
+
+      case TR_DISK_READ:
+        return !job->check_piece && !job->is_cancelled;
+
+      default:
+        return false;
+    }
+}
+
+/* runs in a worker thread without the queue's lock */
+static void
+runJobBatch (tr_ioBatch * batch, struct disk_job ** jobs, int n)
+{
+  int i;
+  struct evbuffer_iovec * iovec = tr_new (struct evbuffer_iovec, n);
+
+  for (i=0; i<n; ++i)
+    {
+      tr_disk_result * r = &jobs[i]->result;
+
+      if (r->type == TR_DISK_WRITE)
+        {
+          int j;
+          tr_torrent * tor = jobs[i]->tor;
+          tr_piece_index_t piece = r->piece;
+          uint32_t offset = r->offset;
+
+          for (j=0; j<jobs[i]->iov_count; ++j)
+            {
+              const struct evbuffer_iovec * v = &jobs[i]->iov[j];
+
+              if (v->iov_len > 0)
+                tr_ioBatchAdd (batch, tor, true, piece, offset, v->iov_len, v->iov_base, &r->err);
+
+              /* move to where the next buffer goes */
+              offset += v->iov_len;
+              while ((piece < tor->info.pieceCount) && (offset >= tr_torPieceCountBytes (tor, piece)))
+                offset -= tr_torPieceCountBytes (tor, piece++);
+            }
+        }
+      else
+        {
+          r->data = evbuffer_new ();
+          evbuffer_reserve_space (r->data, r->length, &iovec[i], 1);
+          tr_ioBatchAdd (batch, jobs[i]->tor, false, r->piece, r->offset, r->length,
+                         iovec[i].iov_base, &r->err);
+        }
+    }
+
+  tr_ioBatchRun (batch);
+
+  for (i=0; i<n; ++i)
+    {
+      tr_disk_result * r = &jobs[i]->result;
+
+      if (r->type == TR_DISK_READ)
+        {
+          iovec[i].iov_len = r->err ? 0 : r->length;
+          evbuffer_commit_space (r->data, &iovec[i], 1);
+        }
+    }
+
+  tr_free (iovec);
+}
+
+static void deliverDoneJobs (void * vsession);
+
+/* called with the queue's lock held */
+static void
+finishJob (tr_diskQueue * q, struct disk_job * job)
+{
+  const tr_disk_job_type type = job->result.type;
+  const uint64_t latency = tr_time_msec () - job->queued_at_msec;
+  struct disk_torrent * t = getDiskTorrent (q, job->torrent_id, false);
+
+  jobListRemove (&t->running, job);
+  --q->job_count;
+  --t->job_count;
+  if (type == TR_DISK_WRITE)
+    --t->write_count;
+  else if (type == TR_DISK_FLUSH)
+    --t->flush_count;
+
+  if (t->job_count == 0)
+    {
+      tr_ptrArrayRemoveSorted (&q->torrents, t, compareDiskTorrents);
+      tr_free (t);
+    }
+
+  job->tor = NULL;
+
+  /* the write's buffers may be released once it's done,
+     so stop tr_diskQueueFindWrite () from looking at them */
+  tr_free (job->iov);
+  job->iov = NULL;
+  job->iov_count = 0;
+
+  --q->stats.queue_depth;
+  ++q->stats.job_count[type];
+  q->stats.latency_total_msec[type] += latency;
+  q->stats.latency_max_msec[type] = MAX (q->stats.latency_max_msec[type], latency);
+
+  tr_ptrArrayAppend (&q->done, job);
+}
+
+static void
+workerFunc (void * vqueue)
+{
+  tr_diskQueue * q = vqueue;
+  tr_uring * ring = NULL;
+  tr_ioBatch * batch = NULL;
+  struct disk_job * jobs[MAX_BATCH_JOBS];
+
+  tr_lockLock (q->lock);
+
+  while (q->worker_count <= q->max_workers)
+    {
+      int i;
+      int n;
+      bool needs_delivery;
+      struct disk_job * job;
+
+      /* start or stop using io_uring if the setting changed */
+      if (q->use_uring && (ring == NULL) && !q->uring_unavailable)
+        {
+          if ((ring = tr_uringNew (RING_ENTRIES)))
+            {
+              batch = tr_ioBatchNew (q->session, ring);
+            }
+          else
+            {
+              q->uring_unavailable = true;
+              tr_logAddNamedInfo (MY_NAME, "Can't use io_uring (%s); using pread () and pwrite () instead",
+                                  tr_strerror (errno));
+            }
+        }
+      else if ((ring != NULL) && (!q->use_uring || tr_uringIsBroken (ring)))
+        {
+          if (tr_uringIsBroken (ring))
+            {
+              q->uring_unavailable = true;
+              tr_logAddNamedError (MY_NAME, "io_uring stopped working; using pread () and pwrite () instead");
+            }
+
+          tr_ioBatchFree (batch);
+          tr_uringFree (ring);
+          batch = NULL;
+          ring = NULL;
+        }
+
+      job = getNextJob (q);
+
+      if (job == NULL)
+        {
+          if (q->is_closing && (q->job_count == 0))
+            break;
+
+          tr_condWait (q->cond, q->lock);
+          continue;
+        }
+
+      startJob (q, job);
+      jobs[0] = job;
+      n = 1;
+
+      /* if we have a ring, gather more jobs to submit along with this one */
+      if ((batch != NULL) && jobIsBatchable (job))
+        {
+          while ((n < MAX_BATCH_JOBS) && ((job = getNextJob (q))) && jobIsBatchable (job))
+            {
+              startJob (q, job);
+              jobs[n++] = job;
+            }
+        }
+
+      tr_lockUnlock (q->lock);
+      if ((batch != NULL) && jobIsBatchable (jobs[0]))
+        runJobBatch (batch, jobs, n);
+      else
+        runJob (jobs[0]);
+      tr_lockLock (q->lock);
+
+      for (i=0; i<n; ++i)
+        finishJob (q, jobs[i]);
+
+      needs_delivery = !q->delivery_pending && !q->is_closing;
+      q->delivery_pending = true;
+
+      /* wake up tr_diskQueueWait () and workers whose jobs were waiting on this one */
+      tr_condBroadcast (q->cond);
+
+      if (needs_delivery)
+        {
+          tr_lockUnlock (q->lock);
+          tr_runInEventThread (q->session, deliverDoneJobs, q->session);
+          tr_lockLock (q->lock);
+        }
+    }
+
+  --q->worker_count;
+  tr_condBroadcast (q->cond);
+  tr_lockUnlock (q->lock);
+
+  if (batch != NULL)
+    tr_ioBatchFree (batch);
+  tr_uringFree (ring);
+}
+
+/***
+****
+***/
+
+static void
+deliverJob (tr_session * session, struct disk_job * job)
+{
+  tr_torrent * tor;
+  const tr_disk_result * r = &job->result;
+
+  if ((job->callback != NULL) && !job->is_cancelled)
+    job->callback (tr_torrentFindFromId (session, job->torrent_id), r, job->user_data);
+
+  /* look the torrent up again in case the callback removed it */
+  if (r->err && ((tor = tr_torrentFindFromId (session, job->torrent_id))))
+    if (tor->error != TR_STAT_LOCAL_ERROR)
+      tr_torrentSetLocalError (tor, "%s", tr_strerror (r->err));
+
+  if (r->data != NULL)
+    evbuffer_free (r->data);
+  tr_free (job->iov);
+  tr_free (job);
+}
+
+static void
+deliverDoneJobs (void * vsession)
+{
+  tr_session * session = vsession;
+  tr_diskQueue * q = session->diskQueue;
+
+  if (q == NULL)
+    return;
+
+  assert (tr_amInEventThread (session));
+
+  tr_lockLock (q->lock);
+  q->delivery_pending = false;
+
+  /* take them one at a time: a callback may cancel the jobs behind it */
+  while (!tr_ptrArrayEmpty (&q->done))
+    {
+      struct disk_job * job = tr_ptrArrayNth (&q->done, 0);
+      tr_ptrArrayRemove (&q->done, 0);
+
+      tr_lockUnlock (q->lock);
+      deliverJob (session, job);
+      tr_lockLock (q->lock);
+    }
+
+  tr_lockUnlock (q->lock);
+}
+
+/***
+****
+***/
+
+static void
+spawnWorkers (tr_diskQueue * q)
+{
+  while (q->worker_count < q->max_workers)
+    {
+      ++q->worker_count;
+      tr_threadNew (workerFunc, q);
+    }
+}
+
+tr_diskQueue *
+tr_diskQueueNew (tr_session * session, int worker_count)
+{
+  tr_diskQueue * q = tr_new0 (tr_diskQueue, 1);
+
+  q->session = session;
+  q->lock = tr_lockNew ();
+  q->cond = tr_condNew ();
+  q->torrents = TR_PTR_ARRAY_INIT;
+  q->done = TR_PTR_ARRAY_INIT;
+  q->max_workers = MAX (1, MIN (worker_count, MAX_WORKERS));
+
+  tr_lockLock (q->lock);
+  spawnWorkers (q);
+  tr_lockUnlock (q->lock);
+
+  return q;
+}
+
+void
+tr_diskQueueFree (tr_diskQueue * q)
+{
+  int i, n;
+  struct disk_job ** jobs;
+
+  tr_lockLock (q->lock);
+  q->is_closing = true;
+  tr_condBroadcast (q->cond);
+  while (q->worker_count > 0)
+    tr_condWait (q->cond, q->lock);
+  tr_lockUnlock (q->lock);
+
+  /* the torrents are gone, so nobody is left to be told */
+  jobs = (struct disk_job**) tr_ptrArrayPeek (&q->done, &n);
+  for (i=0; i<n; ++i)
+    {
+      if (jobs[i]->result.data != NULL)
+        evbuffer_free (jobs[i]->result.data);
+      tr_free (jobs[i]->iov);
+      tr_free (jobs[i]);
+    }
+
+  tr_ptrArrayDestruct (&q->done, NULL);
+  tr_ptrArrayDestruct (&q->torrents, NULL);
+  tr_condFree (q->cond);
+  tr_lockFree (q->lock);
+  tr_free (q);
+}
+
+void
+tr_diskQueueSetWorkerCount (tr_diskQueue * q, int worker_count)
+{
+  tr_lockLock (q->lock);
+
+  q->max_workers = MAX (1, MIN (worker_count, MAX_WORKERS));
+  spawnWorkers (q);
+
+  /* surplus workers notice and exit */
+  tr_condBroadcast (q->cond);
+
+  tr_lockUnlock (q->lock);
+}
+
+int
+tr_diskQueueGetWorkerCount (const tr_diskQueue * q)
+{
+  return q->max_workers;
+}
+
+void
+tr_diskQueueSetUringEnabled (tr_diskQueue * q, bool enabled)
+{
+  tr_lockLock (q->lock);
+
+  q->use_uring = enabled;
+
+  /* idle workers notice and start or stop using their rings */
+  tr_condBroadcast (q->cond);
+
+  tr_lockUnlock (q->lock);
+}
+
+bool
+tr_diskQueueIsUringEnabled (const tr_diskQueue * q)
+{
+  return q->use_uring;
+}
+
+/***
+****
+***/
+
+static struct disk_job *
+jobNew (tr_disk_job_type   type,
+        tr_torrent       * tor,
+        tr_piece_index_t   piece,
+        uint32_t           offset,
+        uint32_t           length)
+{
+  struct disk_job * job = tr_new0 (struct disk_job, 1);
+
+  assert (tr_isTorrent (tor));
+  assert (tr_amInEventThread (tor->session));
+
+  job->result.type = type;
+  job->result.piece = piece;
+  job->result.offset = offset;
+  job->result.length = length;
+  job->tor = tor;
+  job->torrent_id = tr_torrentId (tor);
+  job->queued_at_msec = tr_time_msec ();
+
+  if (type == TR_DISK_FLUSH)
+    {
+      job->begin = 0;
+      job->end = tor->info.totalSize;
+    }
+  else
+    {
+      job->begin = tr_pieceOffset (tor, piece, offset, 0);
+      job->end = job->begin + length;
+    }
+
+  return job;
+}
+
+static void
+jobEnqueue (tr_diskQueue * q, struct disk_job * job)
+{
+  struct disk_torrent * t;
+
+  tr_lockLock (q->lock);
+
+  t = getDiskTorrent (q, job->torrent_id, true);
+  job->seq = q->next_seq++;
+  jobListAppend (&t->waiting, job);
+  ++q->job_count;
+  ++t->job_count;
+  if (jobIsWrite (job))
+    ++t->write_count;
+  else if (job->result.type == TR_DISK_FLUSH)
+    ++t->flush_count;
+
+  ++q->stats.queue_depth;
+  q->stats.queue_depth_peak = MAX (q->stats.queue_depth_peak, q->stats.queue_depth);
+  tr_condBroadcast (q->cond);
+
+  tr_lockUnlock (q->lock);
+}
+
+void
+tr_diskQueueWrite (tr_diskQueue                 * q,
+                   tr_torrent                   * tor,
+                   tr_piece_index_t               piece,
+                   uint32_t                       offset,
+                   uint32_t                       length,
+                   const struct evbuffer_iovec  * iov,
+                   int                            iov_count,
+                   tr_disk_done_func              callback,
+                   void                         * user_data)
+{
+  struct disk_job * job = jobNew (TR_DISK_WRITE, tor, piece, offset, length);
+
+  job->iov = tr_memdup (iov, sizeof (struct evbuffer_iovec) * iov_count);
+  job->iov_count = iov_count;
+  job->callback = callback;
+  job->user_data = user_data;
+
+  dbgmsg ("queueing a write of %"PRIu32" bytes at %"PRIu32":%"PRIu32, length, piece, offset);
+  jobEnqueue (q, job);
+}
+
+void
+tr_diskQueueRead (tr_diskQueue      * q,
+                  tr_torrent        * tor,
+                  tr_piece_index_t    piece,
+                  uint32_t            offset,
+                  uint32_t            length,
+                  bool                check_piece,
+                  tr_disk_done_func   callback,
+                  void              * user_data)
+{
+  struct disk_job * job;
+
+  /* a piece check reads the whole piece */
+  if (check_piece)
+    {
+      job = jobNew (TR_DISK_READ, tor, piece, 0, tr_torPieceCountBytes (tor, piece));
+      job->result.offset = offset;
+      job->result.length = length;
+    }
+  else
+    {
+      job = jobNew (TR_DISK_READ, tor, piece, offset, length);
+    }
+
+  job->check_piece = check_piece;
+  job->callback = callback;
+  job->user_data = user_data;
+
+  jobEnqueue (q, job);
+}
+
+void
+tr_diskQueueHash (tr_diskQueue      * q,
+                  tr_torrent        * tor,
+                  tr_piece_index_t    piece,
+                  tr_disk_done_func   callback,
+                  void              * user_data)
+{
+  struct disk_job * job = jobNew (TR_DISK_HASH, tor, piece, 0, tr_torPieceCountBytes (tor, piece));
+
+  job->callback = callback;
+  job->user_data = user_data;
+
+  jobEnqueue (q, job);
+}
+
+void
+tr_diskQueueFlush (tr_diskQueue      * q,
+                   tr_torrent        * tor,
+                   tr_disk_done_func   callback,
+                   void              * user_data)
+{
+  struct disk_job * job = jobNew (TR_DISK_FLUSH, tor, 0, 0, 0);
+
+  job->callback = callback;
+  job->user_data = user_data;
+
+  jobEnqueue (q, job);
+}
+
+static bool
+torrentHasJobs (tr_diskQueue * q, const tr_torrent * tor)
+{
+  if (tor == NULL)
+    return q->job_count > 0;
+
+  return getDiskTorrent (q, tor->uniqueId, false) != NULL;
+}
+
+void
+tr_diskQueueWait (tr_diskQueue * q, const tr_torrent * tor)
+{
+  tr_lockLock (q->lock);
+
+  while (torrentHasJobs (q, tor))
+    tr_condWait (q->cond, q->lock);
+
+  tr_lockUnlock (q->lock);
+}
+
+/* copy `length' bytes, starting `skip' bytes in, from a write's buffers */
+static void
+jobCopyOut (const struct disk_job * job, size_t skip, size_t length, uint8_t * setme)
+{
+  int i;
+
+  for (i=0; (length > 0) && (i < job->iov_count); ++i)
+    {
+      const struct evbuffer_iovec * v = &job->iov[i];
+
+      if (skip >= v->iov_len)
+        {
+          skip -= v->iov_len;
+        }
+      else
+        {
+          const size_t n = MIN (v->iov_len - skip, length);
+          memcpy (setme, (const uint8_t*)v->iov_base + skip, n);
+          setme += n;
+          length -= n;
+          skip = 0;
+        }
+    }
+}
+
+bool
+tr_diskQueueFindWrite (tr_diskQueue     * q,
+                       const tr_torrent * tor,
+                       tr_piece_index_t   piece,
+                       uint32_t           offset,
+                       uint32_t           length,
+                       uint8_t          * setme)
+{
+  int i;
+  struct disk_torrent * t;
+  const struct disk_job * best = NULL;
+  const uint64_t begin = tr_pieceOffset (tor, piece, offset, 0);
+  const uint64_t end = begin + length;
+
+  tr_lockLock (q->lock);
+
+  if ((t = getDiskTorrent (q, tor->uniqueId, false)))
+    {
+      const struct job_list * lists[2] = { &t->running, &t->waiting };
+
+      /* the most recent write wins */
+      for (i=0; i<2; ++i)
+        {
+          const struct disk_job * job;
+
+          for (job=lists[i]->head; job!=NULL; job=job->next)
+            if ((job->iov != NULL)
+                && (job->begin <= begin)
+                && (end <= job->end)
+                && ((best == NULL) || (best->seq < job->seq)))
+              best = job;
+        }
+
+      if (best != NULL)
+        jobCopyOut (best, begin - best->begin, length, setme);
+    }
+
+  tr_lockUnlock (q->lock);
+  return best != NULL;
+}
+
+bool
+tr_diskQueueHasWrite (tr_diskQueue     * q,
+                      const tr_torrent * tor,
+                      tr_piece_index_t   piece,
+                      uint32_t           offset,
+                      uint32_t           length)
+{
+  int i;
+  bool found = false;
+  struct disk_torrent * t;
+  const uint64_t begin = tr_pieceOffset (tor, piece, offset, 0);
+  const uint64_t end = begin + length;
+
+  tr_lockLock (q->lock);
+
+  if ((t = getDiskTorrent (q, tor->uniqueId, false)) && (t->write_count > 0))
+    {
+      const struct job_list * lists[2] = { &t->running, &t->waiting };
+
+      for (i=0; !found && i<2; ++i)
+        {
+          const struct disk_job * job;
+
+          for (job=lists[i]->head; !found && job!=NULL; job=job->next)
+            found = (job->iov != NULL)
+                 && (job->begin < end)
+                 && (begin < job->end);
+        }
+    }
+
+  tr_lockUnlock (q->lock);
+  return found;
+}
+
+void
+tr_diskQueueCancel (tr_diskQueue * q, const void * user_data)
+{
+  int i, n;
+  struct disk_job * job;
+  struct disk_job ** jobs;
+
+  tr_lockLock (q->lock);
+
+  for (i=0; i<tr_ptrArraySize (&q->torrents); ++i)
+    {
+      struct disk_torrent * t = tr_ptrArrayNth (&q->torrents, i);
+
+      for (job=t->waiting.head; job!=NULL; job=job->next)
+        if (job->user_data == user_data)
+          job->is_cancelled = true;
+
+      for (job=t->running.head; job!=NULL; job=job->next)
+        if (job->user_data == user_data)
+          job->is_cancelled = true;
+    }
+
+  jobs = (struct disk_job**) tr_ptrArrayPeek (&q->done, &n);
+  for (i=0; i<n; ++i)
+    if (jobs[i]->user_data == user_data)
+      jobs[i]->is_cancelled = true;
+
+  tr_lockUnlock (q->lock);
+}
+
+void
+tr_diskQueueGetStats (tr_diskQueue * q, tr_disk_stats * setme)
+{
+  tr_lockLock (q->lock);
+  *setme = q->stats;
+  tr_lockUnlock (q->lock);
+}
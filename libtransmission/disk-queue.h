@@ -0,0 +1,185 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_DISK_QUEUE_H
+#define TR_DISK_QUEUE_H
+
+struct evbuffer;
+struct evbuffer_iovec;
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * The disk queue runs piece reads, writes and hashes on its own
+ * worker threads so that a slow disk doesn't stall the libevent thread.
+ *
+ * Jobs are submitted from the libevent thread. Jobs that touch
+ * overlapping parts of a torrent run in the order they were submitted
+ * if either of them is a write; everything else may run in parallel.
+ * When a job finishes, its callback is invoked in the libevent thread.
+ */
+typedef struct tr_diskQueue tr_diskQueue;
+
+typedef enum
+{
+  TR_DISK_READ,
+  TR_DISK_WRITE,
+  TR_DISK_FLUSH,
+  TR_DISK_HASH,
+  TR_DISK_JOB_TYPE_COUNT
+}
+tr_disk_job_type;
+
+typedef struct tr_disk_result
+{
+  tr_disk_job_type    type;
+
+  /* 0 on success, or an errno */
+  int                 err;
+
+  tr_piece_index_t    piece;
+  uint32_t            offset;
+  uint32_t            length;
+
+  /* true if the piece was hashed: by a TR_DISK_HASH job,
+     or by a TR_DISK_READ job that was asked to check its piece */
+  bool                hash_tested;
+  bool                hash_passed;
+
+  /* the bytes that a TR_DISK_READ job read. The callback may drain it. */
+  struct evbuffer   * data;
+}
+tr_disk_result;
+
+/**
+ * Invoked in the libevent thread when a job is done.
+ * `tor' is NULL if the torrent was removed in the meantime.
+ */
+typedef void (*tr_disk_done_func)(tr_torrent            * tor,
+                                  const tr_disk_result  * result,
+                                  void                  * user_data);
+
+typedef struct tr_disk_stats
+{
+  /* jobs that are waiting to run or running right now */
+  int         queue_depth;
+  int         queue_depth_peak;
+
+  /* per job type: how many have finished, and how long they
+     took from submission until their I/O was done */
+  uint64_t    job_count[TR_DISK_JOB_TYPE_COUNT];
+  uint64_t    latency_total_msec[TR_DISK_JOB_TYPE_COUNT];
+  uint64_t    latency_max_msec[TR_DISK_JOB_TYPE_COUNT];
+}
+tr_disk_stats;
+
+tr_diskQueue * tr_diskQueueNew (tr_session * session, int worker_count);
+
+/** @brief finish every queued job, then stop the worker threads */
+void tr_diskQueueFree (tr_diskQueue * queue);
+
+void tr_diskQueueSetWorkerCount (tr_diskQueue * queue, int worker_count);
+
+int  tr_diskQueueGetWorkerCount (const tr_diskQueue * queue);
+
+/**
+ * @brief if enabled, each worker batches its reads and writes into an
+ * io_uring where the system supports it, and uses pread ()/pwrite ()
+ * where it doesn't.
+ */
+void tr_diskQueueSetUringEnabled (tr_diskQueue * queue, bool enabled);
+
+bool tr_diskQueueIsUringEnabled (const tr_diskQueue * queue);
+
+/**
+ * @brief queue a write of the bytes in `iov'.
+ *
+ * The buffers are written in place, so the memory they point to has to
+ * stay untouched until `callback' is invoked, or until tr_diskQueueWait ()
+ * returns if the callback was cancelled.
+ */
+void tr_diskQueueWrite (tr_diskQueue                 * queue,
+                        tr_torrent                   * tor,
+                        tr_piece_index_t               piece,
+                        uint32_t                       offset,
+                        uint32_t                       length,
+                        const struct evbuffer_iovec  * iov,
+                        int                            iov_count,
+                        tr_disk_done_func              callback,
+                        void                         * user_data);
+
+/**
+ * @brief queue a read.
+ * @param check_piece if true, the whole piece is hashed before the
+ *                    block is read and the result is passed to `callback'
+ */
+void tr_diskQueueRead (tr_diskQueue      * queue,
+                       tr_torrent        * tor,
+                       tr_piece_index_t    piece,
+                       uint32_t            offset,
+                       uint32_t            length,
+                       bool                check_piece,
+                       tr_disk_done_func   callback,
+                       void              * user_data);
+
+/** @brief queue a check of the piece's checksum */
+void tr_diskQueueHash (tr_diskQueue      * queue,
+                       tr_torrent        * tor,
+                       tr_piece_index_t    piece,
+                       tr_disk_done_func   callback,
+                       void              * user_data);
+
+/** @brief `callback' is invoked once every job queued so far for `tor' is done */
+void tr_diskQueueFlush (tr_diskQueue      * queue,
+                        tr_torrent        * tor,
+                        tr_disk_done_func   callback,
+                        void              * user_data);
+
+/**
+ * @brief block until the I/O of all of a torrent's queued jobs is done.
+ * If `tor' is NULL, wait for every job in the queue.
+ */
+void tr_diskQueueWait (tr_diskQueue * queue, const tr_torrent * tor);
+
+/**
+ * @brief if a queued write covers the block, copy it into `setme'.
+ * @return true if the block was found
+ */
+bool tr_diskQueueFindWrite (tr_diskQueue     * queue,
+                            const tr_torrent * tor,
+                            tr_piece_index_t   piece,
+                            uint32_t           offset,
+                            uint32_t           length,
+                            uint8_t          * setme);
+
+/** @brief true if a queued write that hasn't reached the disk yet overlaps the block */
+bool tr_diskQueueHasWrite (tr_diskQueue     * queue,
+                           const tr_torrent * tor,
+                           tr_piece_index_t   piece,
+                           uint32_t           offset,
+                           uint32_t           length);
+
+/** @brief don't invoke the callbacks of any jobs queued with `user_data' */
+void tr_diskQueueCancel (tr_diskQueue * queue, const void * user_data);
+
+void tr_diskQueueGetStats (tr_diskQueue * queue, tr_disk_stats * setme);
+
+/* @} */
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/*
+ * Compares tr_runInEventThread () with the pipe it used to be built on,
+ * where every command was written into a pipe under a lock and read back
+ * out of it by its own libevent callback.
+ *
+ * The throughput pass has several threads post empty commands as fast as
+ * they can and reports how many the loop ran per second. The latency pass
+ * posts one command at a time to an idle loop and reports how long each
+ * took to start running, which is mostly the cost of waking the loop up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* strtoul (), qsort (), EXIT_FAILURE */
+#include <time.h> /* clock_gettime () */
+#include <unistd.h> /* read (), write (), pipe (), close () */
+
+#include <event2/event.h>
+
+#include "transmission.h"
+#include "libtransmission-test.h"
+#include "platform.h" /* tr_threadNew (), tr_lock */
+#include "tr-getopt.h"
+#include "trevent.h"
+#include "utils.h"
+
+#define MY_NAME "event-bench"
+
+static int producer_count = 4;
+static size_t command_count = 250000;
+static size_t sample_count = 2000;
+
+static tr_option options[] =
+{
+  { 'p', "producers", "Number of threads posting commands", "p", 1, "<count>" },
+  { 'n', "commands", "Commands posted by each thread", "n", 1, "<count>" },
+  { 'l', "samples", "Number of commands timed for latency", "l", 1, "<count>" },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int
+parseCommandLine (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 'p': producer_count = atoi (optarg); break;
+          case 'n': command_count = strtoul (optarg, NULL, 10); break;
+          case 'l': sample_count = strtoul (optarg, NULL, 10); break;
+          default: return 1;
+        }
+    }
+
+  return (producer_count > 0) && (command_count > 0) && (sample_count > 0) ? 0 : 1;
+}
+
+static uint64_t
+nowUsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/***
+****  The old way: a lock and a pipe
+***/
+
+struct pipe_command
+{
+  void (*func)(void *);
+  void * user_data;
+};
+
+static int pipe_fds[2];
+static tr_lock * pipe_lock = NULL;
+static struct event_base * pipe_base = NULL;
+static struct event * pipe_event = NULL;
+static bool pipe_running = false;
+
+static void
+pipeRead (int fd, short eventType UNUSED, void * unused UNUSED)
+{
+  char ch = '\0';
+  struct pipe_command cmd;
+
+  if (read (fd, &ch, 1) != 1)
+    {
+      event_free (pipe_event);
+      return;
+    }
+
+  if (read (fd, &cmd, sizeof (cmd)) == (ssize_t)sizeof (cmd))
+    (cmd.func)(cmd.user_data);
+}
+
+static void
+pipeThreadFunc (void * unused UNUSED)
+{
+  pipe_base = event_base_new ();
+  pipe_event = event_new (pipe_base, pipe_fds[0], EV_READ | EV_PERSIST, pipeRead, NULL);
+  event_add (pipe_event, NULL);
+  __atomic_store_n (&pipe_running, true, __ATOMIC_RELEASE);
+
+  event_base_dispatch (pipe_base);
+
+  event_base_free (pipe_base);
+  close (pipe_fds[0]);
+  __atomic_store_n (&pipe_running, false, __ATOMIC_RELEASE);
+}
+
+static void
+pipeStart (void)
+{
+  if (pipe (pipe_fds))
+    {
+      perror ("pipe");
+      exit (EXIT_FAILURE);
+    }
+
+  pipe_lock = tr_lockNew ();
+  tr_threadNew (pipeThreadFunc, NULL);
+  while (!__atomic_load_n (&pipe_running, __ATOMIC_ACQUIRE))
+    tr_wait_msec (1);
+}
+
+static void
+pipeRun (void func (void*), void * user_data)
+{
+  const char ch = 'r';
+  struct pipe_command cmd;
+
+  cmd.func = func;
+  cmd.user_data = user_data;
+
+  tr_lockLock (pipe_lock);
+  if (write (pipe_fds[1], &ch, 1) != 1 || write (pipe_fds[1], &cmd, sizeof (cmd)) != (ssize_t)sizeof (cmd))
+    perror ("write");
+  tr_lockUnlock (pipe_lock);
+}
+
+static void
+pipeStop (void)
+{
+  close (pipe_fds[1]);
+  while (__atomic_load_n (&pipe_running, __ATOMIC_ACQUIRE))
+    tr_wait_msec (1);
+  tr_lockFree (pipe_lock);
+}
+
+/***
+****  The new way: tr_runInEventThread ()
+***/
+
+static tr_session * bench_session = NULL;
+
+static void
+queueStart (void)
+{
+  bench_session = libttest_session_init (NULL);
+}
+
+static void
+queueRun (void func (void*), void * user_data)
+{
+  tr_runInEventThread (bench_session, func, user_data);
+}
+
+static void
+queueStop (void)
+{
+  libttest_session_close (bench_session);
+  bench_session = NULL;
+}
+
+/***
+****
+***/
+
+struct loop
+{
+  const char * name;
+  void (*start)(void);
+  void (*run)(void func (void*), void * user_data);
+  void (*stop)(void);
+};
+
+static uint64_t commands_done = 0;
+
+static void
+countCommand (void * unused UNUSED)
+{
+  /* only the loop's thread writes this */
+  __atomic_store_n (&commands_done, commands_done + 1, __ATOMIC_RELEASE);
+}
+
+static void
+producerFunc (void * vloop)
+{
+  size_t i;
+  const struct loop * loop = vloop;
+
+  for (i=0; i<command_count; ++i)
+    loop->run (countCommand, NULL);
+}
+
+static uint64_t posted_at = 0;
+static uint64_t latency = 0;
+
+static void
+timeCommand (void * unused UNUSED)
+{
+  __atomic_store_n (&latency, nowUsec () - posted_at + 1, __ATOMIC_RELEASE);
+}
+
+static int
+compareUint64 (const void * va, const void * vb)
+{
+  const uint64_t a = *(const uint64_t*)va;
+  const uint64_t b = *(const uint64_t*)vb;
+
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static void
+runLoop (const struct loop * loop)
+{
+  int i;
+  size_t j;
+  uint64_t begin;
+  uint64_t elapsed;
+  uint64_t * samples;
+  const uint64_t total = (uint64_t)producer_count * command_count;
+
+  loop->start ();
+
+  /* throughput */
+  __atomic_store_n (&commands_done, 0, __ATOMIC_RELEASE);
+  begin = nowUsec ();
+  for (i=0; i<producer_count; ++i)
+    tr_threadNew (producerFunc, (void*)loop);
+  while (__atomic_load_n (&commands_done, __ATOMIC_ACQUIRE) < total)
+    tr_wait_msec (1);
+  elapsed = nowUsec () - begin;
+
+  /* wakeup latency, one command at a time */
+  samples = tr_new (uint64_t, sample_count);
+  for (j=0; j<sample_count; ++j)
+    {
+      __atomic_store_n (&latency, 0, __ATOMIC_RELEASE);
+      posted_at = nowUsec ();
+      loop->run (timeCommand, NULL);
+      while ((samples[j] = __atomic_load_n (&latency, __ATOMIC_ACQUIRE)) == 0)
+        tr_wait_msec (1);
+      --samples[j];
+    }
+  qsort (samples, sample_count, sizeof (uint64_t), compareUint64);
+
+  printf ("%-6s %12.0f commands/s %8.1f us median wakeup %8.1f us 99th percentile\n",
+          loop->name, total * 1000000.0 / MAX (elapsed, 1),
+          (double)samples[sample_count / 2],
+          (double)samples[MIN (sample_count - 1, sample_count * 99 / 100)]);
+
+  tr_free (samples);
+  loop->stop ();
+}
+
+int
+main (int argc, char ** argv)
+{
+  size_t i;
+  static const struct loop loops[] =
+  {
+    { "pipe", pipeStart, pipeRun, pipeStop },
+    { "queue", queueStart, queueRun, queueStop }
+  };
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  printf ("%d threads posting %zu commands each, %zu latency samples\n",
+          producer_count, command_count, sample_count);
+
+  for (i=0; i<sizeof (loops) / sizeof (loops[0]); ++i)
+    runLoop (&loops[i]);
+
+  return 0;
+}
@@ -17,6 +17,12 @@
  #define _XOPEN_SOURCE 600
 #endif
 
+#ifdef HAVE_PWRITEV
+ /* _XOPEN_SOURCE hides pwritev () unless we ask for it */
+ #define _DEFAULT_SOURCE
+ #define _BSD_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -40,10 +46,16 @@
 #include <sys/resource.h> /* getrlimit */
 #include <fcntl.h> /* O_LARGEFILE posix_fadvise */
 #include <unistd.h> /* lseek (), write (), ftruncate (), pread (), pwrite (), etc */
+#ifdef HAVE_PWRITEV
+ #include <sys/uio.h> /* pwritev () */
+#endif
+
+#include <event2/buffer.h> /* struct evbuffer_iovec */
 
 #include "transmission.h"
 #include "fdlimit.h"
 #include "log.h"
+#include "platform.h" /* tr_lock */
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent () */
 
@@ -231,6 +243,43 @@ tr_pwrite (int fd, const void *buf, size_t count, off_t offset)
 #endif
 }
 
+ssize_t
+tr_pwritev (int fd, const struct evbuffer_iovec * iov, int iovcnt, off_t offset)
+{
+  int i;
+  ssize_t total = 0;
+
+#ifdef HAVE_PWRITEV
+  /* callers handle short writes, so there's no need to take them all at once */
+  struct iovec vec[64];
+
+  iovcnt = MIN (iovcnt, (int)(sizeof (vec) / sizeof (vec[0])));
+
+  for (i=0; i<iovcnt; ++i)
+    {
+      vec[i].iov_base = iov[i].iov_base;
+      vec[i].iov_len = iov[i].iov_len;
+    }
+
+  total = pwritev (fd, vec, iovcnt, offset);
+#else
+  for (i=0; i<iovcnt; ++i)
+    {
+      const ssize_t rc = tr_pwrite (fd, iov[i].iov_base, iov[i].iov_len, offset + total);
+
+      if (rc < 0)
+        return total > 0 ? total : -1;
+
+      total += rc;
+
+      if ((size_t)rc < iov[i].iov_len)
+        break;
+    }
+#endif
+
+  return total;
+}
+
 int
 tr_prefetch (int fd UNUSED, off_t offset UNUSED, size_t count UNUSED)
 {
@@ -302,20 +351,28 @@ struct tr_cached_file
   int torrent_id;
   tr_file_index_t file_index;
   time_t used_at;
-};
 
-static inline bool
-cached_file_is_open (const struct tr_cached_file * o)
-{
-  assert (o != NULL);
+  /* how many threads are using this fd right now.
+   * checked-out files are never recycled, and closing
+   * one is deferred until it's returned. */
+  int checkout_count;
+  bool close_on_return;
 
-  return o->fd >= 0;
-}
+  /* the next files in the same hash buckets. A file that's
+   * waiting to be closed is only in the fd index. */
+  struct tr_cached_file * key_next;
+  struct tr_cached_file * fd_next;
+
+  /* neighbors in the fileset's list of idle files */
+  struct tr_cached_file * idle_prev;
+  struct tr_cached_file * idle_next;
+};
 
 static void
 cached_file_close (struct tr_cached_file * o)
 {
-  assert (cached_file_is_open (o));
+  assert (o->fd >= 0);
+  assert (o->checkout_count == 0);
 
   tr_close_file (o->fd);
   o->fd = -1;
@@ -384,6 +441,7 @@ cached_file_open (struct tr_cached_file  * o,
     {
       const int err = errno;
       tr_logAddError (_("Couldn't truncate \"%1$s\": %2$s"), filename, tr_strerror (err));
+      cached_file_close (o);
       return err;
     }
 
@@ -402,53 +460,299 @@ cached_file_open (struct tr_cached_file  * o,
 ****
 ***/
 
+/* a file that was closed to make room for another one */
+struct evicted_file
+{
+  int torrent_id;
+  tr_file_index_t file_index;
+  bool indexed;
+  struct evicted_file * next;
+};
+
+/**
+ * The open files are indexed twice: by (torrent_id, file_index) for
+ * checkouts and by fd for returns. The ones that aren't checked out
+ * are also kept in an idle list, least recently used first, so that
+ * making room for a new file means closing the head of that list.
+ *
+ * The last `limit' evictions are remembered in a ring so that we can
+ * count the files that get opened again soon after being closed.
+ * If that happens a lot, the limit is smaller than the working set.
+ */
 struct tr_fileset
 {
-  struct tr_cached_file * begin;
-  const struct tr_cached_file * end;
+  struct tr_cached_file ** by_key;
+  struct tr_cached_file ** by_fd;
+  size_t bucket_count;
+
+  struct tr_cached_file * idle_head;
+  struct tr_cached_file * idle_tail;
+
+  struct evicted_file * evicted;
+  struct evicted_file ** evicted_by_key;
+  size_t evicted_bucket_count;
+  int evicted_pos;
+
+  /* how many files may be open, and how many are */
+  int limit;
+  int open_count;
+
+  uint64_t opens;
+  uint64_t evictions;
+  uint64_t reopens;
 };
 
+enum
+{
+  MIN_BUCKET_COUNT = 64
+};
+
+static size_t
+get_key_hash (int torrent_id, tr_file_index_t i)
+{
+  uint32_t h = ((uint32_t)torrent_id << 20) ^ (uint32_t)i;
+
+  h *= 2654435761u;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static size_t
+get_fd_hash (int fd)
+{
+  uint32_t h = (uint32_t)fd * 2654435761u;
+
+  return h ^ (h >> 16);
+}
+
+static size_t
+round_up_to_power_of_two (size_t n)
+{
+  size_t i = MIN_BUCKET_COUNT;
+
+  while (i < n)
+    i *= 2;
+
+  return i;
+}
+
 static void
-fileset_construct (struct tr_fileset * set, int n)
+fileset_rehash (struct tr_fileset * set, size_t bucket_count)
 {
-  struct tr_cached_file * o;
-  const struct tr_cached_file TR_CACHED_FILE_INIT = { 0, -1, 0, 0, 0 };
+  size_t i;
+  struct tr_cached_file ** old_by_fd = set->by_fd;
+  const size_t old_bucket_count = set->bucket_count;
 
-  set->begin = tr_new (struct tr_cached_file, n);
-  set->end = set->begin + n;
+  tr_free (set->by_key);
+  set->by_key = tr_new0 (struct tr_cached_file*, bucket_count);
+  set->by_fd = tr_new0 (struct tr_cached_file*, bucket_count);
+  set->bucket_count = bucket_count;
+
+  /* every open file is in the fd index */
+  for (i=0; i<old_bucket_count; ++i)
+    {
+      struct tr_cached_file * o = old_by_fd[i];
+
+      while (o != NULL)
+        {
+          struct tr_cached_file * next = o->fd_next;
+          struct tr_cached_file ** bucket;
+
+          bucket = &set->by_fd[get_fd_hash (o->fd) & (bucket_count - 1)];
+          o->fd_next = *bucket;
+          *bucket = o;
+
+          if (!o->close_on_return)
+            {
+              bucket = &set->by_key[get_key_hash (o->torrent_id, o->file_index) & (bucket_count - 1)];
+              o->key_next = *bucket;
+              *bucket = o;
+            }
 
-  for (o=set->begin; o!=set->end; ++o)
-    *o = TR_CACHED_FILE_INIT;
+          o = next;
+        }
+    }
+
+  tr_free (old_by_fd);
+}
+
+static void
+fileset_set_limit (struct tr_fileset * set, int limit)
+{
+  set->limit = MAX (1, limit);
+
+  /* start remembering evictions afresh */
+  tr_free (set->evicted);
+  tr_free (set->evicted_by_key);
+  set->evicted = tr_new0 (struct evicted_file, set->limit);
+  set->evicted_bucket_count = round_up_to_power_of_two (set->limit);
+  set->evicted_by_key = tr_new0 (struct evicted_file*, set->evicted_bucket_count);
+  set->evicted_pos = 0;
+}
+
+static void
+fileset_construct (struct tr_fileset * set, int limit)
+{
+  memset (set, 0, sizeof (struct tr_fileset));
+  fileset_rehash (set, MIN_BUCKET_COUNT);
+  fileset_set_limit (set, limit);
+}
+
+/***
+****
+***/
+
+static void
+idle_append (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  o->idle_next = NULL;
+  o->idle_prev = set->idle_tail;
+
+  if (set->idle_tail != NULL)
+    set->idle_tail->idle_next = o;
+  else
+    set->idle_head = o;
+
+  set->idle_tail = o;
+}
+
+static void
+idle_remove (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (o->idle_prev != NULL)
+    o->idle_prev->idle_next = o->idle_next;
+  else
+    set->idle_head = o->idle_next;
+
+  if (o->idle_next != NULL)
+    o->idle_next->idle_prev = o->idle_prev;
+  else
+    set->idle_tail = o->idle_prev;
+
+  o->idle_prev = o->idle_next = NULL;
+}
+
+static void
+key_index_remove (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  const size_t pos = get_key_hash (o->torrent_id, o->file_index) & (set->bucket_count - 1);
+  struct tr_cached_file ** walk = &set->by_key[pos];
+
+  while (*walk != o)
+    walk = &(*walk)->key_next;
+
+  *walk = o->key_next;
+  o->key_next = NULL;
+}
+
+static void
+fd_index_remove (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  struct tr_cached_file ** walk = &set->by_fd[get_fd_hash (o->fd) & (set->bucket_count - 1)];
+
+  while (*walk != o)
+    walk = &(*walk)->fd_next;
+
+  *walk = o->fd_next;
+  o->fd_next = NULL;
+}
+
+/* adds a newly-opened, checked-out file to the indices */
+static void
+fileset_add (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  struct tr_cached_file ** bucket;
+
+  if ((size_t)set->open_count >= set->bucket_count)
+    fileset_rehash (set, set->bucket_count * 2);
+
+  ++set->open_count;
+
+  bucket = &set->by_key[get_key_hash (o->torrent_id, o->file_index) & (set->bucket_count - 1)];
+  o->key_next = *bucket;
+  *bucket = o;
+
+  bucket = &set->by_fd[get_fd_hash (o->fd) & (set->bucket_count - 1)];
+  o->fd_next = *bucket;
+  *bucket = o;
+}
+
+/* closes a file that nobody has checked out */
+static void
+fileset_free_file (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  fd_index_remove (set, o);
+  cached_file_close (o);
+  --set->open_count;
+  tr_free (o);
+}
+
+/* closes the file now if it's idle, or when it's returned if not */
+static void
+fileset_close_file (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (!o->close_on_return)
+    key_index_remove (set, o);
+
+  if (o->checkout_count > 0)
+    {
+      o->close_on_return = true;
+    }
+  else
+    {
+      idle_remove (set, o);
+      fileset_free_file (set, o);
+    }
 }
 
 static void
 fileset_close_all (struct tr_fileset * set)
 {
-  struct tr_cached_file * o;
+  size_t i;
+
+  for (i=0; i<set->bucket_count; ++i)
+    {
+      struct tr_cached_file * o = set->by_fd[i];
 
-  if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if (cached_file_is_open (o))
-        cached_file_close (o);
+      while (o != NULL)
+        {
+          struct tr_cached_file * next = o->fd_next;
+          fileset_close_file (set, o);
+          o = next;
+        }
+    }
 }
 
 static void
 fileset_destruct (struct tr_fileset * set)
 {
   fileset_close_all (set);
-  tr_free (set->begin);
-  set->end = set->begin = NULL;
+
+  tr_free (set->evicted_by_key);
+  tr_free (set->evicted);
+  tr_free (set->by_fd);
+  tr_free (set->by_key);
+  memset (set, 0, sizeof (struct tr_fileset));
 }
 
 static void
 fileset_close_torrent (struct tr_fileset * set, int torrent_id)
 {
-  struct tr_cached_file * o;
+  size_t i;
 
-  if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((o->torrent_id == torrent_id) && cached_file_is_open (o))
-        cached_file_close (o);
+  for (i=0; i<set->bucket_count; ++i)
+    {
+      struct tr_cached_file * o = set->by_fd[i];
+
+      while (o != NULL)
+        {
+          struct tr_cached_file * next = o->fd_next;
+          if ((o->torrent_id == torrent_id) && !o->close_on_return)
+            fileset_close_file (set, o);
+          o = next;
+        }
+    }
 }
 
 static struct tr_cached_file *
@@ -456,37 +760,122 @@ fileset_lookup (struct tr_fileset * set, int torrent_id, tr_file_index_t i)
 {
   struct tr_cached_file * o;
 
-  if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((torrent_id == o->torrent_id) && (i == o->file_index) && cached_file_is_open (o))
-        return o;
+  o = set->by_key[get_key_hash (torrent_id, i) & (set->bucket_count - 1)];
+  while ((o != NULL) && ((o->torrent_id != torrent_id) || (o->file_index != i)))
+    o = o->key_next;
 
-  return NULL;
+  return o;
 }
 
 static struct tr_cached_file *
-fileset_get_empty_slot (struct tr_fileset * set)
+fileset_lookup_fd (struct tr_fileset * set, int fd)
+{
+  struct tr_cached_file * o;
+
+  o = set->by_fd[get_fd_hash (fd) & (set->bucket_count - 1)];
+  while ((o != NULL) && (o->fd != fd))
+    o = o->fd_next;
+
+  return o;
+}
+
+static void
+fileset_checkout (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (o->checkout_count++ == 0)
+    idle_remove (set, o);
+
+  o->used_at = tr_time ();
+}
+
+static void
+fileset_return (struct tr_fileset * set, struct tr_cached_file * o)
 {
-  struct tr_cached_file * cull = NULL;
+  assert (o->checkout_count > 0);
 
-  if (set->begin != NULL)
+  if (--o->checkout_count > 0)
+    return;
+
+  if (o->close_on_return)
     {
-      struct tr_cached_file * o;
+      fileset_free_file (set, o);
+    }
+  else if (set->open_count > set->limit) /* the limit was lowered */
+    {
+      key_index_remove (set, o);
+      fileset_free_file (set, o);
+    }
+  else
+    {
+      idle_append (set, o);
+    }
+}
+
+static void
+evicted_unindex (struct tr_fileset * set, struct evicted_file * e)
+{
+  const size_t pos = get_key_hash (e->torrent_id, e->file_index) & (set->evicted_bucket_count - 1);
+  struct evicted_file ** walk = &set->evicted_by_key[pos];
 
-      /* try to find an unused slot */
-      for (o=set->begin; o!=set->end; ++o)
-        if (!cached_file_is_open (o))
-          return o;
+  while (*walk != e)
+    walk = &(*walk)->next;
 
-      /* all slots are full... recycle the least recently used */
-      for (cull=NULL, o=set->begin; o!=set->end; ++o)
-        if (!cull || o->used_at < cull->used_at)
-          cull = o;
+  *walk = e->next;
+  e->next = NULL;
+  e->indexed = false;
+}
+
+static void
+evicted_add (struct tr_fileset * set, int torrent_id, tr_file_index_t i)
+{
+  struct evicted_file ** bucket;
+  struct evicted_file * e = &set->evicted[set->evicted_pos];
 
-      cached_file_close (cull);
+  /* overwrite the oldest eviction */
+  set->evicted_pos = (set->evicted_pos + 1) % set->limit;
+  if (e->indexed)
+    evicted_unindex (set, e);
+
+  e->torrent_id = torrent_id;
+  e->file_index = i;
+  e->indexed = true;
+
+  bucket = &set->evicted_by_key[get_key_hash (torrent_id, i) & (set->evicted_bucket_count - 1)];
+  e->next = *bucket;
+  *bucket = e;
+}
+
+/* if the file was evicted recently, forget it and return true */
+static bool
+evicted_take (struct tr_fileset * set, int torrent_id, tr_file_index_t i)
+{
+  struct evicted_file * e;
+
+  e = set->evicted_by_key[get_key_hash (torrent_id, i) & (set->evicted_bucket_count - 1)];
+  while ((e != NULL) && ((e->torrent_id != torrent_id) || (e->file_index != i)))
+    e = e->next;
+
+  if (e != NULL)
+    evicted_unindex (set, e);
+
+  return e != NULL;
+}
+
+/* returns true if there's room to open another file */
+static bool
+fileset_make_room (struct tr_fileset * set)
+{
+  while ((set->open_count >= set->limit) && (set->idle_head != NULL))
+    {
+      struct tr_cached_file * o = set->idle_head;
+
+      dbgmsg ("evicting torrent %d file %u", o->torrent_id, (unsigned int)o->file_index);
+      evicted_add (set, o->torrent_id, o->file_index);
+      ++set->evictions;
+      fileset_close_file (set, o);
     }
 
-  return cull;
+  return set->open_count < set->limit;
 }
 
 /***
@@ -499,6 +888,9 @@ struct tr_fdInfo
 {
   int peerCount;
   struct tr_fileset fileset;
+
+  /* the fileset is shared between the libevent thread and the disk queue's workers */
+  tr_lock * lock;
 };
 
 static void
@@ -515,6 +907,7 @@ ensureSessionFdInfoExists (tr_session * session)
       /* Create the local file cache */
       i = tr_new0 (struct tr_fdInfo, 1);
       fileset_construct (&i->fileset, FILE_CACHE_SIZE);
+      i->lock = tr_lockNew ();
       session->fdInfo = i;
 
       /* set the open-file limit to the largest safe size wrt FD_SETSIZE */
@@ -533,6 +926,12 @@ ensureSessionFdInfoExists (tr_session * session)
     }
 }
 
+void
+tr_fdInit (tr_session * session)
+{
+  ensureSessionFdInfoExists (session);
+}
+
 void
 tr_fdClose (tr_session * session)
 {
@@ -540,6 +939,7 @@ tr_fdClose (tr_session * session)
     {
       struct tr_fdInfo * i = session->fdInfo;
       fileset_destruct (&i->fileset);
+      tr_lockFree (i->lock);
       tr_free (i);
       session->fdInfo = NULL;
     }
@@ -559,11 +959,26 @@ get_fileset (tr_session * session)
   return &session->fdInfo->fileset;
 }
 
+static void
+fileset_lock (tr_session * session)
+{
+  ensureSessionFdInfoExists (session);
+  tr_lockLock (session->fdInfo->lock);
+}
+
+static void
+fileset_unlock (tr_session * session)
+{
+  tr_lockUnlock (session->fdInfo->lock);
+}
+
 void
 tr_fdFileClose (tr_session * s, const tr_torrent * tor, tr_file_index_t i)
 {
   struct tr_cached_file * o;
 
+  fileset_lock (s);
+
   if ((o = fileset_lookup (get_fileset (s), tr_torrentId (tor), i)))
     {
       /* flush writable files so that their mtimes will be
@@ -571,20 +986,46 @@ tr_fdFileClose (tr_session * s, const tr_torrent * tor, tr_file_index_t i)
       if (o->is_writable)
         tr_fsync (o->fd);
 
-      cached_file_close (o);
+      fileset_close_file (get_fileset (s), o);
     }
+
+  fileset_unlock (s);
 }
 
 int
 tr_fdFileGetCached (tr_session * s, int torrent_id, tr_file_index_t i, bool writable)
 {
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  int fd = -1;
+  struct tr_cached_file * o;
 
-  if (!o || (writable && !o->is_writable))
-    return -1;
+  fileset_lock (s);
 
-  o->used_at = tr_time ();
-  return o->fd;
+  o = fileset_lookup (get_fileset (s), torrent_id, i);
+
+  if (o && (!writable || o->is_writable))
+    {
+      fileset_checkout (get_fileset (s), o);
+      fd = o->fd;
+    }
+
+  fileset_unlock (s);
+  return fd;
+}
+
+void
+tr_fdFileReturn (tr_session * s, int fd)
+{
+  struct tr_cached_file * o;
+
+  fileset_lock (s);
+
+  o = fileset_lookup_fd (get_fileset (s), fd);
+  assert (o != NULL);
+
+  if (o != NULL)
+    fileset_return (get_fileset (s), o);
+
+  fileset_unlock (s);
 }
 
 #ifdef SYS_DARWIN
@@ -598,11 +1039,15 @@ tr_fdFileGetCachedMTime (tr_session * s, int torrent_id, tr_file_index_t i, time
 {
   bool success;
   struct stat sb;
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  struct tr_cached_file * o;
+
+  fileset_lock (s);
 
+  o = fileset_lookup (get_fileset (s), torrent_id, i);
   if ((success = (o != NULL) && !fstat (o->fd, &sb)))
     *mtime = TR_STAT_MTIME (sb);
 
+  fileset_unlock (s);
   return success;
 }
 
@@ -611,7 +1056,56 @@ tr_fdTorrentClose (tr_session * session, int torrent_id)
 {
   assert (tr_sessionIsLocked (session));
 
+  fileset_lock (session);
   fileset_close_torrent (get_fileset (session), torrent_id);
+  fileset_unlock (session);
+}
+
+void
+tr_fdSetFileLimit (tr_session * session, int limit)
+{
+  struct tr_fileset * set;
+
+  fileset_lock (session);
+
+  set = get_fileset (session);
+  fileset_set_limit (set, limit);
+
+  /* if the limit went down, close idle files until we're under it.
+     checked-out files are closed when they're returned */
+  while ((set->open_count > set->limit) && (set->idle_head != NULL))
+    fileset_close_file (set, set->idle_head);
+
+  fileset_unlock (session);
+}
+
+int
+tr_fdGetFileLimit (tr_session * session)
+{
+  int limit;
+
+  fileset_lock (session);
+  limit = get_fileset (session)->limit;
+  fileset_unlock (session);
+
+  return limit;
+}
+
+void
+tr_fdGetStats (tr_session * session, tr_fd_stats * setme)
+{
+  const struct tr_fileset * set;
+
+  fileset_lock (session);
+
+  set = get_fileset (session);
+  setme->open_files = set->open_count;
+  setme->open_file_limit = set->limit;
+  setme->opens = set->opens;
+  setme->evictions = set->evictions;
+  setme->reopens = set->reopens;
+
+  fileset_unlock (session);
 }
 
 /* returns an fd on success, or a -1 on failure and sets errno */
@@ -624,31 +1118,75 @@ tr_fdFileCheckout (tr_session             * session,
                    tr_preallocation_mode    allocation,
                    uint64_t                 file_size)
 {
-  struct tr_fileset * set = get_fileset (session);
-  struct tr_cached_file * o = fileset_lookup (set, torrent_id, i);
+  int err = 0;
+  struct tr_fileset * set;
+  struct tr_cached_file * o;
+
+  fileset_lock (session);
+
+  set = get_fileset (session);
+  o = fileset_lookup (set, torrent_id, i);
 
   if (o && writable && !o->is_writable)
-    cached_file_close (o); /* close it so we can reopen in rw mode */
-  else if (!o)
-    o = fileset_get_empty_slot (set);
+    {
+      /* close it so we can reopen in rw mode */
+      if (o->checkout_count > 0)
+        err = EBUSY;
+      else
+        fileset_close_file (set, o);
 
-  if (!cached_file_is_open (o))
+      o = NULL;
+    }
+
+  if (!err && (o == NULL))
     {
-      const int err = cached_file_open (o, filename, writable, allocation, file_size);
-      if (err)
+      /* check before making room, which may evict more files */
+      const bool was_evicted = evicted_take (set, torrent_id, i);
+
+      if (!fileset_make_room (set))
         {
-          errno = err;
-          return -1;
+          err = EMFILE;
         }
+      else
+        {
+          o = tr_new0 (struct tr_cached_file, 1);
+          o->torrent_id = torrent_id;
+          o->file_index = i;
+          err = cached_file_open (o, filename, writable, allocation, file_size);
+
+          if (err)
+            {
+              tr_free (o);
+              o = NULL;
+            }
+          else
+            {
+              dbgmsg ("opened '%s' writable %c", filename, writable?'y':'n');
+              o->is_writable = writable;
+              o->checkout_count = 1;
+              o->used_at = tr_time ();
+              fileset_add (set, o);
+
+              ++set->opens;
+              if (was_evicted)
+                ++set->reopens;
+            }
+        }
+    }
+  else if (!err)
+    {
+      dbgmsg ("checking out '%s'", filename);
+      fileset_checkout (set, o);
+    }
 
-      dbgmsg ("opened '%s' writable %c", filename, writable?'y':'n');
-      o->is_writable = writable;
+  fileset_unlock (session);
+
+  if (err)
+    {
+      errno = err;
+      return -1;
     }
 
-  dbgmsg ("checking out '%s'", filename);
-  o->torrent_id = torrent_id;
-  o->file_index = i;
-  o->used_at = tr_time ();
   return o->fd;
 }
 
@@ -748,4 +1286,8 @@ tr_fdSocketClose (tr_session * session, int fd)
 
       assert (gFd->peerCount >= 0);
     }
+  else if (fd >= 0) /* a peer loop's socket can outlive tr_fdClose () */
+    {
+      tr_netCloseSocket (fd);
+    }
 }
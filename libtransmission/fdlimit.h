@@ -17,6 +17,8 @@
 #include "transmission.h"
 #include "net.h"
 
+struct evbuffer_iovec;
+
 /**
  * @addtogroup file_io File IO
  * @{
@@ -38,6 +40,8 @@ int tr_fsync (int fd);
 
 ssize_t tr_pread (int fd, void *buf, size_t count, off_t offset);
 ssize_t tr_pwrite (int fd, const void *buf, size_t count, off_t offset);
+/* like tr_pwrite (), but gathers from several buffers. May write less than all of them */
+ssize_t tr_pwritev (int fd, const struct evbuffer_iovec * iov, int iovcnt, off_t offset);
 int tr_prefetch (int fd, off_t offset, size_t count);
 
 
@@ -52,8 +56,10 @@ int tr_prefetch (int fd, off_t offset, size_t count);
  * - if do_write is true, the target file is created if necessary.
  *
  * on success, a file descriptor >= 0 is returned.
+ * It must be handed back with tr_fdFileReturn () when the caller is done.
  * on failure, a -1 is returned and errno is set.
  *
+ * @see tr_fdFileReturn
  * @see tr_fdFileClose
  */
 int  tr_fdFileCheckout (tr_session             * session,
@@ -64,11 +70,21 @@ int  tr_fdFileCheckout (tr_session             * session,
                         tr_preallocation_mode    preallocation_mode,
                         uint64_t                 preallocation_file_size);
 
+/**
+ * Like tr_fdFileCheckout (), but only returns files that are already open.
+ * On success the fd must be handed back with tr_fdFileReturn ().
+ */
 int tr_fdFileGetCached (tr_session             * session,
                         int                      torrent_id,
                         tr_file_index_t          file_num,
                         bool                  doWrite);
 
+/**
+ * Returns a file descriptor that was checked out by
+ * tr_fdFileCheckout () or tr_fdFileGetCached ().
+ */
+void tr_fdFileReturn (tr_session * session, int fd);
+
 bool tr_fdFileGetCachedMTime (tr_session       * session,
                               int                torrent_id,
                               tr_file_index_t    file_num,
@@ -94,6 +110,33 @@ void tr_fdFileClose (tr_session        * session,
 void tr_fdTorrentClose (tr_session * session, int torrentId);
 
 
+typedef struct tr_fd_stats
+{
+  /* how many local files are open, and how many may be */
+  int open_files;
+  int open_file_limit;
+
+  /* files opened, closed to make room for another, and opened
+   * again after being closed to make room. If there are many
+   * reopens, the limit is smaller than the torrents' working set. */
+  uint64_t opens;
+  uint64_t evictions;
+  uint64_t reopens;
+}
+tr_fd_stats;
+
+/**
+ * Sets how many local files may be kept open at once.
+ * If there are more than that open, the idle ones are closed now
+ * and the ones that are checked out are closed when they're returned.
+ */
+void tr_fdSetFileLimit (tr_session * session, int limit);
+
+int  tr_fdGetFileLimit (tr_session * session);
+
+void tr_fdGetStats (tr_session * session, tr_fd_stats * setme);
+
+
 /***********************************************************************
  * Sockets
  **********************************************************************/
@@ -106,6 +149,14 @@ int      tr_fdSocketAccept (tr_session  * session,
 
 void     tr_fdSocketClose (tr_session * session, int s);
 
+/***********************************************************************
+ * tr_fdInit
+ ***********************************************************************
+ * Sets up the file repository. This must be called before any threads
+ * other than the libevent thread can check out files.
+ **********************************************************************/
+void     tr_fdInit (tr_session * session);
+
 /***********************************************************************
  * tr_fdClose
  ***********************************************************************
@@ -0,0 +1,154 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <stdlib.h> /* tr_renew () -> realloc () */
+
+#include "transmission.h"
+#include "heap.h"
+#include "utils.h"
+
+#define FLOOR 32
+
+void
+tr_heapConstruct (tr_heap            * heap,
+                  tr_heapCompareFunc   compare,
+                  tr_heapIndexFunc     setIndex)
+{
+  assert (compare != NULL);
+  assert (setIndex != NULL);
+
+  heap->items = NULL;
+  heap->n_items = 0;
+  heap->n_alloc = 0;
+  heap->compare = compare;
+  heap->setIndex = setIndex;
+}
+
+void
+tr_heapDestruct (tr_heap * heap)
+{
+  int i;
+
+  for (i=0; i<heap->n_items; ++i)
+    heap->setIndex (heap->items[i], -1);
+
+  tr_free (heap->items);
+  heap->items = NULL;
+  heap->n_items = 0;
+  heap->n_alloc = 0;
+}
+
+static inline void
+heapPlace (tr_heap * heap, void * item, int pos)
+{
+  heap->items[pos] = item;
+  heap->setIndex (item, pos);
+}
+
+static void
+siftUp (tr_heap * heap, int pos)
+{
+  void * item = heap->items[pos];
+
+  while (pos > 0)
+    {
+      const int parent = (pos - 1) / 2;
+
+      if (heap->compare (heap->items[parent], item) <= 0)
+        break;
+
+      heapPlace (heap, heap->items[parent], pos);
+      pos = parent;
+    }
+
+  heapPlace (heap, item, pos);
+}
+
+static void
+siftDown (tr_heap * heap, int pos)
+{
+  void * item = heap->items[pos];
+  const int n = heap->n_items;
+
+  for (;;)
+    {
+      int child = pos * 2 + 1;
+
+      if (child >= n)
+        break;
+
+      if ((child + 1 < n) && (heap->compare (heap->items[child + 1], heap->items[child]) < 0))
+        ++child;
+
+      if (heap->compare (item, heap->items[child]) <= 0)
+        break;
+
+      heapPlace (heap, heap->items[child], pos);
+      pos = child;
+    }
+
+  heapPlace (heap, item, pos);
+}
+
+void
+tr_heapInsert (tr_heap * heap, void * item)
+{
+  if (heap->n_items >= heap->n_alloc)
+    {
+      heap->n_alloc = MAX (FLOOR, heap->n_alloc * 2);
+      heap->items = tr_renew (void*, heap->items, heap->n_alloc);
+    }
+
+  heap->items[heap->n_items] = item;
+  siftUp (heap, heap->n_items++);
+}
+
+void*
+tr_heapPop (tr_heap * heap)
+{
+  void * ret = tr_heapPeek (heap);
+
+  if (ret != NULL)
+    tr_heapRemove (heap, 0);
+
+  return ret;
+}
+
+void
+tr_heapRemove (tr_heap * heap, int pos)
+{
+  void * item;
+
+  assert (0 <= pos && pos < heap->n_items);
+
+  item = heap->items[pos];
+
+  if (pos != --heap->n_items)
+    {
+      heap->items[pos] = heap->items[heap->n_items];
+      tr_heapUpdate (heap, pos);
+    }
+
+  heap->setIndex (item, -1);
+}
+
+void
+tr_heapUpdate (tr_heap * heap, int pos)
+{
+  assert (0 <= pos && pos < heap->n_items);
+
+  if ((pos > 0) && (heap->compare (heap->items[pos], heap->items[(pos - 1) / 2]) < 0))
+    siftUp (heap, pos);
+  else
+    siftDown (heap, pos);
+}
@@ -0,0 +1,80 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_HEAP_H
+#define TR_HEAP_H
+
+/**
+ * @addtogroup utils Utilities
+ * @{
+ */
+
+typedef int (*tr_heapCompareFunc)(const void * a, const void * b);
+
+/** @brief tells an item where it is in the heap, or -1 when it's been removed */
+typedef void (*tr_heapIndexFunc)(void * item, int pos);
+
+/**
+ * @brief a binary min-heap of pointers.
+ *
+ * The heap tells each item its position whenever it moves, so that an item
+ * whose key has changed can be updated or removed without searching for it.
+ */
+typedef struct tr_heap
+{
+  /* these are PRIVATE IMPLEMENTATION details included for composition only.
+   * Don't access these directly! */
+  void ** items;
+  int n_items;
+  int n_alloc;
+  tr_heapCompareFunc compare;
+  tr_heapIndexFunc setIndex;
+}
+tr_heap;
+
+void tr_heapConstruct (tr_heap            * heap,
+                       tr_heapCompareFunc   compare,
+                       tr_heapIndexFunc     setIndex);
+
+void tr_heapDestruct (tr_heap * heap);
+
+static inline int
+tr_heapSize (const tr_heap * heap)
+{
+  return heap->n_items;
+}
+
+/** @return the smallest item, or NULL if the heap is empty */
+static inline void*
+tr_heapPeek (const tr_heap * heap)
+{
+  return heap->n_items > 0 ? heap->items[0] : NULL;
+}
+
+void tr_heapInsert (tr_heap * heap, void * item);
+
+/** @brief remove and return the smallest item, or NULL if the heap is empty */
+void* tr_heapPop (tr_heap * heap);
+
+/** @brief remove the item at position `pos' */
+void tr_heapRemove (tr_heap * heap, int pos);
+
+/** @brief move the item at position `pos' after its key has changed */
+void tr_heapUpdate (tr_heap * heap, int pos);
+
+/* @} */
+
+#endif
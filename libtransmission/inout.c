@@ -14,17 +14,24 @@
 #include <errno.h>
 #include <stdlib.h> /* bsearch () */
 #include <string.h> /* memcmp () */
+#include <sys/types.h>
+#include <sys/stat.h> /* fstat () */
+#include <unistd.h> /* dup (), close () */
+
+#include <event2/buffer.h>
 
 #include <openssl/sha.h>
 
 #include "transmission.h"
-#include "cache.h" /* tr_cacheReadBlock () */
+#include "cache.h" /* tr_cacheReadBlock (), tr_cacheGetPieceHash () */
 #include "fdlimit.h"
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "stats.h" /* tr_statsFileCreated () */
 #include "torrent.h"
+#include "trevent.h" /* tr_amInEventThread () */
+#include "uring.h"
 #include "utils.h"
 
 /****
@@ -39,32 +46,19 @@ enum
   TR_IO_WRITE
 };
 
-/* returns 0 on success, or an errno on failure */
+/* checks out the fd of a file, opening or creating it if needed.
+   returns 0 on success, or an errno on failure */
 static int
-readOrWriteBytes (tr_session       * session,
-                  tr_torrent       * tor,
-                  int                ioMode,
-                  tr_file_index_t    fileIndex,
-                  uint64_t           fileOffset,
-                  void             * buf,
-                  size_t             buflen)
+checkoutFile (tr_session       * session,
+              tr_torrent       * tor,
+              tr_file_index_t    fileIndex,
+              bool               doWrite,
+              bool               mayWait,
+              int              * setme_fd)
 {
   int fd;
   int err = 0;
-  const bool doWrite = ioMode >= TR_IO_WRITE;
-  const tr_info * const info = &tor->info;
-  const tr_file * const file = &info->files[fileIndex];
-
-  assert (fileIndex < info->fileCount);
-  assert (!file->length || (fileOffset < file->length));
-  assert (fileOffset + buflen <= file->length);
-
-  if (!file->length)
-    return 0;
-
-  /***
-  ****  Find the fd
-  ***/
+  const tr_file * const file = &tor->info.files[fileIndex];
 
   fd = tr_fdFileGetCached (session, tr_torrentId (tor), fileIndex, doWrite);
   if (fd < 0)
@@ -95,13 +89,27 @@ readOrWriteBytes (tr_session       * session,
           const int prealloc = file->dnd || !doWrite
                              ? TR_PREALLOCATE_NONE
                              : tor->session->preallocationMode;
-          if (((fd = tr_fdFileCheckout (session, tor->uniqueId, fileIndex,
-                                        filename, doWrite,
-                                        prealloc, file->length))) < 0)
+          fd = tr_fdFileCheckout (session, tor->uniqueId, fileIndex,
+                                  filename, doWrite,
+                                  prealloc, file->length);
+
+          /* another thread is reading from the read-only fd that we
+           * need to reopen for writing. it'll be returned shortly... */
+          while ((fd < 0) && (errno == EBUSY) && mayWait && !tr_amInEventThread (session))
+            {
+              tr_wait_msec (10);
+              fd = tr_fdFileCheckout (session, tor->uniqueId, fileIndex,
+                                      filename, doWrite,
+                                      prealloc, file->length);
+            }
+
+          if (fd < 0)
             {
               err = errno;
-              tr_logAddTorErr (tor, "tr_fdFileCheckout failed for \"%s\": %s",
-                         filename, tr_strerror (err));
+
+              if (mayWait || ((err != EBUSY) && (err != EMFILE)))
+                tr_logAddTorErr (tor, "tr_fdFileCheckout failed for \"%s\": %s",
+                                 filename, tr_strerror (err));
             }
           else if (doWrite)
             {
@@ -115,6 +123,39 @@ readOrWriteBytes (tr_session       * session,
       tr_free (subpath);
     }
 
+  *setme_fd = fd;
+  return err;
+}
+
+/* returns 0 on success, or an errno on failure */
+static int
+readOrWriteBytes (tr_session       * session,
+                  tr_torrent       * tor,
+                  int                ioMode,
+                  tr_file_index_t    fileIndex,
+                  uint64_t           fileOffset,
+                  void             * buf,
+                  size_t             buflen)
+{
+  int fd;
+  int err = 0;
+  const bool doWrite = ioMode >= TR_IO_WRITE;
+  const tr_info * const info = &tor->info;
+  const tr_file * const file = &info->files[fileIndex];
+
+  assert (fileIndex < info->fileCount);
+  assert (!file->length || (fileOffset < file->length));
+  assert (fileOffset + buflen <= file->length);
+
+  if (!file->length)
+    return 0;
+
+  /***
+  ****  Find the fd
+  ***/
+
+  err = checkoutFile (session, tor, fileIndex, doWrite, true, &fd);
+
   /***
   ****  Use the fd
   ***/
@@ -147,6 +188,8 @@ readOrWriteBytes (tr_session       * session,
         {
           abort ();
         }
+
+      tr_fdFileReturn (session, fd);
     }
 
   return err;
@@ -225,7 +268,10 @@ readOrWritePiece (tr_torrent       * tor,
       fileIndex++;
       fileOffset = 0;
 
-      if ((err != 0) && (ioMode == TR_IO_WRITE) && (tor->error != TR_STAT_LOCAL_ERROR))
+      /* the disk queue reports errors from its own threads
+       * when the job's completion is delivered to the libevent thread */
+      if ((err != 0) && (ioMode == TR_IO_WRITE) && (tor->error != TR_STAT_LOCAL_ERROR)
+                     && tr_amInEventThread (tor->session))
         {
           char * path = tr_buildPath (tor->downloadDir, file->name, NULL);
           tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (err), path);
@@ -265,6 +311,317 @@ tr_ioWrite (tr_torrent       * tor,
   return readOrWritePiece (tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len);
 }
 
+/* a position in an array of buffers */
+struct iovec_cursor
+{
+  const struct evbuffer_iovec * iov;
+
+  /* how many bytes of iov[0] have been used */
+  size_t offset;
+};
+
+static void
+cursorAdvance (struct iovec_cursor * c, size_t len)
+{
+  c->offset += len;
+
+  while ((c->offset > 0) && (c->offset >= c->iov->iov_len))
+    {
+      c->offset -= c->iov->iov_len;
+      ++c->iov;
+    }
+}
+
+/* write the next `len' bytes of the buffers to a file.
+   returns 0 on success, or an errno on failure */
+static int
+writevFile (tr_torrent           * tor,
+            tr_file_index_t        fileIndex,
+            uint64_t               fileOffset,
+            struct iovec_cursor  * cursor,
+            size_t                 len)
+{
+  int fd;
+  int err;
+
+  err = checkoutFile (tor->session, tor, fileIndex, true, true, &fd);
+  if (err)
+    return err;
+
+  while (!err && (len > 0))
+    {
+      ssize_t rc;
+      int n = 0;
+      size_t vecBytes = 0;
+      struct evbuffer_iovec vec[64];
+      struct iovec_cursor walk = *cursor;
+
+      /* gather as much of this file's part of the buffers as we can */
+      while ((n < (int)(sizeof (vec) / sizeof (vec[0]))) && (vecBytes < len))
+        {
+          vec[n].iov_base = (char*)walk.iov->iov_base + walk.offset;
+          vec[n].iov_len = MIN (walk.iov->iov_len - walk.offset, len - vecBytes);
+          vecBytes += vec[n].iov_len;
+          ++walk.iov;
+          walk.offset = 0;
+          ++n;
+        }
+
+      rc = tr_pwritev (fd, vec, n, fileOffset);
+
+      if (rc <= 0)
+        {
+          err = rc < 0 ? errno : EIO;
+          tr_logAddTorErr (tor, "write failed for \"%s\": %s",
+                           tor->info.files[fileIndex].name, tr_strerror (err));
+        }
+      else
+        {
+          cursorAdvance (cursor, rc);
+          fileOffset += rc;
+          len -= rc;
+        }
+    }
+
+  tr_fdFileReturn (tor->session, fd);
+  return err;
+}
+
+int
+tr_ioWritev (tr_torrent                   * tor,
+             tr_piece_index_t               pieceIndex,
+             uint32_t                       begin,
+             const struct evbuffer_iovec  * iov,
+             int                            iovCount)
+{
+  int i;
+  int err = 0;
+  size_t buflen = 0;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  struct iovec_cursor cursor;
+  const tr_info * info = &tor->info;
+
+  if (pieceIndex >= info->pieceCount)
+    return EINVAL;
+
+  for (i=0; i<iovCount; ++i)
+    buflen += iov[i].iov_len;
+
+  cursor.iov = iov;
+  cursor.offset = 0;
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (buflen && !err)
+    {
+      const tr_file * file = &info->files[fileIndex];
+      const uint64_t bytesThisPass = MIN (buflen, file->length - fileOffset);
+
+      if (bytesThisPass > 0)
+        err = writevFile (tor, fileIndex, fileOffset, &cursor, bytesThisPass);
+
+      buflen -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+
+      /* the disk queue reports errors from its own threads
+       * when the job's completion is delivered to the libevent thread */
+      if ((err != 0) && (tor->error != TR_STAT_LOCAL_ERROR) && tr_amInEventThread (tor->session))
+        {
+          char * path = tr_buildPath (tor->downloadDir, file->name, NULL);
+          tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (err), path);
+          tr_free (path);
+        }
+    }
+
+  return err;
+}
+
+/****
+*****  Batched IO
+****/
+
+struct tr_ioBatch
+{
+  tr_session   * session;
+  tr_uring     * ring;
+  tr_uring_op  * ops;
+  int            op_count;
+  int            op_alloc;
+};
+
+tr_ioBatch *
+tr_ioBatchNew (tr_session * session, tr_uring * ring)
+{
+  tr_ioBatch * batch = tr_new0 (tr_ioBatch, 1);
+  batch->session = session;
+  batch->ring = ring;
+  return batch;
+}
+
+void
+tr_ioBatchFree (tr_ioBatch * batch)
+{
+  assert (batch->op_count == 0);
+
+  tr_free (batch->ops);
+  tr_free (batch);
+}
+
+void
+tr_ioBatchAdd (tr_ioBatch       * batch,
+               tr_torrent       * tor,
+               bool               doWrite,
+               tr_piece_index_t   pieceIndex,
+               uint32_t           begin,
+               uint32_t           len,
+               uint8_t          * buf,
+               int              * err)
+{
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  const tr_info * info = &tor->info;
+
+  if (pieceIndex >= info->pieceCount)
+    {
+      *err = EINVAL;
+      return;
+    }
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (len && !*err)
+    {
+      int fd;
+      const tr_file * file = &info->files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      if (bytesThisPass > 0)
+        {
+          int e = checkoutFile (batch->session, tor, fileIndex, doWrite, false, &fd);
+
+          /* the batch itself may be holding the fd that has to be reopened,
+             or all of the file slots. If so, run it to hand them back */
+          if ((e == EBUSY) || (e == EMFILE))
+            {
+              tr_ioBatchRun (batch);
+              e = checkoutFile (batch->session, tor, fileIndex, doWrite, true, &fd);
+            }
+
+          if (e)
+            {
+              *err = e;
+            }
+          else
+            {
+              tr_uring_op * op;
+
+              if (batch->op_count == batch->op_alloc)
+                {
+                  batch->op_alloc = batch->op_alloc ? batch->op_alloc * 2 : 16;
+                  batch->ops = tr_renew (tr_uring_op, batch->ops, batch->op_alloc);
+                }
+
+              op = &batch->ops[batch->op_count++];
+              op->fd = fd;
+              op->do_write = doWrite;
+              op->buf = buf;
+              op->len = bytesThisPass;
+              op->offset = fileOffset;
+              op->err = 0;
+              op->user_data = err;
+            }
+        }
+
+      buf += bytesThisPass;
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+}
+
+void
+tr_ioBatchRun (tr_ioBatch * batch)
+{
+  int i;
+
+  if (batch->op_count == 0)
+    return;
+
+  tr_uringRun (batch->ring, batch->ops, batch->op_count);
+
+  for (i=0; i<batch->op_count; ++i)
+    {
+      const tr_uring_op * op = &batch->ops[i];
+      int * err = op->user_data;
+
+      if (op->err && !*err)
+        *err = op->err;
+
+      tr_fdFileReturn (batch->session, op->fd);
+    }
+
+  batch->op_count = 0;
+}
+
+/****
+*****
+****/
+
+int
+tr_ioAddFileRef (tr_torrent       * tor,
+                 tr_piece_index_t   pieceIndex,
+                 uint32_t           begin,
+                 uint32_t           len,
+                 struct evbuffer  * setme)
+{
+  int fd;
+  int dupfd;
+  struct stat sb;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  const tr_file * file;
+
+  assert (len > 0);
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+  file = &tor->info.files[fileIndex];
+
+  /* a block that spans files has to be copied piecewise */
+  if (fileOffset + len > file->length)
+    return EINVAL;
+
+  /* don't open files here -- that's the disk queue's job */
+  fd = tr_fdFileGetCached (tor->session, tr_torrentId (tor), fileIndex, false);
+  if (fd < 0)
+    return EAGAIN;
+
+  /* the file may be shorter than the torrent says, e.g. if it was
+     truncated behind our back. sendfile () would send short and
+     leave the peer waiting, so let the copying path handle it */
+  if (fstat (fd, &sb) || ((uint64_t)sb.st_size < fileOffset + len))
+    {
+      tr_fdFileReturn (tor->session, fd);
+      return EIO;
+    }
+
+  /* the evbuffer closes its fd when it's done sending,
+     so give it a copy of ours */
+  dupfd = dup (fd);
+  tr_fdFileReturn (tor->session, fd);
+  if (dupfd < 0)
+    return errno;
+
+  if (evbuffer_add_file (setme, dupfd, fileOffset, len))
+    {
+      close (dupfd);
+      return EIO;
+    }
+
+  return 0;
+}
+
 /****
 *****
 ****/
@@ -313,6 +670,10 @@ tr_ioTestPiece (tr_torrent * tor, tr_piece_index_t piece)
 {
   uint8_t hash[SHA_DIGEST_LENGTH];
 
-  return recalculateHash (tor, piece, hash)
-      && !memcmp (hash, tor->info.pieces[piece].hash, SHA_DIGEST_LENGTH);
+  /* if the cache saw the whole piece arrive, we needn't read it back */
+  if (!tr_cacheGetPieceHash (tor->session->cache, tor, piece, hash)
+      && !recalculateHash (tor, piece, hash))
+    return false;
+
+  return !memcmp (hash, tor->info.pieces[piece].hash, SHA_DIGEST_LENGTH);
 }
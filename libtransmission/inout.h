@@ -17,7 +17,10 @@
 #ifndef TR_IO_H
 #define TR_IO_H 1
 
+struct evbuffer;
+struct evbuffer_iovec;
 struct tr_torrent;
+struct tr_uring;
 
 /**
  * @addtogroup file_io File IO
@@ -39,6 +42,30 @@ int tr_ioPrefetch (tr_torrent       * tor,
                    uint32_t           begin,
                    uint32_t           len);
 
+/**
+ * Like tr_ioWrite (), but gathers the block from several buffers.
+ * Each file that the block touches is written with a single pwritev ().
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioWritev (struct tr_torrent              * tor,
+                 tr_piece_index_t                 pieceIndex,
+                 uint32_t                         offset,
+                 const struct evbuffer_iovec    * iov,
+                 int                              iovCount);
+
+/**
+ * Appends a reference to the block's bytes on disk to `setme' so that
+ * they can be sent from the OS' page cache without a userspace copy.
+ * Only blocks that lie inside a single, already-open file that's long
+ * enough to hold them can be added.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioAddFileRef (struct tr_torrent  * tor,
+                     tr_piece_index_t     pieceIndex,
+                     uint32_t             offset,
+                     uint32_t             len,
+                     struct evbuffer    * setme);
+
 /**
  * Writes the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
@@ -49,6 +76,35 @@ int tr_ioWrite (struct tr_torrent  * tor,
                 uint32_t             len,
                 const uint8_t      * writeme);
 
+/**
+ * A batch of reads and writes that are handed to an io_uring together.
+ * Each op's files are opened when it's added, and the I/O happens
+ * when tr_ioBatchRun () is called.
+ */
+typedef struct tr_ioBatch tr_ioBatch;
+
+tr_ioBatch * tr_ioBatchNew (tr_session * session, struct tr_uring * ring);
+
+void tr_ioBatchFree (tr_ioBatch * batch);
+
+/**
+ * Adds a tr_ioRead () or tr_ioWrite () of the block to the batch.
+ * `buf' has to stay valid until the batch is run.
+ * If any of the I/O fails, `*err' is set to an errno value;
+ * otherwise it's left alone.
+ */
+void tr_ioBatchAdd (tr_ioBatch         * batch,
+                    struct tr_torrent  * tor,
+                    bool                 doWrite,
+                    tr_piece_index_t     pieceIndex,
+                    uint32_t             offset,
+                    uint32_t             len,
+                    uint8_t            * buf,
+                    int                * err);
+
+/** @brief submit the batch's I/O and wait until it's done */
+void tr_ioBatchRun (tr_ioBatch * batch);
+
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
  */
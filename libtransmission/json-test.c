@@ -2,6 +2,12 @@
 
 #include <locale.h> /* setlocale() */
 
+#include <event2/buffer.h>
+
+#ifdef HAVE_ZLIB
+ #include <zlib.h>
+#endif
+
 #define __LIBTRANSMISSION_VARIANT_MODULE___
 #include "transmission.h"
 #include "utils.h" /* tr_free */
@@ -220,6 +226,110 @@ test_unescape (void)
     return 0;
 }
 
+static int
+test_writer (void)
+{
+    char * str;
+    tr_variant top;
+    tr_variant * child;
+    tr_json_writer * w;
+    struct evbuffer * buf = evbuffer_new ();
+
+    tr_variantInitDict (&top, 4);
+    tr_variantDictAddInt (&top, TR_KEY_id, 7);
+    child = tr_variantDictAddList (&top, TR_KEY_files, 2);
+    tr_variantListAddStr (child, "a \"quoted\"\tname");
+    tr_variantListAddReal (child, 0.25);
+    tr_variantDictAddDict (&top, TR_KEY_peers, 0);
+    tr_variantDictAddBool (&top, TR_KEY_wanted, true);
+
+    /* written by hand, in tr_variantToBuf ()'s sorted order */
+    w = tr_jsonWriterNew (buf, false, false);
+    tr_jsonBeginDict (w);
+    tr_jsonDictAddList (w, TR_KEY_files);
+    tr_jsonStr (w, "a \"quoted\"\tname", -1);
+    tr_jsonReal (w, 0.25);
+    tr_jsonEnd (w);
+    tr_jsonDictAddInt (w, TR_KEY_id, 7);
+    tr_jsonDictAddDict (w, TR_KEY_peers);
+    tr_jsonEnd (w);
+    tr_jsonDictAddBool (w, TR_KEY_wanted, true);
+    tr_jsonEnd (w);
+    tr_jsonWriterFree (w);
+    evbuffer_add (buf, "\n", 2);
+
+    str = tr_variantToStr (&top, TR_VARIANT_FMT_JSON, NULL);
+    check_streq (str, (char*) evbuffer_pullup (buf, -1));
+    tr_free (str);
+    evbuffer_drain (buf, evbuffer_get_length (buf));
+
+    /* an already-serialized value can be copied in as-is */
+    w = tr_jsonWriterNew (buf, true, false);
+    tr_jsonBeginList (w);
+    tr_jsonInt (w, 1);
+    {
+      struct evbuffer * raw = evbuffer_new ();
+      evbuffer_add_printf (raw, "{\"id\":2}");
+      tr_jsonRawValue (w, raw);
+      check_int_eq (0, evbuffer_get_length (raw));
+      evbuffer_free (raw);
+    }
+    tr_jsonVariant (w, &top);
+    tr_jsonEnd (w);
+    tr_jsonWriterFree (w);
+    evbuffer_add (buf, "", 1);
+    check_streq ("[1,{\"id\":2},{\"id\":7,\"files\":[\"a \\\"quoted\\\"\\tname\",0.2500],\"peers\":{},\"wanted\":true}]",
+                 (char*) evbuffer_pullup (buf, -1));
+
+    tr_variantFree (&top);
+    evbuffer_free (buf);
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+static int
+test_writer_gzip (void)
+{
+    int i;
+    int64_t val;
+    z_stream stream;
+    tr_variant top;
+    tr_json_writer * w;
+    struct evbuffer * buf = evbuffer_new ();
+    const int n = 50000;
+    const size_t inflated_max = 1024 * 1024;
+    char * inflated = tr_new (char, inflated_max);
+
+    /* big enough to be deflated in several chunks */
+    w = tr_jsonWriterNew (buf, true, true);
+    tr_jsonBeginList (w);
+    for (i=0; i<n; ++i)
+      tr_jsonInt (w, i);
+    tr_jsonEnd (w);
+    tr_jsonWriterFree (w);
+
+    memset (&stream, 0, sizeof (stream));
+    inflateInit2 (&stream, MAX_WBITS + 16);
+    stream.next_in = evbuffer_pullup (buf, -1);
+    stream.avail_in = evbuffer_get_length (buf);
+    stream.next_out = (Bytef*) inflated;
+    stream.avail_out = inflated_max;
+    check_int_eq (Z_STREAM_END, inflate (&stream, Z_FINISH));
+    check (stream.total_out > evbuffer_get_length (buf));
+
+    check_int_eq (0, tr_variantFromJson (&top, inflated, stream.total_out));
+    check_int_eq (n, tr_variantListSize (&top));
+    check (tr_variantGetInt (tr_variantListChild (&top, n-1), &val));
+    check_int_eq (n-1, val);
+
+    inflateEnd (&stream);
+    tr_variantFree (&top);
+    tr_free (inflated);
+    evbuffer_free (buf);
+    return 0;
+}
+#endif
+
 int
 main (void)
 {
@@ -236,7 +346,11 @@ main (void)
                              test1,
                              test2,
                              test3,
-                             test_unescape };
+                             test_unescape,
+#ifdef HAVE_ZLIB
+                             test_writer_gzip,
+#endif
+                             test_writer };
 
   /* run the tests in a locale with a decimal point of '.' */
   setlocale (LC_NUMERIC, "C");
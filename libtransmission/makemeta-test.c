@@ -0,0 +1,159 @@
+#include <stdio.h> /* fopen() */
+#include <string.h> /* memcmp() */
+
+#include "transmission.h"
+#include "crypto.h" /* tr_sha1() */
+#include "makemeta.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+enum
+{
+  PIECE_SIZE = 16384
+};
+
+/* fill a file with bytes that differ from piece to piece and file to file */
+static void
+makeFile (const char * path, size_t len, int seed, uint8_t * setme_first_piece)
+{
+  size_t i;
+  char * dir = tr_dirname (path);
+  FILE * fp;
+
+  tr_mkdirp (dir, 0700);
+  fp = fopen (path, "wb");
+  for (i=0; i<len; ++i)
+    {
+      const uint8_t ch = (uint8_t)((i * 31) + (i / PIECE_SIZE) + seed);
+
+      fputc (ch, fp);
+      if ((setme_first_piece != NULL) && (i < PIECE_SIZE))
+        setme_first_piece[i] = ch;
+    }
+  fclose (fp);
+
+  tr_free (dir);
+}
+
+/* create `outfile' from `top', hashing on `thread_count' threads */
+static tr_metainfo_builder_err
+makeTorrent (const char * top, const char * outfile, int thread_count)
+{
+  tr_metainfo_builder_err err;
+  tr_metainfo_builder * builder;
+  tr_tracker_info tracker;
+
+  tracker.tier = 0;
+  tracker.announce = (char*) "http://www.example.com/announce";
+  tracker.scrape = NULL;
+  tracker.id = 0;
+
+  builder = tr_metaInfoBuilderCreate (top);
+  tr_metaInfoBuilderSetPieceSize (builder, PIECE_SIZE);
+  builder->hashThreadCount = thread_count;
+  tr_makeMetaInfo (builder, outfile, &tracker, 1, "a comment", false);
+
+  while (!builder->isDone)
+    tr_wait_msec (10);
+
+  err = builder->result;
+  tr_metaInfoBuilderFree (builder);
+  return err;
+}
+
+/* @return the torrent's info dict, serialized */
+static char *
+getInfoDict (const char * filename, int * setme_len)
+{
+  char * ret = NULL;
+  tr_variant top;
+  tr_variant * info;
+
+  if (!tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, filename))
+    {
+      if (tr_variantDictFindDict (&top, TR_KEY_info, &info))
+        ret = tr_variantToStr (info, TR_VARIANT_FMT_BENC, setme_len);
+
+      tr_variantFree (&top);
+    }
+
+  return ret;
+}
+
+static int
+test_thread_count (void)
+{
+  int i;
+  const char * str;
+  size_t len;
+  int info_len;
+  int one_len;
+  char * one_info;
+  char * top;
+  char * path;
+  uint8_t first_piece[PIECE_SIZE];
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  tr_variant info;
+  tr_session * session = libttest_session_init (NULL);
+  const char * sandbox = tr_sessionGetConfigDir (session);
+  const int thread_counts[] = { 1, 2, 4, 16 };
+
+  /* a folder whose size isn't a multiple of the piece size,
+     with an empty file and a subfolder */
+  top = tr_buildPath (sandbox, "content", NULL);
+  path = tr_buildPath (top, "a", NULL);
+  makeFile (path, 100000, 1, first_piece);
+  tr_free (path);
+  path = tr_buildPath (top, "b", NULL);
+  makeFile (path, 0, 2, NULL);
+  tr_free (path);
+  path = tr_buildPath (top, "sub", "c", NULL);
+  makeFile (path, 333333, 3, NULL);
+  tr_free (path);
+
+  /* single-threaded, the pieces come out right */
+  path = tr_buildPath (sandbox, "1.torrent", NULL);
+  check_int_eq (TR_MAKEMETA_OK, makeTorrent (top, path, 1));
+  one_info = getInfoDict (path, &one_len);
+  check (one_info != NULL);
+  tr_free (path);
+
+  check (!tr_variantFromBenc (&info, one_info, one_len));
+  check (tr_variantDictFindRaw (&info, TR_KEY_pieces, (const uint8_t**)&str, &len));
+  check_int_eq (SHA_DIGEST_LENGTH * ((100000 + 333333 + PIECE_SIZE - 1) / PIECE_SIZE), len);
+  tr_sha1 (hash, first_piece, PIECE_SIZE, NULL);
+  check (!memcmp (hash, str, SHA_DIGEST_LENGTH));
+  tr_variantFree (&info);
+
+  /* and with more threads, the info dict is the same */
+  for (i=1; i<(int)(sizeof (thread_counts) / sizeof (thread_counts[0])); ++i)
+    {
+      char * info_str;
+      char * filename = tr_strdup_printf ("%d.torrent", thread_counts[i]);
+
+      path = tr_buildPath (sandbox, filename, NULL);
+      check_int_eq (TR_MAKEMETA_OK, makeTorrent (top, path, thread_counts[i]));
+      info_str = getInfoDict (path, &info_len);
+      check (info_str != NULL);
+      check_int_eq (one_len, info_len);
+      check (!memcmp (one_info, info_str, info_len));
+
+      tr_free (info_str);
+      tr_free (path);
+      tr_free (filename);
+    }
+
+  /* cleanup */
+  tr_free (one_info);
+  tr_free (top);
+  libttest_session_close (session);
+  return 0;
+}
+
+MAIN_SINGLE_TEST (test_thread_count)
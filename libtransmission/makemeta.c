@@ -18,7 +18,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <unistd.h> /* read () */
+#include <unistd.h> /* read (), sysconf () */
 #include <dirent.h>
 
 #include <event2/util.h> /* evutil_ascii_strcasecmp () */
@@ -202,100 +202,285 @@ tr_metaInfoBuilderFree (tr_metainfo_builder * builder)
 }
 
 /****
+*****  Hashing the pieces.
 *****
+*****  The builder's thread reads the pieces in order into a small pool
+*****  of buffers, and a few worker threads hash whichever buffers are
+*****  full. Each hash is written at its piece's place in the result,
+*****  so the order that the workers finish in doesn't matter.
 ****/
 
+enum
+{
+  /* sanity cap on the number of threads hashing pieces */
+  MAX_HASH_THREADS = 16,
+
+  /* try not to hold more than this much piece data in the buffers */
+  MAX_BUFFERED_BYTES = (1024 * 1024 * 64)
+};
+
+enum
+{
+  SLOT_EMPTY,
+  SLOT_READING,
+  SLOT_FULL,
+  SLOT_HASHING
+};
+
+struct hash_slot
+{
+  int         state;
+  uint8_t   * buf;
+  uint32_t    len;
+  uint32_t    piece;
+};
+
+struct hash_pool
+{
+  tr_lock              * lock;
+  tr_cond              * cond;
+  tr_metainfo_builder  * builder;
+  uint8_t              * hashes;
+
+  struct hash_slot     * slots;
+  int                    slot_count;
+
+  int                    worker_count;
+  bool                   done_reading;
+};
+
+/* where the reader is in the builder's files */
+struct piece_reader
+{
+  uint32_t   fileIndex;
+  uint64_t   off;
+  int        fd;
+};
+
+static int
+getHashThreadCount (const tr_metainfo_builder * b)
+{
+  long n = b->hashThreadCount;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  if (n <= 0)
+    n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+  return (int) MAX (1, MIN (n, MAX_HASH_THREADS));
+}
+
+/* call this with the pool locked */
+static struct hash_slot *
+findSlot (struct hash_pool * pool, int state)
+{
+  int i;
+
+  for (i=0; i<pool->slot_count; ++i)
+    if (pool->slots[i].state == state)
+      return &pool->slots[i];
+
+  return NULL;
+}
+
+static void
+hashWorkerFunc (void * vpool)
+{
+  struct hash_pool * pool = vpool;
+
+  tr_lockLock (pool->lock);
+
+  for (;;)
+    {
+      struct hash_slot * slot = findSlot (pool, SLOT_FULL);
+
+      if (slot == NULL)
+        {
+          if (pool->done_reading)
+            break;
+
+          tr_condWait (pool->cond, pool->lock);
+          continue;
+        }
+
+      slot->state = SLOT_HASHING;
+      tr_lockUnlock (pool->lock);
+
+      tr_sha1 (pool->hashes + (size_t)slot->piece * SHA_DIGEST_LENGTH,
+               slot->buf, slot->len, NULL);
+
+      tr_lockLock (pool->lock);
+      slot->state = SLOT_EMPTY;
+      ++pool->builder->pieceIndex;
+      tr_condBroadcast (pool->cond);
+    }
+
+  --pool->worker_count;
+  tr_condBroadcast (pool->cond);
+  tr_lockUnlock (pool->lock);
+}
+
+static void
+setReadError (tr_metainfo_builder * b, const char * filename, int err)
+{
+  b->my_errno = err;
+  tr_strlcpy (b->errfile, filename, sizeof (b->errfile));
+  b->result = TR_MAKEMETA_IO_READ;
+}
+
+/* read the next `len' bytes of the builder's files into `buf'.
+   returns true on success, or false and sets b->result on failure */
+static bool
+readPiece (tr_metainfo_builder  * b,
+           struct piece_reader  * r,
+           uint8_t              * buf,
+           uint32_t               len)
+{
+  while (len > 0)
+    {
+      ssize_t n_read;
+      const tr_metainfo_builder_file * file = &b->files[r->fileIndex];
+
+      if (r->fd < 0)
+        {
+          r->fd = tr_open_file_for_scanning (file->filename);
+          if (r->fd < 0)
+            {
+              setReadError (b, file->filename, errno);
+              return false;
+            }
+        }
+
+      n_read = read (r->fd, buf, (size_t) MIN (file->size - r->off, len));
+      if (n_read < 0)
+        {
+          setReadError (b, file->filename, errno);
+          return false;
+        }
+      if ((n_read == 0) && (r->off < file->size)) /* it got smaller */
+        {
+          setReadError (b, file->filename, EIO);
+          return false;
+        }
+
+      buf += n_read;
+      len -= n_read;
+      r->off += n_read;
+
+      if (r->off == file->size)
+        {
+          tr_close_file (r->fd);
+          r->fd = -1;
+          r->off = 0;
+          ++r->fileIndex;
+        }
+    }
+
+  return true;
+}
+
 static uint8_t*
 getHashInfo (tr_metainfo_builder * b)
 {
-  uint32_t fileIndex = 0;
-  uint8_t *ret = tr_new0 (uint8_t, SHA_DIGEST_LENGTH * b->pieceCount);
-  uint8_t *walk = ret;
-  uint8_t *buf;
+  int i;
+  uint32_t piece = 0;
   uint64_t totalRemain;
-  uint64_t off = 0;
-  int fd;
+  struct hash_pool pool;
+  struct piece_reader reader;
+  uint8_t * ret = tr_new0 (uint8_t, SHA_DIGEST_LENGTH * b->pieceCount);
+
+  b->pieceIndex = 0;
 
   if (!b->totalSize)
     return ret;
 
-  buf = tr_valloc (b->pieceSize);
-  b->pieceIndex = 0;
+  /* have a couple of buffers per worker, so that the reader can
+     stay ahead of them, unless the pieces are huge */
+  memset (&pool, 0, sizeof (struct hash_pool));
+  pool.builder = b;
+  pool.hashes = ret;
+  pool.worker_count = (int) MIN ((uint32_t)getHashThreadCount (b), b->pieceCount);
+  pool.slot_count = MAX_BUFFERED_BYTES / b->pieceSize;
+  pool.slot_count = MAX (pool.slot_count, pool.worker_count + 1);
+  pool.slot_count = MIN (pool.slot_count, pool.worker_count * 2);
+  pool.slots = tr_new0 (struct hash_slot, pool.slot_count);
+  for (i=0; i<pool.slot_count; ++i)
+    pool.slots[i].buf = tr_valloc (b->pieceSize);
+  pool.lock = tr_lockNew ();
+  pool.cond = tr_condNew ();
+
+  for (i=0; i<pool.worker_count; ++i)
+    tr_threadNew (hashWorkerFunc, &pool);
+
+  reader.fileIndex = 0;
+  reader.off = 0;
+  reader.fd = -1;
   totalRemain = b->totalSize;
-  fd = tr_open_file_for_scanning (b->files[fileIndex].filename);
-  if (fd < 0)
-    {
-      b->my_errno = errno;
-      tr_strlcpy (b->errfile,
-                  b->files[fileIndex].filename,
-                  sizeof (b->errfile));
-      b->result = TR_MAKEMETA_IO_READ;
-      tr_free (buf);
-      tr_free (ret);
-      return NULL;
-    }
 
-  while (totalRemain)
+  tr_lockLock (pool.lock);
+
+  while (totalRemain && !b->abortFlag && !b->result)
     {
-      uint8_t * bufptr = buf;
+      bool ok;
       const uint32_t thisPieceSize = (uint32_t) MIN (b->pieceSize, totalRemain);
-      uint32_t leftInPiece = thisPieceSize;
+      struct hash_slot * slot = findSlot (&pool, SLOT_EMPTY);
 
-      assert (b->pieceIndex < b->pieceCount);
-
-      while (leftInPiece)
+      if (slot == NULL)
         {
-          const size_t n_this_pass = (size_t) MIN ((b->files[fileIndex].size - off), leftInPiece);
-          const ssize_t n_read = read (fd, bufptr, n_this_pass);
-          bufptr += n_read;
-          off += n_read;
-          leftInPiece -= n_read;
-          if (off == b->files[fileIndex].size)
-            {
-              off = 0;
-              tr_close_file (fd);
-              fd = -1;
-              if (++fileIndex < b->fileCount)
-                {
-                  fd = tr_open_file_for_scanning (b->files[fileIndex].filename);
-                  if (fd < 0)
-                    {
-                      b->my_errno = errno;
-                      tr_strlcpy (b->errfile,
-                                  b->files[fileIndex].filename,
-                                  sizeof (b->errfile));
-                      b->result = TR_MAKEMETA_IO_READ;
-                      tr_free (buf);
-                      tr_free (ret);
-                      return NULL;
-                    }
-                }
-            }
+          tr_condWait (pool.cond, pool.lock);
+          continue;
         }
 
-      assert (bufptr - buf == (int)thisPieceSize);
-      assert (leftInPiece == 0);
-      tr_sha1 (walk, buf, thisPieceSize, NULL);
-      walk += SHA_DIGEST_LENGTH;
+      assert (piece < b->pieceCount);
+
+      slot->state = SLOT_READING;
+      tr_lockUnlock (pool.lock);
+      ok = readPiece (b, &reader, slot->buf, thisPieceSize);
+      tr_lockLock (pool.lock);
 
-      if (b->abortFlag)
+      if (!ok)
         {
-          b->result = TR_MAKEMETA_CANCELLED;
-          break;
+          slot->state = SLOT_EMPTY;
+        }
+      else
+        {
+          slot->state = SLOT_FULL;
+          slot->len = thisPieceSize;
+          slot->piece = piece++;
+          totalRemain -= thisPieceSize;
+          tr_condBroadcast (pool.cond);
         }
-
-      totalRemain -= thisPieceSize;
-      ++b->pieceIndex;
     }
 
-  assert (b->abortFlag
-        || (walk - ret == (int)(SHA_DIGEST_LENGTH * b->pieceCount)));
-  assert (b->abortFlag || !totalRemain);
+  /* wait for the workers to hash what's been read */
+  pool.done_reading = true;
+  tr_condBroadcast (pool.cond);
+  while (pool.worker_count > 0)
+    tr_condWait (pool.cond, pool.lock);
 
-  if (fd >= 0)
-    tr_close_file (fd);
+  tr_lockUnlock (pool.lock);
+
+  if (b->abortFlag && !b->result)
+    b->result = TR_MAKEMETA_CANCELLED;
+
+  assert (b->result || (b->pieceIndex == b->pieceCount));
+  assert (b->result || !totalRemain);
+
+  if (reader.fd >= 0)
+    tr_close_file (reader.fd);
+
+  tr_condFree (pool.cond);
+  tr_lockFree (pool.lock);
+  for (i=0; i<pool.slot_count; ++i)
+    tr_free (pool.slots[i].buf);
+  tr_free (pool.slots);
+
+  if (b->result == TR_MAKEMETA_IO_READ)
+    {
+      tr_free (ret);
+      ret = NULL;
+    }
 
-  tr_free (buf);
   return ret;
 }
 
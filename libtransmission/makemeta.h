@@ -50,6 +50,10 @@ typedef struct tr_metainfo_builder
     uint32_t                    pieceCount;
     int                         isSingleFile;
 
+    /* how many threads hash the pieces. The default of 0 means one
+     * per CPU. Clients may change it before calling tr_makeMetaInfo () */
+    int                         hashThreadCount;
+
     /**
     ***  These are set inside tr_makeMetaInfo ()
     ***  by copying the arguments passed to it,
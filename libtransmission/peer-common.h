@@ -92,6 +92,25 @@ struct tr_peer_virtual_funcs
 {
   tr_peer_destruct_func destruct;
   tr_peer_is_transferring_pieces_func is_transferring_pieces;
+
+  /* the rest are for the peers on a swarm's connection list: tr_peerMsgs,
+     or swarm-bench's simulated peers. Webseeds leave them NULL */
+  bool   (*is_peer_choked)         (const struct tr_peer * peer);
+  bool   (*is_peer_interested)     (const struct tr_peer * peer);
+  bool   (*is_client_choked)       (const struct tr_peer * peer);
+  bool   (*is_client_interested)   (const struct tr_peer * peer);
+  bool   (*is_active)              (const struct tr_peer * peer, tr_direction direction);
+  void   (*update_active)          (struct tr_peer * peer, tr_direction direction);
+  time_t (*get_connection_age)     (const struct tr_peer * peer);
+  bool   (*is_utp_connection)      (const struct tr_peer * peer);
+  bool   (*is_encrypted)           (const struct tr_peer * peer);
+  bool   (*is_incoming_connection) (const struct tr_peer * peer);
+  bool   (*is_reading_block)       (const struct tr_peer * peer, tr_block_index_t block);
+  void   (*set_choke)              (struct tr_peer * peer, bool peer_is_choked);
+  void   (*set_interested)         (struct tr_peer * peer, bool client_is_interested);
+  void   (*have)                   (struct tr_peer * peer, uint32_t pieceIndex);
+  void   (*cancel)                 (struct tr_peer * peer, tr_block_index_t block);
+  void   (*pulse)                  (struct tr_peer * peer);
 };
 
 /**
@@ -115,6 +134,9 @@ typedef struct tr_peer
   /* how many requests we've made and are currently awaiting a response for */
   int pendingReqsToPeer;
 
+  /* those requests, oldest first. NOTE: private to request-list.c */
+  struct tr_request * requests;
+
   /* Hook to private peer-mgr information */
   struct peer_atom * atom;
 
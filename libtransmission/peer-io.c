@@ -28,6 +28,7 @@
 #include "net.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-io.h"
+#include "platform.h" /* tr_lock */
 #include "trevent.h" /* tr_runInEventThread () */
 #include "tr-utp.h"
 #include "utils.h"
@@ -706,10 +707,21 @@ tr_peerIoNewOutgoing (tr_session        * session,
 ****
 ***/
 
+/* a peer loop may be blocked on io->shardLock in the middle of one of
+   its callbacks, so the libtransmission thread mustn't wait for it there.
+   the callbacks cope with running once after their event's been removed.
+   tr_eventInit () only starts peer loops when event_del_noblock () exists,
+   so the fallback is only used for events on the libtransmission thread */
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+ #define peer_event_del(ev) event_del_noblock (ev)
+#else
+ #define peer_event_del(ev) event_del (ev)
+#endif
+
 static void
 event_enable (tr_peerIo * io, short event)
 {
-    assert (tr_amInEventThread (io->session));
+    assert (tr_amInEventThread (io->session) || tr_lockHave (io->shardLock));
     assert (io->session != NULL);
     assert (io->session->events != NULL);
 
@@ -739,7 +751,7 @@ event_enable (tr_peerIo * io, short event)
 static void
 event_disable (struct tr_peerIo * io, short event)
 {
-    assert (tr_amInEventThread (io->session));
+    assert (tr_amInEventThread (io->session) || tr_lockHave (io->shardLock));
     assert (io->session != NULL);
     assert (io->session->events != NULL);
 
@@ -753,7 +765,7 @@ event_disable (struct tr_peerIo * io, short event)
     {
         dbgmsg (io, "disabling ready-to-read polling");
         if (io->socket >= 0)
-            event_del (io->event_read);
+            peer_event_del (io->event_read);
         io->pendingEvents &= ~EV_READ;
     }
 
@@ -761,11 +773,45 @@ event_disable (struct tr_peerIo * io, short event)
     {
         dbgmsg (io, "disabling ready-to-write polling");
         if (io->socket >= 0)
-            event_del (io->event_write);
+            peer_event_del (io->event_write);
         io->pendingEvents &= ~EV_WRITE;
     }
 }
 
+/* the most a peer loop may read ahead of the protocol code,
+   or write between two visits to deliverShardEvents () */
+#define SHARD_BUDGET (256 * 1024)
+
+/* set how many bytes a peer loop may move before the libtransmission
+   thread hears about them. Bytes it's moved that haven't been delivered
+   yet haven't been charged to the bandwidth tree, so they're held back */
+static void
+shardGrant (tr_peerIo * io, tr_direction dir)
+{
+    size_t n;
+    size_t pending;
+    size_t room = SHARD_BUDGET;
+
+    assert (tr_amInEventThread (io->session));
+    assert (tr_lockHave (io->shardLock));
+
+    if (dir == TR_UP)
+    {
+        pending = io->shardBytesWritten;
+    }
+    else
+    {
+        const size_t buffered = evbuffer_get_length (io->inbuf)
+                              + evbuffer_get_length (io->recvbuf);
+
+        pending = evbuffer_get_length (io->recvbuf);
+        room = buffered >= SHARD_BUDGET ? 0 : SHARD_BUDGET - buffered;
+    }
+
+    n = tr_bandwidthClamp (&io->bandwidth, dir, room + pending);
+    io->shardAllowance[dir] = n > pending ? n - pending : 0;
+}
+
 void
 tr_peerIoSetEnabled (tr_peerIo    * io,
                      tr_direction   dir,
@@ -778,10 +824,197 @@ tr_peerIoSetEnabled (tr_peerIo    * io,
     assert (tr_amInEventThread (io->session));
     assert (io->session->events != NULL);
 
+    /* a peer loop changes pendingEvents too */
+    if (io->shard > 0)
+        tr_lockLock (io->shardLock);
+
     if (isEnabled)
+    {
+        if (io->shard > 0)
+            shardGrant (io, dir);
         event_enable (io, event);
+    }
     else
+    {
         event_disable (io, event);
+    }
+
+    if (io->shard > 0)
+        tr_lockUnlock (io->shardLock);
+}
+
+/***
+****  Peer loops
+****
+****  When the session has more than one network thread, a peer-io that's
+****  been handed to a peer loop by tr_peerIoSetShard () has its socket read
+****  and written in that loop's thread. Everything else -- decryption, the
+****  protocol, bandwidth bookkeeping -- still happens in the libtransmission
+****  thread, which picks up the loop's results in deliverShardEvents ().
+****
+****  The fields that both threads touch are guarded by the io's own
+****  `shardLock', never the session lock, so the loops don't serialize on
+****  each other or on the libtransmission thread. Nor can a loop look at
+****  the bandwidth tree, so that thread grants it an allowance of bytes in
+****  each direction in shardGrant (), and tops it up as it accounts for
+****  the bytes moved. The loop reads into `recvbuf' rather than `inbuf' so
+****  that the protocol code never sees its input grow underneath it, and
+****  `outbuf' and `recvbuf' have libevent's locking on.
+***/
+
+static void
+deliverShardEvents (void * vio)
+{
+    short what;
+    size_t bytesWritten;
+    tr_peerIo * io = vio;
+
+    assert (tr_isPeerIo (io));
+    assert (tr_amInEventThread (io->session));
+
+    tr_lockLock (io->shardLock);
+    io->isDeliveryQueued = false;
+    bytesWritten = io->shardBytesWritten;
+    io->shardBytesWritten = 0;
+    what = io->shardError;
+    io->shardError = 0;
+    evbuffer_add_buffer (io->inbuf, io->recvbuf);
+    tr_lockUnlock (io->shardLock);
+
+    /* if the io's been freed, io_release_shard () queued its io_dtor ()
+       behind us, so it's still here but there's no one left to tell */
+    if (io->refCount < 1)
+        return;
+
+    tr_peerIoRef (io);
+
+    if (bytesWritten > 0)
+        didWriteWrapper (io, bytesWritten);
+
+    if (evbuffer_get_length (io->inbuf) > 0)
+        canReadWrapper (io);
+
+    if (what && (io->gotError != NULL))
+        io->gotError (io, what, io->userData);
+
+    /* the loop stops when its allowance runs out; top it up */
+    if ((io->canRead != NULL) && tr_peerIoHasBandwidthLeft (io, TR_DOWN))
+        tr_peerIoSetEnabled (io, TR_DOWN, true);
+    if ((io->didWrite != NULL) && evbuffer_get_length (io->outbuf)
+                               && tr_peerIoHasBandwidthLeft (io, TR_UP))
+        tr_peerIoSetEnabled (io, TR_UP, true);
+
+    tr_peerIoUnref (io);
+}
+
+/* @return true if the caller should queue deliverShardEvents ()
+           after it's released io->shardLock */
+static bool
+shardNeedsDelivery (tr_peerIo * io)
+{
+    if (io->isDeliveryQueued)
+        return false;
+
+    io->isDeliveryQueued = true;
+    return true;
+}
+
+static void
+shard_read_cb (int fd, short event UNUSED, void * vio)
+{
+    int res;
+    int e;
+    size_t howmuch;
+    bool deliver = false;
+    tr_peerIo * io = vio;
+
+    tr_lockLock (io->shardLock);
+
+    io->pendingEvents &= ~EV_READ;
+    howmuch = io->shardAllowance[TR_DOWN];
+
+    tr_lockUnlock (io->shardLock);
+
+    /* wait for deliverShardEvents () or the next bandwidth pulse */
+    if (howmuch < 1)
+        return;
+
+    EVUTIL_SET_SOCKET_ERROR (0);
+    res = evbuffer_read (io->recvbuf, fd, (int)howmuch);
+    e = EVUTIL_SOCKET_ERROR ();
+
+    tr_lockLock (io->shardLock);
+
+    if (res > 0)
+    {
+        io->shardAllowance[TR_DOWN] -= MIN ((size_t)res, io->shardAllowance[TR_DOWN]);
+        event_enable (io, EV_READ);
+        deliver = shardNeedsDelivery (io);
+    }
+    else if ((res == -1) && (e == EAGAIN || e == EINTR))
+    {
+        event_enable (io, EV_READ);
+    }
+    else
+    {
+        io->shardError |= BEV_EVENT_READING | (res == 0 ? BEV_EVENT_EOF : BEV_EVENT_ERROR);
+        deliver = shardNeedsDelivery (io);
+    }
+
+    tr_lockUnlock (io->shardLock);
+
+    if (deliver)
+        tr_runInEventThread (io->session, deliverShardEvents, io);
+}
+
+static void
+shard_write_cb (int fd, short event UNUSED, void * vio)
+{
+    int res;
+    int e;
+    size_t howmuch;
+    bool deliver = false;
+    tr_peerIo * io = vio;
+
+    tr_lockLock (io->shardLock);
+
+    io->pendingEvents &= ~EV_WRITE;
+    howmuch = MIN (io->shardAllowance[TR_UP], evbuffer_get_length (io->outbuf));
+
+    tr_lockUnlock (io->shardLock);
+
+    if (howmuch < 1)
+        return;
+
+    EVUTIL_SET_SOCKET_ERROR (0);
+    res = evbuffer_write_atmost (io->outbuf, fd, howmuch);
+    e = EVUTIL_SOCKET_ERROR ();
+
+    tr_lockLock (io->shardLock);
+
+    if (res > 0)
+    {
+        io->shardAllowance[TR_UP] -= MIN ((size_t)res, io->shardAllowance[TR_UP]);
+        if (evbuffer_get_length (io->outbuf))
+            event_enable (io, EV_WRITE);
+        io->shardBytesWritten += res;
+        deliver = shardNeedsDelivery (io);
+    }
+    else if ((res == -1) && (!e || e == EAGAIN || e == EINTR || e == EINPROGRESS))
+    {
+        if (evbuffer_get_length (io->outbuf))
+            event_enable (io, EV_WRITE);
+    }
+    else
+    {
+        io->shardError |= BEV_EVENT_WRITING | (res == 0 ? BEV_EVENT_EOF : BEV_EVENT_ERROR);
+        deliver = shardNeedsDelivery (io);
+    }
+
+    tr_lockUnlock (io->shardLock);
+
+    if (deliver)
+        tr_runInEventThread (io->session, deliverShardEvents, io);
 }
 
 /***
@@ -827,10 +1060,15 @@ io_dtor (void * vio)
     assert (io->session->events != NULL);
 
     dbgmsg (io, "in tr_peerIo destructor");
-    event_disable (io, EV_READ | EV_WRITE);
+    if (io->shard == 0) /* a peer loop's events were freed in io_release_shard () */
+        event_disable (io, EV_READ | EV_WRITE);
     tr_bandwidthDestruct (&io->bandwidth);
     evbuffer_free (io->outbuf);
     evbuffer_free (io->inbuf);
+    if (io->recvbuf != NULL)
+        evbuffer_free (io->recvbuf);
+    if (io->shardLock != NULL)
+        tr_lockFree (io->shardLock);
     io_close_socket (io);
     tr_cryptoDestruct (&io->crypto);
 
@@ -841,6 +1079,26 @@ io_dtor (void * vio)
     tr_free (io);
 }
 
+/* a peer loop's events can only be freed safely in that loop's thread,
+   since it's the only place where their callbacks can't be running */
+static void
+io_release_shard (void * vio)
+{
+    tr_peerIo * io = vio;
+
+    assert (tr_isPeerIo (io));
+
+    tr_lockLock (io->shardLock);
+    event_disable (io, EV_READ | EV_WRITE);
+    event_free (io->event_read);
+    event_free (io->event_write);
+    io->event_read = NULL;
+    io->event_write = NULL;
+    tr_lockUnlock (io->shardLock);
+
+    tr_runInEventThread (io->session, io_dtor, io);
+}
+
 static void
 tr_peerIoFree (tr_peerIo * io)
 {
@@ -850,7 +1108,17 @@ tr_peerIoFree (tr_peerIo * io)
         io->canRead = NULL;
         io->didWrite = NULL;
         io->gotError = NULL;
-        tr_runInEventThread (io->session, io_dtor, io);
+
+        if (io->shard == 0)
+        {
+            tr_runInEventThread (io->session, io_dtor, io);
+        }
+        else
+        {
+            /* the parent may be freed before io_dtor () gets to run */
+            tr_bandwidthSetParent (&io->bandwidth, NULL);
+            tr_runInShardThread (io->session, io->shard, io_release_shard, io);
+        }
     }
 }
 
@@ -930,6 +1198,7 @@ tr_peerIoReconnect (tr_peerIo * io)
 
     assert (tr_isPeerIo (io));
     assert (!tr_peerIoIsIncoming (io));
+    assert (io->shard == 0);
 
     session = tr_peerIoGetSession (io);
 
@@ -953,6 +1222,43 @@ tr_peerIoReconnect (tr_peerIo * io)
     return -1;
 }
 
+void
+tr_peerIoSetShard (tr_peerIo * io, int shard)
+{
+    short pendingEvents;
+    struct event_base * base;
+
+    assert (tr_isPeerIo (io));
+    assert (tr_amInEventThread (io->session));
+    assert (io->shard == 0);
+
+    /* uTP sockets are all serviced through the session's UDP socket */
+    if ((shard == 0) || (io->socket < 0))
+        return;
+
+    pendingEvents = io->pendingEvents;
+    event_disable (io, EV_READ | EV_WRITE);
+    event_free (io->event_read);
+    event_free (io->event_write);
+
+    evbuffer_enable_locking (io->outbuf, NULL);
+    io->recvbuf = evbuffer_new ();
+    evbuffer_enable_locking (io->recvbuf, NULL);
+    io->shardLock = tr_lockNew ();
+
+    tr_lockLock (io->shardLock);
+    io->shard = shard;
+    base = tr_eventGetShardBase (io->session, shard);
+    io->event_read = event_new (base, io->socket, EV_READ, shard_read_cb, io);
+    io->event_write = event_new (base, io->socket, EV_WRITE, shard_write_cb, io);
+    shardGrant (io, TR_UP);
+    shardGrant (io, TR_DOWN);
+    event_enable (io, pendingEvents);
+    tr_lockUnlock (io->shardLock);
+
+    dbgmsg (io, "handed to peer loop %d", shard);
+}
+
 /**
 ***
 **/
@@ -1084,6 +1390,13 @@ void
 tr_peerIoWriteBytes (tr_peerIo * io, const void * bytes, size_t byteCount, bool isPieceData)
 {
     struct evbuffer_iovec iovec;
+
+    /* a peer loop could drain all of outbuf between the reserve and the
+       commit, taking the reserved space with it. outbuf's lock is
+       recursive, so hold it across both */
+    if (io->shard > 0)
+        evbuffer_lock (io->outbuf);
+
     evbuffer_reserve_space (io->outbuf, byteCount, &iovec, 1);
 
     iovec.iov_len = byteCount;
@@ -1093,6 +1406,9 @@ tr_peerIoWriteBytes (tr_peerIo * io, const void * bytes, size_t byteCount, bool
         memcpy (iovec.iov_base, bytes, iovec.iov_len);
     evbuffer_commit_space (io->outbuf, &iovec, 1);
 
+    if (io->shard > 0)
+        evbuffer_unlock (io->outbuf);
+
     addDatatype (io, byteCount, isPieceData);
 }
 
@@ -1235,6 +1551,13 @@ tr_peerIoTryRead (tr_peerIo * io, size_t howmuch)
             if (evbuffer_get_length (io->inbuf) == 0)
                 UTP_RBDrained (io->utp_socket);
         }
+        else if (io->shard > 0) /* its peer loop reads the socket */
+        {
+            res = evbuffer_remove_buffer (io->recvbuf, io->inbuf, howmuch);
+
+            if (evbuffer_get_length (io->inbuf))
+                canReadWrapper (io);
+        }
         else /* tcp peer connection */
         {
             int e;
@@ -1281,6 +1604,10 @@ tr_peerIoTryWrite (tr_peerIo * io, size_t howmuch)
             UTP_Write (io->utp_socket, howmuch);
             n = old_len - evbuffer_get_length (io->outbuf);
         }
+        else if (io->shard > 0) /* its peer loop writes the socket */
+        {
+            tr_peerIoSetEnabled (io, TR_UP, true);
+        }
         else
         {
             int e;
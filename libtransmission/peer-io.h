@@ -115,6 +115,16 @@ typedef struct tr_peerIo
 
     struct event        * event_read;
     struct event        * event_write;
+
+    /* the peer loop servicing the socket, or 0 for the libtransmission
+       thread. See "Peer loops" in peer-io.c */
+    int                   shard;
+    struct tr_lock      * shardLock;
+    bool                  isDeliveryQueued;
+    short                 shardError;
+    size_t                shardBytesWritten;
+    size_t                shardAllowance[2];
+    struct evbuffer     * recvbuf;
 }
 tr_peerIo;
 
@@ -227,6 +237,15 @@ void                 tr_peerIoSetTorrentHash (tr_peerIo *     io,
 
 int                  tr_peerIoReconnect (tr_peerIo * io);
 
+/**
+ * @brief hand the io's socket to one of the session's peer loops.
+ *
+ * Its reads and writes then happen in that loop's thread, while its
+ * callbacks still run in the libtransmission thread. This can only be
+ * done once, and does nothing for uTP sockets or for shard 0.
+ */
+void                 tr_peerIoSetShard (tr_peerIo * io, int shard);
+
 static inline bool tr_peerIoIsIncoming (const tr_peerIo * io)
 {
     return io->isIncoming;
@@ -295,6 +314,16 @@ tr_peerIoIsEncrypted (const tr_peerIo * io)
     return (io != NULL) && (io->encryption_type == PEER_ENCRYPTION_RC4);
 }
 
+/* true if piece data can be handed to the kernel by reference,
+   i.e. it doesn't have to be encrypted or fed to uTP in userspace */
+static inline bool
+tr_peerIoSupportsZeroCopy (const tr_peerIo * io)
+{
+    return (io != NULL)
+        && (io->encryption_type == PEER_ENCRYPTION_NONE)
+        && (io->utp_socket == NULL);
+}
+
 void evbuffer_add_uint8 (struct evbuffer * outbuf, uint8_t byte);
 void evbuffer_add_uint16 (struct evbuffer * outbuf, uint16_t hs);
 void evbuffer_add_uint32 (struct evbuffer * outbuf, uint32_t hl);
@@ -0,0 +1,433 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/*
+ * Measures what the "network-threads" peer loops take off the
+ * libtransmission thread.
+ *
+ * Two sessions in this process, a seeder and a leecher, move a set of
+ * plaintext torrents over real TCP sockets: once with a single network
+ * thread, and once with as many as were asked for. For each run it
+ * prints the throughput and the CPU time that each session's
+ * libtransmission thread spent while the data moved.
+ *
+ * The peer loops only do the socket reads and writes, so what to look
+ * for is the libtransmission thread's CPU per MiB going down. Whether
+ * the throughput goes up depends on there being spare cores to run the
+ * loops on.
+ *
+ * Local addresses are ignored as peers, so the sessions talk over the
+ * first non-loopback IPv4 address unless another one is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi (), EXIT_FAILURE */
+#include <string.h> /* memset () */
+#include <time.h> /* clock_gettime () */
+#include <unistd.h> /* getcwd () */
+
+#include <arpa/inet.h> /* htons (), inet_ntop () */
+#include <ifaddrs.h> /* getifaddrs () */
+#include <net/if.h> /* IFF_LOOPBACK */
+#include <sys/resource.h> /* getrusage () */
+
+#include "transmission.h"
+#include "libtransmission-test.h"
+#include "makemeta.h"
+#include "net.h" /* tr_address_from_string () */
+#include "peer-mgr.h" /* tr_peerMgrAddPex () */
+#include "torrent.h"
+#include "tr-getopt.h"
+#include "trevent.h"
+#include "utils.h"
+#include "variant.h"
+
+#define MY_NAME "peer-loop-bench"
+
+enum
+{
+  SEED_PORT = 51420,
+  LEECH_PORT = 51421,
+
+  BUF_SIZE = 65536
+};
+
+static int torrent_count = 8;
+static int mib_per_torrent = 32;
+static int thread_count = 4;
+static char address[INET6_ADDRSTRLEN] = { '\0' };
+
+static tr_option options[] =
+{
+  { 't', "torrents", "Number of torrents", "t", 1, "<count>" },
+  { 'm', "mib", "Size of each torrent in MiB", "m", 1, "<count>" },
+  { 'n', "network-threads", "Network threads to compare against one", "n", 1, "<count>" },
+  { 'a', "address", "Local address for the sessions to connect on", "a", 1, "<address>" },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int
+parseCommandLine (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 't': torrent_count = atoi (optarg); break;
+          case 'm': mib_per_torrent = atoi (optarg); break;
+          case 'n': thread_count = atoi (optarg); break;
+          case 'a': tr_strlcpy (address, optarg, sizeof (address)); break;
+          default: return 1;
+        }
+    }
+
+  return (torrent_count > 0) && (mib_per_torrent > 0) && (thread_count > 0) ? 0 : 1;
+}
+
+/* the first IPv4 address that isn't loopback */
+static bool
+findAddress (char * setme, size_t setme_len)
+{
+  bool found = false;
+  struct ifaddrs * ifs;
+  struct ifaddrs * it;
+
+  if (getifaddrs (&ifs))
+    return false;
+
+  for (it=ifs; !found && it!=NULL; it=it->ifa_next)
+    if ((it->ifa_addr != NULL) && (it->ifa_addr->sa_family == AF_INET)
+                               && !(it->ifa_flags & IFF_LOOPBACK))
+      found = inet_ntop (AF_INET, &((struct sockaddr_in*)it->ifa_addr)->sin_addr,
+                         setme, setme_len) != NULL;
+
+  freeifaddrs (ifs);
+  return found;
+}
+
+/***
+****  Timing
+***/
+
+static double
+nowSec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+processCpuSec (void)
+{
+  struct rusage ru;
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+       + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+struct thread_cpu
+{
+  double sec;
+  int done;
+};
+
+static void
+readThreadCpu (void * vcpu)
+{
+  struct timespec ts;
+  struct thread_cpu * cpu = vcpu;
+
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  cpu->sec = ts.tv_sec + ts.tv_nsec / 1e9;
+  __atomic_store_n (&cpu->done, 1, __ATOMIC_RELEASE);
+}
+
+/* how much CPU the session's libtransmission thread has used so far */
+static double
+eventThreadCpuSec (tr_session * session)
+{
+  struct thread_cpu cpu;
+
+  memset (&cpu, 0, sizeof (cpu));
+  tr_runInEventThread (session, readThreadCpu, &cpu);
+  while (!__atomic_load_n (&cpu.done, __ATOMIC_ACQUIRE))
+    tr_wait_msec (1);
+
+  return cpu.sec;
+}
+
+/***
+****  Content
+***/
+
+static char *
+contentPath (const char * top, int i, const char * suffix)
+{
+  char * name = tr_strdup_printf ("file-%d%s", i, suffix);
+  char * path = tr_buildPath (top, name, NULL);
+
+  tr_free (name);
+  return path;
+}
+
+/* fill `top' with the torrents' files, and make a .torrent for each */
+static void
+makeContent (const char * top)
+{
+  int i;
+  int j;
+  char * buf = tr_new (char, BUF_SIZE);
+
+  tr_mkdirp (top, 0700);
+
+  for (i=0; i<torrent_count; ++i)
+    {
+      FILE * fp;
+      char * path = contentPath (top, i, "");
+      char * torrent_file = contentPath (top, i, ".torrent");
+      tr_metainfo_builder * builder;
+
+      /* the bytes don't matter, as long as every piece is different */
+      fp = fopen (path, "wb");
+      for (j=0; j<mib_per_torrent*(1024*1024/BUF_SIZE); ++j)
+        {
+          memset (buf, i, BUF_SIZE);
+          memcpy (buf, &j, sizeof (j));
+          fwrite (buf, 1, BUF_SIZE, fp);
+        }
+      fclose (fp);
+
+      builder = tr_metaInfoBuilderCreate (path);
+      tr_makeMetaInfo (builder, torrent_file, NULL, 0, NULL, false);
+      while (!builder->isDone)
+        tr_wait_msec (10);
+      tr_metaInfoBuilderFree (builder);
+
+      tr_free (torrent_file);
+      tr_free (path);
+    }
+
+  tr_free (buf);
+}
+
+static void
+removeContent (const char * top)
+{
+  int i;
+
+  for (i=0; i<torrent_count; ++i)
+    {
+      char * path = contentPath (top, i, "");
+      char * torrent_file = contentPath (top, i, ".torrent");
+
+      tr_remove (torrent_file);
+      tr_remove (path);
+      tr_free (torrent_file);
+      tr_free (path);
+    }
+
+  tr_remove (top);
+}
+
+static tr_torrent *
+addTorrent (tr_session * session, const char * top, int i, const char * download_dir)
+{
+  char * torrent_file = contentPath (top, i, ".torrent");
+  tr_ctor * ctor = tr_ctorNew (session);
+  tr_torrent * tor;
+
+  tr_ctorSetMetainfoFromFile (ctor, torrent_file);
+  tr_ctorSetPaused (ctor, TR_FORCE, false);
+  if (download_dir != NULL)
+    tr_ctorSetDownloadDir (ctor, TR_FORCE, download_dir);
+  tor = tr_torrentNew (ctor, NULL, NULL);
+  tr_ctorFree (ctor);
+  tr_free (torrent_file);
+
+  return tor;
+}
+
+static tr_stat
+getStat (tr_torrent * tor)
+{
+  tr_stat ret;
+
+  tr_sessionLock (tor->session);
+  ret = *tr_torrentStat (tor);
+  tr_sessionUnlock (tor->session);
+
+  return ret;
+}
+
+static tr_session *
+sessionNew (int port, int network_threads)
+{
+  tr_session * session;
+  tr_variant settings;
+
+  tr_variantInitDict (&settings, 10);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_port, port);
+  tr_variantDictAddInt (&settings, TR_KEY_network_threads, network_threads);
+  tr_variantDictAddInt (&settings, TR_KEY_encryption, TR_CLEAR_PREFERRED);
+  tr_variantDictAddBool (&settings, TR_KEY_download_queue_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_lpd_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_pex_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_utp_enabled, false);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  return session;
+}
+
+/***
+****
+***/
+
+/* @return false if the transfer didn't finish */
+static bool
+run (const char * top, int network_threads)
+{
+  int i;
+  int done;
+  bool ok = true;
+  tr_pex pex;
+  double t0;
+  double elapsed;
+  double cpu0;
+  double seed_cpu;
+  double leech_cpu;
+  double process_cpu;
+  const double mib = (double)torrent_count * mib_per_torrent;
+  tr_session * seeder = sessionNew (SEED_PORT, network_threads);
+  tr_session * leecher = sessionNew (LEECH_PORT, network_threads);
+  tr_torrent ** seeds = tr_new (tr_torrent*, torrent_count);
+  tr_torrent ** leeches = tr_new (tr_torrent*, torrent_count);
+
+  for (i=0; i<torrent_count; ++i)
+    {
+      seeds[i] = addTorrent (seeder, top, i, top);
+      leeches[i] = addTorrent (leecher, top, i, NULL);
+    }
+
+  for (i=0; i<torrent_count; ++i)
+    {
+      while (getStat (seeds[i]).activity != TR_STATUS_SEED)
+        tr_wait_msec (10);
+      while (getStat (leeches[i]).activity != TR_STATUS_DOWNLOAD)
+        tr_wait_msec (10);
+    }
+
+  memset (&pex, 0, sizeof (pex));
+  tr_address_from_string (&pex.addr, address);
+  pex.port = htons (SEED_PORT);
+
+  t0 = nowSec ();
+  seed_cpu = eventThreadCpuSec (seeder);
+  leech_cpu = eventThreadCpuSec (leecher);
+  process_cpu = processCpuSec ();
+
+  /* one at a time: the seeder turns away a second handshake from an
+     address that it's still handshaking with */
+  for (i=0; i<torrent_count; ++i)
+    {
+      tr_peerMgrAddPex (leeches[i], TR_PEER_FROM_PEX, &pex, -1);
+      while ((getStat (leeches[i]).peersConnected < 1) && (nowSec () - t0 < 30))
+        tr_wait_msec (10);
+    }
+
+  do
+    {
+      tr_wait_msec (10);
+
+      for (done=i=0; i<torrent_count; ++i)
+        done += getStat (leeches[i]).percentDone >= 1.0;
+    }
+  while ((done < torrent_count) && (nowSec () - t0 < 600));
+
+  elapsed = nowSec () - t0;
+  cpu0 = seed_cpu;
+  seed_cpu = eventThreadCpuSec (seeder) - cpu0;
+  cpu0 = leech_cpu;
+  leech_cpu = eventThreadCpuSec (leecher) - cpu0;
+  process_cpu = processCpuSec () - process_cpu;
+
+  if (done < torrent_count)
+    {
+      fprintf (stderr, "only %d of %d torrents finished\n", done, torrent_count);
+      ok = false;
+    }
+  else
+    {
+      printf ("%d network thread(s): %.2f s, %.1f MiB/s\n",
+              network_threads, elapsed, mib / elapsed);
+      printf ("  seeder libtransmission thread  %6.3f s CPU, %.2f ms/MiB\n",
+              seed_cpu, seed_cpu * 1000 / mib);
+      printf ("  leecher libtransmission thread %6.3f s CPU, %.2f ms/MiB\n",
+              leech_cpu, leech_cpu * 1000 / mib);
+      printf ("  whole process                  %6.3f s CPU, %.2f ms/MiB\n",
+              process_cpu, process_cpu * 1000 / mib);
+    }
+
+  /* the seeder's torrents point at the shared content, so leave it */
+  for (i=0; i<torrent_count; ++i)
+    tr_torrentRemove (leeches[i], true, NULL);
+  libttest_session_close (leecher);
+  libttest_session_close (seeder);
+  tr_free (leeches);
+  tr_free (seeds);
+  return ok;
+}
+
+int
+main (int argc, char ** argv)
+{
+  bool ok;
+  char * top;
+  char cwd[4096];
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  if (!*address && !findAddress (address, sizeof (address)))
+    {
+      fprintf (stderr, "no non-loopback IPv4 address; use --address\n");
+      return EXIT_FAILURE;
+    }
+
+  printf ("%d torrents of %d MiB over %s, plaintext\n",
+          torrent_count, mib_per_torrent, address);
+
+  if (getcwd (cwd, sizeof (cwd)) == NULL)
+    return EXIT_FAILURE;
+
+  top = tr_buildPath (cwd, "peer-loop-bench-XXXXXX", NULL);
+  tr_mkdtemp (top);
+  makeContent (top);
+
+  ok = run (top, 1);
+  if (ok && (thread_count > 1))
+    ok = run (top, thread_count);
+
+  removeContent (top);
+  tr_free (top);
+  return ok ? 0 : EXIT_FAILURE;
+}
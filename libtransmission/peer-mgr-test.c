@@ -0,0 +1,710 @@
+#include <limits.h> /* INT_MAX */
+#include <string.h> /* memset() */
+#include <time.h> /* time() */
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "peer-common.h"
+#include "peer-mgr.h"
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread() */
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+/***
+****  Peers that plug into the peer manager the way swarm-bench's do.
+****  The tests run in a single callback on the event thread so that the
+****  session's own timers can't get in between.
+***/
+
+/* these are only touched in the event thread */
+static volatile int sim_peer_count = 0;
+static volatile int sim_pulse_count = 0;
+
+static void
+simDestruct (tr_peer * peer)
+{
+  --sim_peer_count;
+  tr_peerDestruct (peer);
+}
+
+static bool
+simFalse (const tr_peer * peer UNUSED)
+{
+  return false;
+}
+
+static bool
+simTrue (const tr_peer * peer UNUSED)
+{
+  return true;
+}
+
+static bool
+simIsTransferringPieces (const tr_peer * peer UNUSED,
+                         uint64_t        now UNUSED,
+                         tr_direction    direction UNUSED,
+                         unsigned int  * setme_Bps)
+{
+  if (setme_Bps != NULL)
+    *setme_Bps = 0;
+
+  return false;
+}
+
+static bool
+simIsActive (const tr_peer * peer UNUSED, tr_direction direction UNUSED)
+{
+  return false;
+}
+
+static void
+simUpdateActive (tr_peer * peer UNUSED, tr_direction direction UNUSED)
+{
+}
+
+static time_t
+simGetConnectionAge (const tr_peer * peer UNUSED)
+{
+  return 0;
+}
+
+static bool
+simIsReadingBlock (const tr_peer * peer UNUSED, tr_block_index_t block UNUSED)
+{
+  return false;
+}
+
+static void
+simSetChoke (tr_peer * peer UNUSED, bool peer_is_choked UNUSED)
+{
+}
+
+static void
+simHave (tr_peer * peer UNUSED, uint32_t pieceIndex UNUSED)
+{
+}
+
+static void
+simCancel (tr_peer * peer UNUSED, tr_block_index_t block UNUSED)
+{
+}
+
+static void
+simPulse (tr_peer * peer UNUSED)
+{
+  ++sim_pulse_count;
+}
+
+static const struct tr_peer_virtual_funcs sim_funcs =
+{
+  .destruct = simDestruct,
+  .is_transferring_pieces = simIsTransferringPieces,
+  .is_peer_choked = simTrue,
+  .is_peer_interested = simFalse,
+  .is_client_choked = simFalse,
+  .is_client_interested = simTrue,
+  .is_active = simIsActive,
+  .update_active = simUpdateActive,
+  .get_connection_age = simGetConnectionAge,
+  .is_utp_connection = simFalse,
+  .is_encrypted = simFalse,
+  .is_incoming_connection = simFalse,
+  .is_reading_block = simIsReadingBlock,
+  .set_choke = simSetChoke,
+  .set_interested = simSetChoke,
+  .have = simHave,
+  .cancel = simCancel,
+  .pulse = simPulse
+};
+
+/* add a peer at 10.0.0.`n' that has pieces [0..have_count) */
+static tr_peer *
+simPeerNew (tr_torrent * tor, int n, tr_piece_index_t have_count)
+{
+  tr_address addr;
+  tr_peer_event e = TR_PEER_EVENT_INIT;
+  tr_peer * peer = tr_new0 (tr_peer, 1);
+
+  tr_peerConstruct (peer, tor);
+  peer->funcs = &sim_funcs;
+
+  addr.type = TR_AF_INET;
+  addr.addr.addr4.s_addr = htonl ((10u << 24) | (unsigned)n);
+  tr_peerMgrAddSimulatedPeer (tor, peer, &addr, htons (51413));
+  ++sim_peer_count;
+
+  if (have_count == tor->info.pieceCount)
+    {
+      tr_bitfieldSetHasAll (&peer->have);
+      e.eventType = TR_PEER_CLIENT_GOT_HAVE_ALL;
+    }
+  else
+    {
+      tr_bitfieldAddRange (&peer->have, 0, have_count);
+      e.eventType = TR_PEER_CLIENT_GOT_BITFIELD;
+      e.bitfield = &peer->have;
+    }
+
+  tr_peerMgrSimulatePeerEvent (peer, &e);
+  return peer;
+}
+
+static void
+simPeerGotHave (tr_peer * peer, tr_piece_index_t piece)
+{
+  tr_peer_event e = TR_PEER_EVENT_INIT;
+
+  tr_bitfieldAdd (&peer->have, piece);
+  e.eventType = TR_PEER_CLIENT_GOT_HAVE;
+  e.pieceIndex = piece;
+  tr_peerMgrSimulatePeerEvent (peer, &e);
+}
+
+/* the peer choked us, which cancels all of our requests to it */
+static void
+simPeerChoked (tr_peer * peer)
+{
+  tr_peer_event e = TR_PEER_EVENT_INIT;
+
+  e.eventType = TR_PEER_CLIENT_GOT_CHOKE;
+  tr_peerMgrSimulatePeerEvent (peer, &e);
+}
+
+struct event_thread_call
+{
+  tr_torrent * tor;
+  int (*func)(tr_torrent*);
+  int result;
+  volatile bool done;
+};
+
+static void
+eventThreadCallImpl (void * vcall)
+{
+  struct event_thread_call * call = vcall;
+
+  call->result = call->func (call->tor);
+
+  call->done = true;
+}
+
+/* run `func' in the event thread, and wait for it to return */
+static int
+eventThreadCall (tr_torrent * tor, int (*func)(tr_torrent*))
+{
+  struct event_thread_call call;
+
+  memset (&call, 0, sizeof (call));
+  call.tor = tor;
+  call.func = func;
+
+  tr_runInEventThread (tor->session, eventThreadCallImpl, &call);
+  while (!call.done)
+    tr_wait_msec (10);
+
+  return call.result;
+}
+
+/* wait for the session's timers to make `func' return true */
+static bool
+waitFor (tr_torrent * tor, int (*func)(tr_torrent*))
+{
+  const time_t deadline = time (NULL) + 10;
+
+  while (!eventThreadCall (tor, func))
+    {
+      if (time (NULL) > deadline)
+        return false;
+
+      tr_wait_msec (50);
+    }
+
+  return true;
+}
+
+/* run `func' on the zero torrent, which has none of its pieces yet */
+static int
+runTest (int (*func)(tr_torrent*))
+{
+  int result;
+  tr_session * session = libttest_session_init (NULL);
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+
+  libttest_blockingTorrentVerify (tor);
+  result = eventThreadCall (tor, func);
+
+  /* the peers are freed along with the torrent */
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return result;
+}
+
+/***
+****  Piece picker
+***/
+
+enum
+{
+  /* the zero torrent has 33 pieces, of two blocks each but the last */
+  PIECE_COUNT = 33
+};
+
+/* set wanted[first..last], and clear the rest */
+static void
+setPieces (bool * wanted, tr_piece_index_t first, tr_piece_index_t last)
+{
+  tr_piece_index_t i;
+
+  for (i=0; i<PIECE_COUNT; ++i)
+    wanted[i] = (first <= i) && (i <= last);
+}
+
+/* ask for `numwant' blocks for `peer', and check that
+   they're all of the blocks in the wanted pieces, and only those */
+static bool
+picksPieces (tr_torrent * tor, tr_peer * peer, int numwant, const bool * wanted)
+{
+  int i;
+  int got = 0;
+  bool ok = true;
+  tr_piece_index_t p;
+  int counts[PIECE_COUNT];
+  tr_block_index_t * blocks = tr_new (tr_block_index_t, numwant);
+
+  tr_peerMgrGetNextRequests (tor, peer, numwant, blocks, &got, false);
+
+  memset (counts, 0, sizeof (counts));
+  for (i=0; i<got; ++i)
+    ++counts[tr_torBlockPiece (tor, blocks[i])];
+
+  for (p=0; p<PIECE_COUNT; ++p)
+    {
+      tr_block_index_t first;
+      tr_block_index_t last;
+
+      tr_torGetPieceBlockRange (tor, p, &first, &last);
+      ok = ok && (counts[p] == (wanted[p] ? (int)(last + 1 - first) : 0));
+    }
+
+  tr_free (blocks);
+  return ok;
+}
+
+static int
+test_picker_impl (tr_torrent * tor)
+{
+  int got;
+  tr_peer * seed;
+  tr_peer * quarter;
+  tr_block_index_t block;
+  tr_file_index_t file;
+  bool wanted[PIECE_COUNT];
+  const tr_piece_index_t last = PIECE_COUNT - 1;
+  const tr_file_index_t all_files[] = { 0, 1, 2 };
+  const tr_file_index_t * last_files = all_files + 1;
+
+  /* the first and last pieces of a file that's normal priority or higher
+     get bumped up to high, so start with everything at low */
+  check_int_eq (PIECE_COUNT, tor->info.pieceCount);
+  tr_torrentSetFilePriorities (tor, all_files, 3, TR_PRI_LOW);
+
+  /* the pieces [0..8) have three copies, [8..16) two, and the rest one */
+  seed = simPeerNew (tor, 1, PIECE_COUNT);
+  simPeerNew (tor, 2, 16);
+  quarter = simPeerNew (tor, 3, 8);
+
+  /* the rarest pieces are picked first */
+  setPieces (wanted, 16, last);
+  check (picksPieces (tor, seed, 33, wanted));
+  setPieces (wanted, 8, 15);
+  check (picksPieces (tor, seed, 16, wanted));
+  setPieces (wanted, 0, 7);
+  check (picksPieces (tor, seed, 16, wanted));
+
+  /* and nothing is requested twice from the same peer */
+  tr_peerMgrGetNextRequests (tor, seed, 1, &block, &got, false);
+  check_int_eq (0, got);
+
+  /* once they're cancelled, the pieces can be picked again,
+     and a HAVE makes a piece less rare */
+  simPeerChoked (seed);
+  simPeerGotHave (quarter, 20);
+  setPieces (wanted, 16, last);
+  wanted[20] = false;
+  check (picksPieces (tor, seed, 31, wanted));
+  setPieces (wanted, 8, 15);
+  wanted[20] = true;
+  check (picksPieces (tor, seed, 18, wanted));
+  simPeerChoked (seed);
+
+  /* a HAVE ALL makes every piece one copy less rare,
+     which doesn't change which ones are rarest */
+  simPeerNew (tor, 4, PIECE_COUNT);
+  setPieces (wanted, 16, last);
+  wanted[20] = false;
+  check (picksPieces (tor, seed, 31, wanted));
+  simPeerChoked (seed);
+
+  /* higher priority beats rarity... */
+  tr_torrentSetFilePriorities (tor, last_files, 2, TR_PRI_HIGH);
+  setPieces (wanted, last, last);
+  check (picksPieces (tor, seed, 1, wanted));
+
+  /* ...but within a priority, the rarest pieces still go first */
+  setPieces (wanted, 16, 31);
+  wanted[20] = false;
+  check (picksPieces (tor, seed, 30, wanted));
+  simPeerChoked (seed);
+
+  /* a piece that's been started is finished before
+     new ones are started, even if they're rarer */
+  tr_torrentSetFilePriorities (tor, last_files, 2, TR_PRI_LOW);
+  tr_peerMgrGetNextRequests (tor, quarter, 1, &block, &got, false);
+  check_int_eq (1, got);
+  check_int_eq (40, block);
+  tr_peerMgrGetNextRequests (tor, seed, 1, &block, &got, false);
+  check_int_eq (1, got);
+  check_int_eq (41, block);
+
+  /* pieces that we don't want aren't picked */
+  simPeerChoked (seed);
+  simPeerChoked (quarter);
+  file = 0;
+  tr_torrentSetFileDLs (tor, &file, 1, false);
+  setPieces (wanted, last, last);
+  check (picksPieces (tor, seed, 33, wanted));
+
+  return 0;
+}
+
+static int
+test_picker (void)
+{
+  return runTest (test_picker_impl);
+}
+
+/***
+****  Active torrents. These tests let the session's timers run,
+****  since it's the periodic pulses that they're checking
+***/
+
+static int
+isActive (tr_torrent * tor)
+{
+  int i;
+  int n;
+  bool found = false;
+  tr_torrent ** torrents = tr_peerMgrGetActiveTorrents (tor->session->peerMgr, &n);
+
+  for (i=0; i<n; ++i)
+    found = found || (torrents[i] == tor);
+
+  tr_free (torrents);
+  return found;
+}
+
+static int
+isIdle (tr_torrent * tor)
+{
+  return !isActive (tor);
+}
+
+static int
+isDownloading (tr_torrent * tor)
+{
+  return tr_torrentGetActivity (tor) == TR_STATUS_DOWNLOAD;
+}
+
+static int
+isQueued (tr_torrent * tor)
+{
+  return tr_torrentIsQueued (tor);
+}
+
+static int
+isStopped (tr_torrent * tor)
+{
+  return tr_torrentGetActivity (tor) == TR_STATUS_STOPPED;
+}
+
+static int
+hasNoPeers (tr_torrent * tor UNUSED)
+{
+  return sim_peer_count == 0;
+}
+
+static int
+wasPulsed (tr_torrent * tor UNUSED)
+{
+  return sim_pulse_count >= 2;
+}
+
+static int
+addSeed (tr_torrent * tor)
+{
+  sim_pulse_count = 0;
+  simPeerNew (tor, 1, tor->info.pieceCount);
+  return 0;
+}
+
+/* what the RPC server does to stop a torrent */
+static int
+rpcStop (tr_torrent * tor)
+{
+  tor->isStopping = true;
+  tr_peerMgrTorrentNeedsUpkeep (tor);
+  return 0;
+}
+
+static int
+test_active_torrents (void)
+{
+  tr_session * session = libttest_session_init (NULL);
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+
+  libttest_blockingTorrentVerify (tor);
+
+  /* a paused torrent is left alone by the pulses... */
+  check (waitFor (tor, isIdle));
+
+  /* ...except that peers it somehow has get dropped */
+  eventThreadCall (tor, addSeed);
+  check_int_eq (1, sim_peer_count);
+  check (waitFor (tor, hasNoPeers));
+
+  /* a running torrent is active, and its peers get pulsed */
+  tr_torrentStart (tor);
+  check (waitFor (tor, isDownloading));
+  check (eventThreadCall (tor, isActive));
+  eventThreadCall (tor, addSeed);
+  check (waitFor (tor, wasPulsed));
+  check_int_eq (1, sim_peer_count);
+
+  /* stopping it drops its peers, and it goes idle again */
+  tr_torrentStop (tor);
+  check (waitFor (tor, isIdle));
+  check_int_eq (0, sim_peer_count);
+  check (eventThreadCall (tor, isStopped));
+
+  /* a queued torrent isn't running, but still gets stopped */
+  tr_sessionSetQueueEnabled (session, TR_DOWN, true);
+  tr_sessionSetQueueSize (session, TR_DOWN, 0);
+  tr_torrentStart (tor);
+  check (eventThreadCall (tor, isQueued));
+  check (waitFor (tor, isIdle));
+  eventThreadCall (tor, rpcStop);
+  check (waitFor (tor, isStopped));
+  check (!eventThreadCall (tor, isQueued));
+
+  /* and it's started once there's room in the queue */
+  tr_torrentStart (tor);
+  check (eventThreadCall (tor, isQueued));
+  tr_sessionSetQueueSize (session, TR_DOWN, 1);
+  check (waitFor (tor, isDownloading));
+  check (eventThreadCall (tor, isActive));
+
+  /* cleanup */
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****  Atoms
+***/
+
+enum
+{
+  /* more than fit in one of the peer manager's chunks of atoms */
+  ATOM_COUNT = 300,
+
+  ATOM6_COUNT = 10,
+
+  /* a peer limit of 5 lets a torrent keep 15 atoms */
+  PEER_LIMIT = 5,
+  MAX_ATOM_COUNT = 15,
+
+  /* more connected peers than that */
+  CONNECTED_COUNT = 20
+};
+
+static tr_pex
+makePex (int i, int port)
+{
+  tr_pex pex;
+
+  memset (&pex, 0, sizeof (tr_pex));
+  pex.addr.type = TR_AF_INET;
+  pex.addr.addr.addr4.s_addr = htonl ((10u << 24) | (1u << 16) | (unsigned)i);
+  pex.port = htons (port);
+  return pex;
+}
+
+static tr_pex
+makePex6 (int i, int port)
+{
+  tr_pex pex;
+
+  memset (&pex, 0, sizeof (tr_pex));
+  pex.addr.type = TR_AF_INET6;
+  pex.addr.addr.addr6.s6_addr[0] = 0x20;
+  pex.addr.addr.addr6.s6_addr[1] = 0x01;
+  pex.addr.addr.addr6.s6_addr[2] = 0x0d;
+  pex.addr.addr.addr6.s6_addr[3] = 0xb8;
+  pex.addr.addr.addr6.s6_addr[15] = (uint8_t)(i + 1);
+  pex.port = htons (port);
+  return pex;
+}
+
+/* add atoms for all the test addresses, at ports counting up from `port' */
+static void
+addAtoms (tr_torrent * tor, int port)
+{
+  int i;
+  tr_pex pex;
+
+  for (i=0; i<ATOM_COUNT; ++i)
+    {
+      pex = makePex (i, port + i);
+      tr_peerMgrAddPex (tor, TR_PEER_FROM_PEX, &pex, -1);
+    }
+
+  for (i=0; i<ATOM6_COUNT; ++i)
+    {
+      pex = makePex6 (i, port + i);
+      tr_peerMgrAddPex (tor, TR_PEER_FROM_PEX, &pex, -1);
+    }
+}
+
+/* @return the port that `addr' has in `pex', or zero if it's not there */
+static int
+findPort (const tr_pex * pex, int n, const tr_address * addr)
+{
+  int i;
+
+  for (i=0; i<n; ++i)
+    if (!tr_address_compare (&pex[i].addr, addr))
+      return ntohs (pex[i].port);
+
+  return 0;
+}
+
+static int
+countAtoms (tr_torrent * tor)
+{
+  int n;
+  tr_pex * pex;
+
+  n = tr_peerMgrGetPeers (tor, &pex, TR_AF_INET, TR_PEERS_INTERESTING, INT_MAX);
+  tr_free (pex);
+  n += tr_peerMgrGetPeers (tor, &pex, TR_AF_INET6, TR_PEERS_INTERESTING, INT_MAX);
+  tr_free (pex);
+
+  return n;
+}
+
+static int
+test_atoms_impl (tr_torrent * tor)
+{
+  int i;
+  int n;
+  int round;
+  int kept;
+  tr_pex * pex;
+  tr_pex * pex6;
+  tr_pex tmp;
+  const tr_address * seed_addr;
+  tr_peer * peers[CONNECTED_COUNT];
+  int ports[ATOM_COUNT];
+
+  tr_torrentSetPeerLimit (tor, PEER_LIMIT);
+  peers[0] = simPeerNew (tor, 1, PIECE_COUNT);
+  seed_addr = tr_peerAddress (peers[0]);
+
+  /* every atom is found by its address */
+  addAtoms (tor, 1000);
+  n = tr_peerMgrGetPeers (tor, &pex, TR_AF_INET, TR_PEERS_INTERESTING, INT_MAX);
+  check_int_eq (ATOM_COUNT + 1, n);
+  check_int_eq (51413, findPort (pex, n, seed_addr));
+  for (i=0; i<ATOM_COUNT; ++i)
+    {
+      tmp = makePex (i, 0);
+      ports[i] = findPort (pex, n, &tmp.addr);
+      check_int_eq (1000 + i, ports[i]);
+    }
+  tr_free (pex);
+  n = tr_peerMgrGetPeers (tor, &pex6, TR_AF_INET6, TR_PEERS_INTERESTING, INT_MAX);
+  check_int_eq (ATOM6_COUNT, n);
+  for (i=0; i<ATOM6_COUNT; ++i)
+    {
+      tmp = makePex6 (i, 0);
+      check_int_eq (1000 + i, findPort (pex6, n, &tmp.addr));
+    }
+  tr_free (pex6);
+
+  /* an address that's seen again, even on another port, is the same atom */
+  addAtoms (tor, 2000);
+  check_int_eq (ATOM_COUNT + ATOM6_COUNT + 1, countAtoms (tor));
+
+  for (round=0; round<4; ++round)
+    {
+      /* pruning keeps the atoms that are in use, and not much else */
+      tr_peerMgrPruneAtoms (tor);
+      check_int_eq (MAX_ATOM_COUNT, countAtoms (tor));
+      n = tr_peerMgrGetPeers (tor, &pex, TR_AF_INET, TR_PEERS_INTERESTING, INT_MAX);
+      check_int_eq (51413, findPort (pex, n, seed_addr));
+      kept = 0;
+      for (i=0; i<ATOM_COUNT; ++i)
+        {
+          tmp = makePex (i, 0);
+          if (findPort (pex, n, &tmp.addr) == 0)
+            ports[i] = 3000 + (round * 1000) + i;
+          else
+            ++kept;
+        }
+      tr_free (pex);
+      check (kept < MAX_ATOM_COUNT);
+
+      /* the pruned atoms are reused for new ones, which don't
+         turn up with the old ones' ports. the kept ones keep theirs */
+      addAtoms (tor, 3000 + (round * 1000));
+      check_int_eq (ATOM_COUNT + ATOM6_COUNT + 1, countAtoms (tor));
+      n = tr_peerMgrGetPeers (tor, &pex, TR_AF_INET, TR_PEERS_INTERESTING, INT_MAX);
+      for (i=0; i<ATOM_COUNT; ++i)
+        {
+          tmp = makePex (i, 0);
+          check_int_eq (ports[i], findPort (pex, n, &tmp.addr));
+        }
+      tr_free (pex);
+    }
+
+  /* even if there are more of them in use than we'd like */
+  for (i=1; i<CONNECTED_COUNT; ++i)
+    peers[i] = simPeerNew (tor, 1 + i, 0);
+  tr_peerMgrPruneAtoms (tor);
+  check_int_eq (CONNECTED_COUNT, countAtoms (tor));
+  n = tr_peerMgrGetPeers (tor, &pex, TR_AF_INET, TR_PEERS_INTERESTING, INT_MAX);
+  for (i=0; i<CONNECTED_COUNT; ++i)
+    check_int_eq (51413, findPort (pex, n, tr_peerAddress (peers[i])));
+  tr_free (pex);
+
+  return 0;
+}
+
+static int
+test_atoms (void)
+{
+  return runTest (test_atoms_impl);
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_picker,
+                             test_active_torrents,
+                             test_atoms };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
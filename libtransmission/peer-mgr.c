@@ -27,17 +27,21 @@
 #include "cache.h"
 #include "clients.h"
 #include "completion.h"
+#include "connect-rate.h"
 #include "crypto.h"
 #include "handshake.h"
+#include "heap.h"
 #include "log.h"
 #include "net.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "peer-msgs.h"
 #include "ptrarray.h"
+#include "request-list.h"
 #include "session.h"
 #include "stats.h" /* tr_statsAddUploaded, tr_statsAddDownloaded */
 #include "torrent.h"
+#include "trevent.h" /* tr_eventGetShardCount () */
 #include "tr-utp.h"
 #include "utils.h"
 #include "webseed.h"
@@ -69,12 +73,6 @@ enum
   /* when few peers are available, keep idle ones this long */
   MAX_UPLOAD_IDLE_SECS = (60 * 5),
 
-  /* max number of peers to ask for per second overall.
-   * this throttle is to avoid overloading the router */
-  MAX_CONNECTIONS_PER_SECOND = 12,
-
-  MAX_CONNECTIONS_PER_PULSE = (int)(MAX_CONNECTIONS_PER_SECOND * (RECONNECT_PERIOD_MSEC/1000.0)),
-
   /* number of bad pieces a peer is allowed to send before we ban them */
   MAX_BAD_PIECES_PER_PEER = 5,
 
@@ -93,12 +91,27 @@ enum
   /* the minimum we'll wait before attempting to reconnect to a peer */
   MINIMUM_RECONNECT_INTERVAL_SECS = 5,
 
+  /* how long to leave a swarm's candidates alone when it has
+     as many peers or as much upload speed as it can use */
+  SATURATED_SWARM_RETRY_SECS = 2,
+
+  /* use for peer_atom.candidateHeap and tr_swarm.candidateHeap */
+  CANDIDATE_NONE = 0,
+  CANDIDATE_READY,   /* atom: in its swarm's candidates. swarm: in the manager's candidateSwarms */
+  CANDIDATE_WAITING, /* atom: in the manager's waitingCandidates. swarm: in the manager's waitingSwarms */
+
   /** how long we'll let requests we've made linger before we cancel them */
   REQUEST_TTL_SECS = 90,
 
   NO_BLOCKS_CANCEL_HISTORY = 120,
 
-  CANCEL_HISTORY_SEC = 60
+  CANCEL_HISTORY_SEC = 60,
+
+  /* how many atoms the peer manager allocates at a time */
+  ATOM_CHUNK_SIZE = 256,
+
+  /* a swarm's atom hash is grown whenever it has more atoms than buckets */
+  MIN_ATOM_BUCKET_COUNT = 16
 };
 
 const tr_peer_event TR_PEER_EVENT_INIT = { 0, 0, NULL, 0, 0, 0, 0 };
@@ -120,27 +133,41 @@ const tr_swarm_stats TR_SWARM_STATS_INIT = { { 0, 0 }, 0, 0, { 0, 0, 0, 0, 0, 0,
  */
 struct peer_atom
 {
-  uint8_t     fromFirst;          /* where the peer was first found */
-  uint8_t     fromBest;           /* the "best" value of where the peer has been found */
-  uint8_t     flags;              /* these match the added_f flags */
-  uint8_t     flags2;             /* flags that aren't defined in added_f */
-  int8_t      seedProbability;    /* how likely is this to be a seed... [0..100] or -1 for unknown */
-  int8_t      blocklisted;        /* -1 for unknown, true for blocklisted, false for not blocklisted */
-
-  tr_port     port;
-  bool        utp_failed;         /* We recently failed to connect over uTP */
-  uint16_t    numFails;
   time_t      time;               /* when the peer's connection status last changed */
   time_t      piece_data_time;
 
   time_t      lastConnectionAttemptAt;
   time_t      lastConnectionAt;
+  uint64_t    connectStartedMsec; /* for timing our outgoing handshakes */
 
   /* similar to a TTL field, but less rigid --
    * if the swarm is small, the atom will be kept past this date. */
   time_t      shelf_date;
   tr_peer   * peer;               /* will be NULL if not connected */
+
+  /* the swarm whose pool it's in, or NULL if it's unused */
+  struct tr_swarm * swarm;
+
+  /* the next atom in the swarm's hash bucket, or in the manager's unused list */
+  struct peer_atom * hash_next;
+
+  /* if the atom's in a candidate heap, this is its score
+     if it's ready, or its reconnect time if it's waiting */
+  uint64_t    candidateKey;
+  int         candidateIndex;
+
   tr_address  addr;
+  tr_port     port;
+  uint16_t    numFails;
+
+  uint8_t     fromFirst;          /* where the peer was first found */
+  uint8_t     fromBest;           /* the "best" value of where the peer has been found */
+  uint8_t     flags;              /* these match the added_f flags */
+  uint8_t     flags2;             /* flags that aren't defined in added_f */
+  int8_t      seedProbability;    /* how likely is this to be a seed... [0..100] or -1 for unknown */
+  int8_t      blocklisted;        /* -1 for unknown, true for blocklisted, false for not blocklisted */
+  uint8_t     candidateHeap;      /* which candidate heap it's in */
+  bool        utp_failed;         /* We recently failed to connect over uTP */
 };
 
 #ifdef NDEBUG
@@ -162,25 +189,42 @@ tr_atomAddrStr (const struct peer_atom * atom)
   return atom ? tr_peerIoAddrStr (&atom->addr, atom->port) : "[no atom]";
 }
 
-struct block_request
+/* which of the piece picker's lists a piece is in */
+enum
 {
-  tr_block_index_t block;
-  tr_peer * peer;
-  time_t sentAt;
+  PICKER_NONE,   /* we don't want it, or we've already got it */
+  PICKER_BUCKET, /* untouched */
+  PICKER_ACTIVE, /* started, with some blocks still unrequested */
+  PICKER_FULL    /* all of its missing blocks have been requested */
 };
 
-struct weighted_piece
+#define PIECE_NONE ((tr_piece_index_t)-1)
+
+/* TR_PRI_HIGH, TR_PRI_NORMAL, TR_PRI_LOW */
+#define PRIORITY_COUNT 3
+
+struct picker_piece
 {
-  tr_piece_index_t index;
-  int16_t salt;
+  tr_piece_index_t prev; /* the head's prev is the list's tail */
+  tr_piece_index_t next;
   int16_t requestCount;
+  uint8_t list;
 };
 
-enum piece_sort_state
+struct piece_picker
 {
-  PIECES_UNSORTED,
-  PIECES_SORTED_BY_INDEX,
-  PIECES_SORTED_BY_WEIGHT
+  struct picker_piece * pieces; /* one per piece in the torrent */
+  tr_piece_index_t pieceCount;
+
+  /* the heads of the untouched pieces' lists, by priority and then by
+     replication. bucket (rank, rep) is buckets[rank * bucketCount + rep] */
+  tr_piece_index_t * buckets;
+  int bucketCount;
+
+  tr_piece_index_t active;
+  tr_piece_index_t full;
+
+  bool isValid;
 };
 
 /** @brief Opaque, per-torrent data structure for peer connection information */
@@ -189,26 +233,37 @@ typedef struct tr_swarm
   tr_swarm_stats             stats;
 
   tr_ptrArray                outgoingHandshakes; /* tr_handshake */
-  tr_ptrArray                pool; /* struct peer_atom */
-  tr_ptrArray                peers; /* tr_peerMsgs */
+  /* the pool of atoms, hashed by address */
+  struct peer_atom        ** atomBuckets;
+  size_t                     atomBucketMask;
+  int                        atomCount;
+  tr_ptrArray                peers; /* tr_peerMsgs, or swarm-bench's simulated peers */
   tr_ptrArray                webseeds; /* tr_webseed */
 
   tr_torrent               * tor;
   struct tr_peerMgr        * manager;
 
-  tr_peerMsgs              * optimistic; /* the optimistic peer, or NULL if none */
+  /* the peer loop that services this swarm's TCP sockets */
+  int                        shard;
+
+  tr_peer                  * optimistic; /* the optimistic peer, or NULL if none */
   int                        optimisticUnchokeTimeScaler;
 
   bool                       isRunning;
   bool                       needsCompletenessCheck;
 
-  struct block_request     * requests;
-  int                        requestCount;
-  int                        requestAlloc;
+  tr_requestList             requests;
 
-  struct weighted_piece    * pieces;
-  int                        pieceCount;
-  enum piece_sort_state      pieceSortState;
+  struct piece_picker        picker;
+
+  /* the atoms we could connect to now, best score first */
+  tr_heap                    candidates;
+
+  /* if the swarm's in one of the manager's swarm heaps, this is its best
+     candidate's score if it's ready, or when to look again if it's waiting */
+  uint64_t                   candidateKey;
+  int                        candidateIndex;
+  uint8_t                    candidateHeap;
 
   /* An array of pieceCount items stating how many peers have each piece.
      This is used to help us for downloading pieces "rarest first."
@@ -233,6 +288,36 @@ struct tr_peerMgr
 {
   tr_session    * session;
   tr_ptrArray     incomingHandshakes; /* tr_handshake */
+
+  /* the swarms that the periodic pulses look at, sorted by address.
+     the other swarms are idle, so the pulses can skip them */
+  tr_ptrArray     peerSwarms;      /* swarms with connected peers */
+  tr_ptrArray     upkeepSwarms;    /* running, or with upkeep pending */
+
+  /* the running swarms that have candidates, best candidate first.
+     the ones with all the peers or speed they can use wait in
+     waitingSwarms, and the atoms that we can't retry yet wait in
+     waitingCandidates, soonest first */
+  tr_heap         candidateSwarms;
+  tr_heap         waitingSwarms;
+  tr_heap         waitingCandidates;
+
+  /* all the swarms' atoms are carved out of these chunks,
+     and the unused ones are recycled */
+  struct peer_atom ** atomChunks;
+  int                 atomChunkCount;
+  struct peer_atom  * unusedAtoms;
+
+  /* how many outgoing connections we may attempt. It adapts to how
+     well the last ones went, to fill the peer slots as fast as the
+     network allows without overwhelming the router */
+  tr_connect_rate connectRate;
+
+  /* how long the reconnect pulses have spent picking candidates */
+  uint64_t        candidatePulseCount;
+  uint64_t        candidatePulseUsec;
+  uint64_t        candidatePulseMaxUsec;
+
   struct event  * bandwidthTimer;
   struct event  * rechokeTimer;
   struct event  * refillUpkeepTimer;
@@ -384,24 +469,6 @@ getExistingHandshake (tr_ptrArray * handshakes, const tr_address * addr)
   return tr_ptrArrayFindSorted (handshakes, addr, handshakeCompareToAddr);
 }
 
-static int
-comparePeerAtomToAddress (const void * va, const void * vb)
-{
-  const struct peer_atom * a = va;
-
-  return tr_address_compare (&a->addr, vb);
-}
-
-static int
-compareAtomsByAddress (const void * va, const void * vb)
-{
-  const struct peer_atom * b = vb;
-
-  assert (tr_isAtom (b));
-
-  return comparePeerAtomToAddress (va, &b->addr);
-}
-
 /**
 ***
 **/
@@ -427,12 +494,189 @@ peerCompare (const void * a, const void * b)
   return tr_address_compare (tr_peerAddress (a), tr_peerAddress (b));
 }
 
+static void atomRemoveCandidate (struct peer_atom *);
+static void atomUpdateCandidate (struct peer_atom *, time_t now);
+static void swarmUpdateCandidates (tr_swarm *);
+static void swarmRemoveFromCandidateHeaps (tr_swarm *);
+
+/***
+****  The atom pool
+***/
+
+static size_t
+getAtomBucket (const tr_swarm * s, const tr_address * addr)
+{
+  size_t i, n;
+  const uint8_t * walk;
+  uint32_t h = 2166136261u;
+
+  if (addr->type == TR_AF_INET)
+    {
+      walk = (const uint8_t*) &addr->addr.addr4;
+      n = sizeof (struct in_addr);
+    }
+  else
+    {
+      walk = (const uint8_t*) &addr->addr.addr6;
+      n = sizeof (struct in6_addr);
+    }
+
+  /* FNV-1a */
+  for (i=0; i<n; ++i)
+    {
+      h ^= walk[i];
+      h *= 16777619u;
+    }
+
+  return h & s->atomBucketMask;
+}
+
 static struct peer_atom*
-getExistingAtom (const tr_swarm   * cswarm,
+getExistingAtom (const tr_swarm   * s,
                  const tr_address * addr)
 {
-  tr_swarm * swarm = (tr_swarm*) cswarm;
-  return tr_ptrArrayFindSorted (&swarm->pool, addr, comparePeerAtomToAddress);
+  struct peer_atom * atom = NULL;
+
+  if (s->atomBuckets != NULL)
+    for (atom=s->atomBuckets[getAtomBucket (s, addr)]; atom!=NULL; atom=atom->hash_next)
+      if (!tr_address_compare (&atom->addr, addr))
+        break;
+
+  return atom;
+}
+
+/**
+ * Walk through a swarm's atoms, in no particular order:
+ * for (atom=atomPoolNext (s, NULL); atom!=NULL; atom=atomPoolNext (s, atom))
+ *
+ * Don't add or remove atoms while walking.
+ */
+static struct peer_atom*
+atomPoolNext (const tr_swarm * s, const struct peer_atom * atom)
+{
+  size_t i = 0;
+
+  if (atom != NULL)
+    {
+      if (atom->hash_next != NULL)
+        return atom->hash_next;
+
+      i = getAtomBucket (s, &atom->addr) + 1;
+    }
+
+  if (s->atomBuckets != NULL)
+    for (; i<=s->atomBucketMask; ++i)
+      if (s->atomBuckets[i] != NULL)
+        return s->atomBuckets[i];
+
+  return NULL;
+}
+
+/** @return a new array of the swarm's atoms. Free it with tr_free () */
+static struct peer_atom**
+atomPoolCopy (const tr_swarm * s)
+{
+  int n = 0;
+  struct peer_atom * atom;
+  struct peer_atom ** ret = tr_new (struct peer_atom*, s->atomCount);
+
+  for (atom=atomPoolNext (s, NULL); atom!=NULL; atom=atomPoolNext (s, atom))
+    ret[n++] = atom;
+
+  assert (n == s->atomCount);
+  return ret;
+}
+
+static void
+growAtomBuckets (tr_swarm * s)
+{
+  size_t i;
+  const size_t old_count = s->atomBuckets ? s->atomBucketMask + 1 : 0;
+  const size_t new_count = old_count ? old_count * 2 : MIN_ATOM_BUCKET_COUNT;
+  struct peer_atom ** old_buckets = s->atomBuckets;
+
+  s->atomBuckets = tr_new0 (struct peer_atom*, new_count);
+  s->atomBucketMask = new_count - 1;
+
+  for (i=0; i<old_count; ++i)
+    {
+      struct peer_atom * atom = old_buckets[i];
+
+      while (atom != NULL)
+        {
+          struct peer_atom * next = atom->hash_next;
+          struct peer_atom ** head = &s->atomBuckets[getAtomBucket (s, &atom->addr)];
+          atom->hash_next = *head;
+          *head = atom;
+          atom = next;
+        }
+    }
+
+  tr_free (old_buckets);
+}
+
+/* @return a zeroed atom for `addr' that's been added to the swarm's pool */
+static struct peer_atom*
+atomNew (tr_swarm * s, const tr_address * addr)
+{
+  struct peer_atom * atom;
+  struct peer_atom ** head;
+  tr_peerMgr * mgr = s->manager;
+
+  assert (getExistingAtom (s, addr) == NULL);
+
+  if (mgr->unusedAtoms == NULL)
+    {
+      int i;
+      struct peer_atom * chunk = tr_new (struct peer_atom, ATOM_CHUNK_SIZE);
+
+      mgr->atomChunks = tr_renew (struct peer_atom*, mgr->atomChunks, mgr->atomChunkCount + 1);
+      mgr->atomChunks[mgr->atomChunkCount++] = chunk;
+
+      for (i=ATOM_CHUNK_SIZE-1; i>=0; --i)
+        {
+          chunk[i].hash_next = mgr->unusedAtoms;
+          mgr->unusedAtoms = &chunk[i];
+        }
+    }
+
+  atom = mgr->unusedAtoms;
+  mgr->unusedAtoms = atom->hash_next;
+  memset (atom, 0, sizeof (struct peer_atom));
+  atom->addr = *addr;
+  atom->swarm = s;
+  atom->candidateIndex = -1;
+
+  if (s->atomCount >= (int)(s->atomBuckets ? s->atomBucketMask + 1 : 0))
+    growAtomBuckets (s);
+
+  head = &s->atomBuckets[getAtomBucket (s, addr)];
+  atom->hash_next = *head;
+  *head = atom;
+  ++s->atomCount;
+
+  return atom;
+}
+
+static void
+atomFree (struct peer_atom * atom)
+{
+  tr_swarm * s = atom->swarm;
+  tr_peerMgr * mgr = s->manager;
+  struct peer_atom ** walk = &s->atomBuckets[getAtomBucket (s, &atom->addr)];
+
+  assert (atom->peer == NULL);
+
+  atomRemoveCandidate (atom);
+
+  while (*walk != atom)
+    walk = &(*walk)->hash_next;
+  *walk = atom->hash_next;
+  --s->atomCount;
+
+  atom->swarm = NULL;
+  atom->hash_next = mgr->unusedAtoms;
+  mgr->unusedAtoms = atom;
 }
 
 static bool
@@ -489,6 +733,89 @@ replicationNew (tr_swarm * s)
     }
 }
 
+/***
+****  The active swarms
+***/
+
+static int
+compareSwarms (const void * a, const void * b)
+{
+  if (a != b)
+    return a < b ? -1 : 1;
+
+  return 0;
+}
+
+static bool
+swarmSetHas (tr_ptrArray * set, const tr_swarm * s)
+{
+  return tr_ptrArrayFindSorted (set, s, compareSwarms) != NULL;
+}
+
+static void
+swarmSetInclude (tr_ptrArray * set, tr_swarm * s, bool include)
+{
+  const bool has = swarmSetHas (set, s);
+
+  if (include && !has)
+    tr_ptrArrayInsertSorted (set, s, compareSwarms);
+  else if (!include && has)
+    tr_ptrArrayRemoveSorted (set, s, compareSwarms);
+}
+
+/**
+ * Returns a copy of one of the manager's sets. Walk through the copy
+ * when the loop might connect or close peers, or start, stop or remove
+ * torrents, and use swarmSetHas () to skip the swarms that have left
+ * the set since the copy was made.
+ */
+static tr_swarm **
+swarmSetCopy (tr_ptrArray * set, int * setme_count)
+{
+  *setme_count = tr_ptrArraySize (set);
+  return tr_memdup (tr_ptrArrayBase (set), sizeof (tr_swarm*) * *setme_count);
+}
+
+/* call this when a swarm gains or loses peers */
+static void
+swarmUpdateActivity (tr_swarm * s)
+{
+  tr_peerMgr * mgr = s->manager;
+
+  swarmSetInclude (&mgr->peerSwarms, s, !tr_ptrArrayEmpty (&s->peers));
+}
+
+static bool
+swarmNeedsUpkeep (const tr_swarm * s)
+{
+  const tr_torrent * tor = s->tor;
+
+  return s->isRunning || tor->isRunning || tor->isStopping || s->needsCompletenessCheck;
+}
+
+void
+tr_peerMgrTorrentNeedsUpkeep (tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  if (tor->swarm != NULL)
+    swarmSetInclude (&tor->swarm->manager->upkeepSwarms, tor->swarm, true);
+}
+
+tr_torrent **
+tr_peerMgrGetActiveTorrents (tr_peerMgr * mgr, int * setme_count)
+{
+  int i, n;
+  tr_swarm ** swarms = (tr_swarm**) tr_ptrArrayPeek (&mgr->upkeepSwarms, &n);
+  tr_torrent ** ret = tr_new (tr_torrent*, n);
+
+  for (i=0; i<n; ++i)
+    ret[i] = swarms[i]->tor;
+
+  *setme_count = n;
+  return ret;
+}
+
 static void
 swarmFree (void * vs)
 {
@@ -501,15 +828,23 @@ swarmFree (void * vs)
   assert (tr_ptrArrayEmpty (&s->peers));
 
   tr_ptrArrayDestruct (&s->webseeds, (PtrArrayForeachFunc)tr_peerFree);
-  tr_ptrArrayDestruct (&s->pool, (PtrArrayForeachFunc)tr_free);
+  while (s->atomCount > 0)
+    atomFree (atomPoolNext (s, NULL));
+  tr_free (s->atomBuckets);
+  swarmRemoveFromCandidateHeaps (s);
+  tr_heapDestruct (&s->candidates);
   tr_ptrArrayDestruct (&s->outgoingHandshakes, NULL);
   tr_ptrArrayDestruct (&s->peers, NULL);
   s->stats = TR_SWARM_STATS_INIT;
 
+  swarmSetInclude (&s->manager->upkeepSwarms, s, false);
+  assert (!swarmSetHas (&s->manager->peerSwarms, s));
+
   replicationFree (s);
 
-  tr_free (s->requests);
-  tr_free (s->pieces);
+  tr_requestListDestruct (&s->requests);
+  tr_free (s->picker.pieces);
+  tr_free (s->picker.buckets);
   tr_free (s);
 }
 
@@ -534,6 +869,52 @@ rebuildWebseedArray (tr_swarm * s, tr_torrent * tor)
     }
 }
 
+static int
+compareCandidates (const void * va, const void * vb)
+{
+  const struct peer_atom * a = va;
+  const struct peer_atom * b = vb;
+
+  if (a->candidateKey != b->candidateKey)
+    return a->candidateKey < b->candidateKey ? -1 : 1;
+
+  return 0;
+}
+
+static void
+setCandidateIndex (void * vatom, int pos)
+{
+  struct peer_atom * atom = vatom;
+
+  atom->candidateIndex = pos;
+
+  if (pos < 0)
+    atom->candidateHeap = CANDIDATE_NONE;
+}
+
+static int
+compareSwarmCandidates (const void * va, const void * vb)
+{
+  const tr_swarm * a = va;
+  const tr_swarm * b = vb;
+
+  if (a->candidateKey != b->candidateKey)
+    return a->candidateKey < b->candidateKey ? -1 : 1;
+
+  return 0;
+}
+
+static void
+setSwarmCandidateIndex (void * vs, int pos)
+{
+  tr_swarm * s = vs;
+
+  s->candidateIndex = pos;
+
+  if (pos < 0)
+    s->candidateHeap = CANDIDATE_NONE;
+}
+
 static tr_swarm *
 swarmNew (tr_peerMgr * manager, tr_torrent * tor)
 {
@@ -542,10 +923,12 @@ swarmNew (tr_peerMgr * manager, tr_torrent * tor)
   s = tr_new0 (tr_swarm, 1);
   s->manager = manager;
   s->tor = tor;
-  s->pool = TR_PTR_ARRAY_INIT;
   s->peers = TR_PTR_ARRAY_INIT;
   s->webseeds = TR_PTR_ARRAY_INIT;
   s->outgoingHandshakes = TR_PTR_ARRAY_INIT;
+  s->candidateIndex = -1;
+  s->shard = tor->uniqueId % tr_eventGetShardCount (manager->session);
+  tr_heapConstruct (&s->candidates, compareCandidates, setCandidateIndex);
 
   rebuildWebseedArray (s, tor);
 
@@ -560,6 +943,12 @@ tr_peerMgrNew (tr_session * session)
   tr_peerMgr * m = tr_new0 (tr_peerMgr, 1);
   m->session = session;
   m->incomingHandshakes = TR_PTR_ARRAY_INIT;
+  m->peerSwarms = TR_PTR_ARRAY_INIT;
+  m->upkeepSwarms = TR_PTR_ARRAY_INIT;
+  tr_heapConstruct (&m->candidateSwarms, compareSwarmCandidates, setSwarmCandidateIndex);
+  tr_heapConstruct (&m->waitingSwarms, compareSwarmCandidates, setSwarmCandidateIndex);
+  tr_heapConstruct (&m->waitingCandidates, compareCandidates, setCandidateIndex);
+  tr_connectRateConstruct (&m->connectRate, tr_time_msec ());
   ensureMgrTimersExist (m);
   return m;
 }
@@ -596,6 +985,15 @@ tr_peerMgrFree (tr_peerMgr * manager)
     tr_handshakeAbort (tr_ptrArrayNth (&manager->incomingHandshakes, 0));
 
   tr_ptrArrayDestruct (&manager->incomingHandshakes, NULL);
+  tr_ptrArrayDestruct (&manager->peerSwarms, NULL);
+  tr_ptrArrayDestruct (&manager->upkeepSwarms, NULL);
+  tr_heapDestruct (&manager->candidateSwarms);
+  tr_heapDestruct (&manager->waitingSwarms);
+  tr_heapDestruct (&manager->waitingCandidates);
+
+  while (manager->atomChunkCount > 0)
+    tr_free (manager->atomChunks[--manager->atomChunkCount]);
+  tr_free (manager->atomChunks);
 
   managerUnlock (manager);
   tr_free (manager);
@@ -615,14 +1013,13 @@ tr_peerMgrOnBlocklistChanged (tr_peerMgr * mgr)
      since the blocklist has changed, erase that cached value */
   while ((tor = tr_torrentNext (session, tor)))
     {
-      int i;
+      struct peer_atom * atom;
       tr_swarm * s = tor->swarm;
-      const int n = tr_ptrArraySize (&s->pool);
-      for (i=0; i<n; ++i)
-        {
-          struct peer_atom * atom = tr_ptrArrayNth (&s->pool, i);
-          atom->blocklisted = -1;
-        }
+
+      for (atom=atomPoolNext (s, NULL); atom!=NULL; atom=atomPoolNext (s, atom))
+        atom->blocklisted = -1;
+
+      swarmUpdateCandidates (s);
     }
 }
 
@@ -669,6 +1066,7 @@ atomSetSeed (const tr_swarm * s, struct peer_atom * atom)
       tordbg (s, "marking peer %s as a seed", tr_atomAddrStr (atom));
 
       atomSetSeedProbability (atom, 100);
+      atomUpdateCandidate (atom, tr_time ());
     }
 }
 
@@ -711,151 +1109,16 @@ tr_peerMgrSetUtpFailed (tr_torrent *tor, const tr_address *addr, bool failed)
 ***
 *** There are two data structures associated with managing block requests:
 ***
-*** 1. tr_swarm::requests, an array of "struct block_request" which keeps
-***    track of which blocks have been requested, and when, and by which peers.
-***    This is list is used for (a) cancelling requests that have been pending
+*** 1. tr_swarm::requests, a tr_requestList which keeps track of which
+***    blocks have been requested, and when, and by which peers.
+***    It's used for (a) cancelling requests that have been pending
 ***    for too long and (b) avoiding duplicate requests before endgame.
 ***
-*** 2. tr_swarm::pieces, an array of "struct weighted_piece" which lists the
-***    pieces that we want to request. It's used to decide which blocks to
-***    return next when tr_peerMgrGetBlockRequests () is called.
-**/
-
-/**
-*** struct block_request
+*** 2. tr_swarm::picker, a "struct piece_picker" which lists the pieces
+***    that we want to request. It's used to decide which blocks to
+***    return next when tr_peerMgrGetNextRequests () is called.
 **/
 
-static int
-compareReqByBlock (const void * va, const void * vb)
-{
-  const struct block_request * a = va;
-  const struct block_request * b = vb;
-
-  /* primary key: block */
-  if (a->block < b->block) return -1;
-  if (a->block > b->block) return 1;
-
-  /* secondary key: peer */
-  if (a->peer < b->peer) return -1;
-  if (a->peer > b->peer) return 1;
-
-  return 0;
-}
-
-static void
-requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
-{
-  struct block_request key;
-
-  /* ensure enough room is available... */
-  if (s->requestCount + 1 >= s->requestAlloc)
-    {
-      const int CHUNK_SIZE = 128;
-      s->requestAlloc += CHUNK_SIZE;
-      s->requests = tr_renew (struct block_request,
-                              s->requests, s->requestAlloc);
-    }
-
-  /* populate the record we're inserting */
-  key.block = block;
-  key.peer = peer;
-  key.sentAt = tr_time ();
-
-  /* insert the request to our array... */
-  {
-    bool exact;
-    const int pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                                   sizeof (struct block_request),
-                                   compareReqByBlock, &exact);
-    assert (!exact);
-    memmove (s->requests + pos + 1,
-             s->requests + pos,
-             sizeof (struct block_request) * (s->requestCount++ - pos));
-    s->requests[pos] = key;
-  }
-
-  if (peer != NULL)
-    {
-      ++peer->pendingReqsToPeer;
-      assert (peer->pendingReqsToPeer >= 0);
-    }
-
-  /*fprintf (stderr, "added request of block %lu from peer %s... "
-                     "there are now %d block\n",
-                     (unsigned long)block, tr_atomAddrStr (peer->atom), s->requestCount);*/
-}
-
-static struct block_request *
-requestListLookup (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
-{
-  struct block_request key;
-  key.block = block;
-  key.peer = (tr_peer*) peer;
-
-  return bsearch (&key, s->requests, s->requestCount,
-                  sizeof (struct block_request),
-                  compareReqByBlock);
-}
-
-/**
- * Find the peers are we currently requesting the block
- * with index @a block from and append them to @a peerArr.
- */
-static void
-getBlockRequestPeers (tr_swarm * s, tr_block_index_t block,
-                      tr_ptrArray * peerArr)
-{
-  bool exact;
-  int i, pos;
-  struct block_request key;
-
-  key.block = block;
-  key.peer = NULL;
-  pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                       sizeof (struct block_request),
-                       compareReqByBlock, &exact);
-
-  assert (!exact); /* shouldn't have a request with .peer == NULL */
-
-  for (i=pos; i<s->requestCount; ++i)
-    {
-      if (s->requests[i].block != block)
-        break;
-      tr_ptrArrayAppend (peerArr, s->requests[i].peer);
-    }
-}
-
-static void
-decrementPendingReqCount (const struct block_request * b)
-{
-  if (b->peer != NULL)
-    if (b->peer->pendingReqsToPeer > 0)
-      --b->peer->pendingReqsToPeer;
-}
-
-static void
-requestListRemove (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
-{
-  const struct block_request * b = requestListLookup (s, block, peer);
-
-  if (b != NULL)
-    {
-      const int pos = b - s->requests;
-      assert (pos < s->requestCount);
-
-      decrementPendingReqCount (b);
-
-      tr_removeElementFromArray (s->requests,
-                                 pos,
-                                 sizeof (struct block_request),
-                                 s->requestCount--);
-
-      /*fprintf (stderr, "removing request of block %lu from peer %s... "
-                         "there are now %d block requests left\n",
-                         (unsigned long)block, tr_atomAddrStr (peer->atom), t->requestCount);*/
-    }
-}
-
 static int
 countActiveWebseeds (tr_swarm * s)
 {
@@ -880,15 +1143,13 @@ testForEndgame (const tr_swarm * s)
 {
   /* we consider ourselves to be in endgame if the number of bytes
      we've got requested is >= the number of bytes left to download */
-  return (s->requestCount * s->tor->blockSize)
+  return (tr_requestListCount (&s->requests) * s->tor->blockSize)
                >= tr_cpLeftUntilDone (&s->tor->completion);
 }
 
 static void
 updateEndgame (tr_swarm * s)
 {
-  assert (s->requestCount >= 0);
-
   if (!testForEndgame (s))
     {
       /* not in endgame */
@@ -912,311 +1173,344 @@ updateEndgame (tr_swarm * s)
       numDownloading += countActiveWebseeds (s);
 
       /* average number of pending requests per downloading peer */
-      s->endgame = s->requestCount / MAX (numDownloading, 1);
+      s->endgame = tr_requestListCount (&s->requests) / MAX (numDownloading, 1);
     }
 }
 
 
 /****
 *****
-*****  Piece List Manipulation / Accessors
+*****  Piece Picker
 *****
 ****/
 
+/**
+ * The picker keeps each piece that we want and don't have in one of
+ * three lists, so that picking pieces for a peer only has to look at
+ * the pieces that might be picked:
+ *
+ * 1. "active" pieces that we've started but haven't requested all of,
+ *    oldest first, so that we finish pieces rather than start new ones.
+ *
+ * 2. untouched pieces, in buckets by priority and then by replication,
+ *    so that the highest-priority and rarest pieces are next. A piece
+ *    moves to its new bucket as soon as a HAVE or BITFIELD message
+ *    changes its replication, and a HAVE ALL just shifts the buckets.
+ *
+ * 3. "full" pieces whose missing blocks have all been requested.
+ *    These are only looked at in endgame, when a block can be
+ *    requested from a second peer.
+ */
+
 static inline void
-invalidatePieceSorting (tr_swarm * s)
+pickerInvalidate (tr_swarm * s)
 {
-  s->pieceSortState = PIECES_UNSORTED;
+  s->picker.isValid = false;
 }
 
-static const tr_torrent * weightTorrent;
-
-static const uint16_t * weightReplication;
-
 static void
-setComparePieceByWeightTorrent (tr_swarm * s)
+pickerListAdd (struct piece_picker  * pk,
+               tr_piece_index_t     * head,
+               tr_piece_index_t       i,
+               bool                   at_tail)
 {
-  if (!replicationExists (s))
-    replicationNew (s);
+  struct picker_piece * p = &pk->pieces[i];
 
-  weightTorrent = s->tor;
-  weightReplication = s->pieceReplication;
-}
+  if (*head == PIECE_NONE)
+    {
+      p->prev = i;
+      p->next = PIECE_NONE;
+      *head = i;
+    }
+  else
+    {
+      struct picker_piece * h = &pk->pieces[*head];
+      const tr_piece_index_t tail = h->prev;
 
-/* we try to create a "weight" s.t. high-priority pieces come before others,
- * and that partially-complete pieces come before empty ones. */
-static int
-comparePieceByWeight (const void * va, const void * vb)
-{
-  const struct weighted_piece * a = va;
-  const struct weighted_piece * b = vb;
-  int ia, ib, missing, pending;
-  const tr_torrent * tor = weightTorrent;
-  const uint16_t * rep = weightReplication;
-
-  /* primary key: weight */
-  missing = tr_cpMissingBlocksInPiece (&tor->completion, a->index);
-  pending = a->requestCount;
-  ia = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
-  missing = tr_cpMissingBlocksInPiece (&tor->completion, b->index);
-  pending = b->requestCount;
-  ib = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
-  if (ia < ib) return -1;
-  if (ia > ib) return 1;
-
-  /* secondary key: higher priorities go first */
-  ia = tor->info.pieces[a->index].priority;
-  ib = tor->info.pieces[b->index].priority;
-  if (ia > ib) return -1;
-  if (ia < ib) return 1;
-
-  /* tertiary key: rarest first. */
-  ia = rep[a->index];
-  ib = rep[b->index];
-  if (ia < ib) return -1;
-  if (ia > ib) return 1;
-
-  /* quaternary key: random */
-  if (a->salt < b->salt) return -1;
-  if (a->salt > b->salt) return 1;
-
-  /* okay, they're equal */
-  return 0;
-}
+      p->prev = tail;
+      h->prev = i;
 
-static int
-comparePieceByIndex (const void * va, const void * vb)
-{
-  const struct weighted_piece * a = va;
-  const struct weighted_piece * b = vb;
-  if (a->index < b->index) return -1;
-  if (a->index > b->index) return 1;
-  return 0;
+      if (at_tail)
+        {
+          p->next = PIECE_NONE;
+          pk->pieces[tail].next = i;
+        }
+      else
+        {
+          p->next = *head;
+          *head = i;
+        }
+    }
 }
 
 static void
-pieceListSort (tr_swarm * s, enum piece_sort_state state)
+pickerListRemove (struct piece_picker  * pk,
+                  tr_piece_index_t     * head,
+                  tr_piece_index_t       i)
 {
-  assert (state==PIECES_SORTED_BY_INDEX
-       || state==PIECES_SORTED_BY_WEIGHT);
+  const struct picker_piece * p = &pk->pieces[i];
 
-  if (state == PIECES_SORTED_BY_WEIGHT)
+  if (i == *head)
     {
-      setComparePieceByWeightTorrent (s);
-      qsort (s->pieces, s->pieceCount, sizeof (struct weighted_piece), comparePieceByWeight);
+      *head = p->next;
+      if (*head != PIECE_NONE)
+        pk->pieces[*head].prev = p->prev;
     }
   else
     {
-      qsort (s->pieces, s->pieceCount, sizeof (struct weighted_piece), comparePieceByIndex);
+      pk->pieces[p->prev].next = p->next;
+      if (p->next != PIECE_NONE)
+        pk->pieces[p->next].prev = p->prev;
+      else
+        pk->pieces[*head].prev = p->prev;
     }
-
-  s->pieceSortState = state;
 }
 
-/**
- * These functions are useful for testing, but too expensive for nightly builds.
- * let's leave it disabled but add an easy hook to compile it back in
- */
-#if 1
-#define assertWeightedPiecesAreSorted(t)
-#define assertReplicationCountIsExact(t)
-#else
 static void
-assertWeightedPiecesAreSorted (Torrent * t)
+pickerGrowBuckets (struct piece_picker * pk, int n)
 {
-    if (!t->endgame)
-    {
-        int i;
-        setComparePieceByWeightTorrent (t);
-        for (i=0; i<t->pieceCount-1; ++i)
-            assert (comparePieceByWeight (&t->pieces[i], &t->pieces[i+1]) <= 0);
-    }
-}
-static void
-assertReplicationCountIsExact (Torrent * t)
-{
-    /* This assert might fail due to errors of implementations in other
-     * clients. It happens when receiving duplicate bitfields/HaveAll/HaveNone
-     * from a client. If a such a behavior is noticed,
-     * a bug report should be filled to the faulty client. */
+  int rank, i;
+  tr_piece_index_t * buckets;
+  const int old_n = pk->bucketCount;
 
-    size_t piece_i;
-    const uint16_t * rep = t->pieceReplication;
-    const size_t piece_count = t->pieceReplicationSize;
-    const tr_peer ** peers = (const tr_peer**) tr_ptrArrayBase (&t->peers);
-    const int peer_count = tr_ptrArraySize (&t->peers);
+  n = MAX (n, old_n * 2);
+  n = MAX (n, 16);
+  buckets = tr_new (tr_piece_index_t, PRIORITY_COUNT * n);
 
-    assert (piece_count == t->tor->info.pieceCount);
+  for (rank=0; rank<PRIORITY_COUNT; ++rank)
+    for (i=0; i<n; ++i)
+      buckets[rank*n + i] = i < old_n ? pk->buckets[rank*old_n + i] : PIECE_NONE;
+
+  tr_free (pk->buckets);
+  pk->buckets = buckets;
+  pk->bucketCount = n;
+}
+
+static tr_piece_index_t *
+pickerGetBucket (tr_swarm * s, tr_piece_index_t i, int rep)
+{
+  struct piece_picker * pk = &s->picker;
+  const int rank = TR_PRI_HIGH - s->tor->info.pieces[i].priority;
 
-    for (piece_i=0; piece_i<piece_count; ++piece_i)
-    {
-        int peer_i;
-        uint16_t r = 0;
+  if (rep >= pk->bucketCount)
+    pickerGrowBuckets (pk, rep + 1);
 
-        for (peer_i=0; peer_i<peer_count; ++peer_i)
-            if (tr_bitsetHas (&peers[peer_i]->have, piece_i))
-                ++r;
+  return &pk->buckets[rank * pk->bucketCount + rep];
+}
 
-        assert (rep[piece_i] == r);
+static tr_piece_index_t *
+pickerGetList (tr_swarm * s, tr_piece_index_t i, int list)
+{
+  switch (list)
+    {
+      case PICKER_ACTIVE: return &s->picker.active;
+      case PICKER_FULL: return &s->picker.full;
+      default: return pickerGetBucket (s, i, s->pieceReplication[i]);
     }
 }
-#endif
 
-static struct weighted_piece *
-pieceListLookup (tr_swarm * s, tr_piece_index_t index)
+/* which list should this piece be in? */
+static int
+pickerGetPieceList (const tr_swarm * s, tr_piece_index_t i)
 {
-  int i;
+  int pending;
+  size_t missing;
+  tr_block_index_t first;
+  tr_block_index_t last;
+  const tr_torrent * tor = s->tor;
 
-  for (i=0; i<s->pieceCount; ++i)
-    if (s->pieces[i].index == index)
-      return &s->pieces[i];
+  if (tor->info.pieces[i].dnd || tr_cpPieceIsComplete (&tor->completion, i))
+    return PICKER_NONE;
 
-  return NULL;
+  tr_torGetPieceBlockRange (tor, i, &first, &last);
+  missing = tr_cpMissingBlocksInPiece (&tor->completion, i);
+  pending = s->picker.pieces[i].requestCount;
+
+  if ((pending == 0) && (missing == last + 1 - first))
+    return PICKER_BUCKET;
+
+  if ((size_t)pending >= missing)
+    return PICKER_FULL;
+
+  return PICKER_ACTIVE;
 }
 
+/* call this when a piece's blocks or requests have changed */
 static void
-pieceListRebuild (tr_swarm * s)
+pickerUpdatePiece (tr_swarm * s, tr_piece_index_t i)
 {
-  if (!tr_torrentIsSeed (s->tor))
+  struct piece_picker * pk = &s->picker;
+
+  if (pk->isValid)
     {
-      tr_piece_index_t i;
-      tr_piece_index_t * pool;
-      tr_piece_index_t poolCount = 0;
-      const tr_torrent * tor = s->tor;
-      const tr_info * inf = tr_torrentInfo (tor);
-      struct weighted_piece * pieces;
-      int pieceCount;
-
-      /* build the new list */
-      pool = tr_new (tr_piece_index_t, inf->pieceCount);
-      for (i=0; i<inf->pieceCount; ++i)
-        if (!inf->pieces[i].dnd)
-          if (!tr_cpPieceIsComplete (&tor->completion, i))
-            pool[poolCount++] = i;
-      pieceCount = poolCount;
-      pieces = tr_new0 (struct weighted_piece, pieceCount);
-      for (i=0; i<poolCount; ++i)
-        {
-          struct weighted_piece * piece = pieces + i;
-          piece->index = pool[i];
-          piece->requestCount = 0;
-          piece->salt = tr_cryptoWeakRandInt (4096);
-        }
+      struct picker_piece * p = &pk->pieces[i];
+      const int list = pickerGetPieceList (s, i);
 
-      /* if we already had a list of pieces, merge it into
-       * the new list so we don't lose its requestCounts */
-      if (s->pieces != NULL)
+      if (p->list != list)
         {
-          struct weighted_piece * o = s->pieces;
-          struct weighted_piece * oend = o + s->pieceCount;
-          struct weighted_piece * n = pieces;
-          struct weighted_piece * nend = n + pieceCount;
+          if (p->list != PICKER_NONE)
+            pickerListRemove (pk, pickerGetList (s, i, p->list), i);
 
-          pieceListSort (s, PIECES_SORTED_BY_INDEX);
+          /* shuffle the untouched pieces so that peers don't all pick the same ones */
+          if (list != PICKER_NONE)
+            pickerListAdd (pk, pickerGetList (s, i, list), i,
+                           (list != PICKER_BUCKET) || tr_cryptoWeakRandInt (2));
 
-          while (o!=oend && n!=nend)
-            {
-              if (o->index < n->index)
-                ++o;
-              else if (o->index > n->index)
-                ++n;
-              else
-                *n++ = *o++;
-            }
-
-          tr_free (s->pieces);
+          p->list = list;
         }
+    }
+}
 
-      s->pieces = pieces;
-      s->pieceCount = pieceCount;
-
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+/* call this when a piece's replication has changed from `old_rep' */
+static void
+pickerUpdateReplication (tr_swarm * s, tr_piece_index_t i, int old_rep)
+{
+  struct piece_picker * pk = &s->picker;
 
-      /* cleanup */
-      tr_free (pool);
+  if (pk->isValid && (pk->pieces[i].list == PICKER_BUCKET))
+    {
+      pickerListRemove (pk, pickerGetBucket (s, i, old_rep), i);
+      pickerListAdd (pk, pickerGetBucket (s, i, s->pieceReplication[i]), i,
+                     tr_cryptoWeakRandInt (2));
     }
 }
 
+/* call this when every piece's replication has changed by `delta' */
 static void
-pieceListRemovePiece (tr_swarm * s, tr_piece_index_t piece)
+pickerShiftBuckets (tr_swarm * s, int delta)
 {
-  struct weighted_piece * p;
+  int rank;
+  struct piece_picker * pk = &s->picker;
+
+  assert ((delta == 1) || (delta == -1));
 
-  if ((p = pieceListLookup (s, piece)))
+  if (!pk->isValid)
+    return;
+
+  for (rank=0; rank<PRIORITY_COUNT; ++rank)
     {
-      const int pos = p - s->pieces;
+      const tr_piece_index_t * b = pk->buckets + rank * pk->bucketCount;
+
+      /* make room for the most-replicated bucket to move up */
+      if ((delta > 0) && (b[pk->bucketCount - 1] != PIECE_NONE))
+        pickerGrowBuckets (pk, pk->bucketCount + 1);
+
+      /* if any replication counts were already zero, they're wrong. start over */
+      if ((delta < 0) && (b[0] != PIECE_NONE))
+        {
+          pickerInvalidate (s);
+          return;
+        }
+    }
 
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
+  for (rank=0; rank<PRIORITY_COUNT; ++rank)
+    {
+      const int n = pk->bucketCount;
+      tr_piece_index_t * b = pk->buckets + rank * n;
 
-      if (s->pieceCount == 0)
+      if (delta > 0)
         {
-          tr_free (s->pieces);
-          s->pieces = NULL;
+          memmove (b + 1, b, sizeof (tr_piece_index_t) * (n - 1));
+          b[0] = PIECE_NONE;
+        }
+      else
+        {
+          memmove (b, b + 1, sizeof (tr_piece_index_t) * (n - 1));
+          b[n - 1] = PIECE_NONE;
         }
     }
 }
 
 static void
-pieceListResortPiece (tr_swarm * s, struct weighted_piece * p)
+pickerRebuild (tr_swarm * s)
 {
-  int pos;
-  bool isSorted = true;
-
-  if (p == NULL)
-    return;
+  int j;
+  tr_piece_index_t i;
+  tr_piece_index_t * order;
+  struct piece_picker * pk = &s->picker;
+  const tr_piece_index_t n = s->tor->info.pieceCount;
 
-  /* is the torrent already sorted? */
-  pos = p - s->pieces;
-  setComparePieceByWeightTorrent (s);
-  if (isSorted && (pos > 0) && (comparePieceByWeight (p-1, p) > 0))
-    isSorted = false;
-  if (isSorted && (pos < s->pieceCount - 1) && (comparePieceByWeight (p, p+1) > 0))
-    isSorted = false;
+  if (!replicationExists (s))
+    replicationNew (s);
 
-  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+  /* empty the lists, but keep the pieces' request counts */
+  if (pk->pieceCount != n)
     {
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
-      isSorted = true;
+      tr_free (pk->pieces);
+      pk->pieces = tr_new0 (struct picker_piece, n);
+      pk->pieceCount = n;
     }
 
-  /* if it's not sorted, move it around */
-  if (!isSorted)
+  for (i=0; i<n; ++i)
+    pk->pieces[i].list = PICKER_NONE;
+  for (j=0; j<PRIORITY_COUNT*pk->bucketCount; ++j)
+    pk->buckets[j] = PIECE_NONE;
+  pk->active = PIECE_NONE;
+  pk->full = PIECE_NONE;
+  pk->isValid = true;
+
+  /* add the pieces in random order */
+  order = tr_new (tr_piece_index_t, n);
+  for (i=0; i<n; ++i)
+    order[i] = i;
+  for (i=n; i>1; --i)
     {
-      bool exact;
-      const struct weighted_piece tmp = *p;
+      const tr_piece_index_t k = tr_cryptoWeakRandInt (i);
+      const tr_piece_index_t tmp = order[i-1];
+      order[i-1] = order[k];
+      order[k] = tmp;
+    }
+  for (i=0; i<n; ++i)
+    pickerUpdatePiece (s, order[i]);
+  tr_free (order);
+}
+
+/**
+ * These functions are useful for testing, but too expensive for nightly builds.
+ * let's leave it disabled but add an easy hook to compile it back in
+ */
+#if 1
+#define assertReplicationCountIsExact(t)
+#else
+static void
+assertReplicationCountIsExact (Torrent * t)
+{
+    /* This assert might fail due to errors of implementations in other
+     * clients. It happens when receiving duplicate bitfields/HaveAll/HaveNone
+     * from a client. If a such a behavior is noticed,
+     * a bug report should be filled to the faulty client. */
+
+    size_t piece_i;
+    const uint16_t * rep = t->pieceReplication;
+    const size_t piece_count = t->pieceReplicationSize;
+    const tr_peer ** peers = (const tr_peer**) tr_ptrArrayBase (&t->peers);
+    const int peer_count = tr_ptrArraySize (&t->peers);
 
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
+    assert (piece_count == t->tor->info.pieceCount);
 
-      pos = tr_lowerBound (&tmp, s->pieces, s->pieceCount,
-                           sizeof (struct weighted_piece),
-                           comparePieceByWeight, &exact);
+    for (piece_i=0; piece_i<piece_count; ++piece_i)
+    {
+        int peer_i;
+        uint16_t r = 0;
 
-      memmove (&s->pieces[pos + 1],
-               &s->pieces[pos],
-               sizeof (struct weighted_piece) * (s->pieceCount++ - pos));
+        for (peer_i=0; peer_i<peer_count; ++peer_i)
+            if (tr_bitsetHas (&peers[peer_i]->have, piece_i))
+                ++r;
 
-      s->pieces[pos] = tmp;
+        assert (rep[piece_i] == r);
     }
-
-  assertWeightedPiecesAreSorted (s);
 }
+#endif
 
 static void
 pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
 {
-  struct weighted_piece * p;
   const tr_piece_index_t index = tr_torBlockPiece (s->tor, block);
 
-  if (((p = pieceListLookup (s, index))) && (p->requestCount > 0))
+  if ((index < s->picker.pieceCount) && (s->picker.pieces[index].requestCount > 0))
     {
-      --p->requestCount;
-      pieceListResortPiece (s, p);
+      --s->picker.pieces[index].requestCount;
+      pickerUpdatePiece (s, index);
     }
 }
 
@@ -1240,45 +1534,54 @@ tr_incrReplicationOfPiece (tr_swarm * s, const size_t index)
   /* One more replication of this piece is present in the swarm */
   ++s->pieceReplication[index];
 
-  /* we only resort the piece if the list is already sorted */
-  if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-    pieceListResortPiece (s, pieceListLookup (s, index));
+  pickerUpdateReplication (s, index, s->pieceReplication[index] - 1);
 }
 
 /**
- * Increases the replication count of pieces present in the bitfield
+ * Increase the replication count of every piece
  */
 static void
-tr_incrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
+tr_incrReplication (tr_swarm * s)
 {
-  size_t i;
-  uint16_t * rep = s->pieceReplication;
-  const size_t n = s->tor->info.pieceCount;
+  int i;
+  const int n = s->pieceReplicationSize;
 
   assert (replicationExists (s));
+  assert (s->pieceReplicationSize == s->tor->info.pieceCount);
 
   for (i=0; i<n; ++i)
-    if (tr_bitfieldHas (b, i))
-      ++rep[i];
+    ++s->pieceReplication[i];
 
-  if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-    invalidatePieceSorting (s);
+  pickerShiftBuckets (s, 1);
 }
 
 /**
- * Increase the replication count of every piece
+ * Increases the replication count of pieces present in the bitfield
  */
 static void
-tr_incrReplication (tr_swarm * s)
+tr_incrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
 {
-  int i;
-  const int n = s->pieceReplicationSize;
+  size_t i;
+  uint16_t * rep = s->pieceReplication;
+  const size_t n = s->tor->info.pieceCount;
 
   assert (replicationExists (s));
-  assert (s->pieceReplicationSize == s->tor->info.pieceCount);
 
-  for (i=0; i<n; ++i)
-    ++s->pieceReplication[i];
+  if (tr_bitfieldHasAll (b))
+    {
+      tr_incrReplication (s);
+    }
+  else if (!tr_bitfieldHasNone (b))
+    {
+      for (i=0; i<n; ++i)
+        {
+          if (tr_bitfieldHas (b, i))
+            {
+              ++rep[i];
+              pickerUpdateReplication (s, i, rep[i] - 1);
+            }
+        }
+    }
 }
 
 /**
@@ -1297,15 +1600,19 @@ tr_decrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
     {
       for (i=0; i<n; ++i)
         --s->pieceReplication[i];
+
+      pickerShiftBuckets (s, -1);
     }
   else if (!tr_bitfieldHasNone (b))
     {
       for (i=0; i<n; ++i)
-        if (tr_bitfieldHas (b, i))
-          --s->pieceReplication[i];
-
-      if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-        invalidatePieceSorting (s);
+        {
+          if (tr_bitfieldHas (b, i))
+            {
+              --s->pieceReplication[i];
+              pickerUpdateReplication (s, i, s->pieceReplication[i] + 1);
+            }
+        }
     }
 }
 
@@ -1318,7 +1625,114 @@ tr_peerMgrRebuildRequests (tr_torrent * tor)
 {
   assert (tr_isTorrent (tor));
 
-  pieceListRebuild (tor->swarm);
+  pickerInvalidate (tor->swarm);
+}
+
+/* request the blocks that `peer' can give us from `piece' */
+static int
+pickBlocks (tr_swarm           * s,
+            tr_peer            * peer,
+            tr_piece_index_t     piece,
+            int                  numwant,
+            tr_block_index_t   * setme,
+            int                  got,
+            bool                 get_intervals,
+            time_t               now)
+{
+  tr_block_index_t b;
+  tr_block_index_t first;
+  tr_block_index_t last;
+  const tr_torrent * tor = s->tor;
+
+  tr_torGetPieceBlockRange (tor, piece, &first, &last);
+
+  for (b=first; b<=last && (got<numwant || (get_intervals && setme[2*got-1] == b-1)); ++b)
+    {
+      int peerCount;
+      tr_peer * peers[1];
+
+      /* don't request blocks we've already got */
+      if (tr_cpBlockIsComplete (&tor->completion, b))
+        continue;
+
+      /* always add peer if this block has no peers yet */
+      peerCount = tr_requestListGetPeers (&s->requests, b, peers, 1);
+      if (peerCount != 0)
+        {
+          /* don't make a second block request until the endgame */
+          if (!s->endgame)
+            continue;
+
+          /* don't have more than two peers requesting this block */
+          if (peerCount > 1)
+            continue;
+
+          /* don't send the same request to the same peer twice */
+          if (peer == peers[0])
+            continue;
+
+          /* in the endgame allow an additional peer to download a
+             block but only if the peer seems to be handling requests
+             relatively fast */
+          if (peer->pendingReqsToPeer + numwant - got < s->endgame)
+            continue;
+        }
+
+      /* update the caller's table */
+      if (!get_intervals)
+        {
+          setme[got++] = b;
+        }
+      /* if intervals are requested two array entries are necessarry:
+         one for the interval's starting block and one for its end block */
+      else if (got && setme[2 * got - 1] == b - 1 && b != first)
+        {
+          /* expand the last interval */
+          ++setme[2 * got - 1];
+        }
+      else
+        {
+          /* begin a new interval */
+          setme[2 * got] = setme[2 * got + 1] = b;
+          ++got;
+        }
+
+      /* update our own tables */
+      tr_requestListAdd (&s->requests, b, peer, now);
+      ++s->picker.pieces[piece].requestCount;
+    }
+
+  return got;
+}
+
+/* pick blocks from each piece in the list that the peer has */
+static int
+pickFromList (tr_swarm           * s,
+              tr_peer            * peer,
+              tr_piece_index_t     head,
+              int                  numwant,
+              tr_block_index_t   * setme,
+              int                  got,
+              bool                 get_intervals,
+              time_t               now)
+{
+  tr_piece_index_t i = head;
+
+  while ((i != PIECE_NONE) && (got < numwant))
+    {
+      /* picking from the piece might move it to another list */
+      const tr_piece_index_t next = s->picker.pieces[i].next;
+
+      if (tr_bitfieldHas (&peer->have, i))
+        {
+          got = pickBlocks (s, peer, i, numwant, setme, got, get_intervals, now);
+          pickerUpdatePiece (s, i);
+        }
+
+      i = next;
+    }
+
+  return got;
 }
 
 void
@@ -1329,11 +1743,12 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
                            int                  * numgot,
                            bool                   get_intervals)
 {
-  int i;
   int got;
+  int rank;
+  int rep;
   tr_swarm * s;
-  struct weighted_piece * pieces;
-  const tr_bitfield * const have = &peer->have;
+  struct piece_picker * pk;
+  const time_t now = tr_time ();
 
   /* sanity clause */
   assert (tr_isTorrent (tor));
@@ -1342,126 +1757,29 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
   /* walk through the pieces and find blocks that should be requested */
   got = 0;
   s = tor->swarm;
+  pk = &s->picker;
 
   /* prep the pieces list */
-  if (s->pieces == NULL)
-    pieceListRebuild (s);
-
-  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-    pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+  if (!pk->isValid)
+    pickerRebuild (s);
 
   assertReplicationCountIsExact (s);
-  assertWeightedPiecesAreSorted (s);
 
   updateEndgame (s);
-  pieces = s->pieces;
-  for (i=0; i<s->pieceCount && got<numwant; ++i)
-    {
-      struct weighted_piece * p = pieces + i;
-
-      /* if the peer has this piece that we want... */
-      if (tr_bitfieldHas (have, p->index))
-        {
-          tr_block_index_t b;
-          tr_block_index_t first;
-          tr_block_index_t last;
-          tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
-
-          tr_torGetPieceBlockRange (tor, p->index, &first, &last);
-
-          for (b=first; b<=last && (got<numwant || (get_intervals && setme[2*got-1] == b-1)); ++b)
-            {
-              int peerCount;
-              tr_peer ** peers;
-
-              /* don't request blocks we've already got */
-              if (tr_cpBlockIsComplete (&tor->completion, b))
-                continue;
-
-              /* always add peer if this block has no peers yet */
-              tr_ptrArrayClear (&peerArr);
-              getBlockRequestPeers (s, b, &peerArr);
-              peers = (tr_peer **) tr_ptrArrayPeek (&peerArr, &peerCount);
-              if (peerCount != 0)
-                {
-                  /* don't make a second block request until the endgame */
-                  if (!s->endgame)
-                    continue;
-
-                  /* don't have more than two peers requesting this block */
-                  if (peerCount > 1)
-                    continue;
-
-                  /* don't send the same request to the same peer twice */
-                  if (peer == peers[0])
-                    continue;
-
-                  /* in the endgame allow an additional peer to download a
-                     block but only if the peer seems to be handling requests
-                     relatively fast */
-                  if (peer->pendingReqsToPeer + numwant - got < s->endgame)
-                    continue;
-                }
-
-              /* update the caller's table */
-              if (!get_intervals)
-                {
-                  setme[got++] = b;
-                }
-              /* if intervals are requested two array entries are necessarry:
-                 one for the interval's starting block and one for its end block */
-              else if (got && setme[2 * got - 1] == b - 1 && b != first)
-                {
-                  /* expand the last interval */
-                  ++setme[2 * got - 1];
-                }
-              else
-                {
-                  /* begin a new interval */
-                  setme[2 * got] = setme[2 * got + 1] = b;
-                  ++got;
-                }
-
-              /* update our own tables */
-              requestListAdd (s, b, peer);
-              ++p->requestCount;
-            }
 
-          tr_ptrArrayDestruct (&peerArr, NULL);
-        }
-    }
+  /* first, the pieces that we've already started... */
+  got = pickFromList (s, peer, pk->active, numwant, setme, got, get_intervals, now);
 
-  /* In most cases we've just changed the weights of a small number of pieces.
-   * So rather than qsort ()ing the entire array, it's faster to apply an
-   * adaptive insertion sort algorithm. */
-  if (got > 0)
-    {
-      /* not enough requests || last piece modified */
-      if (i == s->pieceCount)
-        --i;
+  /* then untouched pieces, highest priority and rarest first... */
+  for (rank=0; rank<PRIORITY_COUNT && got<numwant; ++rank)
+    for (rep=0; rep<pk->bucketCount && got<numwant; ++rep)
+      got = pickFromList (s, peer, pk->buckets[rank * pk->bucketCount + rep],
+                          numwant, setme, got, get_intervals, now);
 
-      setComparePieceByWeightTorrent (s);
-      while (--i >= 0)
-        {
-          bool exact;
-
-          /* relative position! */
-          const int newpos = tr_lowerBound (&s->pieces[i], &s->pieces[i + 1],
-                                            s->pieceCount - (i + 1),
-                                            sizeof (struct weighted_piece),
-                                            comparePieceByWeight, &exact);
-          if (newpos > 0)
-            {
-              const struct weighted_piece piece = s->pieces[i];
-              memmove (&s->pieces[i],
-                       &s->pieces[i + 1],
-                       sizeof (struct weighted_piece) * (newpos));
-              s->pieces[i + newpos] = piece;
-            }
-        }
-    }
+  /* and in endgame, blocks that other peers are already sending */
+  if (s->endgame)
+    got = pickFromList (s, peer, pk->full, numwant, setme, got, get_intervals, now);
 
-  assertWeightedPiecesAreSorted (t);
   *numgot = got;
 }
 
@@ -1470,81 +1788,53 @@ tr_peerMgrDidPeerRequest (const tr_torrent  * tor,
                           const tr_peer     * peer,
                           tr_block_index_t    block)
 {
-  return requestListLookup ((tr_swarm*)tor->swarm, block, peer) != NULL;
+  return tr_requestListFind (&tor->swarm->requests, block, peer) != NULL;
 }
 
 /* cancel requests that are too old */
 static void
 refillUpkeep (int foo UNUSED, short bar UNUSED, void * vmgr)
 {
+    int j;
     time_t now;
     time_t too_old;
-    tr_torrent * tor;
-    int cancel_buflen = 0;
-    struct block_request * cancel = NULL;
     tr_peerMgr * mgr = vmgr;
     managerLock (mgr);
 
     now = tr_time ();
     too_old = now - REQUEST_TTL_SECS;
 
-    /* alloc the temporary "cancel" buffer */
-    tor = NULL;
-    while ((tor = tr_torrentNext (mgr->session, tor)))
-        cancel_buflen = MAX (cancel_buflen, tor->swarm->requestCount);
-    if (cancel_buflen > 0)
-        cancel = tr_new (struct block_request, cancel_buflen);
-
-    /* prune requests that are too old */
-    tor = NULL;
-    while ((tor = tr_torrentNext (mgr->session, tor)))
+    /* prune requests that are too old. each peer's requests are
+       oldest first, so we only need to look at the expired ones */
+    for (j=0; j<tr_ptrArraySize (&mgr->peerSwarms); ++j)
     {
-        tr_swarm * s = tor->swarm;
-        const int n = s->requestCount;
-        if (n > 0)
+        int i;
+        tr_swarm * s = tr_ptrArrayNth (&mgr->peerSwarms, j);
+        const int n = tr_ptrArraySize (&s->peers);
+
+        for (i=0; i<n; ++i)
         {
-            int keepCount = 0;
-            int cancelCount = 0;
-            const struct block_request * it;
-            const struct block_request * end;
+            tr_peer * peer = tr_ptrArrayNth (&s->peers, i);
+            tr_request * req = tr_requestListPeerFirst (peer);
 
-            for (it=s->requests, end=it+n; it!=end; ++it)
+            while ((req != NULL) && (req->sentAt <= too_old))
             {
-                tr_peerMsgs * msgs = PEER_MSGS(it->peer);
+                tr_request * next = tr_requestListPeerNext (req);
+                const tr_block_index_t block = req->block;
 
-                if ((msgs !=NULL) && (it->sentAt <= too_old) && !tr_peerMsgsIsReadingBlock (msgs, it->block))
-                    cancel[cancelCount++] = *it;
-                else
+                if (!(*peer->funcs->is_reading_block)(peer, block))
                 {
-                    if (it != &s->requests[keepCount])
-                        s->requests[keepCount] = *it;
-                    keepCount++;
+                    tr_requestListRemove (&s->requests, req);
+                    tr_historyAdd (&peer->cancelsSentToPeer, now, 1);
+                    (*peer->funcs->cancel)(peer, block);
+                    pieceListRemoveRequest (s, block);
                 }
-            }
-
-            /* prune out the ones we aren't keeping */
-            s->requestCount = keepCount;
 
-            /* send cancel messages for all the "cancel" ones */
-            for (it=cancel, end=it+cancelCount; it!=end; ++it)
-            {
-              tr_peerMsgs * msgs = PEER_MSGS(it->peer);
-
-              if (msgs != NULL)
-                {
-                  tr_historyAdd (&it->peer->cancelsSentToPeer, now, 1);
-                  tr_peerMsgsCancel (msgs, it->block);
-                  decrementPendingReqCount (it);
-                }
+                req = next;
             }
-
-            /* decrement the pending request counts for the timed-out blocks */
-            for (it=cancel, end=it+cancelCount; it!=end; ++it)
-                pieceListRemoveRequest (s, it->block);
         }
     }
 
-    tr_free (cancel);
     tr_timerAddMsec (mgr->refillUpkeepTimer, REFILL_UPKEEP_PERIOD_MSEC);
     managerUnlock (mgr);
 }
@@ -1617,7 +1907,11 @@ peerSuggestedPiece (tr_swarm           * s UNUSED,
 static void
 removeRequestFromTables (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 {
-  requestListRemove (s, block, peer);
+  tr_request * req = tr_requestListFind (&s->requests, block, peer);
+
+  if (req != NULL)
+    tr_requestListRemove (&s->requests, req);
+
   pieceListRemoveRequest (s, block);
 }
 
@@ -1626,17 +1920,14 @@ removeRequestFromTables (tr_swarm * s, tr_block_index_t block, const tr_peer * p
 static void
 peerDeclinedAllRequests (tr_swarm * s, const tr_peer * peer)
 {
-  int i, n;
-  tr_block_index_t * blocks = tr_new (tr_block_index_t, s->requestCount);
+  tr_request * req;
 
-  for (i=n=0; i<s->requestCount; ++i)
-    if (peer == s->requests[i].peer)
-      blocks[n++] = s->requests[i].block;
-
-  for (i=0; i<n; ++i)
-    removeRequestFromTables (s, blocks[i], peer);
-
-  tr_free (blocks);
+  while ((req = tr_requestListPeerFirst (peer)))
+    {
+      const tr_block_index_t block = req->block;
+      tr_requestListRemove (&s->requests, req);
+      pieceListRemoveRequest (s, block);
+    }
 }
 
 static void
@@ -1646,26 +1937,33 @@ cancelAllRequestsForBlock (tr_swarm          * s,
 {
   int i;
   int peerCount;
-  tr_peer ** peers;
-  tr_ptrArray peerArr;
+  tr_peer * buf[4];
+  tr_peer ** peers = buf;
+  const int buflen = sizeof (buf) / sizeof (buf[0]);
+
+  peerCount = tr_requestListGetPeers (&s->requests, block, buf, buflen);
+  if (peerCount > buflen)
+    {
+      peers = tr_new (tr_peer*, peerCount);
+      tr_requestListGetPeers (&s->requests, block, peers, peerCount);
+    }
 
-  peerArr = TR_PTR_ARRAY_INIT;
-  getBlockRequestPeers (s, block, &peerArr);
-  peers = (tr_peer **) tr_ptrArrayPeek (&peerArr, &peerCount);
   for (i=0; i<peerCount; ++i)
     {
       tr_peer * p = peers[i];
 
-      if ((p != no_notify) && tr_isPeerMsgs (p))
+      /* webseeds can't be told */
+      if ((p != no_notify) && (p->funcs->cancel != NULL))
         {
           tr_historyAdd (&p->cancelsSentToPeer, tr_time (), 1);
-          tr_peerMsgsCancel (PEER_MSGS(p), block);
+          (*p->funcs->cancel)(p, block);
         }
 
       removeRequestFromTables (s, block, p);
     }
 
-  tr_ptrArrayDestruct (&peerArr, NULL);
+  if (peers != buf)
+    tr_free (peers);
 }
 
 void
@@ -1682,7 +1980,7 @@ tr_peerMgrPieceCompleted (tr_torrent * tor, tr_piece_index_t p)
       tr_peer * peer = tr_ptrArrayNth (&s->peers, i);
 
       /* notify the peer that we now have this piece */
-      tr_peerMsgsHave (PEER_MSGS(peer), p);
+      (*peer->funcs->have)(peer, p);
 
       if (!pieceCameFromPeers)
         pieceCameFromPeers = tr_bitfieldHas (&peer->blame, p);
@@ -1692,8 +1990,9 @@ tr_peerMgrPieceCompleted (tr_torrent * tor, tr_piece_index_t p)
     tr_announcerAddBytes (tor, TR_ANN_DOWN, tr_torPieceCountBytes (tor, p));
 
   /* bookkeeping */
-  pieceListRemovePiece (s, p);
+  pickerUpdatePiece (s, p);
   s->needsCompletenessCheck = true;
+  swarmSetInclude (&s->manager->upkeepSwarms, s, true);
 }
 
 static void
@@ -1805,8 +2104,8 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
           const tr_block_index_t block = _tr_block (tor, p, e->offset);
           cancelAllRequestsForBlock (s, block, peer);
           tr_historyAdd (&peer->blocksSentToClient, tr_time(), 1);
-          pieceListResortPiece (s, pieceListLookup (s, p));
           tr_torrentGotBlock (tor, block);
+          pickerUpdatePiece (s, p);
           break;
         }
 
@@ -1867,8 +2166,7 @@ ensureAtomExists (tr_swarm          * s,
   if (a == NULL)
     {
       const int jitter = tr_cryptoWeakRandInt (60*10);
-      a = tr_new0 (struct peer_atom, 1);
-      a->addr = *addr;
+      a = atomNew (s, addr);
       a->port = port;
       a->flags = flags;
       a->fromFirst = from;
@@ -1876,7 +2174,6 @@ ensureAtomExists (tr_swarm          * s,
       a->shelf_date = tr_time () + getDefaultShelfLife (from) + jitter;
       a->blocklisted = -1;
       atomSetSeedProbability (a, seedProbability);
-      tr_ptrArrayInsertSorted (&s->pool, a, compareAtomsByAddress);
 
       tordbg (s, "got a new atom: %s", tr_atomAddrStr (a));
     }
@@ -1890,6 +2187,8 @@ ensureAtomExists (tr_swarm          * s,
 
       a->flags |= flags;
     }
+
+  atomUpdateCandidate (a, tr_time ());
 }
 
 static int
@@ -1904,6 +2203,40 @@ getPeerCount (const tr_swarm * s)
   return tr_ptrArraySize (&s->peers);/* + tr_ptrArraySize (&t->outgoingHandshakes); */
 }
 
+static int
+getManagerPeerCount (tr_peerMgr * mgr)
+{
+  int i;
+  int peerCount = 0;
+
+  for (i=0; i<tr_ptrArraySize (&mgr->peerSwarms); ++i)
+    peerCount += getPeerCount (tr_ptrArrayNth (&mgr->peerSwarms, i));
+
+  return peerCount;
+}
+
+
+static void
+swarmAddPeer (tr_swarm         * swarm,
+              tr_peer          * peer,
+              struct peer_atom * atom,
+              tr_quark           client)
+{
+  peer->atom = atom;
+  peer->client = client;
+  atom->peer = peer;
+
+  tr_ptrArrayInsertSorted (&swarm->peers, peer, peerCompare);
+  swarmUpdateActivity (swarm);
+  ++swarm->stats.peerCount;
+  ++swarm->stats.peerFromCount[atom->fromFirst];
+
+  assert (swarm->stats.peerCount == tr_ptrArraySize (&swarm->peers));
+  assert (swarm->stats.peerFromCount[atom->fromFirst] <= swarm->stats.peerCount);
+
+  (*peer->funcs->update_active)(peer, TR_UP);
+  (*peer->funcs->update_active)(peer, TR_DOWN);
+}
 
 static void
 createBitTorrentPeer (tr_torrent       * tor,
@@ -1912,7 +2245,6 @@ createBitTorrentPeer (tr_torrent       * tor,
                       tr_quark           client)
 {
   tr_peer * peer;
-  tr_peerMsgs * msgs;
   tr_swarm * swarm;
 
   assert (atom != NULL);
@@ -1921,21 +2253,11 @@ createBitTorrentPeer (tr_torrent       * tor,
 
   swarm = tor->swarm;
 
-  peer = (tr_peer*) tr_peerMsgsNew (tor, io, peerCallbackFunc, swarm);
-  peer->atom = atom;
-  peer->client = client;
-  atom->peer = peer;
-
-  tr_ptrArrayInsertSorted (&swarm->peers, peer, peerCompare);
-  ++swarm->stats.peerCount;
-  ++swarm->stats.peerFromCount[atom->fromFirst];
-
-  assert (swarm->stats.peerCount == tr_ptrArraySize (&swarm->peers));
-  assert (swarm->stats.peerFromCount[atom->fromFirst] <= swarm->stats.peerCount);
+  /* the handshake's done, so the socket's traffic can go to its loop */
+  tr_peerIoSetShard (io, swarm->shard);
 
-  msgs = PEER_MSGS (peer);
-  tr_peerMsgsUpdateActive (msgs, TR_UP);
-  tr_peerMsgsUpdateActive (msgs, TR_DOWN);
+  peer = (tr_peer*) tr_peerMsgsNew (tor, io, peerCallbackFunc, swarm);
+  swarmAddPeer (swarm, peer, atom, client);
 }
 
 
@@ -1980,6 +2302,22 @@ myHandshakeDoneCB (tr_handshake  * handshake,
 
   addr = tr_peerIoGetAddress (io, &port);
 
+  /* let the connection rate know how our attempt went */
+  if (s && !tr_peerIoIsIncoming (io))
+    {
+      const struct peer_atom * atom = getExistingAtom (s, addr);
+
+      if (atom == NULL)
+        ;
+      else if (ok)
+        tr_connectRateAddResult (&manager->connectRate, TR_CONNECT_CONNECTED,
+                                 tr_time_msec () - atom->connectStartedMsec);
+      else if (readAnythingFromPeer)
+        tr_connectRateAddResult (&manager->connectRate, TR_CONNECT_FAILED, 0);
+      else
+        tr_connectRateAddResult (&manager->connectRate, TR_CONNECT_UNREACHABLE, 0);
+    }
+
   if (!ok || !s || !s->isRunning)
     {
       if (s)
@@ -2054,8 +2392,16 @@ myHandshakeDoneCB (tr_handshake  * handshake,
         }
     }
 
-  if (s != NULL)
-    swarmUnlock (s);
+  if (s != NULL)
+    {
+      struct peer_atom * atom = getExistingAtom (s, addr);
+
+      /* the handshake's over, so it might be a candidate again */
+      if (atom != NULL)
+        atomUpdateCandidate (atom, tr_time ());
+
+      swarmUnlock (s);
+    }
 
   return success;
 }
@@ -2131,12 +2477,10 @@ void
 tr_peerMgrMarkAllAsSeeds (tr_torrent * tor)
 {
   tr_swarm * s = tor->swarm;
-  const int n = tr_ptrArraySize (&s->pool);
-  struct peer_atom ** it = (struct peer_atom**) tr_ptrArrayBase (&s->pool);
-  struct peer_atom ** end = it + n;
+  struct peer_atom * atom;
 
-  while (it != end)
-    atomSetSeed (s, *it++);
+  for (atom=atomPoolNext (s, NULL); atom!=NULL; atom=atomPoolNext (s, atom))
+    atomSetSeed (s, atom);
 }
 
 tr_pex *
@@ -2237,6 +2581,9 @@ tr_peerMgrGotBadPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
 
 
   tr_announcerAddBytes (tor, TR_ANN_CORRUPT, byteCount);
+
+  /* its blocks are missing again */
+  pickerUpdatePiece (s, pieceIndex);
 }
 
 int
@@ -2334,13 +2681,11 @@ tr_peerMgrGetPeers (tr_torrent   * tor,
     }
   else /* TR_PEERS_INTERESTING */
     {
-      int i;
-      struct peer_atom ** atomBase = (struct peer_atom**) tr_ptrArrayBase (&s->pool);
-      n = tr_ptrArraySize (&s->pool);
-      atoms = tr_new (struct peer_atom *, n);
-      for (i=0; i<n; ++i)
-        if (isAtomInteresting (tor, atomBase[i]))
-          atoms[atomCount++] = atomBase[i];
+      struct peer_atom * atom;
+      atoms = tr_new (struct peer_atom *, s->atomCount);
+      for (atom=atomPoolNext (s, NULL); atom!=NULL; atom=atomPoolNext (s, atom))
+        if (isAtomInteresting (tor, atom))
+          atoms[atomCount++] = atom;
     }
 
   qsort (atoms, atomCount, sizeof (struct peer_atom *), compareAtomsByUsefulness);
@@ -2419,7 +2764,9 @@ tr_peerMgrStartTorrent (tr_torrent * tor)
 
   s->isRunning = true;
   s->maxPeers = tor->maxConnectedPeers;
-  s->pieceSortState = PIECES_UNSORTED;
+  pickerInvalidate (s);
+  swarmSetInclude (&s->manager->upkeepSwarms, s, true);
+  swarmUpdateCandidates (s);
 
   rechokePulse (0, 0, s->manager);
 }
@@ -2432,7 +2779,7 @@ stopSwarm (tr_swarm * swarm)
   swarm->isRunning = false;
 
   replicationFree (swarm);
-  invalidatePieceSorting (swarm);
+  pickerInvalidate (swarm);
 
   removeAllPeers (swarm);
 
@@ -2440,6 +2787,8 @@ stopSwarm (tr_swarm * swarm)
    * which removes the handshake from t->outgoingHandshakes... */
   while (!tr_ptrArrayEmpty (&swarm->outgoingHandshakes))
     tr_handshakeAbort (tr_ptrArrayNth (&swarm->outgoingHandshakes, 0));
+
+  swarmUpdateCandidates (swarm);
 }
 
 void
@@ -2528,8 +2877,8 @@ tr_peerMgrOnTorrentGotMetainfo (tr_torrent * tor)
   /* update the bittorrent peers' willingnes... */
   for (i=0; i<peerCount; ++i)
     {
-      tr_peerMsgsUpdateActive (tr_peerMsgsCast(peers[i]), TR_UP);
-      tr_peerMsgsUpdateActive (tr_peerMsgsCast(peers[i]), TR_DOWN);
+      (*peers[i]->funcs->update_active)(peers[i], TR_UP);
+      (*peers[i]->funcs->update_active)(peers[i], TR_DOWN);
     }
 }
 
@@ -2711,7 +3060,6 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
     {
       char *                   pch;
       tr_peer *                peer = peers[i];
-      tr_peerMsgs *            msgs = PEER_MSGS (peer);
       const struct peer_atom * atom = peer->atom;
       tr_peer_stat *           stat = ret + i;
 
@@ -2720,17 +3068,17 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
       stat->port                = ntohs (peer->atom->port);
       stat->from                = atom->fromFirst;
       stat->progress            = peer->progress;
-      stat->isUTP               = tr_peerMsgsIsUtpConnection (msgs);
-      stat->isEncrypted         = tr_peerMsgsIsEncrypted (msgs);
+      stat->isUTP               = (*peer->funcs->is_utp_connection)(peer);
+      stat->isEncrypted         = (*peer->funcs->is_encrypted)(peer);
       stat->rateToPeer_KBps     = toSpeedKBps (tr_peerGetPieceSpeed_Bps (peer, now_msec, TR_CLIENT_TO_PEER));
       stat->rateToClient_KBps   = toSpeedKBps (tr_peerGetPieceSpeed_Bps (peer, now_msec, TR_PEER_TO_CLIENT));
-      stat->peerIsChoked        = tr_peerMsgsIsPeerChoked (msgs);
-      stat->peerIsInterested    = tr_peerMsgsIsPeerInterested (msgs);
-      stat->clientIsChoked      = tr_peerMsgsIsClientChoked (msgs);
-      stat->clientIsInterested  = tr_peerMsgsIsClientInterested (msgs);
-      stat->isIncoming          = tr_peerMsgsIsIncomingConnection (msgs);
-      stat->isDownloadingFrom   = tr_peerMsgsIsActive (msgs, TR_PEER_TO_CLIENT);
-      stat->isUploadingTo       = tr_peerMsgsIsActive (msgs, TR_CLIENT_TO_PEER);
+      stat->peerIsChoked        = (*peer->funcs->is_peer_choked)(peer);
+      stat->peerIsInterested    = (*peer->funcs->is_peer_interested)(peer);
+      stat->clientIsChoked      = (*peer->funcs->is_client_choked)(peer);
+      stat->clientIsInterested  = (*peer->funcs->is_client_interested)(peer);
+      stat->isIncoming          = (*peer->funcs->is_incoming_connection)(peer);
+      stat->isDownloadingFrom   = (*peer->funcs->is_active)(peer, TR_PEER_TO_CLIENT);
+      stat->isUploadingTo       = (*peer->funcs->is_active)(peer, TR_CLIENT_TO_PEER);
       stat->isSeed              = tr_peerIsSeed (peer);
 
       stat->blocksToPeer        = tr_historyGet (&peer->blocksSentToPeer,    now, CANCEL_HISTORY_SEC);
@@ -2743,7 +3091,7 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
 
       pch = stat->flagStr;
       if (stat->isUTP) *pch++ = 'T';
-      if (s->optimistic == msgs) *pch++ = 'O';
+      if (s->optimistic == peer) *pch++ = 'O';
       if (stat->isDownloadingFrom) *pch++ = 'D';
       else if (stat->clientIsInterested) *pch++ = 'd';
       if (stat->isUploadingTo) *pch++ = 'U';
@@ -2777,7 +3125,10 @@ tr_peerMgrClearInterest (tr_torrent * tor)
   assert (tr_torrentIsLocked (tor));
 
   for (i=0; i<peerCount; ++i)
-    tr_peerMsgsSetInterested (tr_ptrArrayNth (&s->peers, i), false);
+    {
+      tr_peer * peer = tr_ptrArrayNth (&s->peers, i);
+      (*peer->funcs->set_interested)(peer, false);
+    }
 }
 
 /* does this peer have any pieces that we want? */
@@ -2933,7 +3284,7 @@ rechokeDownloads (tr_swarm * s)
 
           if (!isPeerInteresting (s->tor, piece_is_interesting, peer))
             {
-              tr_peerMsgsSetInterested (PEER_MSGS(peer), false);
+              (*peer->funcs->set_interested)(peer, false);
             }
           else
             {
@@ -2970,7 +3321,7 @@ rechokeDownloads (tr_swarm * s)
   qsort (rechoke, rechoke_count, sizeof (struct tr_rechoke_info), compare_rechoke_info);
   s->interestedCount = MIN (maxPeers, rechoke_count);
   for (i=0; i<rechoke_count; ++i)
-    tr_peerMsgsSetInterested (PEER_MSGS(rechoke[i].peer), i<s->interestedCount);
+    (*rechoke[i].peer->funcs->set_interested)(rechoke[i].peer, i<s->interestedCount);
 
   /* cleanup */
   tr_free (rechoke);
@@ -2987,7 +3338,7 @@ struct ChokeData
   bool          isChoked;
   int           rate;
   int           salt;
-  tr_peerMsgs * msgs;
+  tr_peer     * peer;
 };
 
 static int
@@ -3010,9 +3361,9 @@ compareChoke (const void * va, const void * vb)
 
 /* is this a new connection? */
 static bool
-isNew (const tr_peerMsgs * msgs)
+isNew (const tr_peer * peer)
 {
-  return (msgs != NULL) && (tr_peerMsgsGetConnectionAge (msgs) < 45);
+  return (peer != NULL) && ((*peer->funcs->get_connection_age)(peer) < 45);
 }
 
 /* get a rate for deciding which peers to choke and unchoke. */
@@ -3078,24 +3429,23 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
   for (i=0, size=0; i<peerCount; ++i)
     {
       tr_peer * peer = peers[i];
-      tr_peerMsgs * msgs = PEER_MSGS (peer);
 
       struct peer_atom * atom = peer->atom;
 
       if (tr_peerIsSeed (peer)) /* choke seeds and partial seeds */
         {
-          tr_peerMsgsSetChoke (PEER_MSGS(peer), true);
+          (*peer->funcs->set_choke)(peer, true);
         }
       else if (chokeAll) /* choke everyone if we're not uploading */
         {
-          tr_peerMsgsSetChoke (PEER_MSGS(peer), true);
+          (*peer->funcs->set_choke)(peer, true);
         }
-      else if (msgs != s->optimistic)
+      else if (peer != s->optimistic)
         {
           struct ChokeData * n = &choke[size++];
-          n->msgs         = msgs;
-          n->isInterested = tr_peerMsgsIsPeerInterested (msgs);
-          n->wasChoked    = tr_peerMsgsIsPeerChoked (msgs);
+          n->peer         = peer;
+          n->isInterested = (*peer->funcs->is_peer_interested)(peer);
+          n->wasChoked    = (*peer->funcs->is_peer_choked)(peer);
           n->rate         = getRate (s->tor, atom, now);
           n->salt         = tr_cryptoWeakRandInt (INT_MAX);
           n->isChoked     = true;
@@ -3138,9 +3488,8 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
         {
           if (choke[i].isInterested)
             {
-              const tr_peerMsgs * msgs = choke[i].msgs;
               int x = 1, y;
-              if (isNew (msgs)) x *= 3;
+              if (isNew (choke[i].peer)) x *= 3;
               for (y=0; y<x; ++y)
                 tr_ptrArrayAppend (&randPool, &choke[i]);
             }
@@ -3150,7 +3499,7 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
         {
           c = tr_ptrArrayNth (&randPool, tr_cryptoWeakRandInt (n));
           c->isChoked = false;
-          s->optimistic = c->msgs;
+          s->optimistic = c->peer;
           s->optimisticUnchokeTimeScaler = OPTIMISTIC_UNCHOKE_MULTIPLIER;
         }
 
@@ -3158,7 +3507,7 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
     }
 
   for (i=0; i<size; ++i)
-    tr_peerMsgsSetChoke (choke[i].msgs, choke[i].isChoked);
+    (*choke[i].peer->funcs->set_choke)(choke[i].peer, choke[i].isChoked);
 
   /* cleanup */
   tr_free (choke);
@@ -3167,23 +3516,20 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
 static void
 rechokePulse (int foo UNUSED, short bar UNUSED, void * vmgr)
 {
-  tr_torrent * tor = NULL;
+  int i;
   tr_peerMgr * mgr = vmgr;
   const uint64_t now = tr_time_msec ();
 
   managerLock (mgr);
 
-  while ((tor = tr_torrentNext (mgr->session, tor)))
+  for (i=0; i<tr_ptrArraySize (&mgr->peerSwarms); ++i)
     {
-      if (tor->isRunning)
-        {
-          tr_swarm * s = tor->swarm;
+      tr_swarm * s = tr_ptrArrayNth (&mgr->peerSwarms, i);
 
-          if (s->stats.peerCount > 0)
-            {
-              rechokeUploads (s, now);
-              rechokeDownloads (s);
-            }
+      if (s->tor->isRunning)
+        {
+          rechokeUploads (s, now);
+          rechokeDownloads (s);
         }
     }
 
@@ -3316,6 +3662,7 @@ removePeer (tr_swarm * s, tr_peer * peer)
   atom->time = tr_time ();
 
   removed = tr_ptrArrayRemoveSorted (&s->peers, peer, peerCompare);
+  swarmUpdateActivity (s);
   --s->stats.peerCount;
   --s->stats.peerFromCount[atom->fromFirst];
 
@@ -3327,6 +3674,8 @@ removePeer (tr_swarm * s, tr_peer * peer)
   assert (s->stats.peerFromCount[atom->fromFirst] >= 0);
 
   tr_peerFree (removed);
+
+  atomUpdateCandidate (atom, atom->time);
 }
 
 static void
@@ -3481,15 +3830,16 @@ enforceTorrentPeerLimit (tr_swarm * s, uint64_t now)
 }
 
 static void
-enforceSessionPeerLimit (tr_session * session, uint64_t now)
+enforceSessionPeerLimit (tr_peerMgr * mgr, uint64_t now)
 {
-  int n = 0;
-  tr_torrent * tor = NULL;
-  const int max = tr_sessionGetPeerLimit (session);
+  int i, n = 0;
+  const int swarmCount = tr_ptrArraySize (&mgr->peerSwarms);
+  tr_swarm ** peerSwarms = (tr_swarm**) tr_ptrArrayBase (&mgr->peerSwarms);
+  const int max = tr_sessionGetPeerLimit (mgr->session);
 
   /* count the total number of peers */
-  while ((tor = tr_torrentNext (session, tor)))
-    n += tr_ptrArraySize (&tor->swarm->peers);
+  for (i=0; i<swarmCount; ++i)
+    n += tr_ptrArraySize (&peerSwarms[i]->peers);
 
   /* if there are too many, prune out the worst */
   if (n > max)
@@ -3499,15 +3849,14 @@ enforceSessionPeerLimit (tr_session * session, uint64_t now)
 
       /* populate the peer array */
       n = 0;
-      tor = NULL;
-      while ((tor = tr_torrentNext (session, tor)))
+      for (i=0; i<swarmCount; ++i)
         {
-          int i;
-          tr_swarm * s = tor->swarm;
+          int j;
+          tr_swarm * s = peerSwarms[i];
           const int tn = tr_ptrArraySize (&s->peers);
-          for (i=0; i<tn; ++i, ++n)
+          for (j=0; j<tn; ++j, ++n)
             {
-              peers[n] = tr_ptrArrayNth (&s->peers, i);
+              peers[n] = tr_ptrArrayNth (&s->peers, j);
               swarms[n] = s;
             }
         }
@@ -3525,12 +3874,13 @@ enforceSessionPeerLimit (tr_session * session, uint64_t now)
     }
 }
 
-static void makeNewPeerConnections (tr_peerMgr * mgr, const int max);
+static void makeNewPeerConnections (tr_peerMgr * mgr);
 
 static void
 reconnectPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
 {
-  tr_torrent * tor;
+  int i, n;
+  tr_swarm ** swarms;
   tr_peerMgr * mgr = vmgr;
   const time_t now_sec = tr_time ();
   const uint64_t now_msec = tr_time_msec ();
@@ -3540,24 +3890,28 @@ reconnectPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
   **/
 
   /* if we're over the per-torrent peer limits, cull some peers */
-  tor = NULL;
-  while ((tor = tr_torrentNext (mgr->session, tor)))
-    if (tor->isRunning)
-      enforceTorrentPeerLimit (tor->swarm, now_msec);
+  swarms = swarmSetCopy (&mgr->peerSwarms, &n);
+  for (i=0; i<n; ++i)
+    if (swarms[i]->tor->isRunning)
+      enforceTorrentPeerLimit (swarms[i], now_msec);
+  tr_free (swarms);
 
   /* if we're over the per-session peer limits, cull some peers */
-  enforceSessionPeerLimit (mgr->session, now_msec);
+  enforceSessionPeerLimit (mgr, now_msec);
 
   /* remove crappy peers */
-  tor = NULL;
-  while ((tor = tr_torrentNext (mgr->session, tor)))
-    if (!tor->swarm->isRunning)
-      removeAllPeers (tor->swarm);
+  swarms = swarmSetCopy (&mgr->peerSwarms, &n);
+  for (i=0; i<n; ++i)
+    if (!swarmSetHas (&mgr->peerSwarms, swarms[i]))
+      continue;
+    else if (!swarms[i]->isRunning)
+      removeAllPeers (swarms[i]);
     else
-      closeBadPeers (tor->swarm, now_sec);
+      closeBadPeers (swarms[i], now_sec);
+  tr_free (swarms);
 
   /* try to make new peer connections */
-  makeNewPeerConnections (mgr, MAX_CONNECTIONS_PER_PULSE);
+  makeNewPeerConnections (mgr);
 }
 
 /****
@@ -3569,15 +3923,18 @@ reconnectPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
 static void
 pumpAllPeers (tr_peerMgr * mgr)
 {
-  tr_torrent * tor = NULL;
+  int i;
 
-  while ((tor = tr_torrentNext (mgr->session, tor)))
+  for (i=0; i<tr_ptrArraySize (&mgr->peerSwarms); ++i)
     {
       int j;
-      tr_swarm * s = tor->swarm;
+      tr_swarm * s = tr_ptrArrayNth (&mgr->peerSwarms, i);
 
       for (j=0; j<tr_ptrArraySize (&s->peers); ++j)
-        tr_peerMsgsPulse (tr_ptrArrayNth (&s->peers, j));
+        {
+          tr_peer * peer = tr_ptrArrayNth (&s->peers, j);
+          (*peer->funcs->pulse)(peer);
+        }
     }
 }
 
@@ -3599,7 +3956,7 @@ queuePulse (tr_session * session, tr_direction dir)
   assert (tr_isSession (session));
   assert (tr_isDirection (dir));
 
-  if (tr_sessionGetQueueEnabled (session, dir))
+  if (tr_sessionGetQueueEnabled (session, dir) && (session->queuedTorrentCount > 0))
     {
       tr_ptrArray torrents = TR_PTR_ARRAY_INIT;
 
@@ -3617,7 +3974,8 @@ queuePulse (tr_session * session, tr_direction dir)
 static void
 bandwidthPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
 {
-  tr_torrent * tor;
+  int i, n;
+  tr_swarm ** swarms;
   tr_peerMgr * mgr = vmgr;
   tr_session * session = mgr->session;
   managerLock (mgr);
@@ -3630,16 +3988,23 @@ bandwidthPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
   tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, BANDWIDTH_PERIOD_MSEC);
 
   /* torrent upkeep */
-  tor = NULL;
-  while ((tor = tr_torrentNext (session, tor)))
+  swarms = swarmSetCopy (&mgr->upkeepSwarms, &n);
+  for (i=0; i<n; ++i)
     {
+      tr_swarm * s = swarms[i];
+      tr_torrent * tor = s->tor;
+
+      /* it was removed by an earlier torrent's callback */
+      if (!swarmSetHas (&mgr->upkeepSwarms, s))
+        continue;
+
       /* possibly stop torrents that have seeded enough */
       tr_torrentCheckSeedLimit (tor);
 
       /* run the completeness check for any torrents that need it */
-      if (tor->swarm->needsCompletenessCheck)
+      if (s->needsCompletenessCheck)
         {
-          tor->swarm->needsCompletenessCheck  = false;
+          s->needsCompletenessCheck  = false;
           tr_torrentRecheckCompleteness (tor);
         }
 
@@ -3649,8 +4014,13 @@ bandwidthPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
         tr_torrentStop (tor);
 
       /* update the torrent's stats */
-      tor->swarm->stats.activeWebseedCount = countActiveWebseeds (tor->swarm);
+      s->stats.activeWebseedCount = countActiveWebseeds (s);
+
+      /* if it's idle now, the pulses can leave it alone */
+      if (!swarmNeedsUpkeep (s))
+        swarmSetInclude (&mgr->upkeepSwarms, s, false);
     }
+  tr_free (swarms);
 
   /* pump the queues */
   queuePulse (session, TR_UP);
@@ -3666,18 +4036,6 @@ bandwidthPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
 ****
 ***/
 
-static int
-compareAtomPtrsByAddress (const void * va, const void *vb)
-{
-  const struct peer_atom * a = * (const struct peer_atom**) va;
-  const struct peer_atom * b = * (const struct peer_atom**) vb;
-
-  assert (tr_isAtom (a));
-  assert (tr_isAtom (b));
-
-  return tr_address_compare (&a->addr, &b->addr);
-}
-
 /* best come first, worst go last */
 static int
 compareAtomPtrsByShelfDate (const void * va, const void *vb)
@@ -3712,64 +4070,61 @@ getMaxAtomCount (const tr_torrent * tor)
 }
 
 static void
-atomPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
+swarmPruneAtoms (tr_swarm * s)
 {
-  tr_torrent * tor = NULL;
-  tr_peerMgr * mgr = vmgr;
-  managerLock (mgr);
+  const int atomCount = s->atomCount;
+  const int maxAtomCount = getMaxAtomCount (s->tor);
 
-  while ((tor = tr_torrentNext (mgr->session, tor)))
+  if (atomCount > maxAtomCount) /* we've got too many atoms... time to prune */
     {
-      int atomCount;
-      tr_swarm * s = tor->swarm;
-      const int maxAtomCount = getMaxAtomCount (tor);
-      struct peer_atom ** atoms = (struct peer_atom**) tr_ptrArrayPeek (&s->pool, &atomCount);
+      int i;
+      int keepCount = 0;
+      int testCount = 0;
+      struct peer_atom ** atoms = atomPoolCopy (s);
+      struct peer_atom ** test = tr_new (struct peer_atom*, atomCount);
 
-      if (atomCount > maxAtomCount) /* we've got too many atoms... time to prune */
+      /* keep the ones that are in use */
+      for (i=0; i<atomCount; ++i)
         {
-          int i;
-          int keepCount = 0;
-          int testCount = 0;
-          struct peer_atom ** keep = tr_new (struct peer_atom*, atomCount);
-          struct peer_atom ** test = tr_new (struct peer_atom*, atomCount);
-
-          /* keep the ones that are in use */
-          for (i=0; i<atomCount; ++i)
-            {
-              struct peer_atom * atom = atoms[i];
-              if (peerIsInUse (s, atom))
-                keep[keepCount++] = atom;
-              else
-                test[testCount++] = atom;
-            }
-
-          /* if there's room, keep the best of what's left */
-          i = 0;
-          if (keepCount < maxAtomCount)
-            {
-              qsort (test, testCount, sizeof (struct peer_atom *), compareAtomPtrsByShelfDate);
-              while (i<testCount && keepCount<maxAtomCount)
-                keep[keepCount++] = test[i++];
-            }
+          struct peer_atom * atom = atoms[i];
+          if (peerIsInUse (s, atom))
+            ++keepCount;
+          else
+            test[testCount++] = atom;
+        }
 
-          /* free the culled atoms */
-          while (i<testCount)
-            tr_free (test[i++]);
+      /* if there's room, keep the best of what's left.
+         they only need to be partitioned, not sorted */
+      i = 0;
+      if (keepCount < maxAtomCount)
+        {
+          i = MIN (testCount, maxAtomCount - keepCount);
+          tr_quickfindFirstK (test, testCount, sizeof (struct peer_atom *), compareAtomPtrsByShelfDate, i);
+          keepCount += i;
+        }
 
-          /* rebuild Torrent.pool with what's left */
-          tr_ptrArrayDestruct (&s->pool, NULL);
-          s->pool = TR_PTR_ARRAY_INIT;
-          qsort (keep, keepCount, sizeof (struct peer_atom *), compareAtomPtrsByAddress);
-          for (i=0; i<keepCount; ++i)
-            tr_ptrArrayAppend (&s->pool, keep[i]);
+      /* free the culled atoms */
+      while (i<testCount)
+        atomFree (test[i++]);
 
-          tordbg (s, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
+      tordbg (s, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
+      assert (keepCount == s->atomCount);
 
-          /* cleanup */
-          tr_free (test);
-          tr_free (keep);
-        }
+      /* cleanup */
+      tr_free (test);
+      tr_free (atoms);
     }
+}
+
+static void
+atomPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
+{
+  tr_torrent * tor = NULL;
+  tr_peerMgr * mgr = vmgr;
+  managerLock (mgr);
+
+  while ((tor = tr_torrentNext (mgr->session, tor)))
+    swarmPruneAtoms (tor->swarm);
 
   tr_timerAddMsec (mgr->atomTimer, ATOM_PERIOD_MSEC);
   managerUnlock (mgr);
@@ -3808,13 +4163,6 @@ isPeerCandidate (const tr_torrent * tor, struct peer_atom * atom, const time_t n
   return true;
 }
 
-struct peer_candidate
-{
-  uint64_t score;
-  tr_torrent * tor;
-  struct peer_atom * atom;
-};
-
 static bool
 torrentWasRecentlyStarted (const tr_torrent * tor)
 {
@@ -3883,131 +4231,254 @@ getPeerCandidateScore (const tr_torrent * tor, const struct peer_atom * atom, ui
   return score;
 }
 
-static int
-comparePeerCandidates (const void * va, const void * vb)
+/***
+****  The candidate heaps
+***/
+
+static void
+swarmRemoveFromCandidateHeaps (tr_swarm * s)
+{
+  tr_peerMgr * mgr = s->manager;
+
+  if (s->candidateHeap == CANDIDATE_READY)
+    tr_heapRemove (&mgr->candidateSwarms, s->candidateIndex);
+  else if (s->candidateHeap == CANDIDATE_WAITING)
+    tr_heapRemove (&mgr->waitingSwarms, s->candidateIndex);
+}
+
+/* call this when the best of the swarm's candidates might have changed */
+static void
+swarmUpdateCandidateRank (tr_swarm * s)
 {
-  int ret;
-  const struct peer_candidate * a = va;
-  const struct peer_candidate * b = vb;
+  tr_peerMgr * mgr = s->manager;
+  const struct peer_atom * best = tr_heapPeek (&s->candidates);
+
+  /* the waiting swarms get looked at again when their time comes */
+  if (s->candidateHeap == CANDIDATE_WAITING)
+    return;
 
-  if (a->score < b->score)
-    ret = -1;
-  else if (a->score > b->score)
-    ret = 1;
+  if (best == NULL)
+    {
+      swarmRemoveFromCandidateHeaps (s);
+    }
+  else if (s->candidateHeap == CANDIDATE_READY)
+    {
+      s->candidateKey = best->candidateKey;
+      tr_heapUpdate (&mgr->candidateSwarms, s->candidateIndex);
+    }
   else
-    ret = 0;
+    {
+      s->candidateKey = best->candidateKey;
+      s->candidateHeap = CANDIDATE_READY;
+      tr_heapInsert (&mgr->candidateSwarms, s);
+    }
+}
 
-  return ret;
+/* leave the swarm's candidates alone until `at' */
+static void
+swarmWaitForCandidates (tr_swarm * s, time_t at)
+{
+  swarmRemoveFromCandidateHeaps (s);
+
+  s->candidateKey = at;
+  s->candidateHeap = CANDIDATE_WAITING;
+  tr_heapInsert (&s->manager->waitingSwarms, s);
+}
+
+static void
+atomRemoveCandidate (struct peer_atom * atom)
+{
+  tr_swarm * s = atom->swarm;
+
+  if (atom->candidateHeap == CANDIDATE_READY)
+    {
+      tr_heapRemove (&s->candidates, atom->candidateIndex);
+      swarmUpdateCandidateRank (s);
+    }
+  else if (atom->candidateHeap == CANDIDATE_WAITING)
+    {
+      tr_heapRemove (&s->manager->waitingCandidates, atom->candidateIndex);
+    }
+}
+
+/**
+ * Put the atom in its swarm's candidates if we could connect to it now,
+ * in the manager's waitingCandidates if we could connect to it later,
+ * or in neither. Whatever changes the last case has to call this again:
+ * starting the torrent, closing the atom's peer or handshake, a new
+ * blocklist, or the torrent's completeness changing.
+ */
+static void
+atomUpdateCandidate (struct peer_atom * atom, const time_t now)
+{
+  time_t at;
+  tr_swarm * s = atom->swarm;
+  tr_torrent * tor = s->tor;
+
+  atomRemoveCandidate (atom);
+
+  if (!s->isRunning
+      || (atom->peer != NULL)
+      || (atom->flags2 & MYFLAG_BANNED)
+      || getExistingHandshake (&s->outgoingHandshakes, &atom->addr)
+      || isAtomBlocklisted (tor->session, atom)
+      || (tr_torrentIsSeed (tor) && atomIsSeed (atom)))
+    return;
+
+  /* if they're connecting to us, see how that goes first */
+  if (getExistingHandshake (&s->manager->incomingHandshakes, &atom->addr))
+    at = now + MINIMUM_RECONNECT_INTERVAL_SECS;
+  else
+    at = atom->time + getReconnectIntervalSecs (atom, now);
+
+  if (at > now)
+    {
+      atom->candidateKey = at;
+      atom->candidateHeap = CANDIDATE_WAITING;
+      tr_heapInsert (&s->manager->waitingCandidates, atom);
+    }
+  else
+    {
+      const uint8_t salt = tr_cryptoWeakRandInt (1024);
+      atom->candidateKey = getPeerCandidateScore (tor, atom, salt);
+      atom->candidateHeap = CANDIDATE_READY;
+      tr_heapInsert (&s->candidates, atom);
+      swarmUpdateCandidateRank (s);
+    }
 }
 
-/* Partial sorting -- selecting the k best candidates
-   Adapted from http://en.wikipedia.org/wiki/Selection_algorithm */
 static void
-selectPeerCandidates (struct peer_candidate * candidates, int candidate_count, int select_count)
+swarmUpdateCandidates (tr_swarm * s)
+{
+  struct peer_atom * atom;
+  const time_t now = tr_time ();
+
+  /* updating a candidate doesn't add or remove atoms, so this is safe */
+  for (atom=atomPoolNext (s, NULL); atom!=NULL; atom=atomPoolNext (s, atom))
+    atomUpdateCandidate (atom, now);
+}
+
+void
+tr_peerMgrUpdateCandidates (tr_torrent * tor)
 {
-  tr_quickfindFirstK (candidates,
-                      candidate_count,
-                      sizeof(struct peer_candidate),
-                      comparePeerCandidates,
-                      select_count);
+  assert (tr_isTorrent (tor));
+
+  if (tor->swarm != NULL)
+    {
+      managerLock (tor->swarm->manager);
+      swarmUpdateCandidates (tor->swarm);
+      managerUnlock (tor->swarm->manager);
+    }
 }
 
-#ifndef NDEBUG
 static bool
-checkBestScoresComeFirst (const struct peer_candidate * candidates, int n, int k)
+swarmIsSaturated (const tr_swarm * s, const uint64_t now_msec)
 {
-  int i;
-  uint64_t worstFirstScore = 0;
-  const int x = MIN (n, k) - 1;
+  const tr_torrent * tor = s->tor;
 
-  for (i=0; i<x; i++)
-    if (worstFirstScore < candidates[i].score)
-      worstFirstScore = candidates[i].score;
+  /* if we've already got enough peers in this torrent... */
+  if (tr_torrentGetPeerLimit (tor) <= tr_ptrArraySize (&s->peers))
+    return true;
 
-  for (i=0; i<x; i++)
-    assert (candidates[i].score <= worstFirstScore);
+  /* if we've already got enough speed in this torrent... */
+  if (tr_torrentIsSeed (tor) && isBandwidthMaxedOut (&tor->bandwidth, now_msec, TR_UP))
+    return true;
 
-  for (i=x+1; i<n; i++)
-    assert (candidates[i].score >= worstFirstScore);
+  return false;
+}
 
-  return true;
+static uint64_t
+getTimeUsec (void)
+{
+  struct timeval tv;
+  evutil_gettimeofday (&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
 }
-#endif /* NDEBUG */
 
-/** @return an array of all the atoms we might want to connect to */
-static struct peer_candidate*
-getPeerCandidates (tr_session * session, int * candidateCount, int max)
+/**
+ * Take the best `max' atoms we might want to connect to out of the
+ * candidate heaps and put them in `setme'.
+ * @return the number of atoms in `setme'
+ */
+static int
+popPeerCandidates (tr_peerMgr * mgr, struct peer_atom ** setme, int max)
 {
-  int atomCount;
+  int n;
   int peerCount;
-  tr_torrent * tor;
-  struct peer_candidate * candidates;
-  struct peer_candidate * walk;
+  int examined;
+  tr_swarm * s;
+  struct peer_atom * atom;
   const time_t now = tr_time ();
   const uint64_t now_msec = tr_time_msec ();
   /* leave 5% of connection slots for incoming connections -- ticket #2609 */
-  const int maxCandidates = tr_sessionGetPeerLimit (session) * 0.95;
+  const int maxCandidates = tr_sessionGetPeerLimit (mgr->session) * 0.95;
 
-  /* count how many peers and atoms we've got */
-  tor= NULL;
-  atomCount = 0;
-  peerCount = 0;
-  while ((tor = tr_torrentNext (session, tor)))
-    {
-      atomCount += tr_ptrArraySize (&tor->swarm->pool);
-      peerCount += tr_ptrArraySize (&tor->swarm->peers);
-    }
+  /* count how many peers we've got */
+  peerCount = getManagerPeerCount (mgr);
 
   /* don't start any new handshakes if we're full up */
   if (maxCandidates <= peerCount)
-    {
-      *candidateCount = 0;
-      return NULL;
-    }
+    return 0;
 
-  /* allocate an array of candidates */
-  walk = candidates = tr_new (struct peer_candidate, atomCount);
+  /* the atoms that we can retry now are candidates again */
+  while (((atom = tr_heapPeek (&mgr->waitingCandidates))) && (atom->candidateKey <= (uint64_t)now))
+    atomUpdateCandidate (atom, now);
 
-  /* populate the candidate array */
-  tor = NULL;
-  while ((tor = tr_torrentNext (session, tor)))
+  /* and the swarms that were saturated get another look */
+  while (((s = tr_heapPeek (&mgr->waitingSwarms))) && (s->candidateKey <= (uint64_t)now))
     {
-      int i, nAtoms;
-      struct peer_atom ** atoms;
+      tr_heapPop (&mgr->waitingSwarms);
+      swarmUpdateCandidateRank (s);
+    }
 
-      if (!tor->swarm->isRunning)
-        continue;
+  n = 0;
+  examined = 0;
+  while ((n < max) && ((s = tr_heapPeek (&mgr->candidateSwarms))))
+    {
+      uint64_t score;
+      tr_torrent * tor = s->tor;
 
-      /* if we've already got enough peers in this torrent... */
-      if (tr_torrentGetPeerLimit (tor) <= tr_ptrArraySize (&tor->swarm->peers))
-        continue;
+      ++examined;
+      atom = tr_heapPeek (&s->candidates);
+      assert (atom != NULL);
 
-      /* if we've already got enough speed in this torrent... */
-      if (tr_torrentIsSeed (tor) && isBandwidthMaxedOut (&tor->bandwidth, now_msec, TR_UP))
-        continue;
+      if (swarmIsSaturated (s, now_msec))
+        {
+          swarmWaitForCandidates (s, now + SATURATED_SWARM_RETRY_SECS);
+          continue;
+        }
 
-      atoms = (struct peer_atom**) tr_ptrArrayPeek (&tor->swarm->pool, &nAtoms);
-      for (i=0; i<nAtoms; ++i)
+      /* if something changed that we weren't told about, re-sort it */
+      if (!s->isRunning || !isPeerCandidate (tor, atom, now))
         {
-          struct peer_atom * atom = atoms[i];
+          atomUpdateCandidate (atom, now);
+          continue;
+        }
 
-          if (isPeerCandidate (tor, atom, now))
-            {
-              const uint8_t salt = tr_cryptoWeakRandInt (1024);
-              walk->tor = tor;
-              walk->atom = atom;
-              walk->score = getPeerCandidateScore (tor, atom, salt);
-              ++walk;
-            }
+      /* the torrent's priority or age might have changed the score.
+         keep the salt that it was given when it was added */
+      score = getPeerCandidateScore (tor, atom, atom->candidateKey & 0xff);
+      if (score != atom->candidateKey)
+        {
+          atom->candidateKey = score;
+          tr_heapUpdate (&s->candidates, atom->candidateIndex);
+          swarmUpdateCandidateRank (s);
+          continue;
         }
+
+      tr_heapPop (&s->candidates);
+      swarmUpdateCandidateRank (s);
+      setme[n++] = atom;
     }
 
-  *candidateCount = walk - candidates;
-  if (walk != candidates)
-    selectPeerCandidates (candidates, walk-candidates, max);
+  dbgmsg ("picked %d candidates after examining %d; "
+           "%d swarms have candidates, %d are saturated, and %d atoms are waiting",
+          n, examined,
+          tr_heapSize (&mgr->candidateSwarms),
+          tr_heapSize (&mgr->waitingSwarms),
+          tr_heapSize (&mgr->waitingCandidates));
 
-  assert (checkBestScoresComeFirst (candidates, *candidateCount, max));
-  return candidates;
+  return n;
 }
 
 static void
@@ -4039,6 +4510,7 @@ initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
       tordbg (s, "peerIo not created; marking peer %s as unreachable", tr_atomAddrStr (atom));
       atom->flags2 |= MYFLAG_UNREACHABLE;
       atom->numFails++;
+      tr_connectRateAddResult (&mgr->connectRate, TR_CONNECT_LOCAL_ERROR, 0);
     }
   else
     {
@@ -4057,34 +4529,148 @@ initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
     }
 
   atom->lastConnectionAttemptAt = now;
+  atom->connectStartedMsec = tr_time_msec ();
   atom->time = now;
 }
 
 static void
-initiateCandidateConnection (tr_peerMgr * mgr, struct peer_candidate * c)
+makeNewPeerConnections (struct tr_peerMgr * mgr)
 {
-#if 0
-  fprintf (stderr, "Starting an OUTGOING connection with %s - [%s] seedProbability==%d; %s, %s\n",
-           tr_atomAddrStr (c->atom),
-           tr_torrentName (c->tor),
-           (int)c->atom->seedProbability,
-           tr_torrentIsPrivate (c->tor) ? "private" : "public",
-           tr_torrentIsSeed (c->tor) ? "seed" : "downloader");
-#endif
+  int i, n;
+  uint64_t usec;
+  struct peer_atom ** atoms;
+  const time_t now = tr_time ();
+  const int max = tr_connectRateAllowed (&mgr->connectRate, tr_time_msec ());
+
+  if (max <= 0)
+    return;
+
+  atoms = tr_new (struct peer_atom*, max);
+  usec = getTimeUsec ();
+  n = popPeerCandidates (mgr, atoms, max);
+  usec = getTimeUsec () - usec;
+  tr_connectRateAttempted (&mgr->connectRate, max, n);
+
+  ++mgr->candidatePulseCount;
+  mgr->candidatePulseUsec += usec;
+  mgr->candidatePulseMaxUsec = MAX (mgr->candidatePulseMaxUsec, usec);
+  dbgmsg ("candidate selection took %"PRIu64" usec; average %"PRIu64", max %"PRIu64,
+          usec,
+          mgr->candidatePulseUsec / mgr->candidatePulseCount,
+          mgr->candidatePulseMaxUsec);
 
-  initiateConnection (mgr, c->tor->swarm, c->atom);
+  for (i=0; i<n; ++i)
+    {
+      initiateConnection (mgr, atoms[i]->swarm, atoms[i]);
+
+      /* usually this leaves it out of the heaps until the handshake's done,
+         but if we couldn't even start one it has to wait to be retried */
+      atomUpdateCandidate (atoms[i], now);
+    }
+
+  tr_free (atoms);
 }
 
-static void
-makeNewPeerConnections (struct tr_peerMgr * mgr, const int max)
+void
+tr_peerMgrGetConnectionStats (tr_peerMgr            * mgr,
+                              tr_connect_rate_stats * setme,
+                              int                   * setme_peer_count)
+{
+  managerLock (mgr);
+
+  tr_connectRateGetStats (&mgr->connectRate, setme);
+  *setme_peer_count = getManagerPeerCount (mgr);
+
+  managerUnlock (mgr);
+}
+
+/***
+****
+****  Hooks for swarm-bench
+****
+***/
+
+void
+tr_peerMgrAddSimulatedPeer (tr_torrent       * tor,
+                            tr_peer          * peer,
+                            const tr_address * addr,
+                            tr_port            port)
+{
+  tr_swarm * s;
+  struct peer_atom * atom;
+
+  assert (tr_isTorrent (tor));
+  assert (peer != NULL);
+  assert (peer->funcs->update_active != NULL);
+
+  s = tor->swarm;
+  managerLock (s->manager);
+
+  ensureAtomExists (s, addr, port, 0, -1, TR_PEER_FROM_INCOMING);
+  atom = getExistingAtom (s, addr);
+  assert (atom != NULL);
+  assert (atom->peer == NULL);
+
+  atom->time = tr_time ();
+  atom->piece_data_time = 0;
+  atom->lastConnectionAt = tr_time ();
+  swarmAddPeer (s, peer, atom, TR_KEY_NONE);
+  atomUpdateCandidate (atom, tr_time ());
+
+  managerUnlock (s->manager);
+}
+
+void
+tr_peerMgrSimulatePeerEvent (tr_peer * peer, const tr_peer_event * event)
+{
+  peerCallbackFunc (peer, event, peer->swarm);
+}
+
+void
+tr_peerMgrRechokeUploads (tr_torrent * tor)
+{
+  managerLock (tor->swarm->manager);
+  rechokeUploads (tor->swarm, tr_time_msec ());
+  managerUnlock (tor->swarm->manager);
+}
+
+void
+tr_peerMgrRechokeDownloads (tr_torrent * tor)
+{
+  managerLock (tor->swarm->manager);
+  rechokeDownloads (tor->swarm);
+  managerUnlock (tor->swarm->manager);
+}
+
+int
+tr_peerMgrPickCandidates (tr_peerMgr * mgr, int max)
 {
   int i, n;
-  struct peer_candidate * candidates;
+  struct peer_atom ** atoms = tr_new (struct peer_atom*, max);
+  const time_t now = tr_time ();
+
+  managerLock (mgr);
+
+  n = popPeerCandidates (mgr, atoms, max);
+
+  /* treat them like connections that we tried and gave up on */
+  for (i=0; i<n; ++i)
+    {
+      atoms[i]->lastConnectionAttemptAt = now;
+      atoms[i]->time = now;
+      atomUpdateCandidate (atoms[i], now);
+    }
 
-  candidates = getPeerCandidates (mgr->session, &n, max);
+  managerUnlock (mgr);
 
-  for (i=0; i<n && i<max; ++i)
-    initiateCandidateConnection (mgr, &candidates[i]);
+  tr_free (atoms);
+  return n;
+}
 
-  tr_free (candidates);
+void
+tr_peerMgrPruneAtoms (tr_torrent * tor)
+{
+  managerLock (tor->swarm->manager);
+  swarmPruneAtoms (tor->swarm);
+  managerUnlock (tor->swarm->manager);
 }
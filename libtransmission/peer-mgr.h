@@ -23,6 +23,7 @@
  #include <winsock2.h> /* struct in_addr */
 #endif
 
+#include "connect-rate.h" /* tr_connect_rate_stats */
 #include "net.h" /* tr_address */
 #include "peer-common.h"
 #include "quark.h"
@@ -160,6 +161,19 @@ void         tr_peerMgrAddTorrent           (tr_peerMgr          * manager,
 
 void         tr_peerMgrRemoveTorrent        (tr_torrent          * tor);
 
+/* make sure the next bandwidth pulse looks at the torrent, e.g. to stop it.
+   running torrents are always looked at; idle ones are skipped */
+void         tr_peerMgrTorrentNeedsUpkeep   (tr_torrent          * tor);
+
+/* call this when something that changes which of the torrent's known peers
+   we'd like to connect to has changed, e.g. its priority or completeness */
+void         tr_peerMgrUpdateCandidates     (tr_torrent          * tor);
+
+/* the torrents that are running or have upkeep pending.
+   free the returned array with tr_free () */
+tr_torrent ** tr_peerMgrGetActiveTorrents   (tr_peerMgr          * manager,
+                                             int                 * setmeCount);
+
 void         tr_peerMgrTorrentAvailability  (const tr_torrent    * tor,
                                              int8_t              * tab,
                                              unsigned int          tabCount);
@@ -186,6 +200,40 @@ void         tr_peerMgrGotBadPiece          (tr_torrent         * tor,
 
 void         tr_peerMgrPieceCompleted       (tr_torrent         * tor,
                                              tr_piece_index_t     pieceIndex);
+
+/* how the outgoing connection attempts are going, and how many
+   peers are connected across all the torrents */
+void         tr_peerMgrGetConnectionStats   (tr_peerMgr            * manager,
+                                             tr_connect_rate_stats * setme,
+                                             int                   * setme_peer_count);
+
+/**
+***  Hooks for swarm-bench, which drives the peer manager with simulated
+***  peers instead of sockets. Nothing else should call these.
+**/
+
+/* put `peer' on the torrent's connection list as if we'd just finished
+   a handshake with addr:port. peer->funcs must have the connection ops */
+void         tr_peerMgrAddSimulatedPeer     (tr_torrent         * tor,
+                                             tr_peer            * peer,
+                                             const tr_address   * addr,
+                                             tr_port              port);
+
+/* hand `event' to the peer manager as if `peer' had sent it */
+void         tr_peerMgrSimulatePeerEvent    (tr_peer             * peer,
+                                             const tr_peer_event * event);
+
+void         tr_peerMgrRechokeUploads       (tr_torrent         * tor);
+
+void         tr_peerMgrRechokeDownloads     (tr_torrent         * tor);
+
+/* pick up to `max' connection candidates the way the reconnect pulse
+   does, but mark them as tried instead of connecting to them.
+   @return the number of candidates picked */
+int          tr_peerMgrPickCandidates       (tr_peerMgr         * manager,
+                                             int                  max);
+
+void         tr_peerMgrPruneAtoms           (tr_torrent         * tor);
  
 
 
@@ -24,6 +24,7 @@
 #include "cache.h"
 #include "completion.h"
 #include "crypto.h" /* tr_sha1 () */
+#include "disk-queue.h" /* tr_disk_result */
 #include "log.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
@@ -92,6 +93,9 @@ enum
   /* how many blocks to keep prefetched per peer */
   PREFETCH_SIZE = 18,
 
+  /* how many of a peer's blocks can wait on the disk queue at once */
+  MAX_PENDING_DISK_READS = 4,
+
   /* when we're making requests from another peer,
      batch them together to send enough requests to
      meet our bandwidth goals for the next N seconds */
@@ -198,6 +202,9 @@ struct tr_peerMsgs
 
   int prefetchCount;
 
+  /* how many blocks we've asked the disk queue to read for this peer */
+  int pendingDiskReads;
+
   int is_active[2];
 
   /* how long the outMessages batch should be allowed to grow before
@@ -1900,6 +1907,78 @@ updateBlockRequests (tr_peerMsgs * msgs)
     }
 }
 
+static size_t
+sendBlock (tr_peerMsgs * msgs, const struct peer_request * req, struct evbuffer * data)
+{
+    size_t n;
+    struct evbuffer * out;
+    const uint32_t msglen = 4 + 1 + 4 + 4 + req->length;
+
+    assert (evbuffer_get_length (data) == req->length);
+
+    /* only reserve room for the header. `data' is moved over as-is
+       because it may be a reference to a file rather than a copy */
+    out = evbuffer_new ();
+    evbuffer_expand (out, msglen - req->length);
+
+    evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req->length);
+    evbuffer_add_uint8 (out, BT_PIECE);
+    evbuffer_add_uint32 (out, req->index);
+    evbuffer_add_uint32 (out, req->offset);
+    evbuffer_add_buffer (out, data);
+
+    n = evbuffer_get_length (out);
+    dbgmsg (msgs, "sending block %u:%u->%u", req->index, req->offset, req->length);
+    assert (n == msglen);
+    tr_peerIoWriteBuf (msgs->io, out, true);
+    msgs->clientSentAnythingAt = tr_time ();
+    tr_historyAdd (&msgs->peer.blocksSentToPeer, tr_time (), 1);
+
+    evbuffer_free (out);
+    return n;
+}
+
+/* called in the libevent thread when the disk queue
+   is done reading a block that the peer asked for */
+static void
+onBlockRead (tr_torrent * tor, const tr_disk_result * result, void * vmsgs)
+{
+    tr_peerMsgs * msgs = vmsgs;
+    struct peer_request req;
+    bool piece_is_corrupt = false;
+
+    --msgs->pendingDiskReads;
+
+    if (tor == NULL)
+        return;
+
+    req.index = result->piece;
+    req.offset = result->offset;
+    req.length = result->length;
+
+    if (result->hash_tested)
+    {
+        tr_torrentSetPieceCheckResult (tor, req.index, result->hash_passed);
+        piece_is_corrupt = !result->hash_passed;
+    }
+
+    if (!result->err && !piece_is_corrupt)
+    {
+        sendBlock (msgs, &req, result->data);
+        peerPulse (msgs);
+    }
+    else
+    {
+        if (tr_peerIoSupportsFEXT (msgs->io))
+            protocolSendReject (msgs, &req);
+
+        /* this stops the torrent and frees its peers, so do it last.
+           read errors are reported by the disk queue itself. */
+        if (piece_is_corrupt)
+            tr_torrentSetLocalError (tor, _("Please Verify Local Data! Piece #%zu is corrupt."), (size_t)req.index);
+    }
+}
+
 static size_t
 fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
 {
@@ -2000,7 +2079,8 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
     ***  Data Blocks
     **/
 
-    if ((tr_peerIoGetWriteBufferSpace (msgs->io, now) >= msgs->torrent->blockSize)
+    if ((msgs->pendingDiskReads < MAX_PENDING_DISK_READS)
+        && (tr_peerIoGetWriteBufferSpace (msgs->io, now) >= msgs->torrent->blockSize * (1 + msgs->pendingDiskReads))
         && popNextRequest (msgs, &req))
     {
         --msgs->prefetchCount;
@@ -2008,68 +2088,34 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
         if (requestIsValid (msgs, &req)
             && tr_cpPieceIsComplete (&msgs->torrent->completion, req.index))
         {
-            int err;
-            const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
-            struct evbuffer * out;
-            struct evbuffer_iovec iovec[1];
-
-            out = evbuffer_new ();
-            evbuffer_expand (out, msglen);
-
-            evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req.length);
-            evbuffer_add_uint8 (out, BT_PIECE);
-            evbuffer_add_uint32 (out, req.index);
-            evbuffer_add_uint32 (out, req.offset);
-
-            evbuffer_reserve_space (out, req.length, iovec, 1);
-            err = tr_cacheReadBlock (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base);
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space (out, iovec, 1);
-
-            /* check the piece if it needs checking... */
-            if (!err && tr_torrentPieceNeedsCheck (msgs->torrent, req.index))
-                if ((err = !tr_torrentCheckPiece (msgs->torrent, req.index)))
-                    tr_torrentSetLocalError (msgs->torrent, _("Please Verify Local Data! Piece #%zu is corrupt."), (size_t)req.index);
-
-            if (err)
-            {
-                if (fext)
-                    protocolSendReject (msgs, &req);
-            }
+            const bool check_piece = tr_torrentPieceNeedsCheck (msgs->torrent, req.index);
+            struct evbuffer * data = evbuffer_new ();
+
+            /* if it's in the cache or an open file we can send it right away.
+               otherwise, onBlockRead () sends it when the disk queue is done */
+            if (tr_cacheReadBlockAsync (getSession (msgs)->cache, msgs->torrent,
+                                        req.index, req.offset, req.length,
+                                        check_piece, tr_peerIoSupportsZeroCopy (msgs->io),
+                                        data, onBlockRead, msgs))
+                bytesWritten += sendBlock (msgs, &req, data);
             else
-            {
-                const size_t n = evbuffer_get_length (out);
-                dbgmsg (msgs, "sending block %u:%u->%u", req.index, req.offset, req.length);
-                assert (n == msglen);
-                tr_peerIoWriteBuf (msgs->io, out, true);
-                bytesWritten += n;
-                msgs->clientSentAnythingAt = now;
-                tr_historyAdd (&msgs->peer.blocksSentToPeer, tr_time (), 1);
-            }
+                ++msgs->pendingDiskReads;
 
-            evbuffer_free (out);
-
-            if (err)
-            {
-                bytesWritten = 0;
-                msgs = NULL;
-            }
+            evbuffer_free (data);
         }
         else if (fext) /* peer needs a reject message */
         {
             protocolSendReject (msgs, &req);
         }
 
-        if (msgs != NULL)
-            prefetchPieces (msgs);
+        prefetchPieces (msgs);
     }
 
     /**
     ***  Keepalive
     **/
 
-    if ((msgs != NULL)
-        && (msgs->clientSentAnythingAt != 0)
+    if ((msgs->clientSentAnythingAt != 0)
         && ((now - msgs->clientSentAnythingAt) > KEEPALIVE_INTERVAL_SECS))
     {
         dbgmsg (msgs, "sending a keepalive message");
@@ -2489,6 +2535,9 @@ peermsgs_destruct (tr_peer * peer)
   tr_peerMsgsSetActive (msgs, TR_UP, false);
   tr_peerMsgsSetActive (msgs, TR_DOWN, false);
 
+  if (msgs->pendingDiskReads > 0)
+    tr_cacheCancelReads (getSession (msgs)->cache, msgs);
+
   if (msgs->pexTimer != NULL)
     event_free (msgs->pexTimer);
 
@@ -2510,10 +2559,124 @@ peermsgs_destruct (tr_peer * peer)
   memset (msgs, ~0, sizeof (tr_peerMsgs));
 }
 
+/* the peer manager's view of the connection */
+
+static bool
+peermsgs_is_peer_choked (const tr_peer * peer)
+{
+  return tr_peerMsgsIsPeerChoked ((const tr_peerMsgs *) peer);
+}
+
+static bool
+peermsgs_is_peer_interested (const tr_peer * peer)
+{
+  return tr_peerMsgsIsPeerInterested ((const tr_peerMsgs *) peer);
+}
+
+static bool
+peermsgs_is_client_choked (const tr_peer * peer)
+{
+  return tr_peerMsgsIsClientChoked ((const tr_peerMsgs *) peer);
+}
+
+static bool
+peermsgs_is_client_interested (const tr_peer * peer)
+{
+  return tr_peerMsgsIsClientInterested ((const tr_peerMsgs *) peer);
+}
+
+static bool
+peermsgs_is_active (const tr_peer * peer, tr_direction direction)
+{
+  return tr_peerMsgsIsActive ((const tr_peerMsgs *) peer, direction);
+}
+
+static void
+peermsgs_update_active (tr_peer * peer, tr_direction direction)
+{
+  tr_peerMsgsUpdateActive (PEER_MSGS (peer), direction);
+}
+
+static time_t
+peermsgs_get_connection_age (const tr_peer * peer)
+{
+  return tr_peerMsgsGetConnectionAge ((const tr_peerMsgs *) peer);
+}
+
+static bool
+peermsgs_is_utp_connection (const tr_peer * peer)
+{
+  return tr_peerMsgsIsUtpConnection ((const tr_peerMsgs *) peer);
+}
+
+static bool
+peermsgs_is_encrypted (const tr_peer * peer)
+{
+  return tr_peerMsgsIsEncrypted ((const tr_peerMsgs *) peer);
+}
+
+static bool
+peermsgs_is_incoming_connection (const tr_peer * peer)
+{
+  return tr_peerMsgsIsIncomingConnection ((const tr_peerMsgs *) peer);
+}
+
+static bool
+peermsgs_is_reading_block (const tr_peer * peer, tr_block_index_t block)
+{
+  return tr_peerMsgsIsReadingBlock ((const tr_peerMsgs *) peer, block);
+}
+
+static void
+peermsgs_set_choke (tr_peer * peer, bool peer_is_choked)
+{
+  tr_peerMsgsSetChoke (PEER_MSGS (peer), peer_is_choked);
+}
+
+static void
+peermsgs_set_interested (tr_peer * peer, bool client_is_interested)
+{
+  tr_peerMsgsSetInterested (PEER_MSGS (peer), client_is_interested);
+}
+
+static void
+peermsgs_have (tr_peer * peer, uint32_t pieceIndex)
+{
+  tr_peerMsgsHave (PEER_MSGS (peer), pieceIndex);
+}
+
+static void
+peermsgs_cancel (tr_peer * peer, tr_block_index_t block)
+{
+  tr_peerMsgsCancel (PEER_MSGS (peer), block);
+}
+
+static void
+peermsgs_pulse (tr_peer * peer)
+{
+  tr_peerMsgsPulse (PEER_MSGS (peer));
+}
+
 static const struct tr_peer_virtual_funcs my_funcs =
 {
   .destruct = peermsgs_destruct,
-  .is_transferring_pieces = peermsgs_is_transferring_pieces
+  .is_transferring_pieces = peermsgs_is_transferring_pieces,
+  .is_peer_choked = peermsgs_is_peer_choked,
+  .is_peer_interested = peermsgs_is_peer_interested,
+  .is_client_choked = peermsgs_is_client_choked,
+  .is_client_interested = peermsgs_is_client_interested,
+  .is_active = peermsgs_is_active,
+  .update_active = peermsgs_update_active,
+  .get_connection_age = peermsgs_get_connection_age,
+  .is_utp_connection = peermsgs_is_utp_connection,
+  .is_encrypted = peermsgs_is_encrypted,
+  .is_incoming_connection = peermsgs_is_incoming_connection,
+  .is_reading_block = peermsgs_is_reading_block,
+  .set_choke = peermsgs_set_choke,
+  .set_interested = peermsgs_set_interested,
+  .have = peermsgs_have,
+  .cancel = peermsgs_cancel,
+  .pulse = peermsgs_pulse
 };
 
 /***
@@ -218,6 +218,66 @@ tr_lockUnlock (tr_lock * l)
 #endif
 }
 
+/***
+****  CONDITION VARIABLES
+***/
+
+struct tr_cond
+{
+#ifdef WIN32
+  int                 unused; /* WindowsXP has no condition variables, so poll */
+#else
+  pthread_cond_t      cond;
+#endif
+};
+
+tr_cond*
+tr_condNew (void)
+{
+  tr_cond * c = tr_new0 (tr_cond, 1);
+
+#ifndef WIN32
+  pthread_cond_init (&c->cond, NULL);
+#endif
+
+  return c;
+}
+
+void
+tr_condFree (tr_cond * c)
+{
+#ifndef WIN32
+  pthread_cond_destroy (&c->cond);
+#endif
+  tr_free (c);
+}
+
+void
+tr_condWait (tr_cond * c, tr_lock * l)
+{
+  assert (l->depth == 1);
+  assert (tr_areThreadsEqual (l->lockThread, tr_getCurrentThread ()));
+
+  l->depth = 0;
+#ifdef WIN32
+  LeaveCriticalSection (&l->lock);
+  Sleep (10);
+  EnterCriticalSection (&l->lock);
+#else
+  pthread_cond_wait (&c->cond, &l->lock);
+#endif
+  l->lockThread = tr_getCurrentThread ();
+  l->depth = 1;
+}
+
+void
+tr_condBroadcast (tr_cond * c)
+{
+#ifndef WIN32
+  pthread_cond_broadcast (&c->cond);
+#endif
+}
+
 /***
 ****  PATHS
 ***/
@@ -80,6 +80,28 @@ void tr_lockUnlock (tr_lock *);
 /** @brief return nonzero if the specified lock is locked */
 int tr_lockHave (const tr_lock *);
 
+/***
+****
+***/
+
+typedef struct tr_cond tr_cond;
+
+/** @brief Create a new condition variable */
+tr_cond * tr_condNew (void);
+
+/** @brief Destroy a condition variable */
+void tr_condFree (tr_cond *);
+
+/**
+ * @brief Wait for the condition to be signalled.
+ * @param lock a lock that the caller holds exactly once.
+ *             It's released while waiting and reacquired before returning.
+ */
+void tr_condWait (tr_cond * cond, tr_lock * lock);
+
+/** @brief Wake up every thread waiting on the condition */
+void tr_condBroadcast (tr_cond *);
+
 #ifdef WIN32
 void * mmap (void *ptr, long  size, long  prot, long  type, long  handle, long  arg);
 
@@ -37,6 +37,9 @@ static const struct tr_key_struct my_static[] =
   { "announce-list", 13 },
   { "announceState", 13 },
   { "arguments", 9 },
+  { "attempts", 8 },
+  { "attemptsPerSecond", 17 },
+  { "backoffs", 8 },
   { "bandwidth-priority", 18 },
   { "bandwidthPriority", 17 },
   { "bind-address-ipv4", 17 },
@@ -50,6 +53,8 @@ static const struct tr_key_struct my_static[] =
   { "blocks", 6 },
   { "bytesCompleted", 14 },
   { "cache-size-mb", 13 },
+  { "cache-stats", 11 },
+  { "cleanBlocks", 11 },
   { "clientIsChoked", 14 },
   { "clientIsInterested", 18 },
   { "clientName", 10 },
@@ -58,6 +63,9 @@ static const struct tr_key_struct my_static[] =
   { "compact-view", 12 },
   { "complete", 8 },
   { "config-dir", 10 },
+  { "connectMsec", 11 },
+  { "connected", 9 },
+  { "connection-stats", 16 },
   { "cookies", 7 },
   { "corrupt", 7 },
   { "corruptEver", 11 },
@@ -73,6 +81,9 @@ static const struct tr_key_struct my_static[] =
   { "desiredAvailable", 16 },
   { "destination", 11 },
   { "dht-enabled", 11 },
+  { "dirtyBlocks", 11 },
+  { "disk-stats", 10 },
+  { "disk-threads", 12 },
   { "display-name", 12 },
   { "dnd", 3 },
   { "done-date", 9 },
@@ -101,8 +112,12 @@ static const struct tr_key_struct my_static[] =
   { "errorString", 11 },
   { "eta", 3 },
   { "etaIdle", 7 },
+  { "evictions", 9 },
+  { "failed", 6 },
   { "failure reason", 14 },
   { "fields", 6 },
+  { "file-index", 10 },
+  { "file-offset", 11 },
   { "fileStats", 9 },
   { "filename", 8 },
   { "files", 5 },
@@ -115,6 +130,8 @@ static const struct tr_key_struct my_static[] =
   { "filter-trackers", 15 },
   { "flagStr", 7 },
   { "flags", 5 },
+  { "flush", 5 },
+  { "format", 6 },
   { "fromCache", 9 },
   { "fromDht", 7 },
   { "fromIncoming", 12 },
@@ -124,10 +141,12 @@ static const struct tr_key_struct my_static[] =
   { "fromTracker", 11 },
   { "hasAnnounced", 12 },
   { "hasScraped", 10 },
+  { "hash", 4 },
   { "hashString", 10 },
   { "have", 4 },
   { "haveUnchecked", 13 },
   { "haveValid", 9 },
+  { "hits", 4 },
   { "honorsSessionLimits", 19 },
   { "host", 4 },
   { "id", 2 },
@@ -143,6 +162,7 @@ static const struct tr_key_struct my_static[] =
   { "info_hash", 9 },
   { "inhibit-desktop-hibernation", 27 },
   { "interval", 8 },
+  { "io-uring-enabled", 16 },
   { "ip", 2 },
   { "ipv4", 4 },
   { "ipv6", 4 },
@@ -155,6 +175,7 @@ static const struct tr_key_struct my_static[] =
   { "isStalled", 9 },
   { "isUTP", 5 },
   { "isUploadingTo", 13 },
+  { "jobCount", 8 },
   { "lastAnnouncePeerCount", 21 },
   { "lastAnnounceResult", 18 },
   { "lastAnnounceStartTime", 21 },
@@ -166,9 +187,12 @@ static const struct tr_key_struct my_static[] =
   { "lastScrapeSucceeded", 19 },
   { "lastScrapeTime", 14 },
   { "lastScrapeTimedOut", 18 },
+  { "latencyAverageMsec", 18 },
+  { "latencyMaxMsec", 14 },
   { "leecherCount", 12 },
   { "leftUntilDone", 13 },
   { "length", 6 },
+  { "localErrors", 11 },
   { "location", 8 },
   { "lpd-enabled", 11 },
   { "m", 1 },
@@ -192,16 +216,23 @@ static const struct tr_key_struct my_static[] =
   { "method", 6 },
   { "min interval", 12 },
   { "min_request_interval", 20 },
+  { "misses", 6 },
   { "move", 4 },
   { "msg_type", 8 },
   { "mtimes", 6 },
   { "name", 4 },
   { "name.utf-8", 10 },
+  { "network-threads", 15 },
   { "nextAnnounceTime", 16 },
   { "nextScrapeTime", 14 },
   { "nodes", 5 },
   { "nodes6", 6 },
   { "open-dialog-dir", 15 },
+  { "open-file-limit", 15 },
+  { "open-file-stats", 15 },
+  { "openFileLimit", 13 },
+  { "openFiles", 9 },
+  { "opens", 5 },
   { "p", 1 },
   { "path", 4 },
   { "path.utf-8", 10 },
@@ -254,6 +285,8 @@ static const struct tr_key_struct my_static[] =
   { "queue-move-up", 13 },
   { "queue-stalled-enabled", 21 },
   { "queue-stalled-minutes", 21 },
+  { "queueDepth", 10 },
+  { "queueDepthPeak", 14 },
   { "queuePosition", 13 },
   { "rateDownload", 12 },
   { "rateToClient", 12 },
@@ -262,6 +295,7 @@ static const struct tr_key_struct my_static[] =
   { "ratio-limit", 11 },
   { "ratio-limit-enabled", 19 },
   { "ratio-mode", 10 },
+  { "read", 4 },
   { "recent-download-dir-1", 21 },
   { "recent-download-dir-2", 21 },
   { "recent-download-dir-3", 21 },
@@ -275,6 +309,7 @@ static const struct tr_key_struct my_static[] =
   { "remote-session-username", 23 },
   { "removed", 7 },
   { "rename-partial-files", 20 },
+  { "reopens", 7 },
   { "reqq", 4 },
   { "result", 6 },
   { "rpc-authentication-required", 27 },
@@ -306,6 +341,8 @@ static const struct tr_key_struct my_static[] =
   { "seedRatioMode", 13 },
   { "seederCount", 11 },
   { "seeding-time-seconds", 20 },
+  { "seq", 3 },
+  { "session-changed", 15 },
   { "session-count", 13 },
   { "sessionCount", 12 },
   { "show-backup-trackers", 20 },
@@ -316,6 +353,7 @@ static const struct tr_key_struct my_static[] =
   { "show-statusbar", 14 },
   { "show-toolbar", 12 },
   { "show-tracker-scrapes", 20 },
+  { "since", 5 },
   { "size-bytes", 10 },
   { "size-units", 10 },
   { "sizeWhenDone", 12 },
@@ -337,6 +375,7 @@ static const struct tr_key_struct my_static[] =
   { "tag", 3 },
   { "tier", 4 },
   { "time-checked", 12 },
+  { "timeout", 7 },
   { "torrent-added", 13 },
   { "torrent-added-notification-command", 34 },
   { "torrent-added-notification-enabled", 34 },
@@ -363,6 +402,7 @@ static const struct tr_key_struct my_static[] =
   { "trash-original-torrent-files", 28 },
   { "umask", 5 },
   { "units", 5 },
+  { "unreachable", 11 },
   { "upload-slots-per-torrent", 24 },
   { "uploadLimit", 11 },
   { "uploadLimited", 13 },
@@ -384,13 +424,16 @@ static const struct tr_key_struct my_static[] =
   { "ut_recommend", 12 },
   { "utp-enabled", 11 },
   { "v", 1 },
+  { "verify-threads", 14 },
   { "version", 7 },
   { "wanted", 6 },
   { "warning message", 15 },
   { "watch-dir", 9 },
   { "watch-dir-enabled", 17 },
   { "webseeds", 8 },
-  { "webseedsSendingToUs", 19 }
+  { "webseedsSendingToUs", 19 },
+  { "window", 6 },
+  { "write", 5 }
 };
 
 static int
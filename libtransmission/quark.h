@@ -47,6 +47,9 @@ enum
   TR_KEY_announce_list, /* metainfo */
   TR_KEY_announceState, /* rpc */
   TR_KEY_arguments, /* rpc */
+  TR_KEY_attempts,
+  TR_KEY_attemptsPerSecond,
+  TR_KEY_backoffs,
   TR_KEY_bandwidth_priority,
   TR_KEY_bandwidthPriority,
   TR_KEY_bind_address_ipv4,
@@ -60,6 +63,8 @@ enum
   TR_KEY_blocks,
   TR_KEY_bytesCompleted,
   TR_KEY_cache_size_mb,
+  TR_KEY_cache_stats,
+  TR_KEY_cleanBlocks,
   TR_KEY_clientIsChoked,
   TR_KEY_clientIsInterested,
   TR_KEY_clientName,
@@ -68,6 +73,9 @@ enum
   TR_KEY_compact_view,
   TR_KEY_complete,
   TR_KEY_config_dir,
+  TR_KEY_connectMsec,
+  TR_KEY_connected,
+  TR_KEY_connection_stats,
   TR_KEY_cookies,
   TR_KEY_corrupt,
   TR_KEY_corruptEver,
@@ -83,6 +91,9 @@ enum
   TR_KEY_desiredAvailable,
   TR_KEY_destination,
   TR_KEY_dht_enabled,
+  TR_KEY_dirtyBlocks,
+  TR_KEY_disk_stats,
+  TR_KEY_disk_threads,
   TR_KEY_display_name,
   TR_KEY_dnd,
   TR_KEY_done_date,
@@ -111,8 +122,12 @@ enum
   TR_KEY_errorString,
   TR_KEY_eta,
   TR_KEY_etaIdle,
+  TR_KEY_evictions,
+  TR_KEY_failed,
   TR_KEY_failure_reason,
   TR_KEY_fields,
+  TR_KEY_file_index,
+  TR_KEY_file_offset,
   TR_KEY_fileStats,
   TR_KEY_filename,
   TR_KEY_files,
@@ -125,6 +140,8 @@ enum
   TR_KEY_filter_trackers,
   TR_KEY_flagStr,
   TR_KEY_flags,
+  TR_KEY_flush,
+  TR_KEY_format,
   TR_KEY_fromCache,
   TR_KEY_fromDht,
   TR_KEY_fromIncoming,
@@ -134,10 +151,12 @@ enum
   TR_KEY_fromTracker,
   TR_KEY_hasAnnounced,
   TR_KEY_hasScraped,
+  TR_KEY_hash,
   TR_KEY_hashString,
   TR_KEY_have,
   TR_KEY_haveUnchecked,
   TR_KEY_haveValid,
+  TR_KEY_hits,
   TR_KEY_honorsSessionLimits,
   TR_KEY_host,
   TR_KEY_id,
@@ -153,6 +172,7 @@ enum
   TR_KEY_info_hash,
   TR_KEY_inhibit_desktop_hibernation,
   TR_KEY_interval,
+  TR_KEY_io_uring_enabled,
   TR_KEY_ip,
   TR_KEY_ipv4,
   TR_KEY_ipv6,
@@ -165,6 +185,7 @@ enum
   TR_KEY_isStalled,
   TR_KEY_isUTP,
   TR_KEY_isUploadingTo,
+  TR_KEY_jobCount,
   TR_KEY_lastAnnouncePeerCount,
   TR_KEY_lastAnnounceResult,
   TR_KEY_lastAnnounceStartTime,
@@ -176,9 +197,12 @@ enum
   TR_KEY_lastScrapeSucceeded,
   TR_KEY_lastScrapeTime,
   TR_KEY_lastScrapeTimedOut,
+  TR_KEY_latencyAverageMsec,
+  TR_KEY_latencyMaxMsec,
   TR_KEY_leecherCount,
   TR_KEY_leftUntilDone,
   TR_KEY_length,
+  TR_KEY_localErrors,
   TR_KEY_location,
   TR_KEY_lpd_enabled,
   TR_KEY_m,
@@ -202,16 +226,23 @@ enum
   TR_KEY_method,
   TR_KEY_min_interval,
   TR_KEY_min_request_interval,
+  TR_KEY_misses,
   TR_KEY_move,
   TR_KEY_msg_type,
   TR_KEY_mtimes,
   TR_KEY_name,
   TR_KEY_name_utf_8,
+  TR_KEY_network_threads,
   TR_KEY_nextAnnounceTime,
   TR_KEY_nextScrapeTime,
   TR_KEY_nodes,
   TR_KEY_nodes6,
   TR_KEY_open_dialog_dir,
+  TR_KEY_open_file_limit,
+  TR_KEY_open_file_stats,
+  TR_KEY_openFileLimit,
+  TR_KEY_openFiles,
+  TR_KEY_opens,
   TR_KEY_p,
   TR_KEY_path,
   TR_KEY_path_utf_8,
@@ -264,6 +295,8 @@ enum
   TR_KEY_queue_move_up,
   TR_KEY_queue_stalled_enabled,
   TR_KEY_queue_stalled_minutes,
+  TR_KEY_queueDepth,
+  TR_KEY_queueDepthPeak,
   TR_KEY_queuePosition,
   TR_KEY_rateDownload,
   TR_KEY_rateToClient,
@@ -272,6 +305,7 @@ enum
   TR_KEY_ratio_limit,
   TR_KEY_ratio_limit_enabled,
   TR_KEY_ratio_mode,
+  TR_KEY_read,
   TR_KEY_recent_download_dir_1,
   TR_KEY_recent_download_dir_2,
   TR_KEY_recent_download_dir_3,
@@ -285,6 +319,7 @@ enum
   TR_KEY_remote_session_username,
   TR_KEY_removed,
   TR_KEY_rename_partial_files,
+  TR_KEY_reopens,
   TR_KEY_reqq,
   TR_KEY_result,
   TR_KEY_rpc_authentication_required,
@@ -316,6 +351,8 @@ enum
   TR_KEY_seedRatioMode,
   TR_KEY_seederCount,
   TR_KEY_seeding_time_seconds,
+  TR_KEY_seq,
+  TR_KEY_session_changed,
   TR_KEY_session_count,
   TR_KEY_sessionCount,
   TR_KEY_show_backup_trackers,
@@ -326,6 +363,7 @@ enum
   TR_KEY_show_statusbar,
   TR_KEY_show_toolbar,
   TR_KEY_show_tracker_scrapes,
+  TR_KEY_since,
   TR_KEY_size_bytes,
   TR_KEY_size_units,
   TR_KEY_sizeWhenDone,
@@ -347,6 +385,7 @@ enum
   TR_KEY_tag,
   TR_KEY_tier,
   TR_KEY_time_checked,
+  TR_KEY_timeout,
   TR_KEY_torrent_added,
   TR_KEY_torrent_added_notification_command,
   TR_KEY_torrent_added_notification_enabled,
@@ -373,6 +412,7 @@ enum
   TR_KEY_trash_original_torrent_files,
   TR_KEY_umask,
   TR_KEY_units,
+  TR_KEY_unreachable,
   TR_KEY_upload_slots_per_torrent,
   TR_KEY_uploadLimit,
   TR_KEY_uploadLimited,
@@ -394,6 +434,7 @@ enum
   TR_KEY_ut_recommend,
   TR_KEY_utp_enabled,
   TR_KEY_v,
+  TR_KEY_verify_threads,
   TR_KEY_version,
   TR_KEY_wanted,
   TR_KEY_warning_message,
@@ -401,6 +442,8 @@ enum
   TR_KEY_watch_dir_enabled,
   TR_KEY_webseeds,
   TR_KEY_webseedsSendingToUs,
+  TR_KEY_window,
+  TR_KEY_write,
   TR_N_KEYS
 };
 
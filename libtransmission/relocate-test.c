@@ -0,0 +1,250 @@
+#include <stdio.h> /* fopen() */
+#include <time.h> /* time() */
+
+#include <sys/types.h> /* stat() */
+#include <sys/stat.h> /* stat() */
+
+#include "transmission.h"
+#include "makemeta.h"
+#include "metainfo.h" /* tr_metainfoGetBasename() */
+#include "platform.h" /* tr_getResumeDir() */
+#include "torrent.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+enum
+{
+  /* big enough that the move can be interrupted partway through */
+  BIG_FILE_SIZE = (1024 * 1024 * 64),
+
+  SMALL_FILE_SIZE = 100000,
+
+  BUF_SIZE = 4096
+};
+
+static uint8_t
+getByte (uint64_t i, int seed)
+{
+  return (uint8_t)((i * 31) + (i / BUF_SIZE) + seed);
+}
+
+static void
+makeFile (const char * path, uint64_t len, int seed)
+{
+  uint64_t i;
+  char * dir = tr_dirname (path);
+  FILE * fp;
+
+  tr_mkdirp (dir, 0700);
+  fp = fopen (path, "wb");
+  for (i=0; i<len; ++i)
+    fputc (getByte (i, seed), fp);
+  fclose (fp);
+
+  tr_free (dir);
+}
+
+/* true if the file at `path' is what makeFile() wrote, except for `first' */
+static bool
+checkFile (const char * path, uint64_t len, int seed, uint8_t first)
+{
+  uint64_t i;
+  FILE * fp;
+  bool ok;
+
+  if ((fp = fopen (path, "rb")) == NULL)
+    return false;
+
+  ok = fgetc (fp) == first;
+  for (i=1; ok && i<len; ++i)
+    ok = fgetc (fp) == getByte (i, seed);
+  ok = ok && (fgetc (fp) == EOF);
+
+  fclose (fp);
+  return ok;
+}
+
+static bool
+fileExists (const char * path)
+{
+  struct stat sb;
+  return !stat (path, &sb);
+}
+
+static tr_torrent *
+addTorrent (tr_session * session, const char * filename)
+{
+  int err = 0;
+  tr_torrent * tor;
+  tr_ctor * ctor = tr_ctorNew (session);
+
+  tr_ctorSetMetainfoFromFile (ctor, filename);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  tor = tr_torrentNew (ctor, &err, NULL);
+  tr_ctorFree (ctor);
+
+  return tor;
+}
+
+static void
+makeTorrent (const char * top, const char * outfile)
+{
+  tr_metainfo_builder * builder;
+  tr_tracker_info tracker;
+
+  tracker.tier = 0;
+  tracker.announce = (char*) "http://www.example.com/announce";
+  tracker.scrape = NULL;
+  tracker.id = 0;
+
+  builder = tr_metaInfoBuilderCreate (top);
+  tr_makeMetaInfo (builder, outfile, &tracker, 1, NULL, false);
+  while (!builder->isDone)
+    tr_wait_msec (10);
+  tr_metaInfoBuilderFree (builder);
+}
+
+/***
+****
+***/
+
+static int
+test_resume_copy (void)
+{
+  int64_t i;
+  FILE * fp;
+  char * dest;
+  char * path;
+  char * checkpoint;
+  char * torrent_file;
+  char * base;
+  tr_torrent * tor;
+  struct stat sb;
+  struct stat dest_sb;
+  time_t deadline;
+  volatile double progress = 0;
+  tr_session * session = libttest_session_init (NULL);
+  const char * download_dir = tr_sessionGetDownloadDir (session);
+
+  /* the move has to copy the files, so the destination has to be
+     on another filesystem */
+  dest = tr_strdup ("/dev/shm/relocate-test-XXXXXX");
+  if ((tr_mkdtemp (dest) == NULL) || stat (download_dir, &sb)
+                                  || stat (dest, &dest_sb)
+                                  || (sb.st_dev == dest_sb.st_dev))
+    {
+      fprintf (stderr, "no other filesystem to move to; skipping\n");
+      tr_remove (dest);
+      tr_free (dest);
+      libttest_session_close (session);
+      return 0;
+    }
+
+  /* a torrent with a big file and a small one */
+  path = tr_buildPath (download_dir, "content", "a", NULL);
+  makeFile (path, BIG_FILE_SIZE, 1);
+  tr_free (path);
+  path = tr_buildPath (download_dir, "content", "sub", "b", NULL);
+  makeFile (path, SMALL_FILE_SIZE, 2);
+  tr_free (path);
+  path = tr_buildPath (download_dir, "content", NULL);
+  torrent_file = tr_buildPath (tr_sessionGetConfigDir (session), "content.torrent", NULL);
+  makeTorrent (path, torrent_file);
+  tr_free (path);
+
+  tor = addTorrent (session, torrent_file);
+  check (tor != NULL);
+  libttest_blockingTorrentVerify (tor);
+  check_int_eq (0, tr_torrentStat (tor)->leftUntilDone);
+
+  base = tr_metainfoGetBasename (tr_torrentInfo (tor));
+  checkpoint = tr_strdup_printf ("%s" TR_PATH_DELIMITER_STR "%s.relocate",
+                                 tr_getResumeDir (session), base);
+  tr_free (base);
+
+  /* start moving it, and quit once part of the big file has been copied */
+  tr_torrentSetLocation (tor, dest, true, &progress, NULL);
+  deadline = time (NULL) + 10;
+  while ((progress <= 0) && (time (NULL) <= deadline))
+    tr_wait_msec (1);
+  tr_torrentFree (tor);
+  while (tr_sessionCountTorrents (session) > 0)
+    tr_wait_msec (10);
+  check (progress > 0);
+  check (progress < 1);
+
+  /* the checkpoint says how far the copy got... */
+  {
+    tr_variant top;
+    const char * str;
+
+    check (!tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, checkpoint));
+    check (tr_variantDictFindStr (&top, TR_KEY_destination, &str, NULL));
+    check_streq (dest, str);
+    check (tr_variantDictFindInt (&top, TR_KEY_file_index, &i));
+    check_int_eq (0, i);
+    check (tr_variantDictFindInt (&top, TR_KEY_file_offset, &i));
+    check (i > 0);
+    check (i < BIG_FILE_SIZE);
+    tr_variantFree (&top);
+  }
+
+  /* ...and that much is in the partial copy. mark it, so that we can
+     tell whether the rest of the move copies it again */
+  path = tr_buildPath (dest, "content", "a", NULL);
+  check (!stat (path, &sb));
+  check (sb.st_size >= i);
+  fp = fopen (path, "r+b");
+  check (fp != NULL);
+  fputc (~getByte (0, 1), fp);
+  fclose (fp);
+  tr_free (path);
+
+  /* nothing's been taken from the old location yet */
+  path = tr_buildPath (download_dir, "content", "a", NULL);
+  check (fileExists (path));
+  tr_free (path);
+
+  /* adding the torrent again picks up where the move left off */
+  tor = addTorrent (session, torrent_file);
+  check (tor != NULL);
+  deadline = time (NULL) + 30;
+  while (tor->isRelocating && (time (NULL) <= deadline))
+    tr_wait_msec (10);
+  check (!tor->isRelocating);
+  check_streq (dest, tr_torrentGetDownloadDir (tor));
+  check (!fileExists (checkpoint));
+
+  /* the files are all in the new location... */
+  path = tr_buildPath (dest, "content", "a", NULL);
+  check (checkFile (path, BIG_FILE_SIZE, 1, (uint8_t)~getByte (0, 1)));
+  tr_free (path);
+  path = tr_buildPath (dest, "content", "sub", "b", NULL);
+  check (checkFile (path, SMALL_FILE_SIZE, 2, getByte (0, 2)));
+  tr_free (path);
+
+  /* ...and none are in the old one */
+  path = tr_buildPath (download_dir, "content", "a", NULL);
+  check (!fileExists (path));
+  tr_free (path);
+  path = tr_buildPath (download_dir, "content", "sub", "b", NULL);
+  check (!fileExists (path));
+  tr_free (path);
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, NULL);
+  libttest_session_close (session);
+  tr_remove (dest);
+  tr_free (checkpoint);
+  tr_free (torrent_file);
+  tr_free (dest);
+  return 0;
+}
+
+MAIN_SINGLE_TEST (test_resume_copy)
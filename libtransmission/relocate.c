@@ -0,0 +1,722 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_COPY_FILE_RANGE
+ #define _GNU_SOURCE /* copy_file_range () */
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h> /* open () */
+#include <string.h> /* strcmp () */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h> /* close (), unlink () */
+#include <utime.h>
+
+#ifdef HAVE_LINUX_FS_H
+ #include <sys/ioctl.h>
+ #include <linux/fs.h> /* FICLONE */
+#endif
+
+#include "transmission.h"
+#include "fdlimit.h" /* tr_pread (), tr_pwrite (), tr_fsync () */
+#include "list.h"
+#include "log.h"
+#include "metainfo.h" /* tr_metainfoGetBasename () */
+#include "platform.h" /* tr_getResumeDir (), tr_lock, tr_threadNew () */
+#include "relocate.h"
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+#include "variant.h"
+
+#ifndef O_LARGEFILE
+ #define O_LARGEFILE 0
+#endif
+
+#ifndef O_BINARY
+ #define O_BINARY 0
+#endif
+
+enum
+{
+  /* how much to copy between progress updates and checks for a stop */
+  COPY_CHUNK_SIZE = (1024 * 1024 * 8),
+
+  /* how much to copy between checkpoints */
+  CHECKPOINT_INTERVAL = (1024 * 1024 * 256),
+
+  /* the buffer for when the OS can't copy files for us */
+  COPY_BUFFER_SIZE = (1024 * 1024)
+};
+
+enum
+{
+  NODE_QUEUED,
+  NODE_RUNNING,
+  NODE_FINISHED
+};
+
+struct relocate_file
+{
+  char      * oldpath; /* NULL if the file isn't on disk */
+  char      * newpath;
+  uint64_t    length;
+};
+
+struct relocate_node
+{
+  int                      id;
+  int                      state;
+  tr_torrent             * torrent;
+  tr_session             * session;
+  char                   * location;
+  char                   * checkpoint;
+
+  struct relocate_file   * files;
+  tr_file_index_t          file_count;
+  uint64_t                 total_size;
+  uint64_t                 bytes_done;
+
+  /* where an interrupted move left off */
+  tr_file_index_t          resume_file;
+  uint64_t                 resume_offset;
+
+  volatile double        * setme_progress;
+  tr_relocate_done_func    callback_func;
+  void                   * callback_data;
+
+  bool                     stop;
+  bool                     discard;
+  int                      err;
+};
+
+/* moves waiting to be done, and the one being done, in that order */
+static tr_list * relocateList = NULL;
+
+static bool workerRunning = false;
+
+static int nextId = 1;
+
+static tr_lock*
+getRelocateLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+/***
+****  Checkpoints
+***/
+
+static char*
+getCheckpointFilename (const tr_torrent * tor)
+{
+  char * base = tr_metainfoGetBasename (tr_torrentInfo (tor));
+  char * filename = tr_strdup_printf ("%s" TR_PATH_DELIMITER_STR "%s.relocate",
+                                      tr_getResumeDir (tor->session), base);
+  tr_free (base);
+  return filename;
+}
+
+static void
+saveCheckpoint (const struct relocate_node * node, tr_file_index_t file, uint64_t offset)
+{
+  int err;
+  tr_variant top;
+
+  tr_variantInitDict (&top, 3);
+  tr_variantDictAddStr (&top, TR_KEY_destination, node->location);
+  tr_variantDictAddInt (&top, TR_KEY_file_index, file);
+  tr_variantDictAddInt (&top, TR_KEY_file_offset, offset);
+
+  if ((err = tr_variantToFile (&top, TR_VARIANT_FMT_BENC, node->checkpoint)))
+    tr_logAddError ("Couldn't save \"%s\": %s", node->checkpoint, tr_strerror (err));
+
+  tr_variantFree (&top);
+}
+
+/* returns the destination saved in the checkpoint, or NULL */
+static char*
+loadCheckpoint (const char * filename, tr_file_index_t * file, uint64_t * offset)
+{
+  tr_variant top;
+  char * location = NULL;
+
+  if (!tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, filename))
+    {
+      int64_t i;
+      const char * str;
+
+      if (tr_variantDictFindStr (&top, TR_KEY_destination, &str, NULL))
+        location = tr_strdup (str);
+      if ((file != NULL) && tr_variantDictFindInt (&top, TR_KEY_file_index, &i))
+        *file = i;
+      if ((offset != NULL) && tr_variantDictFindInt (&top, TR_KEY_file_offset, &i))
+        *offset = i;
+
+      tr_variantFree (&top);
+    }
+
+  return location;
+}
+
+char*
+tr_relocateGetCheckpoint (const tr_torrent * tor)
+{
+  char * filename = getCheckpointFilename (tor);
+  char * location = loadCheckpoint (filename, NULL, NULL);
+  tr_free (filename);
+  return location;
+}
+
+/***
+****  Copying
+***/
+
+static void
+setProgress (const struct relocate_node * node)
+{
+  if ((node->setme_progress != NULL) && (node->total_size > 0))
+    *node->setme_progress = (double)node->bytes_done / node->total_size;
+}
+
+/* copy up to `len' bytes at `offset' from `in' to `out'.
+   returns the number of bytes copied, or -1 and sets errno */
+static ssize_t
+copyChunk (int in, int out, uint64_t offset, size_t len, bool * use_copy_file_range, uint8_t ** buf)
+{
+  ssize_t n_read;
+  ssize_t n_written = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  if (*use_copy_file_range)
+    {
+      loff_t in_offset = offset;
+      loff_t out_offset = offset;
+      const ssize_t n = copy_file_range (in, &in_offset, out, &out_offset, len, 0);
+
+      if ((n >= 0) || ((errno != ENOSYS) && (errno != EXDEV) && (errno != EINVAL)
+                                         && (errno != EOPNOTSUPP)))
+        return n;
+
+      /* this kernel or filesystem can't do it; copy the bytes ourselves */
+      *use_copy_file_range = false;
+    }
+#else
+  *use_copy_file_range = false;
+#endif
+
+  if (*buf == NULL)
+    *buf = tr_valloc (COPY_BUFFER_SIZE);
+
+  n_read = tr_pread (in, *buf, MIN (len, COPY_BUFFER_SIZE), offset);
+
+  while ((n_read > 0) && (n_written < n_read))
+    {
+      const ssize_t n = tr_pwrite (out, *buf + n_written, n_read - n_written, offset + n_written);
+      if (n < 0)
+        return -1;
+      n_written += n;
+    }
+
+  return n_read;
+}
+
+/* copy the file from `offset' on. returns 0 on success, or an errno */
+static int
+copyFile (struct relocate_node        * node,
+          tr_file_index_t               fileIndex,
+          uint64_t                      offset,
+          const struct stat           * sb)
+{
+  int in;
+  int out;
+  int err = 0;
+  uint8_t * buf = NULL;
+  bool use_copy_file_range = true;
+  uint64_t checkpointed = offset;
+  const struct relocate_file * f = &node->files[fileIndex];
+  const uint64_t size = sb->st_size;
+
+  if ((in = tr_open_file_for_scanning (f->oldpath)) < 0)
+    return errno;
+
+  if ((out = open (f->newpath, O_WRONLY | O_CREAT | O_LARGEFILE | O_BINARY, 0666)) < 0)
+    {
+      err = errno;
+      tr_close_file (in);
+      return err;
+    }
+
+  /* the part that was copied before we quit last time is only
+     good if it's still there */
+  if (offset > 0)
+    {
+      struct stat out_sb;
+
+      if (fstat (out, &out_sb) || ((uint64_t)out_sb.st_size < offset) || (offset > size))
+        offset = checkpointed = 0;
+    }
+
+  if ((offset == 0) && ftruncate (out, 0))
+    err = errno;
+
+#ifdef FICLONE
+  /* if the filesystem can share the blocks, there's nothing to copy */
+  if (!err && (offset == 0) && !ioctl (out, FICLONE, in))
+    offset = size;
+#endif
+
+  node->bytes_done += offset;
+  setProgress (node);
+
+  while (!err && (offset < size))
+    {
+      ssize_t n;
+
+      if (node->stop)
+        {
+          err = ECANCELED;
+          break;
+        }
+
+      n = copyChunk (in, out, offset, MIN (size - offset, COPY_CHUNK_SIZE), &use_copy_file_range, &buf);
+      if (n <= 0)
+        {
+          err = n < 0 ? errno : EIO; /* EIO if the file got smaller */
+          break;
+        }
+
+      offset += n;
+      node->bytes_done += n;
+      setProgress (node);
+
+      /* make sure the bytes are on disk before saying they're there */
+      if (offset - checkpointed >= CHECKPOINT_INTERVAL)
+        {
+          if (!tr_fsync (out))
+            saveCheckpoint (node, fileIndex, offset);
+          checkpointed = offset;
+        }
+    }
+
+  if (!err && tr_fsync (out))
+    err = errno;
+
+  if ((err == ECANCELED) && !node->discard && !tr_fsync (out))
+    saveCheckpoint (node, fileIndex, offset);
+
+  tr_free (buf);
+  tr_close_file (in);
+  if (close (out) && !err)
+    err = errno;
+
+  return err;
+}
+
+/* returns 0 on success, or an errno */
+static int
+moveFile (struct relocate_node * node, tr_file_index_t fileIndex, uint64_t offset)
+{
+  int err = 0;
+  char * dir;
+  struct stat sb;
+  const struct relocate_file * f = &node->files[fileIndex];
+  const uint64_t bytes_done = node->bytes_done;
+
+  /* nothing to do if the file isn't on disk, or has already been moved */
+  if ((f->oldpath == NULL) || tr_is_same_file (f->oldpath, f->newpath))
+    {
+      node->bytes_done += f->length;
+      setProgress (node);
+      return 0;
+    }
+
+  if (stat (f->oldpath, &sb))
+    return errno;
+  if (!S_ISREG (sb.st_mode))
+    return ENOENT;
+
+  dir = tr_dirname (f->newpath);
+  if (tr_mkdirp (dir, 0777))
+    err = errno;
+  tr_free (dir);
+  if (err)
+    return err;
+
+  /* they might be on the same filesystem... */
+  if ((offset > 0) || tr_rename (f->oldpath, f->newpath))
+    {
+      if ((offset == 0) && (errno != EXDEV))
+        return errno;
+
+      tr_logAddTorDbg (node->torrent, "copying \"%s\" to \"%s\"", f->oldpath, f->newpath);
+
+      /* remember which file we're on, in case we quit before the next checkpoint */
+      if (offset == 0)
+        saveCheckpoint (node, fileIndex, 0);
+
+      err = copyFile (node, fileIndex, offset, &sb);
+
+      if (!err)
+        {
+          struct utimbuf times;
+          times.actime = sb.st_atime;
+          times.modtime = sb.st_mtime;
+          utime (f->newpath, &times);
+
+          if (tr_remove (f->oldpath))
+            err = errno;
+        }
+      else if ((err != ECANCELED) || node->discard)
+        {
+          tr_remove (f->newpath);
+        }
+    }
+
+  if (!err)
+    {
+      node->bytes_done = bytes_done + f->length;
+      setProgress (node);
+    }
+
+  return err;
+}
+
+static void
+runNode (struct relocate_node * node)
+{
+  tr_file_index_t i;
+
+  node->bytes_done = 0;
+
+  for (i=0; !node->err && i<node->file_count; ++i)
+    {
+      const uint64_t offset = i == node->resume_file ? node->resume_offset : 0;
+
+      if (node->stop)
+        {
+          node->err = ECANCELED;
+          break;
+        }
+
+      node->err = moveFile (node, i, offset);
+
+      if (node->err && (node->err != ECANCELED))
+        tr_logAddTorErr (node->torrent, "error moving \"%s\" to \"%s\": %s",
+                         node->files[i].oldpath, node->files[i].newpath,
+                         tr_strerror (node->err));
+    }
+}
+
+/***
+****
+***/
+
+static void
+freeNode (struct relocate_node * node)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<node->file_count; ++i)
+    {
+      tr_free (node->files[i].oldpath);
+      tr_free (node->files[i].newpath);
+    }
+
+  tr_free (node->files);
+  tr_free (node->checkpoint);
+  tr_free (node->location);
+  tr_free (node);
+}
+
+static int
+compareNodeToTorrent (const void * va, const void * vb)
+{
+  const struct relocate_node * a = va;
+  const tr_torrent * b = vb;
+  return a->torrent - b;
+}
+
+static int
+compareNodeToId (const void * va, const void * vb)
+{
+  const struct relocate_node * a = va;
+  const int * b = vb;
+  return a->id - *b;
+}
+
+static struct relocate_node*
+getNextNode (void)
+{
+  tr_list * l;
+
+  for (l=relocateList; l!=NULL; l=l->next)
+    if (((struct relocate_node*)l->data)->state == NODE_QUEUED)
+      return l->data;
+
+  return NULL;
+}
+
+/* called in the libtransmission thread when a move finishes by itself */
+static void
+onNodeDone (void * vid)
+{
+  struct relocate_node * node;
+  tr_lock * lock = getRelocateLock ();
+
+  tr_lockLock (lock);
+  node = tr_list_remove (&relocateList, vid, compareNodeToId);
+  tr_lockUnlock (lock);
+
+  /* if it's not there, tr_relocateRemove () already took care of it */
+  if (node != NULL)
+    {
+      if (node->callback_func != NULL)
+        (*node->callback_func)(node->torrent, node->err, node->callback_data);
+
+      /* the callback has saved the new location, if there was one,
+         so the checkpoint isn't needed anymore */
+      tr_remove (node->checkpoint);
+      freeNode (node);
+    }
+
+  tr_free (vid);
+}
+
+static void
+relocateThreadFunc (void * unused UNUSED)
+{
+  struct relocate_node * node;
+  tr_lock * lock = getRelocateLock ();
+
+  tr_lockLock (lock);
+
+  while ((node = getNextNode ()))
+    {
+      node->state = NODE_RUNNING;
+      tr_lockUnlock (lock);
+      runNode (node);
+      tr_lockLock (lock);
+      node->state = NODE_FINISHED;
+
+      /* stopped nodes are finished by whoever stopped them */
+      if (!node->stop)
+        {
+          int * id = tr_new (int, 1);
+          *id = node->id;
+          tr_runInEventThread (node->session, onNodeDone, id);
+        }
+    }
+
+  workerRunning = false;
+  tr_lockUnlock (lock);
+}
+
+static struct relocate_node*
+newNode (tr_torrent             * tor,
+         const char             * location,
+         volatile double        * setme_progress,
+         tr_relocate_done_func    callback_func,
+         void                   * callback_data)
+{
+  tr_file_index_t i;
+  struct relocate_node * node;
+
+  node = tr_new0 (struct relocate_node, 1);
+  node->state = NODE_QUEUED;
+  node->torrent = tor;
+  node->session = tor->session;
+  node->location = tr_strdup (location);
+  node->checkpoint = getCheckpointFilename (tor);
+  node->total_size = tor->info.totalSize;
+  node->setme_progress = setme_progress;
+  node->callback_func = callback_func;
+  node->callback_data = callback_data;
+
+  /* the worker mustn't look at the torrent, so give it the paths */
+  node->file_count = tor->info.fileCount;
+  node->files = tr_new0 (struct relocate_file, node->file_count);
+  for (i=0; i<node->file_count; ++i)
+    {
+      char * sub;
+      const char * base;
+      struct relocate_file * f = &node->files[i];
+
+      f->length = tor->info.files[i].length;
+
+      if (tr_torrentFindFile2 (tor, i, &base, &sub, NULL))
+        {
+          f->oldpath = tr_buildPath (base, sub, NULL);
+          f->newpath = tr_buildPath (location, sub, NULL);
+          tr_free (sub);
+        }
+    }
+
+  return node;
+}
+
+bool
+tr_relocateCanRename (const tr_torrent * tor, const char * location)
+{
+  tr_file_index_t i;
+  struct stat sb;
+  dev_t dev;
+
+  if (stat (location, &sb))
+    return false;
+
+  dev = sb.st_dev;
+
+  for (i=0; i<tor->info.fileCount; ++i)
+    {
+      char * filename = tr_torrentFindFile (tor, i);
+      const bool other_dev = (filename != NULL) && !stat (filename, &sb) && (sb.st_dev != dev);
+      tr_free (filename);
+
+      if (other_dev)
+        return false;
+    }
+
+  return true;
+}
+
+int
+tr_relocateNow (tr_torrent * tor, const char * location, volatile double * setme_progress)
+{
+  int err;
+  struct relocate_node * node;
+
+  assert (tr_isTorrent (tor));
+
+  node = newNode (tor, location, setme_progress, NULL, NULL);
+  runNode (node);
+  err = node->err;
+
+  /* a copy might have saved a checkpoint */
+  tr_remove (node->checkpoint);
+  freeNode (node);
+  return err;
+}
+
+void
+tr_relocateAdd (tr_torrent             * tor,
+                const char             * location,
+                volatile double        * setme_progress,
+                tr_relocate_done_func    callback_func,
+                void                   * callback_data)
+{
+  char * saved;
+  struct relocate_node * node;
+  tr_lock * lock = getRelocateLock ();
+
+  assert (tr_isTorrent (tor));
+  assert (tr_amInEventThread (tor->session));
+
+  node = newNode (tor, location, setme_progress, callback_func, callback_data);
+
+  /* pick up where we left off if this move was interrupted */
+  saved = loadCheckpoint (node->checkpoint, &node->resume_file, &node->resume_offset);
+  if ((saved == NULL) || strcmp (saved, location))
+    node->resume_file = node->resume_offset = 0;
+  tr_free (saved);
+
+  /* save a checkpoint now so that the move is finished
+     even if we quit before the worker gets to it */
+  saveCheckpoint (node, node->resume_file, node->resume_offset);
+
+  tr_logAddTorInfo (tor, "Moving files to \"%s\"", location);
+
+  tr_lockLock (lock);
+  node->id = nextId++;
+  tr_list_append (&relocateList, node);
+  if (!workerRunning)
+    {
+      workerRunning = true;
+      tr_threadNew (relocateThreadFunc, NULL);
+    }
+  tr_lockUnlock (lock);
+}
+
+void
+tr_relocateRemove (tr_torrent * tor, bool discard)
+{
+  struct relocate_node * node;
+  tr_lock * lock = getRelocateLock ();
+
+  assert (tr_isTorrent (tor));
+
+  tr_lockLock (lock);
+
+  node = tr_list_remove (&relocateList, tor, compareNodeToTorrent);
+
+  if ((node != NULL) && (node->state == NODE_RUNNING))
+    {
+      node->stop = true;
+      node->discard = discard;
+
+      /* wait for the worker to let go of it */
+      while (node->state == NODE_RUNNING)
+        {
+          tr_lockUnlock (lock);
+          tr_wait_msec (50);
+          tr_lockLock (lock);
+        }
+    }
+
+  tr_lockUnlock (lock);
+
+  if (node != NULL)
+    {
+      if (discard)
+        tr_remove (node->checkpoint);
+
+      if (node->callback_func != NULL)
+        (*node->callback_func)(tor, ECANCELED, node->callback_data);
+
+      freeNode (node);
+    }
+}
+
+void
+tr_relocateClose (tr_session * session)
+{
+  tr_list * l;
+  tr_lock * lock = getRelocateLock ();
+
+  tr_lockLock (lock);
+
+  /* the torrents finish their nodes when they're freed */
+  for (l=relocateList; l!=NULL; l=l->next)
+    {
+      struct relocate_node * node = l->data;
+
+      if (node->session == session)
+        node->stop = true;
+    }
+
+  /* give the worker a chance to save its place */
+  while (workerRunning)
+    {
+      tr_lockUnlock (lock);
+      tr_wait_msec (50);
+      tr_lockLock (lock);
+    }
+
+  tr_lockUnlock (lock);
+}
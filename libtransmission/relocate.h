@@ -0,0 +1,83 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_RELOCATE_H
+#define TR_RELOCATE_H 1
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * Called in the libtransmission thread when a move is done.
+ * `err' is 0 on success, ECANCELED if the move was removed
+ * by tr_relocateRemove (), or the errno that stopped it.
+ */
+typedef void (*tr_relocate_done_func)(tr_torrent  * tor,
+                                      int           err,
+                                      void        * user_data);
+
+/**
+ * Move a torrent's files to `location' in a worker thread.
+ *
+ * Files on the same filesystem are renamed. Others are cloned or copied
+ * with copy_file_range () where the OS supports it, and `setme_progress'
+ * is updated as the bytes are copied. The move's progress is saved in a
+ * checkpoint beside the torrent's resume file, so a move that's
+ * interrupted by quitting can be finished by tr_relocateGetCheckpoint ().
+ *
+ * The torrent mustn't read or write its files until the move is done.
+ */
+void tr_relocateAdd (tr_torrent             * tor,
+                     const char             * location,
+                     volatile double        * setme_progress,
+                     tr_relocate_done_func    callback_func,
+                     void                   * callback_data);
+
+/**
+ * @return true if all of the torrent's files are on the same filesystem
+ *         as `location', so that moving them there is just a rename.
+ */
+bool tr_relocateCanRename (const tr_torrent * tor, const char * location);
+
+/**
+ * Move a torrent's files to `location' right away, in the calling thread.
+ * @return 0 on success, or the errno that stopped the move
+ */
+int tr_relocateNow (tr_torrent       * tor,
+                    const char       * location,
+                    volatile double  * setme_progress);
+
+/**
+ * Stop moving a torrent's files, and call its callback with ECANCELED.
+ * If `discard' is true, the partial copy and the checkpoint are deleted.
+ * Otherwise they're kept so the move can be finished later.
+ */
+void tr_relocateRemove (tr_torrent * tor, bool discard);
+
+/**
+ * @return the destination of a move that was interrupted, or NULL.
+ *         The caller must tr_free () the result.
+ */
+char * tr_relocateGetCheckpoint (const tr_torrent * tor);
+
+/** Stop all moves at their checkpoints so that they can be finished later */
+void tr_relocateClose (tr_session *);
+
+/* @} */
+
+#endif
@@ -0,0 +1,402 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/*
+ * Compares the peer manager's request table with the sorted array of
+ * struct block_request that it replaced.
+ *
+ * Both are driven by the same simulated swarm: each peer keeps a full
+ * request pipeline, and every step one peer delivers its oldest block
+ * and asks for more from a random piece, checking each candidate block
+ * for other requests the way tr_peerMgrGetNextRequests () does. Peers
+ * choke us now and then, which cancels all of their requests, and the
+ * table is checked for timed-out requests once per simulated second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* strtoul (), bsearch (), rand (), EXIT_FAILURE */
+#include <string.h> /* memmove () */
+#include <sys/resource.h> /* getrusage () */
+
+#include "transmission.h"
+#include "peer-common.h"
+#include "request-list.h"
+#include "tr-getopt.h"
+#include "utils.h"
+
+#define MY_NAME "request-bench"
+
+static size_t piece_count = 50000;
+static size_t blocks_per_piece = 16;
+static size_t peer_count = 200;
+static size_t depth = 128;
+static size_t step_count = 2000000;
+
+static tr_option options[] =
+{
+  { 'p', "pieces", "Number of pieces in the torrent", "p", 1, "<count>" },
+  { 'b', "blocks", "Blocks per piece", "b", 1, "<count>" },
+  { 'c', "peers", "Number of peers", "c", 1, "<count>" },
+  { 'd', "depth", "Requests in each peer's pipeline", "d", 1, "<count>" },
+  { 's', "steps", "Number of blocks to deliver", "s", 1, "<count>" },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int
+parseCommandLine (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 'p': piece_count = strtoul (optarg, NULL, 10); break;
+          case 'b': blocks_per_piece = strtoul (optarg, NULL, 10); break;
+          case 'c': peer_count = strtoul (optarg, NULL, 10); break;
+          case 'd': depth = strtoul (optarg, NULL, 10); break;
+          case 's': step_count = strtoul (optarg, NULL, 10); break;
+          default: return 1;
+        }
+    }
+
+  /* leave plenty of unrequested blocks for the peers to choose from */
+  return (peer_count > 0) && (depth > 0) && (step_count > 0)
+      && (peer_count * depth * 2 <= piece_count * blocks_per_piece) ? 0 : 1;
+}
+
+/* each peer's pipeline, oldest request first */
+struct pipeline
+{
+  tr_block_index_t * blocks;
+  size_t head;
+  size_t count;
+};
+
+static tr_peer * peers = NULL;
+static struct pipeline * pipelines = NULL;
+
+/***
+****  The old table: one array of requests sorted by block, then by peer
+***/
+
+struct block_request
+{
+  tr_block_index_t block;
+  tr_peer * peer;
+  time_t sentAt;
+};
+
+static struct block_request * array_requests = NULL;
+static int array_count = 0;
+static int array_alloc = 0;
+
+static int
+compareReqByBlock (const void * va, const void * vb)
+{
+  const struct block_request * a = va;
+  const struct block_request * b = vb;
+
+  if (a->block < b->block) return -1;
+  if (a->block > b->block) return 1;
+  if (a->peer < b->peer) return -1;
+  if (a->peer > b->peer) return 1;
+  return 0;
+}
+
+static void
+arrayAdd (tr_block_index_t block, tr_peer * peer, time_t now)
+{
+  bool exact;
+  int pos;
+  struct block_request key;
+
+  if (array_count + 1 >= array_alloc)
+    {
+      array_alloc += 128;
+      array_requests = tr_renew (struct block_request, array_requests, array_alloc);
+    }
+
+  key.block = block;
+  key.peer = peer;
+  key.sentAt = now;
+  pos = tr_lowerBound (&key, array_requests, array_count,
+                       sizeof (struct block_request), compareReqByBlock, &exact);
+  memmove (array_requests + pos + 1, array_requests + pos,
+           sizeof (struct block_request) * (array_count++ - pos));
+  array_requests[pos] = key;
+  ++peer->pendingReqsToPeer;
+}
+
+static void
+arrayRemove (tr_block_index_t block, tr_peer * peer)
+{
+  struct block_request key;
+  struct block_request * b;
+
+  key.block = block;
+  key.peer = peer;
+  b = bsearch (&key, array_requests, array_count,
+               sizeof (struct block_request), compareReqByBlock);
+  if (b != NULL)
+    {
+      --b->peer->pendingReqsToPeer;
+      tr_removeElementFromArray (array_requests, b - array_requests,
+                                 sizeof (struct block_request), array_count--);
+    }
+}
+
+static int
+arrayCountPeers (tr_block_index_t block)
+{
+  int i, n;
+  bool exact;
+  struct block_request key;
+
+  key.block = block;
+  key.peer = NULL;
+  i = tr_lowerBound (&key, array_requests, array_count,
+                     sizeof (struct block_request), compareReqByBlock, &exact);
+  for (n=0; i<array_count && array_requests[i].block==block; ++i)
+    ++n;
+  return n;
+}
+
+static void
+arrayDeclineAll (tr_peer * peer)
+{
+  int i, n;
+  tr_block_index_t * blocks = tr_new (tr_block_index_t, array_count);
+
+  for (i=n=0; i<array_count; ++i)
+    if (array_requests[i].peer == peer)
+      blocks[n++] = array_requests[i].block;
+  for (i=0; i<n; ++i)
+    arrayRemove (blocks[i], peer);
+
+  tr_free (blocks);
+}
+
+static int
+arrayCountExpired (time_t too_old)
+{
+  int i, n;
+
+  for (i=n=0; i<array_count; ++i)
+    if (array_requests[i].sentAt <= too_old)
+      ++n;
+
+  return n;
+}
+
+static void
+arrayFree (void)
+{
+  tr_free (array_requests);
+  array_requests = NULL;
+  array_count = array_alloc = 0;
+}
+
+/***
+****  The new table
+***/
+
+static tr_requestList list = TR_REQUEST_LIST_INIT;
+
+static void
+listAdd (tr_block_index_t block, tr_peer * peer, time_t now)
+{
+  tr_requestListAdd (&list, block, peer, now);
+}
+
+static void
+listRemove (tr_block_index_t block, tr_peer * peer)
+{
+  tr_request * req = tr_requestListFind (&list, block, peer);
+
+  if (req != NULL)
+    tr_requestListRemove (&list, req);
+}
+
+static int
+listCountPeers (tr_block_index_t block)
+{
+  return tr_requestListGetPeers (&list, block, NULL, 0);
+}
+
+static void
+listDeclineAll (tr_peer * peer)
+{
+  tr_request * req;
+
+  while ((req = tr_requestListPeerFirst (peer)))
+    tr_requestListRemove (&list, req);
+}
+
+static int
+listCountExpired (time_t too_old)
+{
+  size_t i;
+  int n = 0;
+
+  for (i=0; i<peer_count; ++i)
+    {
+      const tr_request * req;
+
+      for (req=tr_requestListPeerFirst (&peers[i]); req!=NULL && req->sentAt<=too_old; req=tr_requestListPeerNext (req))
+        ++n;
+    }
+
+  return n;
+}
+
+static void
+listFree (void)
+{
+  tr_requestListDestruct (&list);
+}
+
+/***
+****  The simulated swarm
+***/
+
+struct table
+{
+  const char * name;
+  void (*add)(tr_block_index_t, tr_peer *, time_t);
+  void (*remove)(tr_block_index_t, tr_peer *);
+  int (*countPeers)(tr_block_index_t);
+  void (*declineAll)(tr_peer *);
+  int (*countExpired)(time_t);
+  void (*free)(void);
+};
+
+static void
+fillPipeline (const struct table * t, size_t i, time_t now)
+{
+  struct pipeline * pipe = &pipelines[i];
+
+  while (pipe->count < depth)
+    {
+      size_t b;
+      const size_t piece = rand () % piece_count;
+      const tr_block_index_t first = piece * blocks_per_piece;
+
+      for (b=0; b<blocks_per_piece && pipe->count<depth; ++b)
+        {
+          if (t->countPeers (first + b) != 0)
+            continue;
+
+          t->add (first + b, &peers[i], now);
+          pipe->blocks[(pipe->head + pipe->count++) % depth] = first + b;
+        }
+    }
+}
+
+static void
+runTable (const struct table * t, unsigned int seed)
+{
+  size_t i;
+  size_t step;
+  time_t now = 0;
+  int expired = 0;
+  struct rusage ru;
+  uint64_t cpu;
+
+  srand (seed);
+
+  for (i=0; i<peer_count; ++i)
+    {
+      memset (&peers[i], 0, sizeof (tr_peer));
+      pipelines[i].head = pipelines[i].count = 0;
+    }
+
+  getrusage (RUSAGE_SELF, &ru);
+  cpu = (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+
+  for (i=0; i<peer_count; ++i)
+    fillPipeline (t, i, now);
+
+  for (step=0; step<step_count; ++step)
+    {
+      const size_t p = rand () % peer_count;
+      struct pipeline * pipe = &pipelines[p];
+
+      if (rand () % 1000 == 0)
+        {
+          /* the peer choked us */
+          t->declineAll (&peers[p]);
+          pipe->head = pipe->count = 0;
+        }
+      else if (pipe->count > 0)
+        {
+          /* the peer sent its oldest block */
+          t->remove (pipe->blocks[pipe->head], &peers[p]);
+          pipe->head = (pipe->head + 1) % depth;
+          --pipe->count;
+        }
+
+      fillPipeline (t, p, now);
+
+      /* a few hundred blocks a second, and one upkeep pass per second */
+      if ((step % 500) == 0)
+        expired += t->countExpired (now++ - 90);
+    }
+
+  getrusage (RUSAGE_SELF, &ru);
+  cpu = (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec - cpu;
+
+  printf ("%-8s %8.1f ns/step %8.3f CPU s %10d requests expired\n",
+          t->name, (cpu * 1000.0) / step_count, cpu / 1000000.0, expired);
+
+  for (i=0; i<peer_count; ++i)
+    t->declineAll (&peers[i]);
+  t->free ();
+}
+
+int
+main (int argc, char ** argv)
+{
+  size_t i;
+  static const struct table tables[] =
+  {
+    { "array", arrayAdd, arrayRemove, arrayCountPeers, arrayDeclineAll, arrayCountExpired, arrayFree },
+    { "index", listAdd, listRemove, listCountPeers, listDeclineAll, listCountExpired, listFree }
+  };
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  peers = tr_new0 (tr_peer, peer_count);
+  pipelines = tr_new0 (struct pipeline, peer_count);
+  for (i=0; i<peer_count; ++i)
+    pipelines[i].blocks = tr_new (tr_block_index_t, depth);
+
+  printf ("%zu pieces of %zu blocks, %zu peers with %zu requests each, %zu steps\n",
+          piece_count, blocks_per_piece, peer_count, depth, step_count);
+
+  for (i=0; i<sizeof (tables) / sizeof (tables[0]); ++i)
+    runTable (&tables[i], 1);
+
+  for (i=0; i<peer_count; ++i)
+    tr_free (pipelines[i].blocks);
+  tr_free (pipelines);
+  tr_free (peers);
+  return 0;
+}
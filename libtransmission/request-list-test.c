@@ -0,0 +1,235 @@
+#include <stdlib.h> /* rand(), srand() */
+#include <string.h> /* memset() */
+
+#include "transmission.h"
+#include "peer-common.h"
+#include "request-list.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+enum
+{
+  PEER_COUNT = 8,
+  BLOCK_COUNT = 500
+};
+
+/* true if `peer's requests are for `blocks', oldest first */
+static bool
+peerHasRequests (const tr_peer * peer, const tr_block_index_t * blocks, int n)
+{
+  int i = 0;
+  const tr_request * req;
+
+  for (req=tr_requestListPeerFirst (peer); req!=NULL; req=tr_requestListPeerNext (req))
+    if ((i >= n) || (req->peer != peer) || (req->block != blocks[i++]))
+      return false;
+
+  return (i == n) && (peer->pendingReqsToPeer == n);
+}
+
+static int
+test_add_find (void)
+{
+  tr_peer a;
+  tr_peer b;
+  tr_peer * peers[2];
+  tr_request * req;
+  tr_requestList list = TR_REQUEST_LIST_INIT;
+
+  memset (&a, 0, sizeof (tr_peer));
+  memset (&b, 0, sizeof (tr_peer));
+
+  check_int_eq (0, tr_requestListCount (&list));
+  check (tr_requestListFind (&list, 0, &a) == NULL);
+  check_int_eq (0, tr_requestListGetPeers (&list, 0, peers, 2));
+
+  /* a request is found by its block and its peer */
+  req = tr_requestListAdd (&list, 10, &a, 100);
+  check (req != NULL);
+  check_ptr_eq (req, tr_requestListFind (&list, 10, &a));
+  check_int_eq (10, req->block);
+  check_ptr_eq (&a, req->peer);
+  check_int_eq (100, req->sentAt);
+  check (tr_requestListFind (&list, 10, &b) == NULL);
+  check (tr_requestListFind (&list, 11, &a) == NULL);
+  check_int_eq (1, tr_requestListCount (&list));
+  check_int_eq (1, a.pendingReqsToPeer);
+
+  /* a block can be requested from more than one peer */
+  check (tr_requestListAdd (&list, 10, &b, 101) != NULL);
+  check (tr_requestListAdd (&list, 11, &b, 101) != NULL);
+  check_int_eq (3, tr_requestListCount (&list));
+  check_int_eq (2, b.pendingReqsToPeer);
+  check_int_eq (2, tr_requestListGetPeers (&list, 10, peers, 2));
+  check ((peers[0] == &a) || (peers[1] == &a));
+  check ((peers[0] == &b) || (peers[1] == &b));
+  check_int_eq (1, tr_requestListGetPeers (&list, 11, peers, 2));
+  check_ptr_eq (&b, peers[0]);
+
+  /* only `max' peers are returned, but all of them are counted */
+  peers[0] = peers[1] = NULL;
+  check_int_eq (2, tr_requestListGetPeers (&list, 10, peers, 1));
+  check (peers[0] != NULL);
+  check (peers[1] == NULL);
+
+  /* removing one peer's request leaves the other's */
+  tr_requestListRemove (&list, tr_requestListFind (&list, 10, &a));
+  check (tr_requestListFind (&list, 10, &a) == NULL);
+  check (tr_requestListFind (&list, 10, &b) != NULL);
+  check_int_eq (1, tr_requestListGetPeers (&list, 10, peers, 2));
+  check_ptr_eq (&b, peers[0]);
+  check_int_eq (2, tr_requestListCount (&list));
+  check_int_eq (0, a.pendingReqsToPeer);
+  check (tr_requestListPeerFirst (&a) == NULL);
+
+  tr_requestListDestruct (&list);
+  check_int_eq (0, tr_requestListCount (&list));
+  return 0;
+}
+
+static int
+test_peer_order (void)
+{
+  tr_peer a;
+  tr_request * req;
+  tr_requestList list = TR_REQUEST_LIST_INIT;
+  const tr_block_index_t all[] = { 5, 3, 9, 1, 7 };
+  const tr_block_index_t no_middle[] = { 5, 3, 1, 7 };
+  const tr_block_index_t no_ends[] = { 3, 1 };
+  const tr_block_index_t appended[] = { 3, 1, 2, 5 };
+  int i;
+
+  memset (&a, 0, sizeof (tr_peer));
+
+  /* a peer's requests are kept in the order they were sent */
+  for (i=0; i<5; ++i)
+    tr_requestListAdd (&list, all[i], &a, i);
+  check (peerHasRequests (&a, all, 5));
+
+  /* and stay in order when requests are removed from anywhere in the list */
+  tr_requestListRemove (&list, tr_requestListFind (&list, 9, &a));
+  check (peerHasRequests (&a, no_middle, 4));
+  tr_requestListRemove (&list, tr_requestListFind (&list, 5, &a));
+  tr_requestListRemove (&list, tr_requestListFind (&list, 7, &a));
+  check (peerHasRequests (&a, no_ends, 2));
+
+  /* new requests go after the ones that are left */
+  tr_requestListAdd (&list, 2, &a, 10);
+  tr_requestListAdd (&list, 5, &a, 11);
+  check (peerHasRequests (&a, appended, 4));
+
+  /* a peer that chokes us loses all its requests */
+  while ((req = tr_requestListPeerFirst (&a)))
+    tr_requestListRemove (&list, req);
+  check (peerHasRequests (&a, NULL, 0));
+  check_int_eq (0, tr_requestListCount (&list));
+
+  tr_requestListDestruct (&list);
+  return 0;
+}
+
+/***
+****  Add and remove requests at random, and check the list against
+****  a table of which peers are requesting which blocks
+***/
+
+static int
+test_random (void)
+{
+  int i;
+  int j;
+  int k;
+  int count = 0;
+  tr_request * req;
+  tr_peer peers[PEER_COUNT];
+  tr_peer * found[PEER_COUNT];
+  static bool requested[BLOCK_COUNT][PEER_COUNT];
+  tr_requestList list = TR_REQUEST_LIST_INIT;
+
+  srand (1);
+  memset (peers, 0, sizeof (peers));
+  memset (requested, 0, sizeof (requested));
+
+  for (i=0; i<20000; ++i)
+    {
+      const tr_block_index_t block = rand () % BLOCK_COUNT;
+      tr_peer * peer = &peers[rand () % PEER_COUNT];
+      const int p = peer - peers;
+
+      if (rand () % 500 == 0)
+        {
+          /* the peer choked us */
+          while ((req = tr_requestListPeerFirst (peer)))
+            {
+              requested[req->block][p] = false;
+              tr_requestListRemove (&list, req);
+              --count;
+            }
+        }
+      else if (requested[block][p])
+        {
+          tr_requestListRemove (&list, tr_requestListFind (&list, block, peer));
+          requested[block][p] = false;
+          --count;
+        }
+      else
+        {
+          tr_requestListAdd (&list, block, peer, i);
+          requested[block][p] = true;
+          ++count;
+        }
+    }
+
+  check_int_eq (count, tr_requestListCount (&list));
+
+  /* every request is found by block and by peer, and no others */
+  for (i=0; i<BLOCK_COUNT; ++i)
+    {
+      int n = 0;
+
+      for (j=0; j<PEER_COUNT; ++j)
+        {
+          req = tr_requestListFind (&list, i, &peers[j]);
+          check (requested[i][j] == (req != NULL));
+          n += requested[i][j];
+        }
+
+      check_int_eq (n, tr_requestListGetPeers (&list, i, found, PEER_COUNT));
+      for (k=0; k<n; ++k)
+        check (requested[i][found[k] - peers]);
+    }
+
+  for (j=0; j<PEER_COUNT; ++j)
+    {
+      int n = 0;
+      time_t prev = 0;
+
+      for (req=tr_requestListPeerFirst (&peers[j]); req!=NULL; req=tr_requestListPeerNext (req))
+        {
+          check (requested[req->block][j]);
+          check (req->sentAt >= prev);
+          prev = req->sentAt;
+          ++n;
+        }
+
+      check_int_eq (n, peers[j].pendingReqsToPeer);
+    }
+
+  tr_requestListDestruct (&list);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_add_find,
+                             test_peer_order,
+                             test_random };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,224 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "peer-common.h"
+#include "request-list.h"
+#include "utils.h"
+
+enum
+{
+  /* the table is grown whenever it has more requests than buckets */
+  MIN_BUCKET_COUNT = 64
+};
+
+static inline size_t
+getBucket (const tr_requestList * list, tr_block_index_t block)
+{
+  uint32_t h = block;
+  h *= 2654435761u;
+  h ^= h >> 16;
+  return h & list->bucket_mask;
+}
+
+static void
+growBuckets (tr_requestList * list)
+{
+  size_t i;
+  const size_t old_count = list->buckets ? list->bucket_mask + 1 : 0;
+  const size_t new_count = old_count ? old_count * 2 : MIN_BUCKET_COUNT;
+  tr_request ** old_buckets = list->buckets;
+
+  list->buckets = tr_new0 (tr_request*, new_count);
+  list->bucket_mask = new_count - 1;
+
+  for (i=0; i<old_count; ++i)
+    {
+      tr_request * req = old_buckets[i];
+
+      while (req != NULL)
+        {
+          tr_request * next = req->bucket_next;
+          tr_request ** head = &list->buckets[getBucket (list, req->block)];
+          req->bucket_next = *head;
+          *head = req;
+          req = next;
+        }
+    }
+
+  tr_free (old_buckets);
+}
+
+void
+tr_requestListDestruct (tr_requestList * list)
+{
+  size_t i;
+  tr_request * req;
+
+  if (list->buckets != NULL)
+    {
+      for (i=0; i<=list->bucket_mask; ++i)
+        {
+          while ((req = list->buckets[i]))
+            {
+              list->buckets[i] = req->bucket_next;
+              tr_free (req);
+            }
+        }
+    }
+
+  while ((req = list->recycled))
+    {
+      list->recycled = req->bucket_next;
+      tr_free (req);
+    }
+
+  tr_free (list->buckets);
+  memset (list, 0, sizeof (tr_requestList));
+}
+
+/***
+****
+***/
+
+tr_request *
+tr_requestListAdd (tr_requestList    * list,
+                   tr_block_index_t    block,
+                   tr_peer           * peer,
+                   time_t              now)
+{
+  tr_request * req;
+  tr_request ** head;
+
+  assert (peer != NULL);
+  assert (tr_requestListFind (list, block, peer) == NULL);
+
+  if ((list->buckets == NULL) || ((size_t)list->count > list->bucket_mask))
+    growBuckets (list);
+
+  if ((req = list->recycled))
+    list->recycled = req->bucket_next;
+  else
+    req = tr_new (tr_request, 1);
+
+  req->block = block;
+  req->peer = peer;
+  req->sentAt = now;
+
+  /* add it to its bucket... */
+  head = &list->buckets[getBucket (list, block)];
+  req->bucket_next = *head;
+  *head = req;
+
+  /* and to the tail of its peer's list */
+  req->peer_next = NULL;
+  if (peer->requests == NULL)
+    {
+      req->peer_prev = req;
+      peer->requests = req;
+    }
+  else
+    {
+      tr_request * tail = peer->requests->peer_prev;
+      req->peer_prev = tail;
+      tail->peer_next = req;
+      peer->requests->peer_prev = req;
+    }
+
+  ++list->count;
+  ++peer->pendingReqsToPeer;
+  return req;
+}
+
+void
+tr_requestListRemove (tr_requestList * list, tr_request * req)
+{
+  tr_request ** it;
+  tr_peer * peer = req->peer;
+
+  /* remove it from its bucket... */
+  for (it=&list->buckets[getBucket (list, req->block)]; *it!=req; it=&(*it)->bucket_next)
+    assert (*it != NULL);
+  *it = req->bucket_next;
+
+  /* and from its peer's list */
+  if (req == peer->requests)
+    {
+      peer->requests = req->peer_next;
+      if (peer->requests != NULL)
+        peer->requests->peer_prev = req->peer_prev;
+    }
+  else
+    {
+      req->peer_prev->peer_next = req->peer_next;
+      if (req->peer_next != NULL)
+        req->peer_next->peer_prev = req->peer_prev;
+      else
+        peer->requests->peer_prev = req->peer_prev;
+    }
+
+  --list->count;
+  if (peer->pendingReqsToPeer > 0)
+    --peer->pendingReqsToPeer;
+
+  req->bucket_next = list->recycled;
+  list->recycled = req;
+}
+
+tr_request *
+tr_requestListFind (const tr_requestList  * list,
+                    tr_block_index_t        block,
+                    const tr_peer         * peer)
+{
+  tr_request * req = NULL;
+
+  if (list->count > 0)
+    for (req=list->buckets[getBucket (list, block)]; req!=NULL; req=req->bucket_next)
+      if ((req->block == block) && (req->peer == peer))
+        break;
+
+  return req;
+}
+
+int
+tr_requestListGetPeers (const tr_requestList  * list,
+                        tr_block_index_t        block,
+                        tr_peer              ** setme,
+                        int                     max)
+{
+  int n = 0;
+  const tr_request * req;
+
+  if (list->count > 0)
+    {
+      for (req=list->buckets[getBucket (list, block)]; req!=NULL; req=req->bucket_next)
+        {
+          if (req->block == block)
+            {
+              if (n < max)
+                setme[n] = req->peer;
+              ++n;
+            }
+        }
+    }
+
+  return n;
+}
+
+tr_request *
+tr_requestListPeerFirst (const tr_peer * peer)
+{
+  return peer->requests;
+}
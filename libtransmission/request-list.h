@@ -0,0 +1,108 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_REQUEST_LIST_H
+#define TR_REQUEST_LIST_H
+
+struct tr_peer;
+
+/**
+ * @addtogroup peers Peers
+ * @{
+ */
+
+/**
+ * A block request that we've sent to a peer and are awaiting a response for.
+ *
+ * Each request is in two lists: its hash bucket in the swarm's tr_requestList,
+ * which is keyed by block, and its peer's list, which is ordered oldest first
+ * so that timed-out requests can be found without scanning the whole table.
+ */
+typedef struct tr_request
+{
+  tr_block_index_t block;
+  struct tr_peer * peer;
+  time_t sentAt;
+
+  /* these are PRIVATE IMPLEMENTATION details */
+  struct tr_request * bucket_next;
+  struct tr_request * peer_prev; /* the head's peer_prev is the tail */
+  struct tr_request * peer_next;
+}
+tr_request;
+
+typedef struct tr_requestList
+{
+  /* these are PRIVATE IMPLEMENTATION details included for composition only.
+   * Don't access these directly! */
+  tr_request ** buckets;
+  size_t bucket_mask;
+  int count;
+  tr_request * recycled;
+}
+tr_requestList;
+
+#define TR_REQUEST_LIST_INIT { NULL, 0, 0, NULL }
+
+void tr_requestListDestruct (tr_requestList * list);
+
+/** @brief the number of requests in the list */
+static inline int
+tr_requestListCount (const tr_requestList * list)
+{
+  return list->count;
+}
+
+/**
+ * @brief add a request for `block' that was sent to `peer' at `now'.
+ * @return the new request. `peer' mustn't already have a request for `block'.
+ */
+tr_request * tr_requestListAdd (tr_requestList    * list,
+                                tr_block_index_t    block,
+                                struct tr_peer    * peer,
+                                time_t              now);
+
+/** @brief remove a request and decrement its peer's pendingReqsToPeer */
+void tr_requestListRemove (tr_requestList * list, tr_request * req);
+
+/** @return the request that `peer' has for `block', or NULL if none */
+tr_request * tr_requestListFind (const tr_requestList  * list,
+                                 tr_block_index_t        block,
+                                 const struct tr_peer  * peer);
+
+/**
+ * @brief find the peers that we're requesting `block' from.
+ * @param setme the first `max' of those peers are copied here
+ * @return the number of peers we're requesting `block' from
+ */
+int tr_requestListGetPeers (const tr_requestList  * list,
+                            tr_block_index_t        block,
+                            struct tr_peer       ** setme,
+                            int                     max);
+
+/** @return the oldest request sent to `peer', or NULL if none */
+tr_request * tr_requestListPeerFirst (const struct tr_peer * peer);
+
+/** @return the next-oldest request sent to the same peer, or NULL */
+static inline tr_request *
+tr_requestListPeerNext (const tr_request * req)
+{
+  return req->peer_next;
+}
+
+/* @} */
+
+#endif
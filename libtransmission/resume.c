@@ -705,6 +705,7 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
   const char * str;
   char * filename;
   tr_variant top;
+  tr_variant_arena * arena;
   bool boolVal;
   uint64_t fieldsLoaded = 0;
   const bool wasDirty = tor->isDirty;
@@ -713,10 +714,14 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
 
   filename = getResumeFilename (tor);
 
-  if (tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, filename))
+  /* the tree is only read, then thrown away, so keep it in one place */
+  arena = tr_variantArenaNew ();
+
+  if (tr_variantFromFileArena (&top, TR_VARIANT_FMT_BENC, filename, arena))
     {
       tr_logAddTorDbg (tor, "Couldn't read \"%s\"", filename);
 
+      tr_variantArenaFree (arena);
       tr_free (filename);
       return fieldsLoaded;
     }
@@ -857,7 +862,7 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
    * same resume information... */
   tor->isDirty = wasDirty;
 
-  tr_variantFree (&top);
+  tr_variantArenaFree (arena);
   tr_free (filename);
   return fieldsLoaded;
 }
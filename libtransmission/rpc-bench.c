@@ -0,0 +1,473 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/*
+ * Times a torrent-get over thousands of torrents, asking for the fields
+ * that a client's torrent list does, and measures how much heap it needs
+ * at its peak.
+ *
+ * "tree" builds the whole response as a tr_variant, serializes it, and
+ * then gzips the serialized copy, which is how torrent-get and the RPC
+ * server used to do it. "stream" is torrent-get itself, which writes the
+ * JSON (and gzips it) as it goes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strcmp () */
+#include <time.h> /* clock_gettime () */
+
+#include <event2/buffer.h>
+
+#ifdef HAVE_ZLIB
+ #include <zlib.h>
+#endif
+
+#ifdef __GLIBC__
+ #include <malloc.h> /* malloc_usable_size () */
+#endif
+
+#include "transmission.h"
+#include "libtransmission-test.h"
+#include "rpcimpl.h"
+#include "session.h"
+#include "torrent.h"
+#include "tr-getopt.h"
+#include "trevent.h"
+#include "utils.h"
+#include "variant.h"
+
+#define MY_NAME "rpc-bench"
+
+static int torrent_count = 20000;
+static int file_count = 1;
+static int repeat_count = 5;
+
+static tr_option options[] =
+{
+  { 't', "torrents", "Number of torrents", "t", 1, "<count>" },
+  { 'f', "files", "Files per torrent", "f", 1, "<count>" },
+  { 'r', "repeat", "How many times to run each request", "r", 1, "<count>" },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int
+parseCommandLine (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 't': torrent_count = atoi (optarg); break;
+          case 'f': file_count = atoi (optarg); break;
+          case 'r': repeat_count = atoi (optarg); break;
+          default: return 1;
+        }
+    }
+
+  return (torrent_count > 0) && (file_count > 0) && (repeat_count > 0) ? 0 : 1;
+}
+
+/***
+****  Timing and heap use
+***/
+
+static uint64_t
+nowNsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* only the thread that's running the requests counts its heap use */
+static __thread bool counting = false;
+static __thread int64_t live_bytes = 0;
+static __thread int64_t peak_bytes = 0;
+
+#ifdef __GLIBC__
+
+extern void * __libc_malloc (size_t);
+extern void * __libc_calloc (size_t, size_t);
+extern void * __libc_realloc (void *, size_t);
+extern void   __libc_free (void *);
+
+static void
+countBytes (int64_t n)
+{
+  live_bytes += n;
+  if (peak_bytes < live_bytes)
+    peak_bytes = live_bytes;
+}
+
+void *
+malloc (size_t size)
+{
+  void * ret = __libc_malloc (size);
+  if (counting && ret)
+    countBytes (malloc_usable_size (ret));
+  return ret;
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  void * ret = __libc_calloc (nmemb, size);
+  if (counting && ret)
+    countBytes (malloc_usable_size (ret));
+  return ret;
+}
+
+void *
+realloc (void * ptr, size_t size)
+{
+  void * ret;
+  const int64_t old_size = (counting && ptr) ? (int64_t)malloc_usable_size (ptr) : 0;
+
+  ret = __libc_realloc (ptr, size);
+  if (counting && ret)
+    countBytes ((int64_t)malloc_usable_size (ret) - old_size);
+  return ret;
+}
+
+void
+free (void * ptr)
+{
+  if (counting && ptr)
+    live_bytes -= malloc_usable_size (ptr);
+  __libc_free (ptr);
+}
+
+#define HAVE_HEAP_COUNT 1
+#else
+#define HAVE_HEAP_COUNT 0
+#endif
+
+/***
+****  The torrents
+***/
+
+static tr_torrent *
+createTorrent (tr_session * session, int torrentIndex)
+{
+  int i;
+  int err;
+  int benc_len;
+  char * benc;
+  char * name;
+  tr_torrent * tor;
+  tr_variant top;
+  tr_variant * info;
+  tr_variant * files;
+  tr_ctor * ctor;
+  uint8_t pieces[SHA_DIGEST_LENGTH];
+
+  memset (pieces, 0, sizeof (pieces));
+
+  name = tr_strdup_printf ("rpc-bench-%d", torrentIndex);
+  tr_variantInitDict (&top, 1);
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 4);
+  tr_variantDictAddStr (info, TR_KEY_name, name);
+  tr_variantDictAddInt (info, TR_KEY_piece_length, 16384 * file_count);
+  tr_variantDictAddRaw (info, TR_KEY_pieces, pieces, sizeof (pieces));
+  files = tr_variantDictAddList (info, TR_KEY_files, file_count);
+  for (i=0; i<file_count; ++i)
+    {
+      char buf[32];
+      tr_variant * file = tr_variantListAddDict (files, 2);
+      tr_snprintf (buf, sizeof (buf), "file-%d.bin", i);
+      tr_variantDictAddInt (file, TR_KEY_length, 16384);
+      tr_variantListAddStr (tr_variantDictAddList (file, TR_KEY_path, 1), buf);
+    }
+  benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &benc_len);
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfo (ctor, (uint8_t*)benc, benc_len);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  tor = tr_torrentNew (ctor, &err, NULL);
+  if (tor == NULL)
+    {
+      fprintf (stderr, "couldn't create torrent %d: error %d\n", torrentIndex, err);
+      exit (EXIT_FAILURE);
+    }
+
+  tr_ctorFree (ctor);
+  tr_free (benc);
+  tr_variantFree (&top);
+  tr_free (name);
+  return tor;
+}
+
+/***
+****  The old way: build a tr_variant, serialize it, then gzip that
+***/
+
+static void
+addFiles (const tr_torrent * tor, tr_variant * list)
+{
+  tr_file_index_t i;
+  tr_file_index_t n;
+  const tr_info * info = tr_torrentInfo (tor);
+  tr_file_stat * files = tr_torrentFiles (tor, &n);
+
+  for (i=0; i<info->fileCount; ++i)
+    {
+      const tr_file * file = &info->files[i];
+      tr_variant * d = tr_variantListAddDict (list, 3);
+      tr_variantDictAddInt (d, TR_KEY_bytesCompleted, files[i].bytesCompleted);
+      tr_variantDictAddInt (d, TR_KEY_length, file->length);
+      tr_variantDictAddStr (d, TR_KEY_name, file->name);
+    }
+
+  tr_torrentFilesFree (files, n);
+}
+
+/* the same fields as the request in streamRequest () */
+static void
+addInfo (tr_torrent * tor, tr_variant * d)
+{
+  const tr_stat * st = tr_torrentStat (tor);
+
+  tr_variantInitDict (d, 14);
+  tr_variantDictAddInt (d, TR_KEY_id, st->id);
+  tr_variantDictAddStr (d, TR_KEY_name, tr_torrentName (tor));
+  tr_variantDictAddInt (d, TR_KEY_status, st->activity);
+  tr_variantDictAddInt (d, TR_KEY_error, st->error);
+  tr_variantDictAddStr (d, TR_KEY_errorString, st->errorString);
+  tr_variantDictAddReal (d, TR_KEY_percentDone, st->percentDone);
+  tr_variantDictAddInt (d, TR_KEY_rateDownload, toSpeedBytes (st->pieceDownloadSpeed_KBps));
+  tr_variantDictAddInt (d, TR_KEY_rateUpload, toSpeedBytes (st->pieceUploadSpeed_KBps));
+  tr_variantDictAddInt (d, TR_KEY_eta, st->eta);
+  tr_variantDictAddInt (d, TR_KEY_sizeWhenDone, st->sizeWhenDone);
+  tr_variantDictAddInt (d, TR_KEY_leftUntilDone, st->leftUntilDone);
+  tr_variantDictAddReal (d, TR_KEY_uploadRatio, st->ratio);
+  tr_variantDictAddInt (d, TR_KEY_queuePosition, st->queuePosition);
+  addFiles (tor, tr_variantDictAddList (d, TR_KEY_files, tor->info.fileCount));
+}
+
+#ifdef HAVE_ZLIB
+/* like the RPC server's add_response () */
+static struct evbuffer *
+gzipAll (struct evbuffer * content)
+{
+  z_stream stream;
+  struct evbuffer_iovec iovec[1];
+  struct evbuffer * out = evbuffer_new ();
+  void * content_ptr = evbuffer_pullup (content, -1);
+  const size_t content_len = evbuffer_get_length (content);
+
+  memset (&stream, 0, sizeof (stream));
+  deflateInit2 (&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+  stream.next_in = content_ptr;
+  stream.avail_in = content_len;
+
+  evbuffer_reserve_space (out, content_len, iovec, 1);
+  stream.next_out = iovec[0].iov_base;
+  stream.avail_out = iovec[0].iov_len;
+  deflate (&stream, Z_FINISH);
+  iovec[0].iov_len -= stream.avail_out;
+  evbuffer_commit_space (out, iovec, 1);
+
+  deflateEnd (&stream);
+  return out;
+}
+#endif
+
+static size_t
+treeRequest (tr_session * session, bool gzip)
+{
+  size_t len;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * list;
+  tr_torrent * tor = NULL;
+  struct evbuffer * buf;
+
+  tr_variantInitDict (&response, 2);
+  args = tr_variantDictAddDict (&response, TR_KEY_arguments, 1);
+  list = tr_variantDictAddList (args, TR_KEY_torrents, torrent_count);
+  while ((tor = tr_torrentNext (session, tor)))
+    addInfo (tor, tr_variantListAdd (list));
+  tr_variantDictAddStr (&response, TR_KEY_result, "success");
+
+  buf = tr_variantToBuf (&response, TR_VARIANT_FMT_JSON_LEAN);
+
+#ifdef HAVE_ZLIB
+  if (gzip)
+    {
+      struct evbuffer * gzipped = gzipAll (buf);
+      evbuffer_free (buf);
+      buf = gzipped;
+    }
+#else
+  (void) gzip;
+#endif
+
+  len = evbuffer_get_length (buf);
+  evbuffer_free (buf);
+  tr_variantFree (&response);
+  return len;
+}
+
+/***
+****  The new way: torrent-get itself
+***/
+
+static size_t response_len = 0;
+
+static void
+onResponse (tr_session      * session UNUSED,
+            struct evbuffer * response,
+            void            * user_data UNUSED)
+{
+  response_len = evbuffer_get_length (response);
+}
+
+static size_t
+streamRequest (tr_session * session, bool gzip)
+{
+  const char * json = "{\"method\":\"torrent-get\",\"arguments\":{\"fields\":["
+                      "\"id\",\"name\",\"status\",\"error\",\"errorString\","
+                      "\"percentDone\",\"rateDownload\",\"rateUpload\",\"eta\","
+                      "\"sizeWhenDone\",\"leftUntilDone\",\"uploadRatio\","
+                      "\"queuePosition\",\"files\"]}}";
+
+  tr_rpc_request_exec_json_full (session, json, -1,
+                                 gzip ? TR_RPC_RESPONSE_GZIP : 0,
+                                 onResponse, NULL);
+  return response_len;
+}
+
+/***
+****
+***/
+
+struct run
+{
+  const char * name;
+  size_t (*func)(tr_session * session, bool gzip);
+  bool gzip;
+
+  uint64_t nsec;
+  uint64_t max_nsec;
+  int64_t peak_bytes;
+  size_t output_len;
+};
+
+static struct run runs[] =
+{
+  { "tree",        treeRequest,   false, 0, 0, 0, 0 },
+  { "stream",      streamRequest, false, 0, 0, 0, 0 },
+#ifdef HAVE_ZLIB
+  { "tree+gzip",   treeRequest,   true,  0, 0, 0, 0 },
+  { "stream+gzip", streamRequest, true,  0, 0, 0, 0 },
+#endif
+};
+
+#define RUN_COUNT ((int)(sizeof (runs) / sizeof (runs[0])))
+
+static bool runs_done = false;
+
+/* the requests run in the libtransmission thread, like the RPC server's */
+static void
+runAll (void * vsession)
+{
+  int i;
+  int j;
+  tr_session * session = vsession;
+
+  for (i=0; i<RUN_COUNT; ++i)
+    {
+      struct run * r = &runs[i];
+
+      for (j=0; j<repeat_count; ++j)
+        {
+          uint64_t nsec;
+
+          live_bytes = peak_bytes = 0;
+          counting = true;
+          nsec = nowNsec ();
+          r->output_len = (*r->func)(session, r->gzip);
+          nsec = nowNsec () - nsec;
+          counting = false;
+
+          r->nsec += nsec;
+          r->max_nsec = MAX (r->max_nsec, nsec);
+          r->peak_bytes = MAX (r->peak_bytes, peak_bytes);
+        }
+    }
+
+  __atomic_store_n (&runs_done, true, __ATOMIC_RELEASE);
+}
+
+static void
+printResults (void)
+{
+  int i;
+
+  printf ("%-12s %12s %12s %14s %14s\n",
+          "method", "mean ms", "max ms", "peak heap KiB", "output KiB");
+
+  for (i=0; i<RUN_COUNT; ++i)
+    {
+      const struct run * r = &runs[i];
+
+      printf ("%-12s %12.2f %12.2f", r->name, r->nsec / 1e6 / repeat_count, r->max_nsec / 1e6);
+      if (HAVE_HEAP_COUNT)
+        printf (" %14.1f", r->peak_bytes / 1024.0);
+      else
+        printf (" %14s", "n/a");
+      printf (" %14.1f\n", r->output_len / 1024.0);
+    }
+}
+
+int
+main (int argc, char ** argv)
+{
+  int i;
+  tr_session * session;
+  tr_variant settings;
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  printf ("%d torrents of %d files each, %d runs per method\n",
+          torrent_count, file_count, repeat_count);
+
+  tr_variantInitDict (&settings, 4);
+  tr_variantDictAddBool (&settings, TR_KEY_dht_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_lpd_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_download_queue_enabled, false);
+  session = libttest_session_init (&settings);
+
+  for (i=0; i<torrent_count; ++i)
+    createTorrent (session, i);
+
+  tr_runInEventThread (session, runAll, session);
+  while (!__atomic_load_n (&runs_done, __ATOMIC_ACQUIRE))
+    tr_wait_msec (10);
+
+  printResults ();
+
+  libttest_session_close (session);
+  tr_variantFree (&settings);
+  return 0;
+}
@@ -526,6 +526,9 @@ struct rpc_response_data
 {
   struct evhttp_request * req;
   struct tr_rpc_server  * server;
+
+  /* true if the response was gzipped as it was written */
+  bool                    is_gzipped;
 };
 
 static void
@@ -536,7 +539,16 @@ rpc_response_func (tr_session      * session UNUSED,
   struct rpc_response_data * data = user_data;
   struct evbuffer * buf = evbuffer_new ();
 
-  add_response (data->req, data->server, buf, response);
+  if (data->is_gzipped)
+    {
+      evhttp_add_header (data->req->output_headers, "Content-Encoding", "gzip");
+      evbuffer_add_buffer (buf, response);
+    }
+  else
+    {
+      add_response (data->req, data->server, buf, response);
+    }
+
   evhttp_add_header (data->req->output_headers,
                      "Content-Type", "application/json; charset=UTF-8");
   evhttp_send_reply (data->req, HTTP_OK, "OK", buf);
@@ -557,7 +569,18 @@ handle_rpc_from_json (struct evhttp_request * req,
   data->req = req;
   data->server = server;
 
-  tr_rpc_request_exec_json (server->session, json, json_len, rpc_response_func, data);
+#ifdef HAVE_ZLIB
+  {
+    const char * encoding = evhttp_find_header (req->input_headers, "Accept-Encoding");
+    data->is_gzipped = encoding && strstr (encoding, "gzip");
+  }
+#endif
+
+  /* big responses like torrent-get's are compressed as they're written,
+   * rather than being written out in full and then compressed */
+  tr_rpc_request_exec_json_full (server->session, json, json_len,
+                                 data->is_gzipped ? TR_RPC_RESPONSE_GZIP : 0,
+                                 rpc_response_func, data);
 }
 
 static void
@@ -721,6 +744,8 @@ stopServer (tr_rpc_server * server)
 {
   if (server->httpd)
     {
+      /* evhttp_free () frees the requests that are still waiting */
+      tr_rpc_watch_answer_all (server->session);
       evhttp_free (server->httpd);
       server->httpd = NULL;
     }
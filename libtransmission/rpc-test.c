@@ -4,6 +4,7 @@
 
 #include "transmission.h"
 #include "rpcimpl.h"
+#include "session.h" /* tr_sessionCountTorrents () */
 #include "utils.h"
 #include "variant.h"
 
@@ -153,11 +154,312 @@ test_session_get_and_set (void)
 ****
 ***/
 
+static int64_t
+getTorrentsSince (tr_session * session, int64_t since, tr_variant * response, tr_variant ** torrents, tr_variant ** removed)
+{
+  char * json;
+  int64_t seq = 0;
+  tr_variant * args;
+
+  json = tr_strdup_printf ("{\"method\":\"torrent-get\",\"arguments\":{"
+                           "\"fields\":[\"id\",\"name\",\"downloadLimit\"],"
+                           "\"since\":%"PRId64"}}", since);
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, response);
+  tr_free (json);
+
+  *torrents = *removed = NULL;
+  if (tr_variantDictFindDict (response, TR_KEY_arguments, &args))
+    {
+      tr_variantDictFindInt (args, TR_KEY_seq, &seq);
+      tr_variantDictFindList (args, TR_KEY_torrents, torrents);
+      tr_variantDictFindList (args, TR_KEY_removed, removed);
+    }
+
+  return seq;
+}
+
+static int
+test_torrent_get_since (void)
+{
+  int64_t i;
+  int64_t seq;
+  int64_t first_seq;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * torrents;
+  tr_variant * removed;
+  tr_variant * d;
+  tr_torrent * tor;
+  int id;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+  id = tr_torrentId (tor);
+
+  /* the first time around, everything is new */
+  first_seq = seq = getTorrentsSince (session, 0, &response, &torrents, &removed);
+  check (seq > 0);
+  check (torrents != NULL);
+  check_int_eq (1, tr_variantListSize (torrents));
+  d = tr_variantListChild (torrents, 0);
+  check (tr_variantDictFindInt (d, TR_KEY_id, &i));
+  check_int_eq (id, i);
+  check (tr_variantDictFind (d, TR_KEY_name) != NULL);
+  check (tr_variantDictFind (d, TR_KEY_downloadLimit) != NULL);
+  check_int_eq (0, tr_variantListSize (removed));
+  tr_variantFree (&response);
+
+  /* nothing's changed since then */
+  seq = getTorrentsSince (session, seq, &response, &torrents, &removed);
+  check (seq > first_seq);
+  check_int_eq (0, tr_variantListSize (torrents));
+  tr_variantFree (&response);
+
+  /* only the field that changed is sent, along with the id */
+  tr_torrentSetSpeedLimit_KBps (tor, TR_DOWN, 42);
+  seq = getTorrentsSince (session, seq, &response, &torrents, &removed);
+  check_int_eq (1, tr_variantListSize (torrents));
+  d = tr_variantListChild (torrents, 0);
+  check (tr_variantDictFindInt (d, TR_KEY_id, &i));
+  check_int_eq (id, i);
+  check (tr_variantDictFindInt (d, TR_KEY_downloadLimit, &i));
+  check_int_eq (42, i);
+  check (tr_variantDictFind (d, TR_KEY_name) == NULL);
+  tr_variantFree (&response);
+
+  /* a client that's further behind still gets what it missed */
+  getTorrentsSince (session, first_seq, &response, &torrents, &removed);
+  check_int_eq (1, tr_variantListSize (torrents));
+  d = tr_variantListChild (torrents, 0);
+  check (tr_variantDictFind (d, TR_KEY_downloadLimit) != NULL);
+  check (tr_variantDictFind (d, TR_KEY_name) == NULL);
+  tr_variantFree (&response);
+
+  /* a cursor from before the session started gets everything */
+  getTorrentsSince (session, first_seq / 2, &response, &torrents, &removed);
+  check_int_eq (1, tr_variantListSize (torrents));
+  d = tr_variantListChild (torrents, 0);
+  check (tr_variantDictFind (d, TR_KEY_name) != NULL);
+  check (tr_variantDictFind (d, TR_KEY_downloadLimit) != NULL);
+  tr_variantFree (&response);
+
+  /* removals are reported too */
+  tr_torrentRemove (tor, false, NULL);
+  while (tr_sessionCountTorrents (session) > 0)
+    tr_wait_msec (10);
+  getTorrentsSince (session, seq, &response, &torrents, &removed);
+  check_int_eq (0, tr_variantListSize (torrents));
+  check_int_eq (1, tr_variantListSize (removed));
+  check (tr_variantGetInt (tr_variantListChild (removed, 0), &i));
+  check_int_eq (id, i);
+  tr_variantFree (&response);
+
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_torrent_get_table (void)
+{
+  size_t len;
+  int64_t i;
+  const char * str;
+  const char * json;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * torrents;
+  tr_variant * row;
+  tr_torrent * tor;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+
+  json = "{\"method\":\"torrent-get\",\"arguments\":{"
+         "\"fields\":[\"id\",\"no-such-field\",\"name\"],"
+         "\"format\":\"table\"}}";
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check_int_eq (2, tr_variantListSize (torrents));
+
+  /* the header row, without the field that doesn't exist */
+  row = tr_variantListChild (torrents, 0);
+  check (tr_variantIsList (row));
+  check_int_eq (2, tr_variantListSize (row));
+  check (tr_variantGetStr (tr_variantListChild (row, 0), &str, &len));
+  check_streq ("id", str);
+  check (tr_variantGetStr (tr_variantListChild (row, 1), &str, &len));
+  check_streq ("name", str);
+
+  /* the torrent's row */
+  row = tr_variantListChild (torrents, 1);
+  check (tr_variantIsList (row));
+  check_int_eq (2, tr_variantListSize (row));
+  check (tr_variantGetInt (tr_variantListChild (row, 0), &i));
+  check_int_eq (tr_torrentId (tor), i);
+  check (tr_variantGetStr (tr_variantListChild (row, 1), &str, &len));
+  check_streq (tr_torrentName (tor), str);
+  tr_variantFree (&response);
+
+  /* cleanup */
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+struct watch_response
+{
+  tr_variant top;
+  volatile bool done;
+};
+
+static void
+watch_response_func (tr_session      * session UNUSED,
+                     struct evbuffer * response,
+                     void            * vw)
+{
+  struct watch_response * w = vw;
+  tr_variantFromBuf (&w->top, TR_VARIANT_FMT_JSON, evbuffer_pullup(response,-1), evbuffer_get_length(response), NULL, NULL);
+  w->done = true;
+}
+
+static void
+startWatch (tr_session * session, int64_t since, int timeout, struct watch_response * w)
+{
+  char * json = tr_strdup_printf ("{\"method\":\"session-watch\",\"arguments\":{"
+                                  "\"since\":%"PRId64",\"timeout\":%d,\"window\":0}}",
+                                  since, timeout);
+  w->done = false;
+  tr_rpc_request_exec_json (session, json, strlen(json), watch_response_func, w);
+  tr_free (json);
+}
+
+static tr_variant *
+waitForWatch (struct watch_response * w)
+{
+  tr_variant * args = NULL;
+
+  while (!w->done)
+    tr_wait_msec (10);
+
+  tr_variantDictFindDict (&w->top, TR_KEY_arguments, &args);
+  return args;
+}
+
+static int
+test_session_watch (void)
+{
+  int64_t i;
+  int64_t seq;
+  size_t n;
+  bool changed;
+  bool has_seq;
+  uint64_t elapsed;
+  uint64_t start;
+  const char * json;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * torrents;
+  struct watch_response w;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+
+  /* let the new torrent's verify finish first, so that the only
+     changes the watches see are the ones made here */
+  libttest_blockingTorrentVerify (tor);
+
+  /* a watch that doesn't wait is answered right away, with a cursor */
+  json = "{\"method\":\"session-watch\",\"arguments\":{\"timeout\":0}}";
+  w.done = false;
+  tr_rpc_request_exec_json (session, json, strlen(json), watch_response_func, &w);
+  args = waitForWatch (&w);
+  check (args != NULL);
+  check (tr_variantDictFindInt (args, TR_KEY_seq, &seq));
+  check (seq > 0);
+  tr_variantFree (&w.top);
+
+  /* when nothing changes, it's answered at the timeout with nothing */
+  start = tr_time_msec ();
+  startWatch (session, seq, 1, &w);
+  args = waitForWatch (&w);
+  elapsed = tr_time_msec () - start;
+  n = 1;
+  changed = true;
+  if (tr_variantDictFindList (args, TR_KEY_torrents, &torrents))
+    n = tr_variantListSize (torrents);
+  tr_variantDictFindBool (args, TR_KEY_session_changed, &changed);
+  has_seq = tr_variantDictFindInt (args, TR_KEY_seq, &seq);
+  tr_variantFree (&w.top);
+  check (elapsed >= 900);
+  check_int_eq (0, n);
+  check (!changed);
+  check (has_seq);
+
+  /* a torrent's change gets it answered well before the timeout */
+  start = tr_time_msec ();
+  startWatch (session, seq, 60, &w);
+  tr_torrentSetSpeedLimit_KBps (tor, TR_DOWN, 42);
+  args = waitForWatch (&w);
+  check (tr_time_msec () - start < 30000);
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check_int_eq (1, tr_variantListSize (torrents));
+  check (tr_variantGetInt (tr_variantListChild (torrents, 0), &i));
+  check_int_eq (tr_torrentId (tor), i);
+  check (tr_variantDictFindBool (args, TR_KEY_session_changed, &changed));
+  check (!changed);
+  check (tr_variantDictFindInt (args, TR_KEY_seq, &seq));
+  tr_variantFree (&w.top);
+
+  /* and so does a change to the session's settings */
+  json = "{\"method\":\"session-set\",\"arguments\":{\"peer-limit-global\":77}}";
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  tr_variantFree (&response);
+  startWatch (session, seq, 60, &w);
+  args = waitForWatch (&w);
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check_int_eq (0, tr_variantListSize (torrents));
+  check (tr_variantDictFindBool (args, TR_KEY_session_changed, &changed));
+  check (changed);
+  check (tr_variantDictFindInt (args, TR_KEY_seq, &seq));
+  tr_variantFree (&w.top);
+
+  /* as does one made through the public setters instead of RPC */
+  startWatch (session, seq, 60, &w);
+  tr_sessionSetPeerLimit (session, 78);
+  args = waitForWatch (&w);
+  check (tr_variantDictFindBool (args, TR_KEY_session_changed, &changed));
+  check (changed);
+  tr_variantFree (&w.top);
+
+  /* cleanup */
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
 int
 main (void)
 {
   const testFunc tests[] = { test_list,
-                             test_session_get_and_set };
+                             test_session_get_and_set,
+                             test_torrent_get_since,
+                             test_torrent_get_table,
+                             test_session_watch };
 
   return runTests (tests, NUM_TESTS (tests));
 }
@@ -21,21 +21,27 @@
 #endif
 
 #include <event2/buffer.h>
+#include <event2/event.h> /* evtimer_new () */
 
 #include "transmission.h"
+#include "cache.h"
 #include "completion.h"
+#include "disk-queue.h"
 #include "fdlimit.h"
+#include "list.h"
 #include "log.h"
+#include "peer-mgr.h" /* tr_peerMgrTorrentNeedsUpkeep (), tr_peerMgrGetConnectionStats () */
 #include "platform-quota.h" /* tr_device_info_get_free_space() */
 #include "rpcimpl.h"
 #include "session.h"
 #include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
 #include "utils.h"
 #include "variant.h"
 #include "version.h"
 #include "web.h"
 
-#define RPC_VERSION     15
+#define RPC_VERSION     16
 #define RPC_VERSION_MIN 1
 
 #define RECENTLY_ACTIVE_SECONDS 60
@@ -89,22 +95,38 @@ struct tr_rpc_idle_data
  tr_session            * session;
  tr_variant            * response;
  tr_variant            * args_out;
+ int                     response_flags;
  tr_rpc_response_func    callback;
  void                  * callback_user_data;
 };
 
+/* serialize a response and pass it to the callback */
 static void
-tr_idle_function_done (struct tr_rpc_idle_data * data, const char * result)
+sendResponse (tr_session            * session,
+              const tr_variant      * response,
+              int                     response_flags,
+              tr_rpc_response_func    callback,
+              void                  * callback_user_data)
 {
- struct evbuffer * buf;
+  struct evbuffer * buf = evbuffer_new ();
+  tr_json_writer * w = tr_jsonWriterNew (buf, true, (response_flags & TR_RPC_RESPONSE_GZIP) != 0);
+
+  tr_jsonVariant (w, response);
+  tr_jsonWriterFree (w);
+
+  (*callback)(session, buf, callback_user_data);
+  evbuffer_free (buf);
+}
 
+static void
+tr_idle_function_done (struct tr_rpc_idle_data * data, const char * result)
+{
  if (result == NULL)
    result = "success";
  tr_variantDictAddStr (data->response, TR_KEY_result, result);
 
- buf = tr_variantToBuf (data->response, TR_VARIANT_FMT_JSON_LEAN);
- (*data->callback)(data->session, buf, data->callback_user_data);
- evbuffer_free (buf);
+ sendResponse (data->session, data->response, data->response_flags,
+               data->callback, data->callback_user_data);
 
  tr_variantFree (data->response);
  tr_free (data->response);
@@ -328,6 +350,7 @@ torrentStop (tr_session               * session,
       if (tor->isRunning || tr_torrentIsQueued (tor))
         {
           tor->isStopping = true;
+          tr_peerMgrTorrentNeedsUpkeep (tor);
           notify (session, TR_RPC_TORRENT_STOPPED, tor);
         }
     }
@@ -425,42 +448,50 @@ torrentVerify (tr_session               * session,
 ***/
 
 static void
-addFileStats (const tr_torrent * tor, tr_variant * list)
+writeFileStats (tr_json_writer * w, const tr_torrent * tor)
 {
   tr_file_index_t i;
   tr_file_index_t n;
   const tr_info * info = tr_torrentInfo (tor);
   tr_file_stat * files = tr_torrentFiles (tor, &n);
 
+  tr_jsonBeginList (w);
+
   for (i=0; i<info->fileCount; ++i)
     {
       const tr_file * file = &info->files[i];
-      tr_variant * d = tr_variantListAddDict (list, 3);
-      tr_variantDictAddInt (d, TR_KEY_bytesCompleted, files[i].bytesCompleted);
-      tr_variantDictAddInt (d, TR_KEY_priority, file->priority);
-      tr_variantDictAddBool (d, TR_KEY_wanted, !file->dnd);
+      tr_jsonBeginDict (w);
+      tr_jsonDictAddInt (w, TR_KEY_bytesCompleted, files[i].bytesCompleted);
+      tr_jsonDictAddInt (w, TR_KEY_priority, file->priority);
+      tr_jsonDictAddBool (w, TR_KEY_wanted, !file->dnd);
+      tr_jsonEnd (w);
     }
 
+  tr_jsonEnd (w);
   tr_torrentFilesFree (files, n);
 }
 
 static void
-addFiles (const tr_torrent * tor, tr_variant * list)
+writeFiles (tr_json_writer * w, const tr_torrent * tor)
 {
   tr_file_index_t i;
   tr_file_index_t n;
   const tr_info * info = tr_torrentInfo (tor);
   tr_file_stat *  files = tr_torrentFiles (tor, &n);
 
+  tr_jsonBeginList (w);
+
   for (i=0; i<info->fileCount; ++i)
     {
       const tr_file * file = &info->files[i];
-      tr_variant * d = tr_variantListAddDict (list, 3);
-      tr_variantDictAddInt (d, TR_KEY_bytesCompleted, files[i].bytesCompleted);
-      tr_variantDictAddInt (d, TR_KEY_length, file->length);
-      tr_variantDictAddStr (d, TR_KEY_name, file->name);
+      tr_jsonBeginDict (w);
+      tr_jsonDictAddInt (w, TR_KEY_bytesCompleted, files[i].bytesCompleted);
+      tr_jsonDictAddInt (w, TR_KEY_length, file->length);
+      tr_jsonDictAddStr (w, TR_KEY_name, file->name);
+      tr_jsonEnd (w);
     }
 
+  tr_jsonEnd (w);
   tr_torrentFilesFree (files, n);
 }
 
@@ -492,238 +523,236 @@ addTrackers (const tr_info  * info,
 }
 
 static void
-addTrackerStats (const tr_tracker_stat * st, int n, tr_variant * list)
+writeTrackerStats (tr_json_writer * w, const tr_tracker_stat * st, int n)
 {
   int i;
 
+  tr_jsonBeginList (w);
+
   for (i=0; i<n; ++i)
     {
       const tr_tracker_stat * s = &st[i];
-      tr_variant * d = tr_variantListAddDict (list, 26);
-      tr_variantDictAddStr  (d, TR_KEY_announce, s->announce);
-      tr_variantDictAddInt  (d, TR_KEY_announceState, s->announceState);
-      tr_variantDictAddInt  (d, TR_KEY_downloadCount, s->downloadCount);
-      tr_variantDictAddBool (d, TR_KEY_hasAnnounced, s->hasAnnounced);
-      tr_variantDictAddBool (d, TR_KEY_hasScraped, s->hasScraped);
-      tr_variantDictAddStr  (d, TR_KEY_host, s->host);
-      tr_variantDictAddInt  (d, TR_KEY_id, s->id);
-      tr_variantDictAddBool (d, TR_KEY_isBackup, s->isBackup);
-      tr_variantDictAddInt  (d, TR_KEY_lastAnnouncePeerCount, s->lastAnnouncePeerCount);
-      tr_variantDictAddStr  (d, TR_KEY_lastAnnounceResult, s->lastAnnounceResult);
-      tr_variantDictAddInt  (d, TR_KEY_lastAnnounceStartTime, s->lastAnnounceStartTime);
-      tr_variantDictAddBool (d, TR_KEY_lastAnnounceSucceeded, s->lastAnnounceSucceeded);
-      tr_variantDictAddInt  (d, TR_KEY_lastAnnounceTime, s->lastAnnounceTime);
-      tr_variantDictAddBool (d, TR_KEY_lastAnnounceTimedOut, s->lastAnnounceTimedOut);
-      tr_variantDictAddStr  (d, TR_KEY_lastScrapeResult, s->lastScrapeResult);
-      tr_variantDictAddInt  (d, TR_KEY_lastScrapeStartTime, s->lastScrapeStartTime);
-      tr_variantDictAddBool (d, TR_KEY_lastScrapeSucceeded, s->lastScrapeSucceeded);
-      tr_variantDictAddInt  (d, TR_KEY_lastScrapeTime, s->lastScrapeTime);
-      tr_variantDictAddInt  (d, TR_KEY_lastScrapeTimedOut, s->lastScrapeTimedOut);
-      tr_variantDictAddInt  (d, TR_KEY_leecherCount, s->leecherCount);
-      tr_variantDictAddInt  (d, TR_KEY_nextAnnounceTime, s->nextAnnounceTime);
-      tr_variantDictAddInt  (d, TR_KEY_nextScrapeTime, s->nextScrapeTime);
-      tr_variantDictAddStr  (d, TR_KEY_scrape, s->scrape);
-      tr_variantDictAddInt  (d, TR_KEY_scrapeState, s->scrapeState);
-      tr_variantDictAddInt  (d, TR_KEY_seederCount, s->seederCount);
-      tr_variantDictAddInt  (d, TR_KEY_tier, s->tier);
+      tr_jsonBeginDict (w);
+      tr_jsonDictAddStr  (w, TR_KEY_announce, s->announce);
+      tr_jsonDictAddInt  (w, TR_KEY_announceState, s->announceState);
+      tr_jsonDictAddInt  (w, TR_KEY_downloadCount, s->downloadCount);
+      tr_jsonDictAddBool (w, TR_KEY_hasAnnounced, s->hasAnnounced);
+      tr_jsonDictAddBool (w, TR_KEY_hasScraped, s->hasScraped);
+      tr_jsonDictAddStr  (w, TR_KEY_host, s->host);
+      tr_jsonDictAddInt  (w, TR_KEY_id, s->id);
+      tr_jsonDictAddBool (w, TR_KEY_isBackup, s->isBackup);
+      tr_jsonDictAddInt  (w, TR_KEY_lastAnnouncePeerCount, s->lastAnnouncePeerCount);
+      tr_jsonDictAddStr  (w, TR_KEY_lastAnnounceResult, s->lastAnnounceResult);
+      tr_jsonDictAddInt  (w, TR_KEY_lastAnnounceStartTime, s->lastAnnounceStartTime);
+      tr_jsonDictAddBool (w, TR_KEY_lastAnnounceSucceeded, s->lastAnnounceSucceeded);
+      tr_jsonDictAddInt  (w, TR_KEY_lastAnnounceTime, s->lastAnnounceTime);
+      tr_jsonDictAddBool (w, TR_KEY_lastAnnounceTimedOut, s->lastAnnounceTimedOut);
+      tr_jsonDictAddStr  (w, TR_KEY_lastScrapeResult, s->lastScrapeResult);
+      tr_jsonDictAddInt  (w, TR_KEY_lastScrapeStartTime, s->lastScrapeStartTime);
+      tr_jsonDictAddBool (w, TR_KEY_lastScrapeSucceeded, s->lastScrapeSucceeded);
+      tr_jsonDictAddInt  (w, TR_KEY_lastScrapeTime, s->lastScrapeTime);
+      tr_jsonDictAddInt  (w, TR_KEY_lastScrapeTimedOut, s->lastScrapeTimedOut);
+      tr_jsonDictAddInt  (w, TR_KEY_leecherCount, s->leecherCount);
+      tr_jsonDictAddInt  (w, TR_KEY_nextAnnounceTime, s->nextAnnounceTime);
+      tr_jsonDictAddInt  (w, TR_KEY_nextScrapeTime, s->nextScrapeTime);
+      tr_jsonDictAddStr  (w, TR_KEY_scrape, s->scrape);
+      tr_jsonDictAddInt  (w, TR_KEY_scrapeState, s->scrapeState);
+      tr_jsonDictAddInt  (w, TR_KEY_seederCount, s->seederCount);
+      tr_jsonDictAddInt  (w, TR_KEY_tier, s->tier);
+      tr_jsonEnd (w);
     }
+
+  tr_jsonEnd (w);
 }
 
 static void
-addPeers (tr_torrent * tor, tr_variant * list)
+writePeers (tr_json_writer * w, tr_torrent * tor)
 {
   int i;
   int peerCount;
   tr_peer_stat * peers = tr_torrentPeers (tor, &peerCount);
 
-  tr_variantInitList (list, peerCount);
+  tr_jsonBeginList (w);
 
   for (i=0; i<peerCount; ++i)
     {
-      tr_variant * d = tr_variantListAddDict (list, 16);
       const tr_peer_stat * peer = peers + i;
-      tr_variantDictAddStr  (d, TR_KEY_address, peer->addr);
-      tr_variantDictAddStr  (d, TR_KEY_clientName, peer->client);
-      tr_variantDictAddBool (d, TR_KEY_clientIsChoked, peer->clientIsChoked);
-      tr_variantDictAddBool (d, TR_KEY_clientIsInterested, peer->clientIsInterested);
-      tr_variantDictAddStr  (d, TR_KEY_flagStr, peer->flagStr);
-      tr_variantDictAddBool (d, TR_KEY_isDownloadingFrom, peer->isDownloadingFrom);
-      tr_variantDictAddBool (d, TR_KEY_isEncrypted, peer->isEncrypted);
-      tr_variantDictAddBool (d, TR_KEY_isIncoming, peer->isIncoming);
-      tr_variantDictAddBool (d, TR_KEY_isUploadingTo, peer->isUploadingTo);
-      tr_variantDictAddBool (d, TR_KEY_isUTP, peer->isUTP);
-      tr_variantDictAddBool (d, TR_KEY_peerIsChoked, peer->peerIsChoked);
-      tr_variantDictAddBool (d, TR_KEY_peerIsInterested, peer->peerIsInterested);
-      tr_variantDictAddInt  (d, TR_KEY_port, peer->port);
-      tr_variantDictAddReal (d, TR_KEY_progress, peer->progress);
-      tr_variantDictAddInt  (d, TR_KEY_rateToClient, toSpeedBytes (peer->rateToClient_KBps));
-      tr_variantDictAddInt  (d, TR_KEY_rateToPeer, toSpeedBytes (peer->rateToPeer_KBps));
+      tr_jsonBeginDict (w);
+      tr_jsonDictAddStr  (w, TR_KEY_address, peer->addr);
+      tr_jsonDictAddStr  (w, TR_KEY_clientName, peer->client);
+      tr_jsonDictAddBool (w, TR_KEY_clientIsChoked, peer->clientIsChoked);
+      tr_jsonDictAddBool (w, TR_KEY_clientIsInterested, peer->clientIsInterested);
+      tr_jsonDictAddStr  (w, TR_KEY_flagStr, peer->flagStr);
+      tr_jsonDictAddBool (w, TR_KEY_isDownloadingFrom, peer->isDownloadingFrom);
+      tr_jsonDictAddBool (w, TR_KEY_isEncrypted, peer->isEncrypted);
+      tr_jsonDictAddBool (w, TR_KEY_isIncoming, peer->isIncoming);
+      tr_jsonDictAddBool (w, TR_KEY_isUploadingTo, peer->isUploadingTo);
+      tr_jsonDictAddBool (w, TR_KEY_isUTP, peer->isUTP);
+      tr_jsonDictAddBool (w, TR_KEY_peerIsChoked, peer->peerIsChoked);
+      tr_jsonDictAddBool (w, TR_KEY_peerIsInterested, peer->peerIsInterested);
+      tr_jsonDictAddInt  (w, TR_KEY_port, peer->port);
+      tr_jsonDictAddReal (w, TR_KEY_progress, peer->progress);
+      tr_jsonDictAddInt  (w, TR_KEY_rateToClient, toSpeedBytes (peer->rateToClient_KBps));
+      tr_jsonDictAddInt  (w, TR_KEY_rateToPeer, toSpeedBytes (peer->rateToPeer_KBps));
+      tr_jsonEnd (w);
     }
 
+  tr_jsonEnd (w);
   tr_torrentPeersFree (peers, peerCount);
 }
 
-static void
-addField (tr_torrent       * const tor,
-          const tr_info    * const inf,
-          const tr_stat    * const st,
-          tr_variant       * const d,
-          const tr_quark           key)
+/* The fields that are small enough to build as a tr_variant. See writeField ()
+ * @return false if `key' isn't one of them, leaving `initme' untouched */
+static bool
+initField (tr_torrent       * const tor,
+           const tr_info    * const inf,
+           const tr_stat    * const st,
+           tr_variant       * const initme,
+           const tr_quark           key)
 {
   char * str;
 
   switch (key)
     {
       case TR_KEY_activityDate:
-        tr_variantDictAddInt (d, key, st->activityDate);
+        tr_variantInitInt (initme, st->activityDate);
         break;
 
       case TR_KEY_addedDate:
-        tr_variantDictAddInt (d, key, st->addedDate);
+        tr_variantInitInt (initme, st->addedDate);
         break;
 
       case TR_KEY_bandwidthPriority:
-        tr_variantDictAddInt (d, key, tr_torrentGetPriority (tor));
+        tr_variantInitInt (initme, tr_torrentGetPriority (tor));
         break;
 
       case TR_KEY_comment:
-        tr_variantDictAddStr (d, key, inf->comment ? inf->comment : "");
+        tr_variantInitStr (initme, inf->comment ? inf->comment : "", -1);
         break;
 
       case TR_KEY_corruptEver:
-        tr_variantDictAddInt (d, key, st->corruptEver);
+        tr_variantInitInt (initme, st->corruptEver);
         break;
 
       case TR_KEY_creator:
-        tr_variantDictAddStr (d, key, inf->creator ? inf->creator : "");
+        tr_variantInitStr (initme, inf->creator ? inf->creator : "", -1);
         break;
 
       case TR_KEY_dateCreated:
-        tr_variantDictAddInt (d, key, inf->dateCreated);
+        tr_variantInitInt (initme, inf->dateCreated);
         break;
 
       case TR_KEY_desiredAvailable:
-        tr_variantDictAddInt (d, key, st->desiredAvailable);
+        tr_variantInitInt (initme, st->desiredAvailable);
         break;
 
       case TR_KEY_doneDate:
-        tr_variantDictAddInt (d, key, st->doneDate);
+        tr_variantInitInt (initme, st->doneDate);
         break;
 
       case TR_KEY_downloadDir:
-        tr_variantDictAddStr (d, key, tr_torrentGetDownloadDir (tor));
+        tr_variantInitStr (initme, tr_torrentGetDownloadDir (tor), -1);
         break;
 
       case TR_KEY_downloadedEver:
-        tr_variantDictAddInt (d, key, st->downloadedEver);
+        tr_variantInitInt (initme, st->downloadedEver);
         break;
 
       case TR_KEY_downloadLimit:
-        tr_variantDictAddInt (d, key, tr_torrentGetSpeedLimit_KBps (tor, TR_DOWN));
+        tr_variantInitInt (initme, tr_torrentGetSpeedLimit_KBps (tor, TR_DOWN));
         break;
 
       case TR_KEY_downloadLimited:
-        tr_variantDictAddBool (d, key, tr_torrentUsesSpeedLimit (tor, TR_DOWN));
+        tr_variantInitBool (initme, tr_torrentUsesSpeedLimit (tor, TR_DOWN));
         break;
 
       case TR_KEY_error:
-        tr_variantDictAddInt (d, key, st->error);
+        tr_variantInitInt (initme, st->error);
         break;
 
       case TR_KEY_errorString:
-        tr_variantDictAddStr (d, key, st->errorString);
+        tr_variantInitStr (initme, st->errorString, -1);
         break;
 
       case TR_KEY_eta:
-        tr_variantDictAddInt (d, key, st->eta);
-        break;
-
-      case TR_KEY_files:
-        addFiles (tor, tr_variantDictAddList (d, key, inf->fileCount));
-        break;
-
-      case TR_KEY_fileStats:
-        addFileStats (tor, tr_variantDictAddList (d, key, inf->fileCount));
+        tr_variantInitInt (initme, st->eta);
         break;
 
       case TR_KEY_hashString:
-        tr_variantDictAddStr (d, key, tor->info.hashString);
+        tr_variantInitStr (initme, tor->info.hashString, -1);
         break;
 
       case TR_KEY_haveUnchecked:
-        tr_variantDictAddInt (d, key, st->haveUnchecked);
+        tr_variantInitInt (initme, st->haveUnchecked);
         break;
 
       case TR_KEY_haveValid:
-        tr_variantDictAddInt (d, key, st->haveValid);
+        tr_variantInitInt (initme, st->haveValid);
         break;
 
       case TR_KEY_honorsSessionLimits:
-        tr_variantDictAddBool (d, key, tr_torrentUsesSessionLimits (tor));
+        tr_variantInitBool (initme, tr_torrentUsesSessionLimits (tor));
         break;
 
       case TR_KEY_id:
-        tr_variantDictAddInt (d, key, st->id);
+        tr_variantInitInt (initme, st->id);
         break;
 
       case TR_KEY_isFinished:
-        tr_variantDictAddBool (d, key, st->finished);
+        tr_variantInitBool (initme, st->finished);
         break;
 
       case TR_KEY_isPrivate:
-        tr_variantDictAddBool (d, key, tr_torrentIsPrivate (tor));
+        tr_variantInitBool (initme, tr_torrentIsPrivate (tor));
         break;
 
       case TR_KEY_isStalled:
-        tr_variantDictAddBool (d, key, st->isStalled);
+        tr_variantInitBool (initme, st->isStalled);
         break;
 
       case TR_KEY_leftUntilDone:
-        tr_variantDictAddInt (d, key, st->leftUntilDone);
+        tr_variantInitInt (initme, st->leftUntilDone);
         break;
 
       case TR_KEY_manualAnnounceTime:
-        tr_variantDictAddInt (d, key, st->manualAnnounceTime);
+        tr_variantInitInt (initme, st->manualAnnounceTime);
         break;
 
       case TR_KEY_maxConnectedPeers:
-        tr_variantDictAddInt (d, key,  tr_torrentGetPeerLimit (tor));
+        tr_variantInitInt (initme, tr_torrentGetPeerLimit (tor));
         break;
 
       case TR_KEY_magnetLink:
         str = tr_torrentGetMagnetLink (tor);
-        tr_variantDictAddStr (d, key, str);
+        tr_variantInitStr (initme, str, -1);
         tr_free (str);
         break;
 
       case TR_KEY_metadataPercentComplete:
-        tr_variantDictAddReal (d, key, st->metadataPercentComplete);
+        tr_variantInitReal (initme, st->metadataPercentComplete);
         break;
 
       case TR_KEY_name:
-        tr_variantDictAddStr (d, key, tr_torrentName (tor));
+        tr_variantInitStr (initme, tr_torrentName (tor), -1);
         break;
 
       case TR_KEY_percentDone:
-        tr_variantDictAddReal (d, key, st->percentDone);
+        tr_variantInitReal (initme, st->percentDone);
         break;
 
       case TR_KEY_peer_limit:
-        tr_variantDictAddInt (d, key, tr_torrentGetPeerLimit (tor));
-        break;
-
-      case TR_KEY_peers:
-        addPeers (tor, tr_variantDictAdd (d, key));
+        tr_variantInitInt (initme, tr_torrentGetPeerLimit (tor));
         break;
 
       case TR_KEY_peersConnected:
-        tr_variantDictAddInt (d, key, st->peersConnected);
+        tr_variantInitInt (initme, st->peersConnected);
         break;
 
       case TR_KEY_peersFrom:
         {
-          tr_variant * tmp = tr_variantDictAddDict (d, key, 7);
+          tr_variant * tmp = initme;
           const int * f = st->peersFrom;
+          tr_variantInitDict (tmp, 7);
           tr_variantDictAddInt (tmp, TR_KEY_fromCache,    f[TR_PEER_FROM_RESUME]);
           tr_variantDictAddInt (tmp, TR_KEY_fromDht,      f[TR_PEER_FROM_DHT]);
           tr_variantDictAddInt (tmp, TR_KEY_fromIncoming, f[TR_PEER_FROM_INCOMING]);
@@ -735,11 +764,11 @@ addField (tr_torrent       * const tor,
         }
 
       case TR_KEY_peersGettingFromUs:
-        tr_variantDictAddInt (d, key, st->peersGettingFromUs);
+        tr_variantInitInt (initme, st->peersGettingFromUs);
         break;
 
       case TR_KEY_peersSendingToUs:
-        tr_variantDictAddInt (d, key, st->peersSendingToUs);
+        tr_variantInitInt (initme, st->peersSendingToUs);
         break;
 
       case TR_KEY_pieces:
@@ -748,146 +777,140 @@ addField (tr_torrent       * const tor,
             size_t byte_count = 0;
             void * bytes = tr_cpCreatePieceBitfield (&tor->completion, &byte_count);
             char * str = tr_base64_encode (bytes, byte_count, NULL);
-            tr_variantDictAddStr (d, key, str!=NULL ? str : "");
+            tr_variantInitStr (initme, str!=NULL ? str : "", -1);
             tr_free (str);
             tr_free (bytes);
           }
         else
           {
-            tr_variantDictAddStr (d, key, "");
+            tr_variantInitStr (initme, "", -1);
           }
         break;
 
       case TR_KEY_pieceCount:
-        tr_variantDictAddInt (d, key, inf->pieceCount);
+        tr_variantInitInt (initme, inf->pieceCount);
         break;
 
       case TR_KEY_pieceSize:
-        tr_variantDictAddInt (d, key, inf->pieceSize);
+        tr_variantInitInt (initme, inf->pieceSize);
         break;
 
-      case TR_KEY_priorities:
-        {
-          tr_file_index_t i;
-          tr_variant * p = tr_variantDictAddList (d, key, inf->fileCount);
-          for (i=0; i<inf->fileCount; ++i)
-            tr_variantListAddInt (p, inf->files[i].priority);
-          break;
-        }
-
       case TR_KEY_queuePosition:
-        tr_variantDictAddInt (d, key, st->queuePosition);
+        tr_variantInitInt (initme, st->queuePosition);
         break;
 
       case TR_KEY_etaIdle:
-        tr_variantDictAddInt (d, key, st->etaIdle);
+        tr_variantInitInt (initme, st->etaIdle);
         break;
 
       case TR_KEY_rateDownload:
-        tr_variantDictAddInt (d, key, toSpeedBytes (st->pieceDownloadSpeed_KBps));
+        tr_variantInitInt (initme, toSpeedBytes (st->pieceDownloadSpeed_KBps));
         break;
 
       case TR_KEY_rateUpload:
-        tr_variantDictAddInt (d, key, toSpeedBytes (st->pieceUploadSpeed_KBps));
+        tr_variantInitInt (initme, toSpeedBytes (st->pieceUploadSpeed_KBps));
         break;
 
       case TR_KEY_recheckProgress:
-        tr_variantDictAddReal (d, key, st->recheckProgress);
+        tr_variantInitReal (initme, st->recheckProgress);
         break;
 
       case TR_KEY_seedIdleLimit:
-        tr_variantDictAddInt (d, key, tr_torrentGetIdleLimit (tor));
+        tr_variantInitInt (initme, tr_torrentGetIdleLimit (tor));
         break;
 
       case TR_KEY_seedIdleMode:
-        tr_variantDictAddInt (d, key, tr_torrentGetIdleMode (tor));
+        tr_variantInitInt (initme, tr_torrentGetIdleMode (tor));
         break;
 
       case TR_KEY_seedRatioLimit:
-        tr_variantDictAddReal (d, key, tr_torrentGetRatioLimit (tor));
+        tr_variantInitReal (initme, tr_torrentGetRatioLimit (tor));
         break;
 
       case TR_KEY_seedRatioMode:
-        tr_variantDictAddInt (d, key, tr_torrentGetRatioMode (tor));
+        tr_variantInitInt (initme, tr_torrentGetRatioMode (tor));
         break;
 
       case TR_KEY_sizeWhenDone:
-        tr_variantDictAddInt (d, key, st->sizeWhenDone);
+        tr_variantInitInt (initme, st->sizeWhenDone);
         break;
 
       case TR_KEY_startDate:
-        tr_variantDictAddInt (d, key, st->startDate);
+        tr_variantInitInt (initme, st->startDate);
         break;
 
       case TR_KEY_status:
-        tr_variantDictAddInt (d, key, st->activity);
+        tr_variantInitInt (initme, st->activity);
         break;
 
       case TR_KEY_secondsDownloading:
-        tr_variantDictAddInt (d, key, st->secondsDownloading);
+        tr_variantInitInt (initme, st->secondsDownloading);
         break;
 
       case TR_KEY_secondsSeeding:
-        tr_variantDictAddInt (d, key, st->secondsSeeding);
+        tr_variantInitInt (initme, st->secondsSeeding);
         break;
 
       case TR_KEY_trackers:
-        addTrackers (inf, tr_variantDictAddList (d, key, inf->trackerCount));
+        tr_variantInitList (initme, inf->trackerCount);
+        addTrackers (inf, initme);
         break;
 
-      case TR_KEY_trackerStats:
-        {
-          int n;
-          tr_tracker_stat * s = tr_torrentTrackers (tor, &n);
-          addTrackerStats (s, n, tr_variantDictAddList (d, key, n));
-          tr_torrentTrackersFree (s, n);
-          break;
-        }
-
       case TR_KEY_torrentFile:
-        tr_variantDictAddStr (d, key, inf->torrent);
+        tr_variantInitStr (initme, inf->torrent, -1);
         break;
 
       case TR_KEY_totalSize:
-        tr_variantDictAddInt (d, key, inf->totalSize);
+        tr_variantInitInt (initme, inf->totalSize);
         break;
 
       case TR_KEY_uploadedEver:
-        tr_variantDictAddInt (d, key, st->uploadedEver);
+        tr_variantInitInt (initme, st->uploadedEver);
         break;
 
       case TR_KEY_uploadLimit:
-        tr_variantDictAddInt (d, key, tr_torrentGetSpeedLimit_KBps (tor, TR_UP));
+        tr_variantInitInt (initme, tr_torrentGetSpeedLimit_KBps (tor, TR_UP));
         break;
 
       case TR_KEY_uploadLimited:
-        tr_variantDictAddBool (d, key, tr_torrentUsesSpeedLimit (tor, TR_UP));
+        tr_variantInitBool (initme, tr_torrentUsesSpeedLimit (tor, TR_UP));
         break;
 
       case TR_KEY_uploadRatio:
-        tr_variantDictAddReal (d, key, st->ratio);
+        tr_variantInitReal (initme, st->ratio);
         break;
 
-      case TR_KEY_wanted:
-        {
-          tr_file_index_t i;
-          tr_variant * w = tr_variantDictAddList (d, key, inf->fileCount);
-          for (i=0; i<inf->fileCount; ++i)
-            tr_variantListAddInt (w, inf->files[i].dnd ? 0 : 1);
-          break;
-        }
-
       case TR_KEY_webseeds:
-        addWebseeds (inf, tr_variantDictAddList (d, key, inf->webseedCount));
+        tr_variantInitList (initme, inf->webseedCount);
+        addWebseeds (inf, initme);
         break;
 
       case TR_KEY_webseedsSendingToUs:
-        tr_variantDictAddInt (d, key, st->webseedsSendingToUs);
+        tr_variantInitInt (initme, st->webseedsSendingToUs);
         break;
 
       default:
-        break;
+        return false;
     }
+
+  return true;
+}
+
+static void
+addField (tr_torrent       * const tor,
+          const tr_info    * const inf,
+          const tr_stat    * const st,
+          tr_variant       * const d,
+          const tr_quark           key)
+{
+  tr_variant * child;
+
+  if (tr_variantDictFind (d, key) != NULL)
+    return;
+
+  child = tr_variantDictAdd (d, key);
+  if (!initField (tor, inf, st, child, key))
+    tr_variantDictRemove (d, key);
 }
 
 static void
@@ -913,44 +936,457 @@ addInfo (tr_torrent * tor, tr_variant * d, tr_variant * fields)
     }
 }
 
+/* @return false if `key' isn't a torrent-get field, having written nothing */
+static bool
+writeField (tr_json_writer * w,
+            tr_torrent     * tor,
+            const tr_info  * inf,
+            const tr_stat  * st,
+            const tr_quark   key)
+{
+  tr_file_index_t i;
+  tr_variant v;
+
+  switch (key)
+    {
+      /* the listings can be long, so they're written as they're walked */
+      case TR_KEY_files:
+        writeFiles (w, tor);
+        break;
+
+      case TR_KEY_fileStats:
+        writeFileStats (w, tor);
+        break;
+
+      case TR_KEY_peers:
+        writePeers (w, tor);
+        break;
+
+      case TR_KEY_priorities:
+        tr_jsonBeginList (w);
+        for (i=0; i<inf->fileCount; ++i)
+          tr_jsonInt (w, inf->files[i].priority);
+        tr_jsonEnd (w);
+        break;
+
+      case TR_KEY_trackerStats:
+        {
+          int n;
+          tr_tracker_stat * s = tr_torrentTrackers (tor, &n);
+          writeTrackerStats (w, s, n);
+          tr_torrentTrackersFree (s, n);
+          break;
+        }
+
+      case TR_KEY_wanted:
+        tr_jsonBeginList (w);
+        for (i=0; i<inf->fileCount; ++i)
+          tr_jsonInt (w, inf->files[i].dnd ? 0 : 1);
+        tr_jsonEnd (w);
+        break;
+
+      default:
+        if (!initField (tor, inf, st, &v, key))
+          return false;
+        tr_jsonVariant (w, &v);
+        tr_variantFree (&v);
+        break;
+    }
+
+  return true;
+}
+
+/* Every torrent-get field. Keep this in step with initField () and writeField () */
+static const tr_quark torrentGetFields[] =
+{
+  TR_KEY_activityDate, TR_KEY_addedDate, TR_KEY_bandwidthPriority,
+  TR_KEY_comment, TR_KEY_corruptEver, TR_KEY_creator, TR_KEY_dateCreated,
+  TR_KEY_desiredAvailable, TR_KEY_doneDate, TR_KEY_downloadDir,
+  TR_KEY_downloadLimit, TR_KEY_downloadLimited, TR_KEY_downloadedEver,
+  TR_KEY_error, TR_KEY_errorString, TR_KEY_eta, TR_KEY_etaIdle,
+  TR_KEY_fileStats, TR_KEY_files, TR_KEY_hashString, TR_KEY_haveUnchecked,
+  TR_KEY_haveValid, TR_KEY_honorsSessionLimits, TR_KEY_id, TR_KEY_isFinished,
+  TR_KEY_isPrivate, TR_KEY_isStalled, TR_KEY_leftUntilDone, TR_KEY_magnetLink,
+  TR_KEY_manualAnnounceTime, TR_KEY_maxConnectedPeers,
+  TR_KEY_metadataPercentComplete, TR_KEY_name, TR_KEY_peer_limit, TR_KEY_peers,
+  TR_KEY_peersConnected, TR_KEY_peersFrom, TR_KEY_peersGettingFromUs,
+  TR_KEY_peersSendingToUs, TR_KEY_percentDone, TR_KEY_pieceCount,
+  TR_KEY_pieceSize, TR_KEY_pieces, TR_KEY_priorities, TR_KEY_queuePosition,
+  TR_KEY_rateDownload, TR_KEY_rateUpload, TR_KEY_recheckProgress,
+  TR_KEY_secondsDownloading, TR_KEY_secondsSeeding, TR_KEY_seedIdleLimit,
+  TR_KEY_seedIdleMode, TR_KEY_seedRatioLimit, TR_KEY_seedRatioMode,
+  TR_KEY_sizeWhenDone, TR_KEY_startDate, TR_KEY_status, TR_KEY_torrentFile,
+  TR_KEY_totalSize, TR_KEY_trackerStats, TR_KEY_trackers, TR_KEY_uploadLimit,
+  TR_KEY_uploadLimited, TR_KEY_uploadRatio, TR_KEY_uploadedEver, TR_KEY_wanted,
+  TR_KEY_webseeds, TR_KEY_webseedsSendingToUs
+};
+
+static bool
+isTorrentGetField (tr_quark key)
+{
+  size_t i;
+
+  for (i=0; i<TR_N_ELEMENTS (torrentGetFields); ++i)
+    if (torrentGetFields[i] == key)
+      return true;
+
+  return false;
+}
+
+/* Get the torrent-get fields named in `fields', leaving out duplicates
+ * and any that aren't fields */
+static tr_quark *
+getFieldKeys (tr_variant * fields, int * setmeCount)
+{
+  int i;
+  int j;
+  int keyCount = 0;
+  const int n = tr_variantListSize (fields);
+  tr_quark * keys = tr_new (tr_quark, n);
+
+  for (i=0; i<n; ++i)
+    {
+      size_t len;
+      const char * str;
+      tr_quark key;
+
+      if (!tr_variantGetStr (tr_variantListChild (fields, i), &str, &len))
+        continue;
+
+      if (!tr_quark_lookup (str, len, &key) || !isTorrentGetField (key))
+        continue;
+
+      for (j=0; j<keyCount; ++j)
+        if (keys[j] == key)
+          break;
+      if (j < keyCount)
+        continue;
+
+      keys[keyCount++] = key;
+    }
+
+  *setmeCount = keyCount;
+  return keys;
+}
+
+static void
+writeInfo (tr_json_writer * w, tr_torrent * tor, const tr_quark * keys, int keyCount)
+{
+  int i;
+  const tr_info * inf = tr_torrentInfo (tor);
+  const tr_stat * st = tr_torrentStat (tor);
+
+  tr_jsonBeginDict (w);
+
+  for (i=0; i<keyCount; ++i)
+    {
+      tr_jsonKey (w, keys[i]);
+      writeField (w, tor, inf, st, keys[i]);
+    }
+
+  tr_jsonEnd (w);
+}
+
+/***
+****  torrent-get's "since" argument.
+****
+****  Each torrent remembers a hash of the last value that RPC sent for each
+****  field, and the changeSeq at which that value last changed. A client
+****  that saw seq N already has every field whose changeSeq is <= N.
+***/
+
+struct tr_field_stamp
+{
+  tr_quark key;
+  uint64_t hash;
+  uint64_t seq;
+};
+
+#define FNV_OFFSET_BASIS 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+static uint64_t
+hashBytes (uint64_t hash, const void * vbytes, size_t len)
+{
+  const uint8_t * bytes = vbytes;
+
+  while (len--)
+    {
+      hash ^= *bytes++;
+      hash *= FNV_PRIME;
+    }
+
+  return hash;
+}
+
+/* hash a field's JSON, so that only changes a client could see count */
+static uint64_t
+hashBuffer (struct evbuffer * buf)
+{
+  return hashBytes (FNV_OFFSET_BASIS,
+                    evbuffer_pullup (buf, -1),
+                    evbuffer_get_length (buf));
+}
+
+static int
+compareKeyToFieldStamp (const void * vkey, const void * vstamp)
+{
+  const tr_quark key = *(const tr_quark*) vkey;
+  const struct tr_field_stamp * stamp = vstamp;
+
+  if (key < stamp->key)
+    return -1;
+  if (key > stamp->key)
+    return 1;
+  return 0;
+}
+
+/* @return the changeSeq at which this field last changed to `hash' */
+static uint64_t
+getFieldSeq (tr_torrent * tor, tr_quark key, uint64_t hash)
+{
+  bool exact;
+  struct tr_field_stamp * stamp;
+  const int pos = tr_lowerBound (&key, tor->fieldStamps, tor->fieldStampCount,
+                                 sizeof (struct tr_field_stamp),
+                                 compareKeyToFieldStamp, &exact);
+
+  if (!exact)
+    {
+      tor->fieldStamps = tr_renew (struct tr_field_stamp, tor->fieldStamps, tor->fieldStampCount+1);
+      memmove (tor->fieldStamps + pos + 1,
+               tor->fieldStamps + pos,
+               sizeof (struct tr_field_stamp) * (tor->fieldStampCount - pos));
+      ++tor->fieldStampCount;
+
+      stamp = tor->fieldStamps + pos;
+      stamp->key = key;
+      stamp->hash = hash;
+      stamp->seq = tor->changeSeq;
+    }
+  else
+    {
+      stamp = tor->fieldStamps + pos;
+
+      if (stamp->hash != hash)
+        {
+          stamp->hash = hash;
+          stamp->seq = tor->changeSeq;
+        }
+    }
+
+  return stamp->seq;
+}
+
+/* Changes are only numbered when a request asks about them, so that
+ * the many small changes between two requests all share one number */
+static uint64_t
+getTorrentChangeSeq (tr_torrent * tor, uint64_t seq)
+{
+  if (__atomic_exchange_n (&tor->hasChanged, false, __ATOMIC_ACQUIRE))
+    {
+      tor->changeSeq = seq;
+      tor->session->latestChangeSeq = MAX (tor->session->latestChangeSeq, seq);
+    }
+
+  return tor->changeSeq;
+}
+
+/* Like writeInfo (), but only with the fields that changed after `since'.
+ * The fields are hashed as they're written into scratch buffers, and
+ * the torrent is only copied into `w' if any of them did */
+static void
+writeChangedInfo (tr_json_writer   * w,
+                  tr_torrent       * tor,
+                  const tr_quark   * keys,
+                  int                keyCount,
+                  uint64_t           since,
+                  tr_json_writer   * row,
+                  struct evbuffer  * row_buf,
+                  tr_json_writer   * field,
+                  struct evbuffer  * field_buf)
+{
+  int i;
+  int changed = 0;
+  const tr_info * inf = tr_torrentInfo (tor);
+  const tr_stat * st = tr_torrentStat (tor);
+
+  /* the id is always included, so that clients know which torrent it is */
+  tr_jsonBeginDict (row);
+  tr_jsonDictAddInt (row, TR_KEY_id, st->id);
+
+  for (i=0; i<keyCount; ++i)
+    {
+      if (keys[i] == TR_KEY_id)
+        continue;
+
+      writeField (field, tor, inf, st, keys[i]);
+
+      if (getFieldSeq (tor, keys[i], hashBuffer (field_buf)) > since)
+        {
+          ++changed;
+          tr_jsonKey (row, keys[i]);
+          tr_jsonRawValue (row, field_buf);
+        }
+      else
+        {
+          evbuffer_drain (field_buf, evbuffer_get_length (field_buf));
+        }
+    }
+
+  tr_jsonEnd (row);
+
+  if (changed > 0)
+    tr_jsonRawValue (w, row_buf);
+  else
+    evbuffer_drain (row_buf, evbuffer_get_length (row_buf));
+}
+
+/* The "table" format sends a header row of the field names, and then a
+ * row of values for each torrent, rather than repeating every field name
+ * in every torrent. */
+static void
+writeTable (tr_json_writer * w, tr_torrent ** torrents, int torrentCount, const tr_quark * keys, int keyCount)
+{
+  int i;
+  int j;
+
+  tr_jsonBeginList (w);
+  for (j=0; j<keyCount; ++j)
+    tr_jsonStr (w, tr_quark_get_string (keys[j], NULL), -1);
+  tr_jsonEnd (w);
+
+  for (i=0; i<torrentCount; ++i)
+    {
+      tr_torrent * tor = torrents[i];
+      const tr_info * inf = tr_torrentInfo (tor);
+      const tr_stat * st = tr_torrentStat (tor);
+
+      tr_jsonBeginList (w);
+      for (j=0; j<keyCount; ++j)
+        writeField (w, tor, inf, st, keys[j]);
+      tr_jsonEnd (w);
+    }
+}
+
+/* torrent-get's response is written straight into the output as it's
+ * generated, rather than built up as a tr_variant first. With many
+ * torrents, that tree could take far more memory than the JSON itself */
 static const char*
-torrentGet (tr_session               * session,
-            tr_variant               * args_in,
-            tr_variant               * args_out,
-            struct tr_rpc_idle_data  * idle_data UNUSED)
+torrentGet (tr_session      * session,
+            tr_variant      * args_in,
+            tr_json_writer  * out)
 {
   int i;
   int torrentCount;
   tr_torrent ** torrents = getTorrents (session, args_in, &torrentCount);
-  tr_variant * list = tr_variantDictAddList (args_out, TR_KEY_torrents, torrentCount);
   tr_variant * fields;
   const char * strVal;
   const char * errmsg = NULL;
+  int64_t since;
+  uint64_t seq = 0;
+  const bool delta = tr_variantDictFindInt (args_in, TR_KEY_since, &since);
+  const bool table = tr_variantDictFindStr (args_in, TR_KEY_format, &strVal, NULL) && !strcmp (strVal, "table");
 
-  assert (idle_data == NULL);
+  if (delta)
+    {
+      int n = 0;
+      tr_variant * d;
+
+      seq = ++session->changeSeq;
+      tr_jsonDictAddInt (out, TR_KEY_seq, seq);
 
-  if (tr_variantDictFindStr (args_in, TR_KEY_ids, &strVal, NULL) && !strcmp (strVal, "recently-active"))
+      /* a cursor we didn't hand out gets everything */
+      if ((since < 0) || ((uint64_t)since < session->startChangeSeq)
+                      || ((uint64_t)since >= seq))
+        since = 0;
+
+      tr_jsonDictAddList (out, TR_KEY_removed);
+      while ((d = tr_variantListChild (&session->removedTorrents, n++)))
+        {
+          int64_t intVal;
+          if (tr_variantDictFindInt (d, TR_KEY_seq, &intVal) && (intVal > since))
+            {
+              tr_variantDictFindInt (d, TR_KEY_id, &intVal);
+              tr_jsonInt (out, intVal);
+            }
+        }
+      tr_jsonEnd (out);
+    }
+  else if (tr_variantDictFindStr (args_in, TR_KEY_ids, &strVal, NULL) && !strcmp (strVal, "recently-active"))
     {
       int n = 0;
       tr_variant * d;
       const time_t now = tr_time ();
       const int interval = RECENTLY_ACTIVE_SECONDS;
-      tr_variant * removed_out = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
+
+      tr_jsonDictAddList (out, TR_KEY_removed);
       while ((d = tr_variantListChild (&session->removedTorrents, n++)))
         {
           int64_t intVal;
           if (tr_variantDictFindInt (d, TR_KEY_date, &intVal) && (intVal >= now - interval))
             {
               tr_variantDictFindInt (d, TR_KEY_id, &intVal);
-              tr_variantListAddInt (removed_out, intVal);
+              tr_jsonInt (out, intVal);
             }
         }
+      tr_jsonEnd (out);
     }
 
+  tr_jsonDictAddList (out, TR_KEY_torrents);
+
   if (!tr_variantDictFindList (args_in, TR_KEY_fields, &fields))
-    errmsg = "no fields specified";
-  else for (i=0; i<torrentCount; ++i)
-    addInfo (torrents[i], tr_variantListAdd (list), fields);
+    {
+      errmsg = "no fields specified";
+    }
+  else
+    {
+      int keyCount;
+      tr_quark * keys;
+
+      /* skip the torrents that haven't changed at all */
+      if (delta)
+        {
+          int n = 0;
+          for (i=0; i<torrentCount; ++i)
+            if (getTorrentChangeSeq (torrents[i], seq) > (uint64_t)since)
+              torrents[n++] = torrents[i];
+          torrentCount = n;
+        }
+
+      keys = getFieldKeys (fields, &keyCount);
+
+      /* rows don't leave fields out, so "since" only skips whole torrents */
+      if (table)
+        {
+          writeTable (out, torrents, torrentCount, keys, keyCount);
+        }
+      else if (delta)
+        {
+          struct evbuffer * row_buf = evbuffer_new ();
+          struct evbuffer * field_buf = evbuffer_new ();
+          tr_json_writer * row = tr_jsonWriterNew (row_buf, true, false);
+          tr_json_writer * field = tr_jsonWriterNew (field_buf, true, false);
+
+          for (i=0; i<torrentCount; ++i)
+            writeChangedInfo (out, torrents[i], keys, keyCount, since,
+                              row, row_buf, field, field_buf);
+
+          tr_jsonWriterFree (field);
+          tr_jsonWriterFree (row);
+          evbuffer_free (field_buf);
+          evbuffer_free (row_buf);
+        }
+      else
+        {
+          for (i=0; i<torrentCount; ++i)
+            writeInfo (out, torrents[i], keys, keyCount);
+        }
+
+      tr_free (keys);
+    }
+
+  tr_jsonEnd (out);
 
   tr_free (torrents);
   return errmsg;
@@ -1958,21 +2394,34 @@ sessionSet (tr_session               * session,
   return NULL;
 }
 
+static void
+writeDiskJobStats (tr_json_writer * w, tr_quark key, const tr_disk_stats * stats, tr_disk_job_type type)
+{
+  const uint64_t n = stats->job_count[type];
+
+  tr_jsonDictAddDict (w, key);
+  tr_jsonDictAddInt (w, TR_KEY_jobCount, n);
+  tr_jsonDictAddInt (w, TR_KEY_latencyAverageMsec, n ? stats->latency_total_msec[type] / n : 0);
+  tr_jsonDictAddInt (w, TR_KEY_latencyMaxMsec, stats->latency_max_msec[type]);
+  tr_jsonEnd (w);
+}
+
 static const char*
-sessionStats (tr_session               * session,
-              tr_variant               * args_in UNUSED,
-              tr_variant               * args_out,
-              struct tr_rpc_idle_data  * idle_data UNUSED)
+sessionStats (tr_session      * session,
+              tr_variant      * args_in UNUSED,
+              tr_json_writer  * out)
 {
   int running = 0;
   int total = 0;
-  tr_variant * d;
   tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 };
   tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 };
+  tr_cache_stats cacheStats;
+  tr_disk_stats diskStats;
+  tr_fd_stats fdStats;
+  tr_connect_rate_stats connectStats;
+  int peerCount;
   tr_torrent * tor = NULL;
 
-  assert (idle_data == NULL);
-
   while ((tor = tr_torrentNext (session, tor)))
     {
       ++total;
@@ -1984,25 +2433,68 @@ sessionStats (tr_session               * session,
   tr_sessionGetStats (session, &currentStats);
   tr_sessionGetCumulativeStats (session, &cumulativeStats);
 
-  tr_variantDictAddInt  (args_out, TR_KEY_activeTorrentCount, running);
-  tr_variantDictAddReal (args_out, TR_KEY_downloadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_DOWN));
-  tr_variantDictAddInt  (args_out, TR_KEY_pausedTorrentCount, total - running);
-  tr_variantDictAddInt  (args_out, TR_KEY_torrentCount, total);
-  tr_variantDictAddReal (args_out, TR_KEY_uploadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_UP));
-
-  d = tr_variantDictAddDict (args_out, TR_KEY_cumulative_stats, 5);
-  tr_variantDictAddInt (d, TR_KEY_downloadedBytes, cumulativeStats.downloadedBytes);
-  tr_variantDictAddInt (d, TR_KEY_filesAdded, cumulativeStats.filesAdded);
-  tr_variantDictAddInt (d, TR_KEY_secondsActive, cumulativeStats.secondsActive);
-  tr_variantDictAddInt (d, TR_KEY_sessionCount, cumulativeStats.sessionCount);
-  tr_variantDictAddInt (d, TR_KEY_uploadedBytes, cumulativeStats.uploadedBytes);
-
-  d = tr_variantDictAddDict (args_out, TR_KEY_current_stats, 5);
-  tr_variantDictAddInt (d, TR_KEY_downloadedBytes, currentStats.downloadedBytes);
-  tr_variantDictAddInt (d, TR_KEY_filesAdded, currentStats.filesAdded);
-  tr_variantDictAddInt (d, TR_KEY_secondsActive, currentStats.secondsActive);
-  tr_variantDictAddInt (d, TR_KEY_sessionCount, currentStats.sessionCount);
-  tr_variantDictAddInt (d, TR_KEY_uploadedBytes, currentStats.uploadedBytes);
+  tr_jsonDictAddInt  (out, TR_KEY_activeTorrentCount, running);
+  tr_jsonDictAddReal (out, TR_KEY_downloadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_DOWN));
+  tr_jsonDictAddInt  (out, TR_KEY_pausedTorrentCount, total - running);
+  tr_jsonDictAddInt  (out, TR_KEY_torrentCount, total);
+  tr_jsonDictAddReal (out, TR_KEY_uploadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_UP));
+
+  tr_jsonDictAddDict (out, TR_KEY_cumulative_stats);
+  tr_jsonDictAddInt (out, TR_KEY_downloadedBytes, cumulativeStats.downloadedBytes);
+  tr_jsonDictAddInt (out, TR_KEY_filesAdded, cumulativeStats.filesAdded);
+  tr_jsonDictAddInt (out, TR_KEY_secondsActive, cumulativeStats.secondsActive);
+  tr_jsonDictAddInt (out, TR_KEY_sessionCount, cumulativeStats.sessionCount);
+  tr_jsonDictAddInt (out, TR_KEY_uploadedBytes, cumulativeStats.uploadedBytes);
+  tr_jsonEnd (out);
+
+  tr_jsonDictAddDict (out, TR_KEY_current_stats);
+  tr_jsonDictAddInt (out, TR_KEY_downloadedBytes, currentStats.downloadedBytes);
+  tr_jsonDictAddInt (out, TR_KEY_filesAdded, currentStats.filesAdded);
+  tr_jsonDictAddInt (out, TR_KEY_secondsActive, currentStats.secondsActive);
+  tr_jsonDictAddInt (out, TR_KEY_sessionCount, currentStats.sessionCount);
+  tr_jsonDictAddInt (out, TR_KEY_uploadedBytes, currentStats.uploadedBytes);
+  tr_jsonEnd (out);
+
+  tr_cacheGetStats (session->cache, &cacheStats);
+  tr_jsonDictAddDict (out, TR_KEY_cache_stats);
+  tr_jsonDictAddInt (out, TR_KEY_hits, cacheStats.hits);
+  tr_jsonDictAddInt (out, TR_KEY_misses, cacheStats.misses);
+  tr_jsonDictAddInt (out, TR_KEY_evictions, cacheStats.evictions);
+  tr_jsonDictAddInt (out, TR_KEY_dirtyBlocks, cacheStats.dirty_blocks);
+  tr_jsonDictAddInt (out, TR_KEY_cleanBlocks, cacheStats.clean_blocks);
+  tr_jsonEnd (out);
+
+  tr_diskQueueGetStats (session->diskQueue, &diskStats);
+  tr_jsonDictAddDict (out, TR_KEY_disk_stats);
+  tr_jsonDictAddInt (out, TR_KEY_queueDepth, diskStats.queue_depth);
+  tr_jsonDictAddInt (out, TR_KEY_queueDepthPeak, diskStats.queue_depth_peak);
+  writeDiskJobStats (out, TR_KEY_read, &diskStats, TR_DISK_READ);
+  writeDiskJobStats (out, TR_KEY_write, &diskStats, TR_DISK_WRITE);
+  writeDiskJobStats (out, TR_KEY_flush, &diskStats, TR_DISK_FLUSH);
+  writeDiskJobStats (out, TR_KEY_hash, &diskStats, TR_DISK_HASH);
+  tr_jsonEnd (out);
+
+  tr_fdGetStats (session, &fdStats);
+  tr_jsonDictAddDict (out, TR_KEY_open_file_stats);
+  tr_jsonDictAddInt (out, TR_KEY_openFiles, fdStats.open_files);
+  tr_jsonDictAddInt (out, TR_KEY_openFileLimit, fdStats.open_file_limit);
+  tr_jsonDictAddInt (out, TR_KEY_opens, fdStats.opens);
+  tr_jsonDictAddInt (out, TR_KEY_evictions, fdStats.evictions);
+  tr_jsonDictAddInt (out, TR_KEY_reopens, fdStats.reopens);
+  tr_jsonEnd (out);
+
+  tr_peerMgrGetConnectionStats (session->peerMgr, &connectStats, &peerCount);
+  tr_jsonDictAddDict (out, TR_KEY_connection_stats);
+  tr_jsonDictAddReal (out, TR_KEY_attemptsPerSecond, connectStats.attempts_per_second);
+  tr_jsonDictAddInt (out, TR_KEY_attempts, connectStats.attempts);
+  tr_jsonDictAddInt (out, TR_KEY_connected, connectStats.connected);
+  tr_jsonDictAddInt (out, TR_KEY_failed, connectStats.failed);
+  tr_jsonDictAddInt (out, TR_KEY_unreachable, connectStats.unreachable);
+  tr_jsonDictAddInt (out, TR_KEY_localErrors, connectStats.local_errors);
+  tr_jsonDictAddInt (out, TR_KEY_backoffs, connectStats.backoffs);
+  tr_jsonDictAddInt (out, TR_KEY_connectMsec, connectStats.connect_msec);
+  tr_jsonDictAddInt (out, TR_KEY_peersConnected, peerCount);
+  tr_jsonEnd (out);
 
   return NULL;
 }
@@ -2117,42 +2609,235 @@ sessionClose (tr_session               * session,
   return NULL;
 }
 
+/***
+****  session-watch: a long poll that's answered when something changes,
+****  so that clients needn't keep asking an idle session for its state
+***/
+
+enum
+{
+  /* how often pending watches look for changes */
+  WATCH_PULSE_MSEC = 100,
+
+  WATCH_DEFAULT_TIMEOUT_SECS = 30,
+  WATCH_MAX_TIMEOUT_SECS = 300,
+
+  /* how long to wait for more changes after the first one */
+  WATCH_DEFAULT_WINDOW_MSEC = 1000
+};
+
+struct rpc_watch
+{
+  struct tr_rpc_idle_data * data;
+
+  bool has_since;
+  int64_t since;
+  uint64_t window_msec;
+  uint64_t deadline_msec;
+
+  /* when the first change after `since' was noticed, or 0 for none yet */
+  uint64_t changed_msec;
+};
+
+/* give the changes made since the last pulse a number */
+static void
+stampChanges (tr_session * session)
+{
+  if (__atomic_exchange_n (&session->hasChangedTorrents, false, __ATOMIC_ACQUIRE))
+    {
+      tr_torrent * tor = NULL;
+      const uint64_t seq = ++session->changeSeq;
+
+      while ((tor = tr_torrentNext (session, tor)))
+        getTorrentChangeSeq (tor, seq);
+    }
+
+  if (__atomic_exchange_n (&session->hasChangedSettings, false, __ATOMIC_ACQUIRE))
+    {
+      session->settingsChangeSeq = ++session->changeSeq;
+      session->latestChangeSeq = session->settingsChangeSeq;
+    }
+}
+
+static void
+answerWatch (tr_session * session, struct rpc_watch * w)
+{
+  int n = 0;
+  tr_variant * d;
+  tr_torrent * tor = NULL;
+  tr_variant * args_out = w->data->args_out;
+  tr_variant * changed = tr_variantDictAddList (args_out, TR_KEY_torrents, 0);
+  tr_variant * removed = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
+
+  tr_variantDictAddInt (args_out, TR_KEY_seq, session->changeSeq);
+
+  while ((tor = tr_torrentNext (session, tor)))
+    if (tor->changeSeq > (uint64_t)w->since)
+      tr_variantListAddInt (changed, tr_torrentId (tor));
+
+  while ((d = tr_variantListChild (&session->removedTorrents, n++)))
+    {
+      int64_t intVal;
+      if (tr_variantDictFindInt (d, TR_KEY_seq, &intVal) && (intVal > w->since))
+        {
+          tr_variantDictFindInt (d, TR_KEY_id, &intVal);
+          tr_variantListAddInt (removed, intVal);
+        }
+    }
+
+  tr_variantDictAddBool (args_out, TR_KEY_session_changed,
+                         session->settingsChangeSeq > (uint64_t)w->since);
+
+  tr_idle_function_done (w->data, NULL);
+  tr_free (w);
+}
+
+static void
+onWatchTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
+{
+  tr_list * l;
+  tr_session * session = vsession;
+  const uint64_t now = tr_time_msec ();
+
+  stampChanges (session);
+
+  for (l=session->rpcWatches; l!=NULL; )
+    {
+      struct rpc_watch * w = l->data;
+      l = l->next;
+
+      if (!w->changed_msec && (session->latestChangeSeq > (uint64_t)w->since))
+        w->changed_msec = now;
+
+      if ((w->changed_msec && (now >= w->changed_msec + w->window_msec))
+          || (now >= w->deadline_msec))
+        {
+          tr_list_remove_data (&session->rpcWatches, w);
+          answerWatch (session, w);
+        }
+    }
+
+  /* an idle session with nobody watching has nothing to do here */
+  if (session->rpcWatches != NULL)
+    tr_timerAddMsec (session->rpcWatchTimer, WATCH_PULSE_MSEC);
+}
+
+static void
+addWatch (void * vwatch)
+{
+  struct rpc_watch * w = vwatch;
+  tr_session * session = w->data->session;
+
+  /* a cursor we didn't hand out gets everything */
+  if (!w->has_since)
+    {
+      stampChanges (session);
+      w->since = session->changeSeq;
+    }
+  else if ((w->since < 0) || ((uint64_t)w->since < session->startChangeSeq)
+                           || ((uint64_t)w->since > session->changeSeq))
+    w->since = 0;
+
+  if (session->isClosing)
+    {
+      answerWatch (session, w);
+      return;
+    }
+
+  tr_list_append (&session->rpcWatches, w);
+
+  if (session->rpcWatchTimer == NULL)
+    session->rpcWatchTimer = evtimer_new (session->event_base, onWatchTimer, session);
+  if (!evtimer_pending (session->rpcWatchTimer, NULL))
+    tr_timerAddMsec (session->rpcWatchTimer, WATCH_PULSE_MSEC);
+}
+
+static const char*
+sessionWatch (tr_session               * session,
+              tr_variant               * args_in,
+              tr_variant               * args_out UNUSED,
+              struct tr_rpc_idle_data  * idle_data)
+{
+  int64_t i;
+  const uint64_t now = tr_time_msec ();
+  struct rpc_watch * w = tr_new0 (struct rpc_watch, 1);
+
+  w->data = idle_data;
+  w->has_since = tr_variantDictFindInt (args_in, TR_KEY_since, &w->since);
+
+  if (!tr_variantDictFindInt (args_in, TR_KEY_timeout, &i))
+    i = WATCH_DEFAULT_TIMEOUT_SECS;
+  w->deadline_msec = now + 1000 * (uint64_t) MIN (MAX (i, 0), WATCH_MAX_TIMEOUT_SECS);
+
+  if (!tr_variantDictFindInt (args_in, TR_KEY_window, &i))
+    i = WATCH_DEFAULT_WINDOW_MSEC;
+  w->window_msec = MAX (i, 0);
+
+  /* the watches live in the libtransmission thread */
+  tr_runInEventThread (session, addWatch, w);
+  return NULL;
+}
+
+void
+tr_rpc_watch_answer_all (tr_session * session)
+{
+  struct rpc_watch * w;
+
+  assert (tr_amInEventThread (session));
+
+  stampChanges (session);
+
+  while ((w = tr_list_pop_front (&session->rpcWatches)))
+    answerWatch (session, w);
+
+  if (session->rpcWatchTimer != NULL)
+    {
+      event_free (session->rpcWatchTimer);
+      session->rpcWatchTimer = NULL;
+    }
+}
+
 /***
 ****
 ***/
 
 typedef const char* (*handler)(tr_session*, tr_variant*, tr_variant*, struct tr_rpc_idle_data *);
 
+/* for immediate methods whose arguments are written straight into the response */
+typedef const char* (*stream_handler)(tr_session*, tr_variant*, tr_json_writer*);
+
 static struct method
 {
-  const char *  name;
-  bool          immediate;
-  handler       func;
+  const char *    name;
+  bool            immediate;
+  handler         func;
+  stream_handler  stream_func;
 }
 methods[] =
 {
-  { "port-test",             false, portTest            },
-  { "blocklist-update",      false, blocklistUpdate     },
-  { "free-space",            true,  freeSpace           },
-  { "session-close",         true,  sessionClose        },
-  { "session-get",           true,  sessionGet          },
-  { "session-set",           true,  sessionSet          },
-  { "session-stats",         true,  sessionStats        },
-  { "torrent-add",           false, torrentAdd          },
-  { "torrent-get",           true,  torrentGet          },
-  { "torrent-remove",        true,  torrentRemove       },
-  { "torrent-rename-path",   false, torrentRenamePath   },
-  { "torrent-set",           true,  torrentSet          },
-  { "torrent-set-location",  true,  torrentSetLocation  },
-  { "torrent-start",         true,  torrentStart        },
-  { "torrent-start-now",     true,  torrentStartNow     },
-  { "torrent-stop",          true,  torrentStop         },
-  { "torrent-verify",        true,  torrentVerify       },
-  { "torrent-reannounce",    true,  torrentReannounce   },
-  { "queue-move-top",        true,  queueMoveTop        },
-  { "queue-move-up",         true,  queueMoveUp         },
-  { "queue-move-down",       true,  queueMoveDown       },
-  { "queue-move-bottom",     true,  queueMoveBottom     }
+  { "port-test",             false, portTest,            NULL         },
+  { "blocklist-update",      false, blocklistUpdate,     NULL         },
+  { "free-space",            true,  freeSpace,           NULL         },
+  { "session-close",         true,  sessionClose,        NULL         },
+  { "session-get",           true,  sessionGet,          NULL         },
+  { "session-set",           true,  sessionSet,          NULL         },
+  { "session-stats",         true,  NULL,                sessionStats },
+  { "session-watch",         false, sessionWatch,        NULL         },
+  { "torrent-add",           false, torrentAdd,          NULL         },
+  { "torrent-get",           true,  NULL,                torrentGet   },
+  { "torrent-remove",        true,  torrentRemove,       NULL         },
+  { "torrent-rename-path",   false, torrentRenamePath,   NULL         },
+  { "torrent-set",           true,  torrentSet,          NULL         },
+  { "torrent-set-location",  true,  torrentSetLocation,  NULL         },
+  { "torrent-start",         true,  torrentStart,        NULL         },
+  { "torrent-start-now",     true,  torrentStartNow,     NULL         },
+  { "torrent-stop",          true,  torrentStop,         NULL         },
+  { "torrent-verify",        true,  torrentVerify,       NULL         },
+  { "torrent-reannounce",    true,  torrentReannounce,   NULL         },
+  { "queue-move-top",        true,  queueMoveTop,        NULL         },
+  { "queue-move-up",         true,  queueMoveUp,         NULL         },
+  { "queue-move-down",       true,  queueMoveDown,       NULL         },
+  { "queue-move-bottom",     true,  queueMoveBottom,     NULL         }
 };
 
 static void
@@ -2162,9 +2847,12 @@ noop_response_callback (tr_session       * session UNUSED,
 {
 }
 
+/* immediate responses are built in `arena', which the caller frees */
 static void
 request_exec (tr_session             * session,
               tr_variant             * request,
+              tr_variant_arena       * arena,
+              int                      response_flags,
               tr_rpc_response_func     callback,
               void                   * callback_user_data)
 {
@@ -2198,28 +2886,47 @@ request_exec (tr_session             * session,
     {
       int64_t tag;
       tr_variant response;
-      struct evbuffer * buf;
 
-      tr_variantInitDict (&response, 3);
+      tr_variantInitDictArena (&response, 3, arena);
       tr_variantDictAddDict (&response, TR_KEY_arguments, 0);
       tr_variantDictAddStr (&response, TR_KEY_result, result);
       if (tr_variantDictFindInt (request, TR_KEY_tag, &tag))
         tr_variantDictAddInt (&response, TR_KEY_tag, tag);
 
-      buf = tr_variantToBuf (&response, TR_VARIANT_FMT_JSON_LEAN);
+      sendResponse (session, &response, response_flags, callback, callback_user_data);
+    }
+  else if (methods[i].stream_func != NULL)
+    {
+      /* the response is never built as a tr_variant: the method
+       * writes its arguments straight into the output buffer */
+      int64_t tag;
+      struct evbuffer * buf = evbuffer_new ();
+      tr_json_writer * w = tr_jsonWriterNew (buf, true, (response_flags & TR_RPC_RESPONSE_GZIP) != 0);
+
+      tr_jsonBeginDict (w);
+      tr_jsonDictAddDict (w, TR_KEY_arguments);
+      result = (*methods[i].stream_func)(session, args_in, w);
+      tr_jsonEnd (w);
+      if (result == NULL)
+        result = "success";
+      tr_jsonDictAddStr (w, TR_KEY_result, result);
+      if (tr_variantDictFindInt (request, TR_KEY_tag, &tag))
+        tr_jsonDictAddInt (w, TR_KEY_tag, tag);
+      tr_jsonEnd (w);
+      tr_jsonWriterFree (w);
+
       (*callback)(session, buf, callback_user_data);
       evbuffer_free (buf);
-
-      tr_variantFree (&response);
     }
   else if (methods[i].immediate)
     {
       int64_t tag;
       tr_variant response;
       tr_variant * args_out;
-      struct evbuffer * buf;
 
-      tr_variantInitDict (&response, 3);
+      /* the handlers build args_out with the tr_variantDictAdd* () helpers,
+       * so the whole response is in the arena and needs no tr_variantFree () */
+      tr_variantInitDictArena (&response, 3, arena);
       args_out = tr_variantDictAddDict (&response, TR_KEY_arguments, 0);
       result = (*methods[i].func)(session, args_in, args_out, NULL);
       if (result == NULL)
@@ -2228,11 +2935,7 @@ request_exec (tr_session             * session,
       if (tr_variantDictFindInt (request, TR_KEY_tag, &tag))
         tr_variantDictAddInt (&response, TR_KEY_tag, tag);
 
-      buf = tr_variantToBuf (&response, TR_VARIANT_FMT_JSON_LEAN);
-      (*callback)(session, buf, callback_user_data);
-      evbuffer_free (buf);
-
-      tr_variantFree (&response);
+      sendResponse (session, &response, response_flags, callback, callback_user_data);
     }
   else
     {
@@ -2244,30 +2947,75 @@ request_exec (tr_session             * session,
       if (tr_variantDictFindInt (request, TR_KEY_tag, &tag))
         tr_variantDictAddInt (data->response, TR_KEY_tag, tag);
       data->args_out = tr_variantDictAddDict (data->response, TR_KEY_arguments, 0);
+      data->response_flags = response_flags;
       data->callback = callback;
       data->callback_user_data = callback_user_data;
       (*methods[i].func)(session, args_in, data->args_out, data);
     }
 }
 
+/* the session keeps an arena for requests in the libtransmission thread.
+ * others, such as from the GTK+ and Qt clients, get one of their own */
+static tr_variant_arena *
+takeArena (tr_session * session)
+{
+  tr_variant_arena * arena = NULL;
+
+  if (tr_amInEventThread (session))
+    {
+      arena = session->rpcArena;
+      session->rpcArena = NULL;
+    }
+
+  return arena != NULL ? arena : tr_variantArenaNew ();
+}
+
+static void
+returnArena (tr_session * session, tr_variant_arena * arena)
+{
+  if (tr_amInEventThread (session) && (session->rpcArena == NULL))
+    {
+      tr_variantArenaClear (arena);
+      session->rpcArena = arena;
+    }
+  else
+    {
+      tr_variantArenaFree (arena);
+    }
+}
+
 void
 tr_rpc_request_exec_json (tr_session            * session,
                           const void            * request_json,
                           int                     request_len,
                           tr_rpc_response_func    callback,
                           void                  * callback_user_data)
+{
+  tr_rpc_request_exec_json_full (session, request_json, request_len, 0,
+                                 callback, callback_user_data);
+}
+
+void
+tr_rpc_request_exec_json_full (tr_session            * session,
+                               const void            * request_json,
+                               int                     request_len,
+                               int                     response_flags,
+                               tr_rpc_response_func    callback,
+                               void                  * callback_user_data)
 {
   tr_variant top;
   int have_content;
+  tr_variant_arena * arena = takeArena (session);
 
   if (request_len < 0)
     request_len = strlen (request_json);
 
-  have_content = !tr_variantFromJson (&top, request_json, request_len);
-  request_exec (session, have_content ? &top : NULL, callback, callback_user_data);
+  /* the request and its response both live in the arena */
+  have_content = !tr_variantFromBufArena (&top, TR_VARIANT_FMT_JSON, request_json, request_len,
+                                          NULL, NULL, arena);
+  request_exec (session, have_content ? &top : NULL, arena, response_flags, callback, callback_user_data);
 
-  if (have_content)
-    tr_variantFree (&top);
+  returnArena (session, arena);
 }
 
 /**
@@ -2319,6 +3067,7 @@ tr_rpc_request_exec_uri (tr_session           * session,
   const char * pch;
   tr_variant top;
   tr_variant * args;
+  tr_variant_arena * arena = takeArena (session);
   char * request = tr_strndup (request_uri, request_len);
 
   tr_variantInitDict (&top, 3);
@@ -2345,9 +3094,10 @@ tr_rpc_request_exec_uri (tr_session           * session,
       pch = next ? next + 1 : NULL;
     }
 
-  request_exec (session, &top, callback, callback_user_data);
+  request_exec (session, &top, arena, 0, callback, callback_user_data);
 
   /* cleanup */
   tr_variantFree (&top);
+  returnArena (session, arena);
   tr_free (request);
 }
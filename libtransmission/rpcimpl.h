@@ -36,6 +36,20 @@ void tr_rpc_request_exec_json (tr_session            * session,
                                tr_rpc_response_func    callback,
                                void                  * callback_user_data);
 
+enum
+{
+  /* gzip the response, such as for an HTTP client that accepts it */
+  TR_RPC_RESPONSE_GZIP = (1 << 0)
+};
+
+/* like tr_rpc_request_exec_json (), with TR_RPC_RESPONSE_* flags */
+void tr_rpc_request_exec_json_full (tr_session            * session,
+                                    const void            * request_json,
+                                    int                     request_len,
+                                    int                     response_flags,
+                                    tr_rpc_response_func    callback,
+                                    void                  * callback_user_data);
+
 /* see the RPC spec's "Request URI Notation" section */
 void tr_rpc_request_exec_uri (tr_session           * session,
                               const void           * request_uri,
@@ -43,6 +57,10 @@ void tr_rpc_request_exec_uri (tr_session           * session,
                               tr_rpc_response_func   callback,
                               void                 * callback_user_data);
 
+/* answer every pending session-watch request right away,
+ * such as when the RPC server or the session is going away */
+void tr_rpc_watch_answer_all (tr_session * session);
+
 void tr_rpc_parse_list_str (tr_variant  * setme,
                             const char  * list_str,
                             int           list_str_len);
@@ -33,6 +33,7 @@
 #include "blocklist.h"
 #include "cache.h"
 #include "crypto.h"
+#include "disk-queue.h"
 #include "fdlimit.h"
 #include "list.h"
 #include "log.h"
@@ -42,7 +43,9 @@
 #include "platform.h" /* tr_lock, tr_getTorrentDir () */
 #include "platform-quota.h" /* tr_device_info_free() */
 #include "port-forwarding.h"
+#include "relocate.h"
 #include "rpc-server.h"
+#include "rpcimpl.h" /* tr_rpc_watch_answer_all () */
 #include "session.h"
 #include "stats.h"
 #include "torrent.h"
@@ -62,9 +65,17 @@ enum
 #ifdef TR_LIGHTWEIGHT
   DEFAULT_CACHE_SIZE_MB = 2,
   DEFAULT_PREFETCH_ENABLED = false,
+  DEFAULT_VERIFY_THREADS = 1,
+  DEFAULT_DISK_THREADS = 1,
+  DEFAULT_NETWORK_THREADS = 1,
+  DEFAULT_OPEN_FILE_LIMIT = 16,
 #else
   DEFAULT_CACHE_SIZE_MB = 4,
   DEFAULT_PREFETCH_ENABLED = true,
+  DEFAULT_VERIFY_THREADS = 2,
+  DEFAULT_DISK_THREADS = 2,
+  DEFAULT_NETWORK_THREADS = 1,
+  DEFAULT_OPEN_FILE_LIMIT = 32,
 #endif
   SAVE_INTERVAL_SECS = 360
 };
@@ -134,6 +145,8 @@ tr_sessionSetEncryption (tr_session          * session,
        || mode == TR_CLEAR_PREFERRED);
 
   session->encryptionMode = mode;
+
+  tr_sessionSetChanged (session);
 }
 
 /***
@@ -315,11 +328,15 @@ tr_sessionGetDefaultSettings (tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 67);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,               false);
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                   "http://www.example.com/blocklist");
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                   DEFAULT_CACHE_SIZE_MB);
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                     true);
+  tr_variantDictAddInt  (d, TR_KEY_disk_threads,                    DEFAULT_DISK_THREADS);
+  tr_variantDictAddBool (d, TR_KEY_io_uring_enabled,                false);
+  tr_variantDictAddInt  (d, TR_KEY_network_threads,                 DEFAULT_NETWORK_THREADS);
+  tr_variantDictAddInt  (d, TR_KEY_open_file_limit,                 DEFAULT_OPEN_FILE_LIMIT);
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                     true);
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                     false);
   tr_variantDictAddStr  (d, TR_KEY_download_dir,                    tr_getDefaultDownloadDir ());
@@ -375,6 +392,7 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,          false);
   tr_variantDictAddInt  (d, TR_KEY_umask,                           022);
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,        14);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,                  DEFAULT_VERIFY_THREADS);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,               TR_DEFAULT_BIND_ADDRESS_IPV4);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,               TR_DEFAULT_BIND_ADDRESS_IPV6);
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,            true);
@@ -386,11 +404,15 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 67);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,            tr_blocklistIsEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                tr_sessionGetCacheLimit_MB (s));
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                  s->isDHTEnabled);
+  tr_variantDictAddInt  (d, TR_KEY_disk_threads,                 tr_diskQueueGetWorkerCount (s->diskQueue));
+  tr_variantDictAddBool (d, TR_KEY_io_uring_enabled,             tr_diskQueueIsUringEnabled (s->diskQueue));
+  tr_variantDictAddInt  (d, TR_KEY_network_threads,              tr_eventGetShardCount (s));
+  tr_variantDictAddInt  (d, TR_KEY_open_file_limit,              tr_fdGetFileLimit (s));
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                  s->isUTPEnabled);
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                  s->isLPDEnabled);
   tr_variantDictAddStr  (d, TR_KEY_download_dir,                 tr_sessionGetDownloadDir (s));
@@ -447,6 +469,7 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,       tr_sessionIsSpeedLimited (s, TR_UP));
   tr_variantDictAddInt  (d, TR_KEY_umask,                        s->umask);
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,     s->uploadSlotsPerTorrent);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,               s->verifyThreadCount);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,            tr_address_to_string (&s->public_ipv4->addr));
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,            tr_address_to_string (&s->public_ipv6->addr));
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,         !tr_sessionGetPaused (s));
@@ -600,16 +623,25 @@ tr_sessionInit (const char  * tag,
   session->cache = tr_cacheNew (1024*1024*2);
   session->tag = tr_strdup (tag);
   session->magicNumber = SESSION_MAGIC_NUMBER;
+  tr_fdInit (session);
+  session->diskQueue = tr_diskQueueNew (session, DEFAULT_DISK_THREADS);
   tr_bandwidthConstruct (&session->bandwidth, session, NULL);
   tr_variantInitList (&session->removedTorrents, 0);
+  session->changeSeq = tr_time_msec () * 1000;
+  session->startChangeSeq = session->changeSeq;
 
   /* nice to start logging at the very beginning */
   if (tr_variantDictFindInt (clientSettings, TR_KEY_message_level, &i))
     tr_logSetLevel (i);
 
+  /* the peer loops are started along with the libtransmission thread,
+     so this can't wait for tr_sessionInitImpl () */
+  if (!tr_variantDictFindInt (clientSettings, TR_KEY_network_threads, &i))
+    i = DEFAULT_NETWORK_THREADS;
+
   /* start the libtransmission thread */
   tr_netInit (); /* must go before tr_eventInit */
-  tr_eventInit (session);
+  tr_eventInit (session, MAX (1, i));
   assert (session->events != NULL);
 
   /* run the rest in the libtransmission thread */
@@ -633,8 +665,9 @@ onNowTimer (int foo UNUSED, short bar UNUSED, void * vsession)
   int usec;
   const int min = 100;
   const int max = 999999;
+  int i, n = 0;
   struct timeval tv;
-  tr_torrent * tor = NULL;
+  tr_torrent ** torrents;
   tr_session * session = vsession;
   const time_t now = time (NULL);
 
@@ -652,8 +685,12 @@ onNowTimer (int foo UNUSED, short bar UNUSED, void * vsession)
   if (session->turtle.isClockEnabled)
     turtleCheckClock (session, &session->turtle);
 
-  while ((tor = tr_torrentNext (session, tor)))
+  /* the first call comes before there's a peer manager, or any torrents */
+  torrents = session->peerMgr ? tr_peerMgrGetActiveTorrents (session->peerMgr, &n) : NULL;
+  for (i=0; i<n; ++i)
     {
+      tr_torrent * tor = torrents[i];
+
       if (tor->isRunning)
         {
           if (tr_torrentIsSeed (tor))
@@ -661,7 +698,18 @@ onNowTimer (int foo UNUSED, short bar UNUSED, void * vsession)
           else
             ++tor->secondsDownloading;
         }
+
+      /* peer counts, speeds and etas drift without any one event to say so.
+         speeds take a moment to settle back down after the last transfer */
+      if (tor->swarm != NULL)
+        {
+          struct tr_swarm_stats swarm_stats;
+          tr_swarmGetStats (tor->swarm, &swarm_stats);
+          if ((swarm_stats.peerCount > 0) || (tor->activityDate + (HISTORY_MSEC/1000) + 1 >= now))
+            tr_torrentSetChanged (tor);
+        }
     }
+  tr_free (torrents);
 
   /**
   ***  Set the timer
@@ -829,6 +877,14 @@ sessionSetImpl (void * vdata)
   /* files and directories */
   if (tr_variantDictFindBool (settings, TR_KEY_prefetch_enabled, &boolVal))
     session->isPrefetchEnabled = boolVal;
+  if (tr_variantDictFindInt (settings, TR_KEY_verify_threads, &i))
+    session->verifyThreadCount = MAX (1, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_disk_threads, &i))
+    tr_diskQueueSetWorkerCount (session->diskQueue, i);
+  if (tr_variantDictFindBool (settings, TR_KEY_io_uring_enabled, &boolVal))
+    tr_diskQueueSetUringEnabled (session->diskQueue, boolVal);
+  if (tr_variantDictFindInt (settings, TR_KEY_open_file_limit, &i))
+    tr_fdSetFileLimit (session, i);
   if (tr_variantDictFindInt (settings, TR_KEY_preallocation, &i))
     session->preallocationMode = i;
   if (tr_variantDictFindStr (settings, TR_KEY_download_dir, &str, NULL))
@@ -937,6 +993,9 @@ sessionSetImpl (void * vdata)
   if (tr_variantDictFindBool (settings, TR_KEY_scrape_paused_torrents_enabled, &boolVal))
     session->scrapePausedTorrents = boolVal;
 
+  /* some of these bypass the public setters, e.g. the turtle fields */
+  tr_sessionSetChanged (session);
+
   data->done = true;
 }
 
@@ -969,6 +1028,8 @@ tr_sessionSetDownloadDir (tr_session * session, const char * dir)
     info = tr_device_info_create (dir);
   tr_device_info_free (session->downloadDir);
   session->downloadDir = info;
+
+  tr_sessionSetChanged (session);
 }
 
 const char *
@@ -1008,6 +1069,8 @@ tr_sessionSetIncompleteFileNamingEnabled (tr_session * session, bool b)
   assert (tr_isBool (b));
 
   session->isIncompleteFileNamingEnabled = b;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -1034,6 +1097,8 @@ tr_sessionSetIncompleteDir (tr_session * session, const char * dir)
 
       session->incompleteDir = tr_strdup (dir);
     }
+
+  tr_sessionSetChanged (session);
 }
 
 const char*
@@ -1051,6 +1116,8 @@ tr_sessionSetIncompleteDirEnabled (tr_session * session, bool b)
   assert (tr_isBool (b));
 
   session->isIncompleteDirEnabled = b;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -1122,6 +1189,8 @@ tr_sessionSetPeerPort (tr_session * session, tr_port port)
     {
       setPeerPort (session, port);
     }
+
+  tr_sessionSetChanged (session);
 }
 
 tr_port
@@ -1146,6 +1215,8 @@ tr_sessionSetPeerPortRandomOnStart (tr_session * session,
   assert (tr_isSession (session));
 
   session->isPortRandom = random;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -1174,6 +1245,8 @@ tr_sessionSetRatioLimited (tr_session * session, bool isLimited)
   assert (tr_isSession (session));
 
   session->isRatioLimited = isLimited;
+
+  tr_sessionSetChanged (session);
 }
 
 void
@@ -1182,6 +1255,8 @@ tr_sessionSetRatioLimit (tr_session * session, double desiredRatio)
   assert (tr_isSession (session));
 
   session->desiredRatio = desiredRatio;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -1210,6 +1285,8 @@ tr_sessionSetIdleLimited (tr_session * session, bool isLimited)
   assert (tr_isSession (session));
 
   session->isIdleLimited = isLimited;
+
+  tr_sessionSetChanged (session);
 }
 
 void
@@ -1218,6 +1295,8 @@ tr_sessionSetIdleLimit (tr_session * session, uint16_t idleMinutes)
   assert (tr_isSession (session));
 
   session->idleLimitMinutes = idleMinutes;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -1324,6 +1403,7 @@ altSpeedToggled (void * vsession)
 
   updateBandwidth (session, TR_UP);
   updateBandwidth (session, TR_DOWN);
+  tr_sessionSetChanged (session);
 
   if (t->callback != NULL)
     (*t->callback)(session, t->isEnabled, t->changedByUser, t->callbackUserData);
@@ -1430,6 +1510,8 @@ tr_sessionSetSpeedLimit_Bps (tr_session * s, tr_direction d, unsigned int Bps)
   s->speedLimit_Bps[d] = Bps;
 
   updateBandwidth (s, d);
+
+  tr_sessionSetChanged (s);
 }
 void
 tr_sessionSetSpeedLimit_KBps (tr_session * s, tr_direction d, unsigned int KBps)
@@ -1461,6 +1543,8 @@ tr_sessionLimitSpeed (tr_session * s, tr_direction d, bool b)
   s->speedLimitEnabled[d] = b;
 
   updateBandwidth (s, d);
+
+  tr_sessionSetChanged (s);
 }
 
 bool
@@ -1485,6 +1569,8 @@ tr_sessionSetAltSpeed_Bps (tr_session * s, tr_direction d, unsigned int Bps)
   s->turtle.speedLimit_Bps[d] = Bps;
 
   updateBandwidth (s, d);
+
+  tr_sessionSetChanged (s);
 }
 
 void
@@ -1537,6 +1623,8 @@ tr_sessionUseAltSpeedTime (tr_session * s, bool b)
       t->isClockEnabled = b;
       userPokedTheClock (s, t);
     }
+
+  tr_sessionSetChanged (s);
 }
 
 bool
@@ -1558,6 +1646,8 @@ tr_sessionSetAltSpeedBegin (tr_session * s, int minute)
       s->turtle.beginMinute = minute;
       userPokedTheClock (s, &s->turtle);
     }
+
+  tr_sessionSetChanged (s);
 }
 
 int
@@ -1579,6 +1669,8 @@ tr_sessionSetAltSpeedEnd (tr_session * s, int minute)
       s->turtle.endMinute = minute;
       userPokedTheClock (s, &s->turtle);
     }
+
+  tr_sessionSetChanged (s);
 }
 
 int
@@ -1599,6 +1691,8 @@ tr_sessionSetAltSpeedDay (tr_session * s, tr_sched_day days)
       s->turtle.days = days;
       userPokedTheClock (s, &s->turtle);
     }
+
+  tr_sessionSetChanged (s);
 }
 
 tr_sched_day
@@ -1650,6 +1744,8 @@ tr_sessionSetPeerLimit (tr_session * session, uint16_t n)
   assert (tr_isSession (session));
 
   session->peerLimit = n;
+
+  tr_sessionSetChanged (session);
 }
 
 uint16_t
@@ -1666,6 +1762,8 @@ tr_sessionSetPeerLimitPerTorrent (tr_session  * session, uint16_t n)
     assert (tr_isSession (session));
 
     session->peerLimitPerTorrent = n;
+
+    tr_sessionSetChanged (session);
 }
 
 uint16_t
@@ -1686,6 +1784,8 @@ tr_sessionSetPaused (tr_session * session, bool isPaused)
   assert (tr_isSession (session));
 
   session->pauseAddedTorrent = isPaused;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -1702,6 +1802,8 @@ tr_sessionSetDeleteSource (tr_session * session, bool deleteSource)
   assert (tr_isSession (session));
 
   session->deleteSourceTorrent = deleteSource;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -1804,7 +1906,9 @@ sessionCloseImpl (void * vsession)
   session->nowTimer = NULL;
 
   tr_verifyClose (session);
+  tr_relocateClose (session);
   tr_sharedClose (session);
+  tr_rpc_watch_answer_all (session);
   tr_rpcClose (&session->rpcServer);
 
   /* Close the torrents. Get the most active ones first so that
@@ -1828,6 +1932,10 @@ sessionCloseImpl (void * vsession)
   tr_cacheFree (session->cache);
   session->cache = NULL;
 
+  /* the torrents are gone and the cache is flushed, so this should be quick */
+  tr_diskQueueFree (session->diskQueue);
+  session->diskQueue = NULL;
+
   /* gotta keep udp running long enough to send out all
      the &event=stopped UDP tracker messages */
   while (!tr_tracker_udp_is_idle (session))
@@ -1844,6 +1952,7 @@ sessionCloseImpl (void * vsession)
 
   tr_statsClose (session);
   tr_peerMgrFree (session->peerMgr);
+  tr_eventCloseShards (session);
 
   closeBlocklists (session);
 
@@ -1915,6 +2024,7 @@ tr_sessionClose (tr_session * session)
 
   /* free the session memory */
   tr_variantFree (&session->removedTorrents);
+  tr_variantArenaFree (session->rpcArena);
   tr_bandwidthDestruct (&session->bandwidth);
   tr_bitfieldDestruct (&session->turtle.minutes);
   tr_lockFree (session->lock);
@@ -2029,6 +2139,8 @@ tr_sessionSetPexEnabled (tr_session * session, bool enabled)
   assert (tr_isSession (session));
 
   session->isPexEnabled = enabled != 0;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -2062,6 +2174,8 @@ toggleDHTImpl (void * data)
   tr_udpUninit (session);
   session->isDHTEnabled = !session->isDHTEnabled;
   tr_udpInit (session);
+
+  tr_sessionSetChanged (session);
 }
 
 void
@@ -2103,6 +2217,8 @@ toggle_utp (void * data)
 
   /* But don't call tr_utpClose -- see reset_timer in tr-utp.c for an
      explanation. */
+
+  tr_sessionSetChanged (session);
 }
 
 void
@@ -2132,6 +2248,8 @@ toggleLPDImpl (void * data)
 
   if (session->isLPDEnabled)
     tr_lpdInit (session, &session->public_ipv4->addr);
+
+  tr_sessionSetChanged (session);
 }
 
 void
@@ -2168,6 +2286,8 @@ tr_sessionSetCacheLimit_MB (tr_session * session, int max_bytes)
   assert (tr_isSession (session));
 
   tr_cacheSetLimit (session->cache, toMemBytes (max_bytes));
+
+  tr_sessionSetChanged (session);
 }
 
 int
@@ -2185,6 +2305,7 @@ tr_sessionGetCacheLimit_MB (const tr_session * session)
 struct port_forwarding_data
 {
   bool enabled;
+  tr_session * session;
   struct tr_shared * shared;
 };
 
@@ -2193,6 +2314,7 @@ setPortForwardingEnabled (void * vdata)
 {
   struct port_forwarding_data * data = vdata;
   tr_sharedTraversalEnable (data->shared, data->enabled);
+  tr_sessionSetChanged (data->session);
   tr_free (data);
 }
 
@@ -2201,6 +2323,7 @@ tr_sessionSetPortForwardingEnabled (tr_session  * session, bool enabled)
 {
   struct port_forwarding_data * d;
   d = tr_new0 (struct port_forwarding_data, 1);
+  d->session = session;
   d->shared = session->shared;
   d->enabled = enabled;
   tr_runInEventThread (session, setPortForwardingEnabled, d);
@@ -2376,6 +2499,8 @@ tr_blocklistSetEnabled (tr_session * session, bool isEnabled)
 
   for (l=session->blocklists; l!=NULL; l=l->next)
     tr_blocklistFileSetEnabled (l->data, isEnabled);
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -2409,6 +2534,9 @@ tr_blocklistSetContent (tr_session * session, const char * contentFilename)
 
   ruleCount = tr_blocklistFileSetContent (b, contentFilename);
   tr_sessionUnlock (session);
+
+  tr_sessionSetChanged (session);
+
   return ruleCount;
 }
 
@@ -2435,6 +2563,8 @@ tr_blocklistSetURL (tr_session * session, const char * url)
       tr_free (session->blocklist_url);
       session->blocklist_url = tr_strdup (url);
     }
+
+  tr_sessionSetChanged (session);
 }
 
 const char *
@@ -2693,6 +2823,8 @@ tr_sessionSetTorrentDoneScriptEnabled (tr_session * session, bool isEnabled)
   assert (tr_isBool (isEnabled));
 
   session->isTorrentDoneScriptEnabled = isEnabled;
+
+  tr_sessionSetChanged (session);
 }
 
 const char *
@@ -2713,6 +2845,8 @@ tr_sessionSetTorrentDoneScript (tr_session * session, const char * scriptFilenam
       tr_free (session->torrentDoneScript);
       session->torrentDoneScript = tr_strdup (scriptFilename);
     }
+
+  tr_sessionSetChanged (session);
 }
 
 /***
@@ -2726,6 +2860,8 @@ tr_sessionSetQueueSize (tr_session * session, tr_direction dir, int n)
   assert (tr_isDirection (dir));
 
   session->queueSize[dir] = n;
+
+  tr_sessionSetChanged (session);
 }
 
 int
@@ -2745,6 +2881,8 @@ tr_sessionSetQueueEnabled (tr_session * session, tr_direction dir, bool is_enabl
   assert (tr_isBool (is_enabled));
 
   session->queueEnabled[dir] = is_enabled;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -2763,6 +2901,8 @@ tr_sessionSetQueueStalledMinutes (tr_session * session, int minutes)
   assert (minutes > 0);
 
   session->queueStalledMinutes = minutes;
+
+  tr_sessionSetChanged (session);
 }
 
 void
@@ -2772,6 +2912,8 @@ tr_sessionSetQueueStalledEnabled (tr_session * session, bool is_enabled)
   assert (tr_isBool (is_enabled));
 
   session->stalledEnabled = is_enabled;
+
+  tr_sessionSetChanged (session);
 }
 
 bool
@@ -2866,7 +3008,8 @@ tr_sessionGetNextQueuedTorrents (tr_session   * session,
 int
 tr_sessionCountQueueFreeSlots (tr_session * session, tr_direction dir)
 {
-  tr_torrent * tor;
+  int i, n;
+  tr_torrent ** torrents;
   int active_count;
   const int max = tr_sessionGetQueueSize (session, dir);
   const tr_torrent_activity activity = dir == TR_UP ? TR_STATUS_SEED : TR_STATUS_DOWNLOAD;
@@ -2874,12 +3017,14 @@ tr_sessionCountQueueFreeSlots (tr_session * session, tr_direction dir)
   if (!tr_sessionGetQueueEnabled (session, dir))
     return INT_MAX;
 
-    tor = NULL;
+    /* only running torrents can be downloading or seeding */
     active_count = 0;
-    while ((tor = tr_torrentNext (session, tor)))
-        if (!tr_torrentIsStalled (tor))
-            if (tr_torrentGetActivity (tor) == activity)
+    torrents = tr_peerMgrGetActiveTorrents (session->peerMgr, &n);
+    for (i=0; i<n; ++i)
+        if (!tr_torrentIsStalled (torrents[i]))
+            if (tr_torrentGetActivity (torrents[i]) == activity)
                 ++active_count;
+    tr_free (torrents);
 
     if (active_count >= max)
         return 0;
@@ -55,8 +55,10 @@ struct tr_announcer;
 struct tr_announcer_udp;
 struct tr_bindsockets;
 struct tr_cache;
+struct tr_diskQueue;
 struct tr_fdInfo;
 struct tr_device_info;
+struct tr_list;
 
 typedef void (tr_web_config_func)(tr_session * session, void * curl_pointer, const char * url, void * user_data);
 
@@ -124,6 +126,34 @@ struct tr_session
 
     tr_variant                   removedTorrents;
 
+    /* the last sequence number handed out for torrent-get's "since".
+     * it starts at the wall clock time so that it keeps going up when
+     * the session restarts */
+    uint64_t                     changeSeq;
+
+    /* changeSeq's value when the session started. cursors below it
+     * were handed out by an earlier session and can't be trusted */
+    uint64_t                     startChangeSeq;
+
+    /* the newest changeSeq that a change was given, so that session-watch
+     * can tell whether anything changed without looking at every torrent */
+    uint64_t                     latestChangeSeq;
+
+    /* set by tr_torrentSetChanged () when any torrent changes */
+    bool                         hasChangedTorrents;
+
+    /* set by tr_sessionSetChanged () when session-get's answer changes */
+    bool                         hasChangedSettings;
+    uint64_t                     settingsChangeSeq;
+
+    /* pending session-watch requests. see rpcimpl.c */
+    struct tr_list             * rpcWatches;
+    struct event               * rpcWatchTimer;
+
+    /* RPC requests that run in the libtransmission thread build their
+     * trees here, so that they reuse its memory. see rpcimpl.c */
+    struct tr_variant_arena    * rpcArena;
+
     bool                         stalledEnabled;
     bool                         queueEnabled[2];
     int                          queueSize[2];
@@ -153,6 +183,9 @@ struct tr_session
 
     int                          uploadSlotsPerTorrent;
 
+    /* how many worker threads the verifier may use at once */
+    int                          verifyThreadCount;
+
     /* The UDP sockets used for the DHT and uTP. */
     tr_port                      udp_port;
     int                          udp_socket;
@@ -181,6 +214,9 @@ struct tr_session
     int                          torrentCount;
     tr_torrent *                 torrentList;
 
+    /* how many of those torrents are queued */
+    int                          queuedTorrentCount;
+
     char *                       torrentDoneScript;
 
     char *                       tag;
@@ -198,6 +234,7 @@ struct tr_session
     struct tr_shared *           shared;
 
     struct tr_cache *            cache;
+    struct tr_diskQueue *        diskQueue;
 
     struct tr_lock *             lock;
 
@@ -275,6 +312,13 @@ static inline bool tr_isSession (const tr_session * session)
     return (session != NULL) && (session->magicNumber == SESSION_MAGIC_NUMBER);
 }
 
+/* note that something session-get reports has changed.
+ * the public setters can be called from any thread, so this is atomic */
+static inline void tr_sessionSetChanged (tr_session * session)
+{
+    __atomic_store_n (&session->hasChangedSettings, true, __ATOMIC_RELEASE);
+}
+
 static inline bool tr_isPreallocationMode (tr_preallocation_mode m)
 {
     return (m == TR_PREALLOCATE_NONE)
@@ -0,0 +1,823 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/*
+ * Drives the peer manager with thousands of simulated peers instead of
+ * sockets, so that its bookkeeping can be timed without a real swarm.
+ *
+ * Each torrent gets a swarm of fake peers that plug into the peer manager
+ * through tr_peer's virtual functions the way webseeds do. Every round is
+ * one simulated second: peers announce pieces, choke and unchoke us, take
+ * requests and deliver blocks, PEX brings in more addresses, and then the
+ * rechoke, reconnect and atom pulses run. Everything happens in a single
+ * callback on the event thread so the session's own timers can't get in
+ * between, and it's all driven from a seeded RNG so that runs repeat.
+ *
+ * At the end it prints how long each peer manager entry point took and,
+ * with glibc, how many allocations it made.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* strtoul (), srand (), EXIT_FAILURE */
+#include <string.h> /* memset () */
+#include <time.h> /* clock_gettime () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "cache.h" /* tr_cacheWriteBlock () */
+#include "completion.h"
+#include "crypto.h" /* tr_sha1 (), tr_cryptoWeakRandInt () */
+#include "libtransmission-test.h"
+#include "peer-common.h"
+#include "peer-mgr.h"
+#include "session.h"
+#include "torrent.h"
+#include "tr-getopt.h"
+#include "trevent.h"
+#include "utils.h"
+#include "variant.h"
+
+#define MY_NAME "swarm-bench"
+
+enum
+{
+  PIECE_SIZE = MAX_BLOCK_SIZE * 2,
+
+  /* how many requests a peer keeps open, like peer-msgs' minimum */
+  MAX_PENDING_REQUESTS = 8,
+
+  /* about a second's worth of the reconnect pulse */
+  CANDIDATES_PER_ROUND = 12
+};
+
+static int torrent_count = 4;
+static int peer_count = 1000;
+static int piece_count = 2048;
+static int round_count = 100;
+static int blocks_per_round = 16;
+static int pex_per_round = 50;
+static unsigned int seed = 1;
+
+static tr_option options[] =
+{
+  { 't', "torrents", "Number of torrents", "t", 1, "<count>" },
+  { 'p', "peers", "Simulated peers per torrent", "p", 1, "<count>" },
+  { 'n', "pieces", "Pieces per torrent", "n", 1, "<count>" },
+  { 'r', "rounds", "Number of simulated seconds", "r", 1, "<count>" },
+  { 'b', "blocks", "Blocks delivered per torrent per round", "b", 1, "<count>" },
+  { 'x', "pex", "PEX addresses added per torrent per round", "x", 1, "<count>" },
+  { 's', "seed", "Random seed", "s", 1, "<number>" },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int
+parseCommandLine (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 't': torrent_count = atoi (optarg); break;
+          case 'p': peer_count = atoi (optarg); break;
+          case 'n': piece_count = atoi (optarg); break;
+          case 'r': round_count = atoi (optarg); break;
+          case 'b': blocks_per_round = atoi (optarg); break;
+          case 'x': pex_per_round = atoi (optarg); break;
+          case 's': seed = strtoul (optarg, NULL, 10); break;
+          default: return 1;
+        }
+    }
+
+  return (torrent_count > 0) && (peer_count > 0) && (peer_count < 60000)
+      && (piece_count > 0) && (round_count > 0)
+      && (blocks_per_round >= 0) && (pex_per_round >= 0) ? 0 : 1;
+}
+
+/***
+****  Timing and allocation counts
+***/
+
+static uint64_t
+nowNsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* only the thread that's running the simulation counts its allocations */
+static __thread bool counting = false;
+static __thread uint64_t alloc_count = 0;
+
+#ifdef __GLIBC__
+
+extern void * __libc_malloc (size_t);
+extern void * __libc_calloc (size_t, size_t);
+extern void * __libc_realloc (void *, size_t);
+
+void *
+malloc (size_t size)
+{
+  if (counting)
+    ++alloc_count;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  if (counting)
+    ++alloc_count;
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void * ptr, size_t size)
+{
+  if (counting)
+    ++alloc_count;
+  return __libc_realloc (ptr, size);
+}
+
+#define HAVE_ALLOC_COUNT 1
+#else
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+struct stopwatch
+{
+  const char * name;
+  uint64_t calls;
+  uint64_t nsec;
+  uint64_t max_nsec;
+  uint64_t allocs;
+
+  uint64_t started_at;
+  uint64_t allocs_at;
+};
+
+enum
+{
+  WATCH_GET_NEXT_REQUESTS,
+  WATCH_RECHOKE_UPLOADS,
+  WATCH_RECHOKE_DOWNLOADS,
+  WATCH_PICK_CANDIDATES,
+  WATCH_PRUNE_ATOMS,
+  WATCH_ADD_PEX,
+  WATCH_GOT_BLOCK,
+  WATCH_GOT_HAVE,
+  WATCH_GOT_CHOKE,
+  WATCH_COUNT
+};
+
+static struct stopwatch watches[WATCH_COUNT] =
+{
+  { "tr_peerMgrGetNextRequests", 0, 0, 0, 0, 0, 0 },
+  { "rechokeUploads", 0, 0, 0, 0, 0, 0 },
+  { "rechokeDownloads", 0, 0, 0, 0, 0, 0 },
+  { "popPeerCandidates", 0, 0, 0, 0, 0, 0 },
+  { "atomPulse", 0, 0, 0, 0, 0, 0 },
+  { "tr_peerMgrAddPex", 0, 0, 0, 0, 0, 0 },
+  { "got block event", 0, 0, 0, 0, 0, 0 },
+  { "got have event", 0, 0, 0, 0, 0, 0 },
+  { "got choke event", 0, 0, 0, 0, 0, 0 }
+};
+
+static inline void
+watchStart (int i)
+{
+  watches[i].allocs_at = alloc_count;
+  watches[i].started_at = nowNsec ();
+  counting = true;
+}
+
+static inline void
+watchStop (int i)
+{
+  struct stopwatch * w = &watches[i];
+  const uint64_t nsec = nowNsec () - w->started_at;
+
+  counting = false;
+  ++w->calls;
+  w->nsec += nsec;
+  w->max_nsec = MAX (w->max_nsec, nsec);
+  w->allocs += alloc_count - w->allocs_at;
+}
+
+/***
+****  A deterministic RNG for the simulation's own choices.
+****  The library's weak RNG is reseeded too; see simulate ().
+***/
+
+static uint64_t rng_state = 0;
+
+static uint32_t
+rngNext (void)
+{
+  /* xorshift64* */
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32_t)((rng_state * UINT64_C (2685821657736338717)) >> 32);
+}
+
+static inline int
+rngInt (int upperBound)
+{
+  return (int)(rngNext () % (uint32_t)upperBound);
+}
+
+/***
+****  Simulated peers
+***/
+
+struct sim_peer
+{
+  tr_peer peer; /* must come first */
+
+  bool peer_is_choked;
+  bool peer_is_interested;
+  bool client_is_choked;
+  bool client_is_interested;
+
+  unsigned int download_Bps;
+  unsigned int upload_Bps;
+  time_t connected_at;
+
+  int pending_count;
+  tr_block_index_t pending[MAX_PENDING_REQUESTS];
+};
+
+static inline struct sim_peer *
+SIM_PEER (const tr_peer * peer)
+{
+  return (struct sim_peer*) peer;
+}
+
+/* the peer manager frees the peer after this */
+static void
+simDestruct (tr_peer * peer)
+{
+  tr_peerDestruct (peer);
+}
+
+static bool
+simIsTransferringPieces (const tr_peer * peer,
+                         uint64_t        now UNUSED,
+                         tr_direction    direction,
+                         unsigned int  * setme_Bps)
+{
+  const struct sim_peer * sp = SIM_PEER (peer);
+  const unsigned int Bps = direction == TR_PEER_TO_CLIENT ? sp->download_Bps : sp->upload_Bps;
+
+  if (setme_Bps != NULL)
+    *setme_Bps = Bps;
+
+  return Bps > 0;
+}
+
+static bool
+simIsPeerChoked (const tr_peer * peer)
+{
+  return SIM_PEER (peer)->peer_is_choked;
+}
+
+static bool
+simIsPeerInterested (const tr_peer * peer)
+{
+  return SIM_PEER (peer)->peer_is_interested;
+}
+
+static bool
+simIsClientChoked (const tr_peer * peer)
+{
+  return SIM_PEER (peer)->client_is_choked;
+}
+
+static bool
+simIsClientInterested (const tr_peer * peer)
+{
+  return SIM_PEER (peer)->client_is_interested;
+}
+
+static bool
+simIsActive (const tr_peer * peer, tr_direction direction)
+{
+  return simIsTransferringPieces (peer, 0, direction, NULL);
+}
+
+static void
+simUpdateActive (tr_peer * peer UNUSED, tr_direction direction UNUSED)
+{
+}
+
+static time_t
+simGetConnectionAge (const tr_peer * peer)
+{
+  return tr_time () - SIM_PEER (peer)->connected_at;
+}
+
+static bool
+simFalse (const tr_peer * peer UNUSED)
+{
+  return false;
+}
+
+static bool
+simIsReadingBlock (const tr_peer * peer UNUSED, tr_block_index_t block UNUSED)
+{
+  return false;
+}
+
+static void
+simSetChoke (tr_peer * peer, bool peer_is_choked)
+{
+  SIM_PEER (peer)->peer_is_choked = peer_is_choked;
+}
+
+static void
+simSetInterested (tr_peer * peer, bool client_is_interested)
+{
+  SIM_PEER (peer)->client_is_interested = client_is_interested;
+}
+
+static void
+simHave (tr_peer * peer UNUSED, uint32_t pieceIndex UNUSED)
+{
+}
+
+static void
+simCancel (tr_peer * peer, tr_block_index_t block)
+{
+  int i;
+  struct sim_peer * sp = SIM_PEER (peer);
+
+  for (i=0; i<sp->pending_count; ++i)
+    {
+      if (sp->pending[i] == block)
+        {
+          sp->pending[i] = sp->pending[--sp->pending_count];
+          break;
+        }
+    }
+}
+
+static void
+simPulse (tr_peer * peer UNUSED)
+{
+}
+
+static const struct tr_peer_virtual_funcs sim_funcs =
+{
+  .destruct = simDestruct,
+  .is_transferring_pieces = simIsTransferringPieces,
+  .is_peer_choked = simIsPeerChoked,
+  .is_peer_interested = simIsPeerInterested,
+  .is_client_choked = simIsClientChoked,
+  .is_client_interested = simIsClientInterested,
+  .is_active = simIsActive,
+  .update_active = simUpdateActive,
+  .get_connection_age = simGetConnectionAge,
+  .is_utp_connection = simFalse,
+  .is_encrypted = simFalse,
+  .is_incoming_connection = simFalse,
+  .is_reading_block = simIsReadingBlock,
+  .set_choke = simSetChoke,
+  .set_interested = simSetInterested,
+  .have = simHave,
+  .cancel = simCancel,
+  .pulse = simPulse
+};
+
+static void
+fireEvent (struct sim_peer * sp, const tr_peer_event * e, int watch)
+{
+  watchStart (watch);
+  tr_peerMgrSimulatePeerEvent (&sp->peer, e);
+  watchStop (watch);
+}
+
+static struct sim_peer *
+simPeerNew (tr_torrent * tor, int torrentIndex, int peerIndex)
+{
+  tr_address addr;
+  tr_peer_event e = TR_PEER_EVENT_INIT;
+  struct sim_peer * sp = tr_new0 (struct sim_peer, 1);
+  tr_peer * peer = &sp->peer;
+
+  tr_peerConstruct (peer, tor);
+  peer->funcs = &sim_funcs;
+
+  sp->peer_is_choked = true;
+  sp->peer_is_interested = rngInt (2) == 0;
+  sp->client_is_choked = rngInt (4) != 0;
+  sp->download_Bps = rngInt (3) ? rngInt (200000) : 0;
+  sp->upload_Bps = rngInt (3) ? rngInt (200000) : 0;
+  sp->connected_at = tr_time () - rngInt (600);
+
+  /* 10.t.i.i */
+  addr.type = TR_AF_INET;
+  addr.addr.addr4.s_addr = htonl ((10u << 24) | ((unsigned)torrentIndex << 16) | (unsigned)peerIndex);
+  tr_peerMgrAddSimulatedPeer (tor, peer, &addr, htons (51413));
+
+  /* a third are seeds, the rest have some random fraction of the torrent */
+  if (rngInt (3) == 0)
+    {
+      tr_bitfieldSetHasAll (&peer->have);
+      peer->progress = 1.0;
+      e.eventType = TR_PEER_CLIENT_GOT_HAVE_ALL;
+      fireEvent (sp, &e, WATCH_GOT_HAVE);
+    }
+  else
+    {
+      tr_piece_index_t i;
+      const int percent = rngInt (100);
+
+      for (i=0; i<tor->info.pieceCount; ++i)
+        if (rngInt (100) < percent)
+          tr_bitfieldAdd (&peer->have, i);
+
+      peer->progress = tr_bitfieldCountTrueBits (&peer->have) / (float)tor->info.pieceCount;
+      e.eventType = TR_PEER_CLIENT_GOT_BITFIELD;
+      e.bitfield = &peer->have;
+      fireEvent (sp, &e, WATCH_GOT_HAVE);
+    }
+
+  return sp;
+}
+
+/* tell the peer manager that the peer got one more piece */
+static void
+simPeerGotPiece (tr_torrent * tor, struct sim_peer * sp)
+{
+  tr_piece_index_t i;
+  tr_peer_event e = TR_PEER_EVENT_INIT;
+  tr_peer * peer = &sp->peer;
+  const tr_piece_index_t start = rngInt (tor->info.pieceCount);
+
+  if (tr_bitfieldHasAll (&peer->have))
+    return;
+
+  for (i=start; tr_bitfieldHas (&peer->have, i); )
+    if (++i == tor->info.pieceCount)
+      i = 0;
+
+  tr_bitfieldAdd (&peer->have, i);
+  peer->progress = tr_bitfieldCountTrueBits (&peer->have) / (float)tor->info.pieceCount;
+
+  e.eventType = TR_PEER_CLIENT_GOT_HAVE;
+  e.pieceIndex = i;
+  fireEvent (sp, &e, WATCH_GOT_HAVE);
+}
+
+static void
+simPeerChokesClient (struct sim_peer * sp, bool choke)
+{
+  tr_peer_event e = TR_PEER_EVENT_INIT;
+
+  sp->client_is_choked = choke;
+
+  if (choke)
+    {
+      /* a choke cancels everything we asked for, like in peer-msgs */
+      sp->pending_count = 0;
+      e.eventType = TR_PEER_CLIENT_GOT_CHOKE;
+      fireEvent (sp, &e, WATCH_GOT_CHOKE);
+    }
+}
+
+static void
+simPeerRequest (tr_torrent * tor, struct sim_peer * sp)
+{
+  int got = 0;
+  const int numwant = MAX_PENDING_REQUESTS - sp->pending_count;
+
+  if (sp->client_is_choked || !sp->client_is_interested || (numwant <= 0))
+    return;
+
+  watchStart (WATCH_GET_NEXT_REQUESTS);
+  tr_peerMgrGetNextRequests (tor, &sp->peer, numwant,
+                             sp->pending + sp->pending_count, &got, false);
+  watchStop (WATCH_GET_NEXT_REQUESTS);
+
+  sp->pending_count += got;
+}
+
+/* deliver the oldest block that we asked the peer for */
+static bool
+simPeerDeliver (tr_torrent * tor, struct sim_peer * sp)
+{
+  tr_block_index_t block;
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t length;
+  struct evbuffer * data;
+  tr_peer_event e = TR_PEER_EVENT_INIT;
+  static const uint8_t zeroes[MAX_BLOCK_SIZE];
+
+  if (sp->pending_count == 0)
+    return false;
+
+  block = sp->pending[0];
+  sp->pending_count--;
+  memmove (sp->pending, sp->pending + 1, sp->pending_count * sizeof (tr_block_index_t));
+
+  /* the same checks as peer-msgs' clientGotBlock () */
+  piece = tr_torBlockPiece (tor, block);
+  if (!tr_peerMgrDidPeerRequest (tor, &sp->peer, block) || tr_cpPieceIsComplete (&tor->completion, piece))
+    return false;
+
+  offset = (block - piece * tor->blockCountInPiece) * tor->blockSize;
+  length = tr_torBlockCountBytes (tor, block);
+
+  data = evbuffer_new ();
+  evbuffer_add (data, zeroes, length);
+  tr_cacheWriteBlock (tor->session->cache, tor, piece, offset, length, data);
+  evbuffer_free (data);
+  tr_bitfieldAdd (&sp->peer.blame, piece);
+
+  e.eventType = TR_PEER_CLIENT_GOT_BLOCK;
+  e.pieceIndex = piece;
+  e.offset = offset;
+  e.length = length;
+  fireEvent (sp, &e, WATCH_GOT_BLOCK);
+
+  e.eventType = TR_PEER_CLIENT_GOT_PIECE_DATA;
+  fireEvent (sp, &e, WATCH_GOT_BLOCK);
+
+  return true;
+}
+
+/***
+****  The swarms
+***/
+
+struct sim_swarm
+{
+  tr_torrent * tor;
+  struct sim_peer ** peers;
+  uint32_t pex_serial;
+};
+
+static struct sim_swarm * swarms = NULL;
+
+/* a zero-filled torrent with no trackers, so that blocks of zeroes pass */
+static tr_torrent *
+createTorrent (tr_session * session, int torrentIndex)
+{
+  int i;
+  int err;
+  int benc_len;
+  char * benc;
+  char * name;
+  uint8_t * pieces;
+  uint8_t * zeroes;
+  tr_torrent * tor;
+  tr_variant top;
+  tr_variant * info;
+  tr_ctor * ctor;
+
+  zeroes = tr_new0 (uint8_t, PIECE_SIZE);
+  pieces = tr_new (uint8_t, SHA_DIGEST_LENGTH * piece_count);
+  tr_sha1 (pieces, zeroes, PIECE_SIZE, NULL);
+  for (i=1; i<piece_count; ++i)
+    memcpy (pieces + SHA_DIGEST_LENGTH * i, pieces, SHA_DIGEST_LENGTH);
+
+  name = tr_strdup_printf ("swarm-bench-%d", torrentIndex);
+  tr_variantInitDict (&top, 1);
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 4);
+  tr_variantDictAddStr (info, TR_KEY_name, name);
+  tr_variantDictAddInt (info, TR_KEY_length, (int64_t)PIECE_SIZE * piece_count);
+  tr_variantDictAddInt (info, TR_KEY_piece_length, PIECE_SIZE);
+  tr_variantDictAddRaw (info, TR_KEY_pieces, pieces, SHA_DIGEST_LENGTH * piece_count);
+  benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &benc_len);
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfo (ctor, (uint8_t*)benc, benc_len);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  tor = tr_torrentNew (ctor, &err, NULL);
+  if (tor == NULL)
+    {
+      fprintf (stderr, "couldn't create torrent %d: error %d\n", torrentIndex, err);
+      exit (EXIT_FAILURE);
+    }
+
+  tr_torrentSetPeerLimit (tor, peer_count + 100);
+  tr_torrentStart (tor);
+
+  tr_ctorFree (ctor);
+  tr_free (benc);
+  tr_variantFree (&top);
+  tr_free (name);
+  tr_free (pieces);
+  tr_free (zeroes);
+  return tor;
+}
+
+static void
+addPex (struct sim_swarm * ss, int torrentIndex)
+{
+  int i;
+  tr_pex pex;
+
+  memset (&pex, 0, sizeof (pex));
+  pex.addr.type = TR_AF_INET;
+  pex.port = htons (51413);
+
+  for (i=0; i<pex_per_round; ++i)
+    {
+      /* 100.64.0.0/10, with the torrent in the top bits */
+      const uint32_t n = ((uint32_t)torrentIndex << 18) | (ss->pex_serial++ & 0x3ffff);
+      pex.addr.addr.addr4.s_addr = htonl ((100u << 24) | (64u << 16) | (n & 0x3fffff));
+      pex.flags = rngInt (4) == 0 ? ADDED_F_SEED_FLAG : 0;
+
+      watchStart (WATCH_ADD_PEX);
+      tr_peerMgrAddPex (ss->tor, TR_PEER_FROM_PEX, &pex, -1);
+      watchStop (WATCH_ADD_PEX);
+    }
+}
+
+static void
+simulateRound (tr_session * session)
+{
+  int t;
+  int i;
+  int delivered;
+
+  for (t=0; t<torrent_count; ++t)
+    {
+      struct sim_swarm * ss = &swarms[t];
+      tr_torrent * tor = ss->tor;
+
+      /* peers get pieces and change their minds about us */
+      for (i=0; i<peer_count; ++i)
+        {
+          struct sim_peer * sp = ss->peers[i];
+
+          if (rngInt (10) == 0)
+            simPeerGotPiece (tor, sp);
+
+          if (rngInt (50) == 0)
+            simPeerChokesClient (sp, !sp->client_is_choked);
+
+          if (rngInt (100) == 0)
+            sp->peer_is_interested = !sp->peer_is_interested;
+        }
+
+      /* then we ask the unchoked ones for blocks... */
+      for (i=0; i<peer_count; ++i)
+        simPeerRequest (tor, ss->peers[i]);
+
+      /* ...and some of them arrive */
+      for (i=delivered=0; (i<blocks_per_round * 4) && (delivered<blocks_per_round); ++i)
+        if (simPeerDeliver (tor, ss->peers[rngInt (peer_count)]))
+          ++delivered;
+
+      addPex (ss, t);
+    }
+
+  /* the session's pulses */
+  for (t=0; t<torrent_count; ++t)
+    {
+      watchStart (WATCH_RECHOKE_UPLOADS);
+      tr_peerMgrRechokeUploads (swarms[t].tor);
+      watchStop (WATCH_RECHOKE_UPLOADS);
+
+      watchStart (WATCH_RECHOKE_DOWNLOADS);
+      tr_peerMgrRechokeDownloads (swarms[t].tor);
+      watchStop (WATCH_RECHOKE_DOWNLOADS);
+    }
+
+  watchStart (WATCH_PICK_CANDIDATES);
+  tr_peerMgrPickCandidates (session->peerMgr, CANDIDATES_PER_ROUND);
+  watchStop (WATCH_PICK_CANDIDATES);
+
+  for (t=0; t<torrent_count; ++t)
+    {
+      watchStart (WATCH_PRUNE_ATOMS);
+      tr_peerMgrPruneAtoms (swarms[t].tor);
+      watchStop (WATCH_PRUNE_ATOMS);
+    }
+}
+
+static bool simulation_done = false;
+
+static void
+simulate (void * vsession)
+{
+  int t;
+  int i;
+  int round;
+  tr_session * session = vsession;
+  const time_t start = tr_time ();
+
+  rng_state = UINT64_C (0x9E3779B97F4A7C15) ^ seed;
+
+  /* make the peer manager's own coin flips repeat too */
+  tr_cryptoWeakRandInt (1);
+  srand (seed);
+
+  for (t=0; t<torrent_count; ++t)
+    {
+      swarms[t].peers = tr_new (struct sim_peer*, peer_count);
+      for (i=0; i<peer_count; ++i)
+        swarms[t].peers[i] = simPeerNew (swarms[t].tor, t, i);
+    }
+
+  for (round=1; round<=round_count; ++round)
+    {
+      tr_timeUpdate (start + round);
+      simulateRound (session);
+    }
+
+  __atomic_store_n (&simulation_done, true, __ATOMIC_RELEASE);
+}
+
+/***
+****
+***/
+
+static void
+printResults (void)
+{
+  int i;
+
+  printf ("%-26s %10s %12s %12s %12s %12s\n",
+          "function", "calls", "total ms", "mean us", "max us", "allocs/call");
+
+  for (i=0; i<WATCH_COUNT; ++i)
+    {
+      const struct stopwatch * w = &watches[i];
+      const uint64_t calls = MAX (w->calls, 1);
+
+      printf ("%-26s %10"PRIu64" %12.2f %12.2f %12.2f",
+              w->name, w->calls, w->nsec / 1e6, w->nsec / 1e3 / calls, w->max_nsec / 1e3);
+      if (HAVE_ALLOC_COUNT)
+        printf (" %12.2f\n", (double)w->allocs / calls);
+      else
+        printf (" %12s\n", "n/a");
+    }
+}
+
+int
+main (int argc, char ** argv)
+{
+  int t;
+  tr_session * session;
+  tr_variant settings;
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  printf ("%d torrents of %d pieces, %d peers each, %d rounds, seed %u\n",
+          torrent_count, piece_count, peer_count, round_count, seed);
+
+  tr_variantInitDict (&settings, 8);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_limit_global, 65535);
+  tr_variantDictAddInt (&settings, TR_KEY_cache_size_mb, 256);
+  tr_variantDictAddBool (&settings, TR_KEY_download_queue_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_lpd_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_utp_enabled, false);
+  session = libttest_session_init (&settings);
+
+  swarms = tr_new0 (struct sim_swarm, torrent_count);
+  for (t=0; t<torrent_count; ++t)
+    swarms[t].tor = createTorrent (session, t);
+  for (t=0; t<torrent_count; ++t)
+    while (tr_torrentGetActivity (swarms[t].tor) != TR_STATUS_DOWNLOAD)
+      tr_wait_msec (10);
+
+  tr_runInEventThread (session, simulate, session);
+  while (!__atomic_load_n (&simulation_done, __ATOMIC_ACQUIRE))
+    tr_wait_msec (10);
+
+  printResults ();
+
+  /* the peers are freed along with their torrents */
+  for (t=0; t<torrent_count; ++t)
+    tr_free (swarms[t].peers);
+  tr_free (swarms);
+  libttest_session_close (session);
+  tr_variantFree (&settings);
+  return 0;
+}
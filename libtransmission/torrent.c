@@ -35,6 +35,7 @@
 #include "cache.h"
 #include "completion.h"
 #include "crypto.h" /* for tr_sha1 */
+#include "disk-queue.h"
 #include "resume.h"
 #include "fdlimit.h" /* tr_fdTorrentClose */
 #include "inout.h" /* tr_ioTestPiece () */
@@ -45,6 +46,7 @@
 #include "peer-mgr.h"
 #include "platform.h" /* TR_PATH_DELIMITER_STR */
 #include "ptrarray.h"
+#include "relocate.h"
 #include "session.h"
 #include "torrent.h"
 #include "torrent-magnet.h"
@@ -530,6 +532,7 @@ tr_torrentSetLocalError (tr_torrent * tor, const char * fmt, ...)
   assert (tr_isTorrent (tor));
 
   va_start (ap, fmt);
+  tr_torrentSetChanged (tor);
   tor->error = TR_STAT_LOCAL_ERROR;
   tor->errorTracker[0] = '\0';
   evutil_vsnprintf (tor->errorString, sizeof (tor->errorString), fmt, ap);
@@ -544,6 +547,7 @@ tr_torrentSetLocalError (tr_torrent * tor, const char * fmt, ...)
 static void
 tr_torrentClearError (tr_torrent * tor)
 {
+  tr_torrentSetChanged (tor);
   tor->error = TR_STAT_OK;
   tor->errorString[0] = '\0';
   tor->errorTracker[0] = '\0';
@@ -552,6 +556,8 @@ tr_torrentClearError (tr_torrent * tor)
 static void
 onTrackerResponse (tr_torrent * tor, const tr_tracker_event * event, void * unused UNUSED)
 {
+  tr_torrentSetChanged (tor);
+
   switch (event->messageType)
     {
       case TR_TRACKER_PEERS:
@@ -756,6 +762,15 @@ tr_getBlockSize (uint32_t pieceSize)
 
 static void refreshCurrentDir (tr_torrent * tor);
 
+/* The disk queue's workers use a torrent's paths without locking,
+   so wait for them to finish before changing or freeing the paths. */
+static void
+waitForDiskJobs (const tr_torrent * tor)
+{
+  if (tor->session->diskQueue != NULL)
+    tr_diskQueueWait (tor->session->diskQueue, tor);
+}
+
 static void
 torrentInitFromInfo (tr_torrent * tor)
 {
@@ -817,6 +832,7 @@ void
 tr_torrentGotNewInfoDict (tr_torrent * tor)
 {
   torrentInitFromInfo (tor);
+  tr_torrentSetChanged (tor);
 
   tr_peerMgrOnTorrentGotMetainfo (tor);
 
@@ -855,6 +871,7 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
   int doStart;
   uint64_t loaded;
   const char * dir;
+  char * location;
   bool isNewTorrent;
   struct stat st;
   tr_session * session = tr_ctorGetSession (ctor);
@@ -868,6 +885,8 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
   tor->uniqueId = nextUniqueId++;
   tor->magicNumber = TORRENT_MAGIC_NUMBER;
   tor->queuePosition = session->torrentCount;
+  tor->hasChanged = true;
+  session->hasChangedTorrents = true;
 
   tr_sha1 (tor->obfuscatedHash, "req2", 4,
            tor->info.hash, SHA_DIGEST_LENGTH,
@@ -970,6 +989,14 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
       tor->startAfterVerify = doStart;
       tr_torrentVerify (tor, NULL, NULL);
     }
+  else if ((location = tr_relocateGetCheckpoint (tor)) != NULL)
+    {
+      /* we quit while moving its files, so finish the move */
+      tor->isRelocating = true;
+      tor->startAfterRelocate = doStart;
+      tr_torrentSetLocation (tor, location, true, NULL, NULL);
+      tr_free (location);
+    }
   else if (doStart)
     {
       tr_torrentStart (tor);
@@ -1084,6 +1111,7 @@ tr_torrentSetDownloadDir (tr_torrent * tor, const char * path)
 
   if (!path || !tor->downloadDir || strcmp (path, tor->downloadDir))
     {
+      waitForDiskJobs (tor);
       tr_free (tor->downloadDir);
       tor->downloadDir = tr_strdup (path);
       tr_torrentSetDirty (tor);
@@ -1169,6 +1197,7 @@ tr_torrentSetVerifyState (tr_torrent * tor, tr_verify_state state)
 
   tor->verifyState = state;
   tor->anyDate = tr_time ();
+  tr_torrentSetChanged (tor);
 }
 
 tr_torrent_activity
@@ -1578,12 +1607,16 @@ freeTorrent (tr_torrent * tor)
 
   tr_peerMgrRemoveTorrent (tor);
 
+  /* drop its blocks from the cache and wait for its disk jobs */
+  tr_cacheFlushTorrent (session->cache, tor);
+
   tr_announcerRemoveTorrent (session->announcer, tor);
 
   tr_cpDestruct (&tor->completion);
 
   tr_free (tor->downloadDir);
   tr_free (tor->incompleteDir);
+  tr_free (tor->fieldStamps);
 
   if (tor == session->torrentList)
     {
@@ -1610,6 +1643,7 @@ freeTorrent (tr_torrent * tor)
         {
           t->queuePosition--;
           t->anyDate = now;
+          tr_torrentSetChanged (t);
         }
     }
   assert (queueIsSequenced (session));
@@ -1646,6 +1680,7 @@ torrentStartImpl (void * vtor)
   tor->isRunning = true;
   tor->completeness = tr_cpGetStatus (&tor->completion);
   tor->startDate = tor->anyDate = now;
+  tr_torrentSetChanged (tor);
   tr_torrentClearError (tor);
   tor->finishedSeedingByIdle = false;
 
@@ -1692,6 +1727,13 @@ torrentShouldQueue (const tr_torrent * tor)
 static void
 torrentStart (tr_torrent * tor, bool bypass_queue)
 {
+  /* its files are being moved... start it when they're in place */
+  if (tor->isRelocating)
+    {
+      tor->startAfterRelocate = true;
+      return;
+    }
+
   switch (tr_torrentGetActivity (tor))
     {
       case TR_STATUS_SEED:
@@ -1887,6 +1929,7 @@ tr_torrentStop (tr_torrent * tor)
 
       tor->isRunning = 0;
       tor->isStopping = 0;
+      tor->startAfterRelocate = false;
       tr_torrentSetDirty (tor);
       tr_runInEventThread (tor->session, stopTorrent, tor);
 
@@ -1902,12 +1945,18 @@ closeTorrent (void * vtor)
 
   assert (tr_isTorrent (tor));
 
-  d = tr_variantListAddDict (&tor->session->removedTorrents, 2);
+  d = tr_variantListAddDict (&tor->session->removedTorrents, 3);
   tr_variantDictAddInt (d, TR_KEY_id, tor->uniqueId);
   tr_variantDictAddInt (d, TR_KEY_date, tr_time ());
+  tr_variantDictAddInt (d, TR_KEY_seq, ++tor->session->changeSeq);
+  tor->session->latestChangeSeq = tor->session->changeSeq;
 
   tr_logAddTorInfo (tor, "%s", _("Removing torrent"));
 
+  /* if the torrent's just being closed, keep the move's checkpoint
+     so that the move can be finished the next time it's loaded */
+  tr_relocateRemove (tor, tor->isDeleting);
+
   stopTorrent (tor);
 
   if (tor->isDeleting)
@@ -2155,12 +2204,16 @@ tr_torrentRecheckCompleteness (tr_torrent * tor)
       tor->completeness = completeness;
       tr_fdTorrentClose (tor->session, tor->uniqueId);
 
+      /* seeds don't connect to seeds */
+      tr_peerMgrUpdateCandidates (tor);
+
       if (tr_torrentIsSeed (tor))
         {
           if (recentChange)
             {
               tr_announcerTorrentCompleted (tor);
               tor->doneDate = tor->anyDate = tr_time ();
+              tr_torrentSetChanged (tor);
             }
 
           if (wasLeeching && wasRunning)
@@ -2183,7 +2236,9 @@ tr_torrentRecheckCompleteness (tr_torrent * tor)
               tr_torrentCheckSeedLimit (tor);
             }
 
-          if (tr_sessionIsTorrentDoneScriptEnabled (tor->session))
+          if (tor->isRelocating)
+            tor->callScriptAfterRelocate = true;
+          else if (tr_sessionIsTorrentDoneScriptEnabled (tor->session))
             torrentCallScript (tor, tr_sessionGetTorrentDoneScript (tor->session));
         }
 
@@ -2393,6 +2448,7 @@ tr_torrentSetPriority (tr_torrent * tor, tr_priority_t priority)
   if (tor->bandwidth.priority != priority)
     {
       tor->bandwidth.priority = priority;
+      tr_peerMgrUpdateCandidates (tor);
 
       tr_torrentSetDirty (tor);
     }
@@ -2566,16 +2622,22 @@ tr_torrentSetChecked (tr_torrent * tor, time_t when)
     tor->info.pieces[i].timeChecked = when;
 }
 
-bool
-tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
+void
+tr_torrentSetPieceCheckResult (tr_torrent * tor, tr_piece_index_t pieceIndex, bool pass)
 {
-  const bool pass = tr_ioTestPiece (tor, pieceIndex);
-
-  tr_deeplog_tor (tor, "[LAZY] tr_torrentCheckPiece tested piece %zu, pass==%d", (size_t)pieceIndex, (int)pass);
+  tr_deeplog_tor (tor, "[LAZY] tested piece %zu, pass==%d", (size_t)pieceIndex, (int)pass);
   tr_torrentSetHasPiece (tor, pieceIndex, pass);
   tr_torrentSetPieceChecked (tor, pieceIndex);
   tor->anyDate = tr_time ();
   tr_torrentSetDirty (tor);
+}
+
+bool
+tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
+{
+  const bool pass = tr_ioTestPiece (tor, pieceIndex);
+
+  tr_torrentSetPieceCheckResult (tor, pieceIndex, pass);
 
   return pass;
 }
@@ -2749,6 +2811,7 @@ tr_torrentSetAddedDate (tr_torrent * tor,
 
   tor->addedDate = t;
   tor->anyDate = MAX (tor->anyDate, tor->addedDate);
+  tr_torrentSetChanged (tor);
 }
 
 void
@@ -2758,6 +2821,7 @@ tr_torrentSetActivityDate (tr_torrent * tor, time_t t)
 
   tor->activityDate = t;
   tor->anyDate = MAX (tor->anyDate, tor->activityDate);
+  tr_torrentSetChanged (tor);
 }
 
 void
@@ -2768,6 +2832,7 @@ tr_torrentSetDoneDate (tr_torrent * tor,
 
   tor->doneDate = t;
   tor->anyDate = MAX (tor->anyDate, tor->doneDate);
+  tr_torrentSetChanged (tor);
 }
 
 /**
@@ -3038,15 +3103,67 @@ struct LocationData
   tr_torrent * tor;
 };
 
+static void
+freeLocationData (struct LocationData * data, bool err)
+{
+  if (data->setme_state != NULL)
+    *data->setme_state = err ? TR_LOC_ERROR : TR_LOC_DONE;
+
+  tr_free (data->location);
+  tr_free (data);
+}
+
+static void
+onRelocateDone (tr_torrent * tor, int err, void * vdata)
+{
+  struct LocationData * data = vdata;
+
+  tr_torrentLock (tor);
+
+  tor->isRelocating = false;
+
+  if (!err)
+    {
+      /* blow away the leftover subdirectories in the old location */
+      tr_torrentDeleteLocalData (tor, remove);
+
+      /* set the new location and reverify */
+      tr_torrentSetDownloadDir (tor, data->location);
+      tr_free (tor->incompleteDir);
+      tor->incompleteDir = NULL;
+      tor->currentDir = tor->downloadDir;
+
+      /* save it before the relocation forgets its checkpoint */
+      tr_torrentSave (tor);
+    }
+
+  if ((err != ECANCELED) && tor->startAfterRelocate)
+    {
+      tor->startAfterRelocate = false;
+      torrentStart (tor, false);
+    }
+
+  /* now the finished torrent's files are where the script expects them */
+  if (tor->callScriptAfterRelocate)
+    {
+      tor->callScriptAfterRelocate = false;
+
+      if (!err && tr_sessionIsTorrentDoneScriptEnabled (tor->session))
+        torrentCallScript (tor, tr_sessionGetTorrentDoneScript (tor->session));
+    }
+
+  tr_torrentUnlock (tor);
+
+  freeLocationData (data, err != 0);
+}
+
 static void
 setLocation (void * vdata)
 {
-  bool err = false;
   struct LocationData * data = vdata;
   tr_torrent * tor = data->tor;
-  const bool do_move = data->move_from_old_location;
   const char * location = data->location;
-  double bytesHandled = 0;
+  bool startAfter = false;
   tr_torrentLock (tor);
 
   assert (tr_isTorrent (tor));
@@ -3056,79 +3173,80 @@ setLocation (void * vdata)
 
   tr_mkdirp (location, 0777);
 
-  if (!tr_is_same_file (location, tor->currentDir))
+  /* a move that was interrupted by quitting is finished
+     even if the torrent's location has already been saved */
+  if (data->move_from_old_location
+      && (tor->isRelocating || !tr_is_same_file (location, tor->currentDir)))
     {
-      tr_file_index_t i;
+      const bool resuming = tor->isRelocating;
+
+      /* if they were already being moved, this move replaces that one */
+      startAfter = tor->isRelocating
+                 ? tor->startAfterRelocate
+                 : (tor->isRunning || tor->startAfterVerify) && !tor->isStopping;
+      tr_relocateRemove (tor, true);
 
       /* bad idea to move files while they're being verified... */
       tr_verifyRemove (tor);
 
-      /* try to move the files.
-       * FIXME: there are still all kinds of nasty cases, like what
-       * if the target directory runs out of space halfway through... */
-      for (i=0; !err && i<tor->info.fileCount; ++i)
+      /* renaming is quick, so do it now */
+      if (!resuming && tr_relocateCanRename (tor, location))
         {
-          char * sub;
-          const char * oldbase;
-          const tr_file * f = &tor->info.files[i];
+          int err;
 
-          if (tr_torrentFindFile2 (tor, i, &oldbase, &sub, NULL))
-            {
-              char * oldpath = tr_buildPath (oldbase, sub, NULL);
-              char * newpath = tr_buildPath (location, sub, NULL);
+          waitForDiskJobs (tor);
+          err = tr_relocateNow (tor, location, data->setme_progress);
 
-              tr_logAddDebug ("Found file #%d: %s", (int)i, oldpath);
+          tor->isRelocating = true;
+          tor->startAfterRelocate = false;
+          onRelocateDone (tor, err, data);
 
-              if (do_move && !tr_is_same_file (oldpath, newpath))
-                {
-                  bool renamed = false;
-                  errno = 0;
-                  tr_logAddTorInfo (tor, "moving \"%s\" to \"%s\"", oldpath, newpath);
-                  if (tr_moveFile (oldpath, newpath, &renamed))
-                    {
-                      err = true;
-                      tr_logAddTorErr (tor, "error moving \"%s\" to \"%s\": %s",
-                                       oldpath, newpath, tr_strerror (errno));
-                    }
-                }
+          tr_torrentUnlock (tor);
+          return;
+        }
 
-              tr_free (newpath);
-              tr_free (oldpath);
-              tr_free (sub);
-            }
+      /* otherwise stop the torrent until its files have been copied */
+      if (tor->isRunning)
+        tr_torrentStop (tor);
+      waitForDiskJobs (tor);
 
-          if (data->setme_progress != NULL)
-            {
-              bytesHandled += f->length;
-              *data->setme_progress = bytesHandled / tor->info.totalSize;
-            }
-        }
+      tor->isRelocating = true;
+      tor->startAfterRelocate = startAfter;
+      tr_relocateAdd (tor, location, data->setme_progress, onRelocateDone, data);
 
-      if (!err)
-        {
-          /* blow away the leftover subdirectories in the old location */
-          if (do_move)
-            tr_torrentDeleteLocalData (tor, remove);
+      tr_torrentUnlock (tor);
+      return;
+    }
 
-          /* set the new location and reverify */
-          tr_torrentSetDownloadDir (tor, location);
-        }
+  /* setting the location without moving replaces a move that's underway */
+  if (tor->isRelocating)
+    {
+      startAfter = tor->startAfterRelocate;
+      tr_relocateRemove (tor, true);
     }
 
-  if (!err && do_move)
+  if (!tr_is_same_file (location, tor->currentDir))
+    {
+      /* bad idea to move files while they're being verified... */
+      tr_verifyRemove (tor);
+      waitForDiskJobs (tor);
+      tr_torrentSetDownloadDir (tor, location);
+    }
+  else if (data->move_from_old_location)
     {
       tr_free (tor->incompleteDir);
       tor->incompleteDir = NULL;
       tor->currentDir = tor->downloadDir;
     }
 
-  if (data->setme_state != NULL)
-    *data->setme_state = err ? TR_LOC_ERROR : TR_LOC_DONE;
+  if (data->setme_progress != NULL)
+    *data->setme_progress = 1.0;
+
+  if (startAfter)
+    torrentStart (tor, false);
 
-  /* cleanup */
   tr_torrentUnlock (tor);
-  tr_free (data->location);
-  tr_free (data);
+  freeLocationData (data, false);
 }
 
 void
@@ -3455,6 +3573,7 @@ tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
             {
               walk->queuePosition--;
               walk->anyDate = now;
+              tr_torrentSetChanged (walk);
             }
         }
 
@@ -3475,6 +3594,7 @@ tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
 
   tor->queuePosition = MIN (pos, (back+1));
   tor->anyDate = now;
+  tr_torrentSetChanged (tor);
 
   assert (queueIsSequenced (tor->session));
 }
@@ -3542,6 +3662,8 @@ torrentSetQueued (tr_torrent * tor, bool queued)
     {
       tor->isQueued = queued;
       tor->anyDate = tr_time ();
+      tr_torrentSetChanged (tor);
+      tor->session->queuedTorrentCount += queued ? 1 : -1;
     }
 }
 
@@ -3732,6 +3854,7 @@ torrentRenamePath (void * vdata)
         {
           size_t i;
 
+          waitForDiskJobs (tor);
           error = renamePath (tor, oldpath, newname);
 
           if (!error)
@@ -3760,6 +3883,7 @@ torrentRenamePath (void * vdata)
   ***/
 
   tor->anyDate = tr_time ();
+  tr_torrentSetChanged (tor);
 
   /* callback */
   if (data->callback != NULL)
@@ -247,9 +247,22 @@ struct tr_torrent
     bool                       isStopping;
     bool                       isDeleting;
     bool                       startAfterVerify;
+    bool                       isRelocating;
+    bool                       startAfterRelocate;
+    bool                       callScriptAfterRelocate;
     bool                       isDirty;
     bool                       isQueued;
 
+    /* set when something in its tr_stat changes, and cleared when an
+     * RPC request gives that change a changeSeq. see tr_torrentSetChanged () */
+    bool                       hasChanged;
+    uint64_t                   changeSeq;
+
+    /* the last value sent to RPC clients for each torrent-get field,
+     * sorted by key. see rpcimpl.c */
+    struct tr_field_stamp    * fieldStamps;
+    int                        fieldStampCount;
+
     bool                       infoDictOffsetIsCached;
 
     uint16_t                   maxConnectedPeers;
@@ -379,6 +392,20 @@ void tr_torrentSetDirty (tr_torrent * tor)
     assert (tr_isTorrent (tor));
 
     tor->isDirty = true;
+    __atomic_store_n (&tor->hasChanged, true, __ATOMIC_RELEASE);
+    __atomic_store_n (&tor->session->hasChangedTorrents, true, __ATOMIC_RELEASE);
+}
+
+/* note that something RPC clients can see has changed,
+ * so torrent-get's "since" argument shouldn't skip it.
+ * the verify threads call this too, so the flags are atomic */
+static inline
+void tr_torrentSetChanged (tr_torrent * tor)
+{
+    assert (tr_isTorrent (tor));
+
+    __atomic_store_n (&tor->hasChanged, true, __ATOMIC_RELEASE);
+    __atomic_store_n (&tor->session->hasChangedTorrents, true, __ATOMIC_RELEASE);
 }
 
 uint32_t tr_getBlockSize (uint32_t pieceSize);
@@ -431,6 +458,14 @@ bool tr_torrentPieceNeedsCheck (const tr_torrent * tor, tr_piece_index_t pieceIn
  */
 bool tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex);
 
+/**
+ * @brief Record the result of a piece's checksum test
+ *        that was run somewhere else, such as in the disk queue
+ */
+void tr_torrentSetPieceCheckResult (tr_torrent       * tor,
+                                    tr_piece_index_t   pieceIndex,
+                                    bool               pass);
+
 time_t tr_torrentGetFileMTime (const tr_torrent * tor, tr_file_index_t i);
 
 uint64_t tr_torrentGetCurrentSizeOnDisk (const tr_torrent * tor);
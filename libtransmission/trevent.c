@@ -18,6 +18,8 @@
 
 #include <event2/dns.h>
 #include <event2/event.h>
+#include <event2/thread.h>
+#include <event2/util.h> /* evutil_make_socket_nonblocking () */
 
 #include "transmission.h"
 #include "log.h"
@@ -127,7 +129,7 @@ piperead (int s, char *buf, int len)
 #include <unistd.h> /* read (), write (), pipe () */
 
 #include "transmission.h"
-#include "platform.h" /* tr_lockLock () */
+#include "platform.h" /* tr_threadNew () */
 #include "trevent.h"
 #include "utils.h"
 
@@ -135,23 +137,43 @@ piperead (int s, char *buf, int len)
 ****
 ***/
 
+struct tr_run_data
+{
+    struct tr_run_data * next;
+    void  (*func)(void *);
+    void *  user_data;
+};
+
 typedef struct tr_event_handle
 {
     uint8_t      die;
     int          fds[2];
-    tr_lock *    lock;
+    int          shard;
     tr_session *  session;
     tr_thread *  thread;
     struct event_base * base;
     struct event * pipeEvent;
+
+    /* commands from other threads, newest first. Any thread pushes onto it
+       with a compare-and-swap; the loop takes the whole list at once */
+    struct tr_run_data * commands;
+
+    /* the main loop keeps the list of all the loops, itself included as #0.
+       the others only service peer sockets */
+    int                       shardCount;
+    struct tr_event_handle ** shards;
+
+    /* a peer loop clears its slot in `shards' under this lock
+       and then signals tr_eventCloseShards () */
+    tr_lock                 * shardsLock;
+    tr_cond                 * shardsDone;
 }
 tr_event_handle;
 
-struct tr_run_data
-{
-    void  (*func)(void *);
-    void *  user_data;
-};
+#define loadRelaxed(p) __atomic_load_n ((p), __ATOMIC_RELAXED)
+#define exchangeAcquire(p,v) __atomic_exchange_n ((p), (v), __ATOMIC_ACQUIRE)
+#define casRelease(p,expected,v) \
+    __atomic_compare_exchange_n ((p), (expected), (v), true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
 
 #define dbgmsg(...) \
     do { \
@@ -164,48 +186,55 @@ readFromPipe (int    fd,
               short  eventType,
               void * veh)
 {
-    char              ch;
-    int               ret;
-    tr_event_handle * eh = veh;
+    int                  ret;
+    char                 buf[64];
+    bool                 eof = false;
+    tr_event_handle    * eh = veh;
+    struct tr_run_data * data;
+    struct tr_run_data * next;
+    struct tr_run_data * batch;
 
     dbgmsg ("readFromPipe: eventType is %hd", eventType);
 
-    /* read the command type */
-    ch = '\0';
+    /* the pipe only holds wakeups, so just empty it */
     do
     {
-        ret = piperead (fd, &ch, 1);
+        ret = piperead (fd, buf, sizeof (buf));
+        eof = ret == 0;
     }
-    while (!eh->die && ret < 0 && errno == EAGAIN);
+    while (ret == (int)sizeof (buf));
 
-    dbgmsg ("command is [%c], ret is %d, errno is %d", ch, ret, (int)errno);
+    /* take everything that's been queued, and put it back in order */
+    batch = NULL;
+    for (data=exchangeAcquire (&eh->commands, NULL); data!=NULL; data=next)
+    {
+        next = data->next;
+        data->next = batch;
+        batch = data;
+    }
 
-    switch (ch)
+    for (data=batch; data!=NULL; data=next)
     {
-        case 'r': /* run in libevent thread */
+        next = data->next;
+        if (!eh->die)
         {
-            struct tr_run_data data;
-            const size_t       nwant = sizeof (data);
-            const ssize_t      ngot = piperead (fd, &data, nwant);
-            if (!eh->die && (ngot == (ssize_t)nwant))
-            {
-                dbgmsg ("invoking function in libevent thread");
-              (data.func)(data.user_data);
-            }
-            break;
+            dbgmsg ("invoking function in libevent thread");
+          (data->func)(data->user_data);
         }
+        tr_free (data);
+    }
 
-        case '\0': /* eof */
-        {
-            dbgmsg ("pipe eof reached... removing event listener");
-            event_free (eh->pipeEvent);
-            break;
-        }
+    if (eof)
+    {
+        dbgmsg ("pipe eof reached... removing event listener");
+        event_free (eh->pipeEvent);
 
-        default:
+        /* a peer loop is closed by its pipe alone, so that everything
+           queued before the eof still gets run */
+        if (eh->shard > 0)
         {
-            assert (0 && "unhandled command type!");
-            break;
+            eh->die = true;
+            event_base_loopexit (eh->base, NULL);
         }
     }
 }
@@ -219,9 +248,53 @@ logFunc (int severity, const char * message)
         tr_logAddDebug ("%s", message);
 }
 
+static void
+shardThreadFunc (void * veh)
+{
+    tr_event_handle * eh = veh;
+    tr_event_handle * events;
+    const int shard = eh->shard;
+
+    while (!eh->die)
+        event_base_dispatch (eh->base);
+
+    /* only tr_eventCloseShards () stops us, so the main loop's
+       handle has long since been published by now */
+    events = eh->session->events;
+    tr_netCloseSocket (eh->fds[0]);
+    event_base_free (eh->base);
+    tr_logAddDebug ("Closing peer event loop %d", shard);
+
+    /* tell tr_eventCloseShards () we're done. eh is freed under the
+       lock because that's where it's looked at from the other side */
+    tr_lockLock (events->shardsLock);
+    events->shards[shard] = NULL;
+    tr_free (eh);
+    tr_condBroadcast (events->shardsDone);
+    tr_lockUnlock (events->shardsLock);
+}
+
+static tr_event_handle*
+shardNew (tr_session * session, int shard)
+{
+    tr_event_handle * eh = tr_new0 (tr_event_handle, 1);
+
+    eh->shard = shard;
+    pipe (eh->fds);
+    evutil_make_socket_nonblocking (eh->fds[0]);
+    eh->session = session;
+    eh->base = event_base_new ();
+    eh->pipeEvent = event_new (eh->base, eh->fds[0], EV_READ | EV_PERSIST, readFromPipe, eh);
+    event_add (eh->pipeEvent, NULL);
+    eh->thread = tr_threadNew (shardThreadFunc, eh);
+
+    return eh;
+}
+
 static void
 libeventThreadFunc (void * veh)
 {
+    int i;
     struct event_base * base;
     tr_event_handle * eh = veh;
 
@@ -237,6 +310,15 @@ libeventThreadFunc (void * veh)
     eh->base = base;
     eh->session->event_base = base;
     eh->session->evdns_base = evdns_base_new (base, true);
+
+    /* start the peer loops */
+    eh->shards = tr_new0 (tr_event_handle*, eh->shardCount);
+    eh->shards[0] = eh;
+    eh->shardsLock = tr_lockNew ();
+    eh->shardsDone = tr_condNew ();
+    for (i=1; i<eh->shardCount; ++i)
+        eh->shards[i] = shardNew (eh->session, i);
+
     eh->session->events = eh;
 
     /* listen to the pipe's read fd */
@@ -249,7 +331,11 @@ libeventThreadFunc (void * veh)
         event_base_dispatch (base);
 
     /* shut down the thread */
-    tr_lockFree (eh->lock);
+    tr_eventCloseShards (eh->session);
+    tr_condFree (eh->shardsDone);
+    tr_lockFree (eh->shardsLock);
+    tr_free (eh->shards);
+    tr_netCloseSocket (eh->fds[0]);
     event_base_free (base);
     eh->session->events = NULL;
     tr_free (eh);
@@ -257,15 +343,35 @@ libeventThreadFunc (void * veh)
 }
 
 void
-tr_eventInit (tr_session * session)
+tr_eventInit (tr_session * session, int shardCount)
 {
     tr_event_handle * eh;
 
     session->events = NULL;
 
+    /* the loops add and remove each other's events,
+       so libevent has to be told to use locking */
+    if (shardCount > 1)
+    {
+#if LIBEVENT_VERSION_NUMBER < 0x02010100
+        /* peer-io.c has to remove a peer loop's events without waiting
+           for its callbacks, which needs event_del_noblock () */
+        tr_logAddInfo ("libevent %s is too old for more than one network thread", event_get_version ());
+        shardCount = 1;
+#elif defined (WIN32)
+        evthread_use_windows_threads ();
+#elif defined (HAVE_LIBEVENT_PTHREADS)
+        evthread_use_pthreads ();
+#else
+        tr_logAddInfo ("libevent was built without thread support, so only one network thread will be used");
+        shardCount = 1;
+#endif
+    }
+
     eh = tr_new0 (tr_event_handle, 1);
-    eh->lock = tr_lockNew ();
+    eh->shardCount = MAX (1, shardCount);
     pipe (eh->fds);
+    evutil_make_socket_nonblocking (eh->fds[0]);
     eh->session = session;
     eh->thread = tr_threadNew (libeventThreadFunc, eh);
 
@@ -284,6 +390,51 @@ tr_eventClose (tr_session * session)
     tr_netCloseSocket (session->events->fds[1]);
 }
 
+void
+tr_eventCloseShards (tr_session * session)
+{
+    int i;
+    tr_event_handle * eh;
+
+    assert (tr_isSession (session));
+    assert (tr_amInEventThread (session));
+
+    eh = session->events;
+
+    tr_lockLock (eh->shardsLock);
+
+    /* close all their pipes first, so that they wind down together */
+    for (i=1; i<eh->shardCount; ++i)
+        if (eh->shards[i] != NULL)
+            tr_netCloseSocket (eh->shards[i]->fds[1]);
+
+    for (i=1; i<eh->shardCount; ++i)
+        while (eh->shards[i] != NULL)
+            tr_condWait (eh->shardsDone, eh->shardsLock);
+
+    tr_lockUnlock (eh->shardsLock);
+}
+
+int
+tr_eventGetShardCount (const tr_session * session)
+{
+    assert (tr_isSession (session));
+    assert (session->events != NULL);
+
+    return session->events->shardCount;
+}
+
+struct event_base *
+tr_eventGetShardBase (tr_session * session, int shard)
+{
+    assert (tr_isSession (session));
+    assert (session->events != NULL);
+    assert (0 <= shard && shard < session->events->shardCount);
+    assert (session->events->shards[shard] != NULL);
+
+    return session->events->shards[shard]->base;
+}
+
 /**
 ***
 **/
@@ -305,25 +456,40 @@ void
 tr_runInEventThread (tr_session * session,
                      void func (void*), void * user_data)
 {
+    tr_runInShardThread (session, 0, func, user_data);
+}
+
+void
+tr_runInShardThread (tr_session * session, int shard,
+                     void func (void*), void * user_data)
+{
+    tr_event_handle * eh;
+
     assert (tr_isSession (session));
     assert (session->events != NULL);
+    assert (0 <= shard && shard < session->events->shardCount);
+
+    eh = session->events->shards[shard];
+    assert (eh != NULL);
 
-    if (tr_amInThread (session->events->thread))
+    if (tr_amInThread (eh->thread))
     {
       (func)(user_data);
     }
     else
     {
-        const char         ch = 'r';
-        int                fd = session->events->fds[1];
-        tr_lock *          lock = session->events->lock;
-        struct tr_run_data data;
-
-        tr_lockLock (lock);
-        pipewrite (fd, &ch, 1);
-        data.func = func;
-        data.user_data = user_data;
-        pipewrite (fd, &data, sizeof (data));
-        tr_lockUnlock (lock);
+        struct tr_run_data * data = tr_new (struct tr_run_data, 1);
+        struct tr_run_data * head = loadRelaxed (&eh->commands);
+
+        data->func = func;
+        data->user_data = user_data;
+        do
+            data->next = head;
+        while (!casRelease (&eh->commands, &head, data));
+
+        /* only the command that finds the list empty has to wake the loop up.
+           The ones after it will be taken in the same batch */
+        if (head == NULL)
+            pipewrite (eh->fds[1], "r", 1);
     }
 }
@@ -20,12 +20,33 @@
 /**
 **/
 
-void   tr_eventInit (tr_session *);
+struct event_base;
+
+/**
+ * @brief start the libtransmission thread.
+ *
+ * If shardCount is more than one, that many event loops are started in all.
+ * Loop #0 is the libtransmission thread, which runs everything else too;
+ * the others only read and write peer sockets. See tr_peerIoSetShard ().
+ * Only one loop is started if libevent is older than 2.1.1 or was built
+ * without thread support.
+ */
+void   tr_eventInit (tr_session *, int shardCount);
 
 void   tr_eventClose (tr_session *);
 
+/** @brief stop the peer loops. Their peer-ios must already have been freed. */
+void   tr_eventCloseShards (tr_session *);
+
+int    tr_eventGetShardCount (const tr_session *);
+
+struct event_base * tr_eventGetShardBase (tr_session *, int shard);
+
 bool   tr_amInEventThread (const tr_session *);
 
 void   tr_runInEventThread (tr_session *, void func (void*), void * user_data);
 
+/** @brief like tr_runInEventThread (), but for one of the peer loops */
+void   tr_runInShardThread (tr_session *, int shard, void func (void*), void * user_data);
+
 #endif
@@ -0,0 +1,366 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h> /* memset () */
+
+#ifdef HAVE_LINUX_IO_URING_H
+ #include <linux/io_uring.h>
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+ #include <sys/uio.h> /* struct iovec */
+ #include <unistd.h>
+#endif
+
+#include "transmission.h"
+#include "fdlimit.h" /* tr_pread (), tr_pwrite () */
+#include "uring.h"
+#include "utils.h"
+
+#if defined (HAVE_LINUX_IO_URING_H) && defined (__NR_io_uring_setup)
+
+/* the kernel reads and writes the ring indices concurrently */
+#define loadAcquire(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define storeRelease(p,v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+
+struct tr_uring
+{
+  int fd;
+
+  /* submission queue */
+  void                 * sq_ptr;
+  size_t                 sq_size;
+  unsigned int         * sq_head;
+  unsigned int         * sq_tail;
+  unsigned int         * sq_mask;
+  unsigned int         * sq_array;
+  unsigned int           sq_entries;
+  struct io_uring_sqe  * sqes;
+  size_t                 sqes_size;
+
+  /* completion queue */
+  void                 * cq_ptr;
+  size_t                 cq_size;
+  unsigned int         * cq_head;
+  unsigned int         * cq_tail;
+  unsigned int         * cq_mask;
+  struct io_uring_cqe  * cqes;
+
+  /* if not 0, why the ring stopped working */
+  int err;
+};
+
+static int
+uringSetup (unsigned int entries, struct io_uring_params * p)
+{
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+uringEnter (int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void *
+mapRing (int fd, size_t len, off_t offset)
+{
+  return mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+tr_uring *
+tr_uringNew (unsigned int entries)
+{
+  int err = 0;
+  struct io_uring_params p;
+  tr_uring * ring = tr_new0 (tr_uring, 1);
+
+  ring->sq_ptr = MAP_FAILED;
+  ring->cq_ptr = MAP_FAILED;
+  ring->sqes = MAP_FAILED;
+
+  memset (&p, 0, sizeof (p));
+  ring->fd = uringSetup (entries, &p);
+  if (ring->fd < 0)
+    err = errno;
+
+  if (!err)
+    {
+      ring->sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+      ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+      ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+
+      ring->sq_ptr = mapRing (ring->fd, ring->sq_size, IORING_OFF_SQ_RING);
+      ring->cq_ptr = mapRing (ring->fd, ring->cq_size, IORING_OFF_CQ_RING);
+      ring->sqes = mapRing (ring->fd, ring->sqes_size, IORING_OFF_SQES);
+
+      if ((ring->sq_ptr == MAP_FAILED) || (ring->cq_ptr == MAP_FAILED) || (ring->sqes == MAP_FAILED))
+        err = errno;
+    }
+
+  if (err)
+    {
+      tr_uringFree (ring);
+      errno = err;
+      return NULL;
+    }
+
+  ring->sq_head = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int*)((char*)ring->sq_ptr + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+
+  ring->cq_head = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned int*)((char*)ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + p.cq_off.cqes);
+
+  return ring;
+}
+
+void
+tr_uringFree (tr_uring * ring)
+{
+  if (ring != NULL)
+    {
+      if (ring->sqes != MAP_FAILED)
+        munmap (ring->sqes, ring->sqes_size);
+      if (ring->cq_ptr != MAP_FAILED)
+        munmap (ring->cq_ptr, ring->cq_size);
+      if (ring->sq_ptr != MAP_FAILED)
+        munmap (ring->sq_ptr, ring->sq_size);
+      if (ring->fd >= 0)
+        close (ring->fd);
+
+      tr_free (ring);
+    }
+}
+
+bool
+tr_uringIsBroken (const tr_uring * ring)
+{
+  return ring->err != 0;
+}
+
+/* finish an op with plain pread () / pwrite (), picking up after
+   the `done' bytes that the ring already transferred */
+static int
+runSync (const tr_uring_op * op, size_t done)
+{
+  while (done < op->len)
+    {
+      const ssize_t rc = op->do_write
+        ? tr_pwrite (op->fd, op->buf + done, op->len - done, op->offset + done)
+        : tr_pread (op->fd, op->buf + done, op->len - done, op->offset + done);
+
+      if (rc < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return errno;
+        }
+
+      if (rc == 0)
+        return op->do_write ? EIO : 0;
+
+      done += rc;
+    }
+
+  return 0;
+}
+
+enum
+{
+  OP_WAITING,   /* not handed to the kernel yet, or to be resubmitted */
+  OP_SUBMITTED, /* the kernel may be reading or writing its buffer */
+  OP_FINISHED
+};
+
+int
+tr_uringRun (tr_uring * ring, tr_uring_op * ops, int n)
+{
+  int i;
+  int failed = 0;
+  int in_flight = 0;
+  int queue_head = 0;
+  int queue_len = n;
+  int ring_err = ring->err;               /* set once the ring itself fails */
+  int * queue = tr_new (int, n);          /* ops waiting to be (re)submitted */
+  size_t * done = tr_new0 (size_t, n);    /* bytes transferred so far */
+  char * state = tr_new0 (char, n);
+  struct iovec * iov = tr_new (struct iovec, n);
+
+  for (i=0; i<n; ++i)
+    {
+      ops[i].err = 0;
+      queue[i] = i;
+    }
+
+  while ((!ring_err && (queue_len > 0)) || (in_flight > 0))
+    {
+      unsigned int head;
+      unsigned int tail = *ring->sq_tail;
+
+      /* fill the submission queue. Keeping no more ops in flight than
+         there are submission entries means the completion queue,
+         which is twice as big, can't overflow */
+      while (!ring_err && (queue_len > 0) && (in_flight < (int)ring->sq_entries))
+        {
+          const int k = queue[queue_head];
+          const unsigned int slot = tail & *ring->sq_mask;
+          struct io_uring_sqe * sqe = &ring->sqes[slot];
+
+          queue_head = (queue_head + 1) % n;
+          --queue_len;
+
+          iov[k].iov_base = ops[k].buf + done[k];
+          iov[k].iov_len = ops[k].len - done[k];
+
+          memset (sqe, 0, sizeof (struct io_uring_sqe));
+          sqe->opcode = ops[k].do_write ? IORING_OP_WRITEV : IORING_OP_READV;
+          sqe->fd = ops[k].fd;
+          sqe->off = ops[k].offset + done[k];
+          sqe->addr = (uintptr_t) &iov[k];
+          sqe->len = 1;
+          sqe->user_data = k;
+
+          ring->sq_array[slot] = slot;
+          state[k] = OP_SUBMITTED;
+          ++tail;
+          ++in_flight;
+        }
+
+      storeRelease (ring->sq_tail, tail);
+
+      /* submit whatever the kernel hasn't picked up yet,
+         and wait for at least one completion */
+      if ((uringEnter (ring->fd, tail - loadAcquire (ring->sq_head), 1, IORING_ENTER_GETEVENTS) < 0)
+          && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+        {
+          /* if we can't even wait for the ops in flight, there's
+             no telling when the kernel is done with their buffers */
+          if (ring_err)
+            break;
+
+          ring_err = errno;
+
+          /* take back the entries that the kernel didn't pick up, so
+             that they can't be submitted by a later tr_uringRun (),
+             and then stay to reap the ones that it did */
+          head = loadAcquire (ring->sq_head);
+          storeRelease (ring->sq_tail, head);
+          for (; head!=tail; ++head)
+            {
+              state[(int) ring->sqes[head & *ring->sq_mask].user_data] = OP_WAITING;
+              --in_flight;
+            }
+          continue;
+        }
+
+      /* reap the completions */
+      head = *ring->cq_head;
+      while (head != loadAcquire (ring->cq_tail))
+        {
+          const struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cq_mask];
+          const int k = (int) cqe->user_data;
+          const int res = cqe->res;
+          bool again = false;
+
+          ++head;
+          --in_flight;
+
+          if ((res == -EINTR) || (res == -EAGAIN))
+            again = true;
+          else if (res < 0)
+            ops[k].err = -res;
+          else if ((res == 0) && ops[k].do_write)
+            ops[k].err = EIO;
+          else if (res > 0)
+            again = (done[k] += res) < ops[k].len;
+
+          if (again)
+            {
+              state[k] = OP_WAITING;
+
+              if (!ring_err)
+                {
+                  queue[(queue_head + queue_len) % n] = k;
+                  ++queue_len;
+                }
+            }
+          else
+            {
+              state[k] = OP_FINISHED;
+              if (ops[k].err)
+                ++failed;
+            }
+        }
+
+      storeRelease (ring->cq_head, head);
+    }
+
+  /* if the ring broke, finish what it couldn't without it */
+  if (ring_err)
+    {
+      ring->err = ring_err;
+
+      for (i=0; i<n; ++i)
+        {
+          if (state[i] == OP_WAITING)
+            ops[i].err = runSync (&ops[i], done[i]);
+          else if (state[i] == OP_SUBMITTED)
+            ops[i].err = ring_err;
+          else
+            continue;
+
+          if (ops[i].err)
+            ++failed;
+        }
+    }
+
+  tr_free (iov);
+  tr_free (state);
+  tr_free (done);
+  tr_free (queue);
+  return failed;
+}
+
+#else /* no io_uring */
+
+tr_uring *
+tr_uringNew (unsigned int entries UNUSED)
+{
+  errno = ENOSYS;
+  return NULL;
+}
+
+void
+tr_uringFree (tr_uring * ring UNUSED)
+{
+}
+
+bool
+tr_uringIsBroken (const tr_uring * ring UNUSED)
+{
+  return true;
+}
+
+int
+tr_uringRun (tr_uring * ring UNUSED, tr_uring_op * ops UNUSED, int n)
+{
+  assert (0 && "io_uring isn't available");
+  return n;
+}
+
+#endif
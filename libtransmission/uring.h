@@ -0,0 +1,79 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_URING_H
+#define TR_URING_H
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * A thin wrapper around a Linux io_uring submission/completion ring.
+ * It lets a thread hand the kernel a batch of preads and pwrites with
+ * a single syscall and then reap their completions.
+ *
+ * A ring belongs to the thread that created it.
+ * On systems without io_uring, tr_uringNew () always fails.
+ */
+typedef struct tr_uring tr_uring;
+
+typedef struct tr_uring_op
+{
+  int         fd;
+  bool        do_write;
+  uint8_t   * buf;
+  size_t      len;
+  uint64_t    offset;
+
+  /* 0 on success, or an errno. Set by tr_uringRun () */
+  int         err;
+
+  void      * user_data;
+}
+tr_uring_op;
+
+/**
+ * @return a new ring with room for `entries' in-flight ops,
+ *         or NULL with errno set if io_uring isn't available
+ */
+tr_uring * tr_uringNew (unsigned int entries);
+
+void tr_uringFree (tr_uring * ring);
+
+/**
+ * @brief submit `ops' and wait until they're all done.
+ *
+ * If there are more ops than the ring has room for, they're submitted
+ * as in-flight ops complete. Short transfers are resubmitted for the
+ * remainder, and a read that hits the end of its file stops there,
+ * just like tr_pread ().
+ *
+ * If the ring itself stops working, the ops still in flight are reaped
+ * before this returns, and the rest are done with tr_pread () and
+ * tr_pwrite () instead. So are all later runs on a broken ring.
+ *
+ * @return the number of ops that failed
+ */
+int tr_uringRun (tr_uring * ring, tr_uring_op * ops, int n);
+
+/** @return true if the ring has stopped working and should be replaced */
+bool tr_uringIsBroken (const tr_uring * ring);
+
+/* @} */
+
+#endif
@@ -5,6 +5,7 @@
 #include "ConvertUTF.h" /* tr_utf8_validate*/
 #include "platform.h"
 #include "crypto.h"
+#include "heap.h"
 #include "utils.h"
 #include "web.h"
 
@@ -264,6 +265,78 @@ test_quickfindFirst (void)
   return 0;
 }
 
+struct heap_item
+{
+  int key;
+  int pos;
+};
+
+static int
+compareHeapItems (const void * va, const void * vb)
+{
+  const struct heap_item * a = va;
+  const struct heap_item * b = vb;
+
+  return a->key - b->key;
+}
+
+static void
+setHeapItemPos (void * item, int pos)
+{
+  ((struct heap_item*)item)->pos = pos;
+}
+
+static int
+test_heap (void)
+{
+  int i;
+  int prev;
+  tr_heap heap;
+  const int n = 1000;
+  struct heap_item * items = tr_new0 (struct heap_item, n);
+
+  tr_heapConstruct (&heap, compareHeapItems, setHeapItemPos);
+  check (tr_heapPeek (&heap) == NULL);
+
+  for (i=0; i<n; ++i)
+    {
+      items[i].key = tr_cryptoWeakRandInt (n);
+      tr_heapInsert (&heap, &items[i]);
+    }
+  check_int_eq (n, tr_heapSize (&heap));
+
+  /* every item knows where it is */
+  for (i=0; i<n; ++i)
+    check (heap.items[items[i].pos] == &items[i]);
+
+  /* change some keys and remove some items */
+  for (i=0; i<n; i+=3)
+    {
+      items[i].key = tr_cryptoWeakRandInt (n);
+      tr_heapUpdate (&heap, items[i].pos);
+    }
+  for (i=1; i<n; i+=3)
+    {
+      tr_heapRemove (&heap, items[i].pos);
+      check_int_eq (-1, items[i].pos);
+    }
+  check_int_eq (n - (n+1)/3, tr_heapSize (&heap));
+
+  /* the rest come out smallest first */
+  prev = INT_MIN;
+  while (tr_heapSize (&heap) > 0)
+    {
+      struct heap_item * item = tr_heapPop (&heap);
+      check (prev <= item->key);
+      check_int_eq (-1, item->pos);
+      prev = item->key;
+    }
+
+  tr_heapDestruct (&heap);
+  tr_free (items);
+  return 0;
+}
+
 static int
 test_memmem (void)
 {
@@ -418,6 +491,7 @@ main (void)
                              test_base64,
                              test_buildpath,
                              test_cryptoRand,
+                             test_heap,
                              test_hex,
                              test_lowerbound,
                              test_quickfindFirst,
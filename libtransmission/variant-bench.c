@@ -0,0 +1,476 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/*
+ * Times building and freeing tr_variant trees on the heap and in a
+ * tr_variant_arena.
+ *
+ * "resume" parses a batch of .resume files the way startup does: each
+ * one is parsed, a few fields are read, and the tree is thrown away.
+ * The files are made up to look like tr_torrentSaveResume ()'s, and
+ * are parsed from memory so that disk reads don't drown out the rest.
+ *
+ * "rpc" is an RPC round trip without the session: a torrent-set request
+ * for a batch of torrents is parsed, a response is built and serialized,
+ * and both trees are freed, the way tr_rpc_request_exec_json () does.
+ *
+ * "heap" is the old way, "arena" gets a new arena for each file or
+ * request, and "arena reused" clears one arena and reuses its memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* strlen () */
+#include <time.h> /* clock_gettime () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "tr-getopt.h"
+#include "utils.h"
+#include "variant.h"
+
+#define MY_NAME "variant-bench"
+
+static int resume_count = 5000;
+static int file_count = 20;
+static int peer_count = 50;
+static int request_count = 20000;
+static int ids_count = 200;
+static int repeat_count = 5;
+
+static tr_option options[] =
+{
+  { 'n', "resume-files", "Number of .resume files to parse", "n", 1, "<count>" },
+  { 'f', "files", "Files per torrent", "f", 1, "<count>" },
+  { 'p', "peers", "Peers saved in each .resume file", "p", 1, "<count>" },
+  { 'q', "requests", "Number of RPC requests", "q", 1, "<count>" },
+  { 'i', "ids", "Torrent ids in each RPC request", "i", 1, "<count>" },
+  { 'r', "repeat", "How many times to run each method", "r", 1, "<count>" },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int
+parseCommandLine (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 'n': resume_count = atoi (optarg); break;
+          case 'f': file_count = atoi (optarg); break;
+          case 'p': peer_count = atoi (optarg); break;
+          case 'q': request_count = atoi (optarg); break;
+          case 'i': ids_count = atoi (optarg); break;
+          case 'r': repeat_count = atoi (optarg); break;
+          default: return 1;
+        }
+    }
+
+  return (resume_count > 0) && (file_count > 0) && (peer_count >= 0)
+      && (request_count > 0) && (ids_count > 0) && (repeat_count > 0) ? 0 : 1;
+}
+
+static uint64_t
+nowNsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+enum
+{
+  HEAP,
+  ARENA,
+  ARENA_REUSED,
+
+  MODE_COUNT
+};
+
+static const char * mode_names[MODE_COUNT] = { "heap", "arena", "arena reused" };
+
+/***
+****  .resume files
+***/
+
+static char *
+createResume (int n, size_t * len)
+{
+  int i;
+  int ret_len;
+  char * ret;
+  char buf[64];
+  tr_variant top;
+  tr_variant * d;
+  tr_variant * l;
+  uint8_t * raw;
+  const size_t peers_len = peer_count * 6;
+  const size_t blocks_len = file_count * 64;
+
+  tr_variantInitDict (&top, 30);
+  tr_variantDictAddInt (&top, TR_KEY_seeding_time_seconds, 86400 + n);
+  tr_variantDictAddInt (&top, TR_KEY_downloading_time_seconds, 3600 + n);
+  tr_variantDictAddInt (&top, TR_KEY_activity_date, 1400000000 + n);
+  tr_variantDictAddInt (&top, TR_KEY_added_date, 1300000000 + n);
+  tr_variantDictAddInt (&top, TR_KEY_corrupt, 0);
+  tr_variantDictAddInt (&top, TR_KEY_done_date, 1350000000 + n);
+  tr_variantDictAddStr (&top, TR_KEY_destination, "/home/user/Downloads/torrents/complete");
+  tr_variantDictAddInt (&top, TR_KEY_downloaded, (int64_t)n * 1048576);
+  tr_variantDictAddInt (&top, TR_KEY_uploaded, (int64_t)n * 524288);
+  tr_variantDictAddInt (&top, TR_KEY_max_peers, 50);
+  tr_variantDictAddInt (&top, TR_KEY_bandwidth_priority, 0);
+  tr_variantDictAddBool (&top, TR_KEY_paused, false);
+
+  raw = tr_new0 (uint8_t, MAX (peers_len, blocks_len));
+  for (i=0; i<(int)peers_len; ++i)
+    raw[i] = (uint8_t)(n + i);
+  if (peers_len > 0)
+    tr_variantDictAddRaw (&top, TR_KEY_peers2, raw, peers_len);
+
+  l = tr_variantDictAddList (&top, TR_KEY_priority, file_count);
+  for (i=0; i<file_count; ++i)
+    tr_variantListAddInt (l, 0);
+  l = tr_variantDictAddList (&top, TR_KEY_dnd, file_count);
+  for (i=0; i<file_count; ++i)
+    tr_variantListAddInt (l, 0);
+
+  d = tr_variantDictAddDict (&top, TR_KEY_progress, 2);
+  l = tr_variantDictAddList (d, TR_KEY_time_checked, file_count);
+  for (i=0; i<file_count; ++i)
+    tr_variantListAddInt (l, 1400000000 + i);
+  memset (raw, 0xff, blocks_len);
+  tr_variantDictAddRaw (d, TR_KEY_blocks, raw, blocks_len);
+  tr_free (raw);
+
+  d = tr_variantDictAddDict (&top, TR_KEY_speed_limit_down, 3);
+  tr_variantDictAddInt (d, TR_KEY_speed_Bps, 100000);
+  tr_variantDictAddBool (d, TR_KEY_use_global_speed_limit, true);
+  tr_variantDictAddBool (d, TR_KEY_use_speed_limit, false);
+  d = tr_variantDictAddDict (&top, TR_KEY_speed_limit_up, 3);
+  tr_variantDictAddInt (d, TR_KEY_speed_Bps, 100000);
+  tr_variantDictAddBool (d, TR_KEY_use_global_speed_limit, true);
+  tr_variantDictAddBool (d, TR_KEY_use_speed_limit, false);
+  d = tr_variantDictAddDict (&top, TR_KEY_ratio_limit, 2);
+  tr_variantDictAddReal (d, TR_KEY_ratio_limit, 2.0);
+  tr_variantDictAddInt (d, TR_KEY_ratio_mode, 0);
+  d = tr_variantDictAddDict (&top, TR_KEY_idle_limit, 2);
+  tr_variantDictAddInt (d, TR_KEY_idle_limit, 30);
+  tr_variantDictAddInt (d, TR_KEY_idle_mode, 0);
+
+  l = tr_variantDictAddList (&top, TR_KEY_files, file_count);
+  for (i=0; i<file_count; ++i)
+    {
+      tr_snprintf (buf, sizeof (buf), "Some Torrent %d/Disc 1/track-%03d.flac", n, i);
+      tr_variantListAddStr (l, buf);
+    }
+
+  tr_snprintf (buf, sizeof (buf), "Some Torrent %d", n);
+  tr_variantDictAddStr (&top, TR_KEY_name, buf);
+
+  ret = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &ret_len);
+  *len = ret_len;
+  tr_variantFree (&top);
+  return ret;
+}
+
+/* read a few fields, like loadFromFile () does */
+static int64_t
+readResume (tr_variant * top)
+{
+  int64_t i;
+  int64_t sum = 0;
+  size_t len;
+  const char * str;
+  tr_variant * d;
+  tr_variant * l;
+
+  if (tr_variantDictFindInt (top, TR_KEY_downloaded, &i))
+    sum += i;
+  if (tr_variantDictFindStr (top, TR_KEY_destination, &str, &len))
+    sum += len;
+  if (tr_variantDictFindList (top, TR_KEY_files, &l))
+    sum += tr_variantListSize (l);
+  if (tr_variantDictFindDict (top, TR_KEY_progress, &d) && tr_variantDictFindList (d, TR_KEY_time_checked, &l))
+    sum += tr_variantListSize (l);
+
+  return sum;
+}
+
+static int64_t
+parseResumes (char ** files, const size_t * lens, int mode)
+{
+  int i;
+  int64_t sum = 0;
+  tr_variant top;
+  tr_variant_arena * arena = mode == ARENA_REUSED ? tr_variantArenaNew () : NULL;
+
+  for (i=0; i<resume_count; ++i)
+    {
+      if (mode == ARENA)
+        arena = tr_variantArenaNew ();
+
+      if (tr_variantFromBufArena (&top, TR_VARIANT_FMT_BENC, files[i], lens[i], NULL, NULL, arena))
+        {
+          fprintf (stderr, "couldn't parse resume file %d\n", i);
+          exit (EXIT_FAILURE);
+        }
+
+      sum += readResume (&top);
+
+      if (mode == HEAP)
+        tr_variantFree (&top);
+      else if (mode == ARENA)
+        tr_variantArenaFree (arena);
+      else
+        tr_variantArenaClear (arena);
+    }
+
+  if (mode == ARENA_REUSED)
+    tr_variantArenaFree (arena);
+
+  return sum;
+}
+
+/***
+****  RPC round trips
+***/
+
+static char *
+createRequest (int n)
+{
+  int i;
+  char * ret;
+  tr_variant top;
+  tr_variant * args;
+  tr_variant * l;
+
+  tr_variantInitDict (&top, 3);
+  tr_variantDictAddStr (&top, TR_KEY_method, "torrent-set");
+  tr_variantDictAddInt (&top, TR_KEY_tag, n);
+  args = tr_variantDictAddDict (&top, TR_KEY_arguments, 5);
+  l = tr_variantDictAddList (args, TR_KEY_ids, ids_count);
+  for (i=0; i<ids_count; ++i)
+    tr_variantListAddInt (l, n + i);
+  l = tr_variantDictAddList (args, TR_KEY_files_wanted, file_count);
+  for (i=0; i<file_count; ++i)
+    tr_variantListAddInt (l, i);
+  l = tr_variantDictAddList (args, TR_KEY_trackerAdd, 2);
+  tr_variantListAddStr (l, "http://tracker.example.com:6969/announce");
+  tr_variantListAddStr (l, "udp://tracker.example.org:1337/announce");
+  tr_variantDictAddStr (args, TR_KEY_location, "/home/user/Downloads/torrents/complete");
+  tr_variantDictAddBool (args, TR_KEY_move, true);
+
+  ret = tr_variantToStr (&top, TR_VARIANT_FMT_JSON_LEAN, NULL);
+  tr_variantFree (&top);
+  return ret;
+}
+
+/* the handler reads the request and answers with something about as
+   big as session-get's response */
+static void
+buildResponse (tr_variant * request, tr_variant * response)
+{
+  int i;
+  int n;
+  int64_t tag = 0;
+  const char * str = "";
+  tr_variant * args_in = NULL;
+  tr_variant * args_out;
+  tr_variant * l = NULL;
+
+  tr_variantDictFindDict (request, TR_KEY_arguments, &args_in);
+  tr_variantDictFindStr (args_in, TR_KEY_location, &str, NULL);
+  tr_variantDictFindList (args_in, TR_KEY_ids, &l);
+
+  args_out = tr_variantDictAddDict (response, TR_KEY_arguments, 50);
+  tr_variantDictAddStr (args_out, TR_KEY_download_dir, str);
+  tr_variantDictAddStr (args_out, TR_KEY_incomplete_dir, "/home/user/Downloads/torrents/incomplete");
+  tr_variantDictAddStr (args_out, TR_KEY_script_torrent_done_filename, "/home/user/bin/on-torrent-done.sh");
+  tr_variantDictAddStr (args_out, TR_KEY_blocklist_url, "http://www.example.com/blocklist");
+  tr_variantDictAddStr (args_out, TR_KEY_encryption, "preferred");
+  tr_variantDictAddStr (args_out, TR_KEY_version, "2.84 (14307)");
+
+  /* any forty keys will do for the numbers and flags */
+  for (i=0; i<40; ++i)
+    tr_variantDictAddInt (args_out, TR_KEY_alt_speed_down + i, i);
+
+  /* and echo back the ids, to give it a list */
+  n = tr_variantListSize (l);
+  l = tr_variantDictAddList (args_out, TR_KEY_ids, n);
+  for (i=0; i<n; ++i)
+    tr_variantListAddInt (l, i);
+
+  tr_variantDictAddStr (response, TR_KEY_result, "success");
+  if (tr_variantDictFindInt (request, TR_KEY_tag, &tag))
+    tr_variantDictAddInt (response, TR_KEY_tag, tag);
+}
+
+static int64_t
+roundTrips (char ** requests, int mode)
+{
+  int i;
+  int64_t sum = 0;
+  tr_variant_arena * arena = mode == ARENA_REUSED ? tr_variantArenaNew () : NULL;
+
+  for (i=0; i<request_count; ++i)
+    {
+      tr_variant request;
+      tr_variant response;
+      struct evbuffer * buf;
+
+      if (mode == ARENA)
+        arena = tr_variantArenaNew ();
+
+      if (tr_variantFromBufArena (&request, TR_VARIANT_FMT_JSON, requests[i], strlen (requests[i]), NULL, NULL, arena))
+        {
+          fprintf (stderr, "couldn't parse request %d\n", i);
+          exit (EXIT_FAILURE);
+        }
+
+      tr_variantInitDictArena (&response, 3, arena);
+      buildResponse (&request, &response);
+
+      buf = tr_variantToBuf (&response, TR_VARIANT_FMT_JSON_LEAN);
+      sum += evbuffer_get_length (buf);
+      evbuffer_free (buf);
+
+      if (mode == HEAP)
+        {
+          tr_variantFree (&response);
+          tr_variantFree (&request);
+        }
+      else if (mode == ARENA)
+        {
+          tr_variantArenaFree (arena);
+        }
+      else
+        {
+          tr_variantArenaClear (arena);
+        }
+    }
+
+  if (mode == ARENA_REUSED)
+    tr_variantArenaFree (arena);
+
+  return sum;
+}
+
+/***
+****
+***/
+
+static void
+printResult (const char * name, int mode, const uint64_t * nsec, int count, size_t bytes)
+{
+  const double sec = nsec[mode] / 1e9 / repeat_count;
+
+  printf ("%-8s %-14s %12.2f %14.0f %12.1f\n",
+          name, mode_names[mode], sec * 1000, count / sec, bytes / sec / (1024 * 1024));
+}
+
+int
+main (int argc, char ** argv)
+{
+  int i;
+  int j;
+  int mode;
+  char ** files;
+  size_t * lens;
+  char ** requests;
+  size_t files_bytes = 0;
+  size_t requests_bytes = 0;
+  int64_t check[MODE_COUNT];
+  uint64_t resume_nsec[MODE_COUNT];
+  uint64_t rpc_nsec[MODE_COUNT];
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  files = tr_new (char*, resume_count);
+  lens = tr_new (size_t, resume_count);
+  for (i=0; i<resume_count; ++i)
+    {
+      files[i] = createResume (i, &lens[i]);
+      files_bytes += lens[i];
+    }
+
+  requests = tr_new (char*, request_count);
+  for (i=0; i<request_count; ++i)
+    {
+      requests[i] = createRequest (i);
+      requests_bytes += strlen (requests[i]);
+    }
+
+  printf ("%d .resume files of %zu bytes on average, %d requests of %zu bytes on average, %d runs each\n",
+          resume_count, files_bytes / resume_count,
+          request_count, requests_bytes / request_count, repeat_count);
+
+  memset (resume_nsec, 0, sizeof (resume_nsec));
+  memset (rpc_nsec, 0, sizeof (rpc_nsec));
+
+  /* take turns, so that no mode gets a warmer cache than the others */
+  for (j=0; j<repeat_count; ++j)
+    {
+      for (mode=0; mode<MODE_COUNT; ++mode)
+        {
+          uint64_t nsec = nowNsec ();
+          check[mode] = parseResumes (files, lens, mode);
+          resume_nsec[mode] += nowNsec () - nsec;
+        }
+
+      for (mode=1; mode<MODE_COUNT; ++mode)
+        if (check[mode] != check[HEAP])
+          {
+            fprintf (stderr, "%s and %s parsed different things\n", mode_names[HEAP], mode_names[mode]);
+            return EXIT_FAILURE;
+          }
+
+      for (mode=0; mode<MODE_COUNT; ++mode)
+        {
+          uint64_t nsec = nowNsec ();
+          check[mode] = roundTrips (requests, mode);
+          rpc_nsec[mode] += nowNsec () - nsec;
+        }
+
+      for (mode=1; mode<MODE_COUNT; ++mode)
+        if (check[mode] != check[HEAP])
+          {
+            fprintf (stderr, "%s and %s answered differently\n", mode_names[HEAP], mode_names[mode]);
+            return EXIT_FAILURE;
+          }
+    }
+
+  printf ("%-8s %-14s %12s %14s %12s\n", "test", "method", "mean ms", "per second", "input MiB/s");
+  for (mode=0; mode<MODE_COUNT; ++mode)
+    printResult ("resume", mode, resume_nsec, resume_count, files_bytes);
+  for (mode=0; mode<MODE_COUNT; ++mode)
+    printResult ("rpc", mode, rpc_nsec, request_count, requests_bytes);
+
+  for (i=0; i<resume_count; ++i)
+    tr_free (files[i]);
+  tr_free (files);
+  tr_free (lens);
+  for (i=0; i<request_count; ++i)
+    tr_free (requests[i]);
+  tr_free (requests);
+  return 0;
+}
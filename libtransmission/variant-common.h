@@ -42,11 +42,15 @@ void tr_variantToBufBenc (const tr_variant * top, struct evbuffer * buf);
 
 void tr_variantInit (tr_variant * v, char type);
 
+/* like tr_variantInitStr (), but if arena isn't NULL a long string is copied into it */
+void tr_variantInitStrArena (tr_variant * v, const void * str, int len, tr_variant_arena * arena);
+
 int tr_jsonParse (const char    * source, /* Such as a filename. Only when logging an error */
                   const void    * vbuf,
                   size_t          len,
                   tr_variant    * setme_benc,
-                  const char   ** setme_end);
+                  const char   ** setme_end,
+                  tr_variant_arena * arena);
 
 /** @brief Private function that's exposed here only for unit tests */
 int tr_bencParseInt (const uint8_t *  buf,
@@ -64,7 +68,8 @@ int tr_bencParseStr (const uint8_t *  buf,
 int tr_variantParseBenc (const void     * buf,
                          const void     * end,
                          tr_variant     * top,
-                         const char ** setme_end);
+                         const char ** setme_end,
+                         tr_variant_arena * arena);
 
 
 
@@ -12,14 +12,19 @@
 
 #include <assert.h>
 #include <ctype.h>
-#include <math.h> /* fabs() */
+#include <math.h> /* fabs(), log10() */
 #include <stdio.h>
 #include <string.h>
 #include <errno.h> /* EILSEQ, EINVAL */
+#include <float.h> /* DBL_EPSILON */
 
 #include <event2/buffer.h> /* evbuffer_add() */
 #include <event2/util.h> /* evutil_strtoll () */
 
+#ifdef HAVE_ZLIB
+ #include <zlib.h>
+#endif
+
 #define JSONSL_STATE_USER_FIELDS /* no fields */
 #include "jsonsl.h"
 #include "jsonsl.c"
@@ -27,7 +32,6 @@
 #define __LIBTRANSMISSION_VARIANT_MODULE___
 #include "transmission.h"
 #include "ConvertUTF.h"
-#include "list.h"
 #include "log.h"
 #include "ptrarray.h"
 #include "utils.h"
@@ -42,6 +46,7 @@ struct json_wrapper_data
   int error;
   bool has_content;
   tr_variant * top;
+  tr_variant_arena * arena;
   const char * key;
   size_t keylen;
   struct evbuffer * keybuf;
@@ -132,14 +137,14 @@ action_callback_PUSH (jsonsl_t                  jsn,
       case JSONSL_T_LIST:
         data->has_content = true;
         node = get_node (jsn);
-        tr_variantInitList (node, 0);
+        tr_variantInitListArena (node, 0, data->arena);
         tr_ptrArrayAppend (&data->stack, node);
         break;
 
       case JSONSL_T_OBJECT:
         data->has_content = true;
         node = get_node (jsn);
-        tr_variantInitDict (node, 0);
+        tr_variantInitDictArena (node, 0, data->arena);
         tr_ptrArrayAppend (&data->stack, node);
         break;
 
@@ -290,7 +295,7 @@ action_callback_POP (jsonsl_t                  jsn,
     {
       size_t len;
       const char * str = extract_string (jsn, state, &len, data->strbuf);
-      tr_variantInitStr (get_node (jsn), str, len);
+      tr_variantInitStrArena (get_node (jsn), str, len, data->arena);
       data->has_content = true;
     }
   else if (state->type == JSONSL_T_HKEY)
@@ -335,7 +340,8 @@ tr_jsonParse (const char     * source,
               const void     * vbuf,
               size_t           len,
               tr_variant     * setme_variant,
-              const char    ** setme_end)
+              const char    ** setme_end,
+              tr_variant_arena * arena)
 {
   int error;
   jsonsl_t jsn;
@@ -352,6 +358,7 @@ tr_jsonParse (const char     * source,
   data.has_content = false;
   data.key = NULL;
   data.top = setme_variant;
+  data.arena = arena;
   data.stack = TR_PTR_ARRAY_INIT;
   data.source = source;
   data.keybuf = evbuffer_new ();
@@ -378,25 +385,135 @@ tr_jsonParse (const char     * source,
 }
 
 /****
-*****
+*****  tr_json_writer
 ****/
 
-struct ParentState
+enum
+{
+  /* when gzipping, deflate the pending output once there's this much */
+  DEFLATE_CHUNK_SIZE = 32 * 1024,
+
+  /* how much space to reserve at a time for deflate's output */
+  DEFLATE_OUT_SIZE = 16 * 1024
+};
+
+struct json_level
 {
-  int variantType;
-  int childIndex;
-  int childCount;
+  bool isDict;
+  int childCount; /* in a dict, the keys and values are each counted */
 };
 
-struct jsonWalk
+struct tr_json_writer
 {
   bool doIndent;
-  tr_list * parents;
-  struct evbuffer *  out;
+
+  /* where the JSON goes. If gzipping, this is a staging buffer */
+  struct evbuffer * out;
+
+  int depth;
+  int levelsAlloc;
+  struct json_level * levels;
+
+#ifdef HAVE_ZLIB
+  bool doDeflate;
+  struct evbuffer * deflated;
+  z_stream stream;
+#endif
 };
 
+tr_json_writer *
+tr_jsonWriterNew (struct evbuffer * out, bool lean, bool gzip)
+{
+  tr_json_writer * w = tr_new0 (tr_json_writer, 1);
+
+  w->doIndent = !lean;
+  w->out = out;
+
+#ifdef HAVE_ZLIB
+  if (gzip)
+    {
+      int compressionLevel;
+
+      /* the same as the RPC server's */
+#ifdef TR_LIGHTWEIGHT
+      compressionLevel = Z_DEFAULT_COMPRESSION;
+#else
+      compressionLevel = Z_BEST_COMPRESSION;
+#endif
+
+      w->doDeflate = true;
+      w->deflated = out;
+      w->out = evbuffer_new ();
+
+      /* zlib's manual says: "Add 16 to windowBits to write a simple gzip header
+       * and trailer around the compressed data instead of a zlib wrapper." */
+      deflateInit2 (&w->stream, compressionLevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+    }
+#else
+  (void) gzip;
+#endif
+
+  return w;
+}
+
+#ifdef HAVE_ZLIB
+static void
+jsonDeflate (tr_json_writer * w, int flush)
+{
+  int state;
+  const size_t len = evbuffer_get_length (w->out);
+
+  w->stream.next_in = evbuffer_pullup (w->out, -1);
+  w->stream.avail_in = len;
+
+  for (;;)
+    {
+      struct evbuffer_iovec vec[1];
+
+      evbuffer_reserve_space (w->deflated, DEFLATE_OUT_SIZE, vec, 1);
+      w->stream.next_out = vec[0].iov_base;
+      w->stream.avail_out = vec[0].iov_len;
+      state = deflate (&w->stream, flush);
+      vec[0].iov_len -= w->stream.avail_out;
+      evbuffer_commit_space (w->deflated, vec, 1);
+
+      if ((state != Z_OK) && (state != Z_BUF_ERROR))
+        break;
+      if ((flush != Z_FINISH) && (w->stream.avail_in == 0) && (w->stream.avail_out != 0))
+        break;
+    }
+
+  evbuffer_drain (w->out, len);
+}
+#endif
+
 static void
-jsonIndent (struct jsonWalk * data)
+jsonMaybeDeflate (tr_json_writer * w UNUSED)
+{
+#ifdef HAVE_ZLIB
+  if (w->doDeflate && (evbuffer_get_length (w->out) >= DEFLATE_CHUNK_SIZE))
+    jsonDeflate (w, Z_NO_FLUSH);
+#endif
+}
+
+void
+tr_jsonWriterFree (tr_json_writer * w)
+{
+#ifdef HAVE_ZLIB
+  if (w->doDeflate)
+    {
+      jsonDeflate (w, Z_FINISH);
+      deflateEnd (&w->stream);
+      evbuffer_free (w->out);
+    }
+#endif
+
+  tr_free (w->levels);
+  tr_free (w);
+}
+
+static void
+jsonIndent (tr_json_writer * w)
 {
   static char buf[1024] = { '\0' };
   if (!*buf)
@@ -405,132 +522,188 @@ jsonIndent (struct jsonWalk * data)
       buf[0] = '\n';
     }
 
-  if (data->doIndent)
-    evbuffer_add (data->out, buf, tr_list_size(data->parents)*4 + 1);
+  if (w->doIndent)
+    evbuffer_add (w->out, buf, MIN (w->depth*4 + 1, (int)sizeof(buf)));
 }
 
-static void
-jsonChildFunc (struct jsonWalk * data)
+static inline struct json_level *
+jsonLevel (tr_json_writer * w)
 {
-  if (data->parents && data->parents->data)
-    {
-      struct ParentState * pstate = data->parents->data;
+  return w->depth > 0 ? &w->levels[w->depth-1] : NULL;
+}
 
-      switch (pstate->variantType)
-        {
-          case TR_VARIANT_TYPE_DICT:
-            {
-              const int i = pstate->childIndex++;
-              if (! (i % 2))
-                {
-                  evbuffer_add (data->out, ": ", data->doIndent ? 2 : 1);
-                }
-              else
-                {
-                  const bool isLast = pstate->childIndex == pstate->childCount;
+/* @return true if the next thing written is a dict's key */
+static inline bool
+jsonIsKeyNext (tr_json_writer * w)
+{
+  const struct json_level * level = jsonLevel (w);
 
-                  if (!isLast)
-                    {
-                      evbuffer_add (data->out, ", ", data->doIndent ? 2 : 1);
-                      jsonIndent (data);
-                    }
-                }
-              break;
-            }
+  return (level != NULL) && level->isDict && !(level->childCount % 2);
+}
 
-          case TR_VARIANT_TYPE_LIST:
-            {
-              const bool isLast = ++pstate->childIndex == pstate->childCount;
-              if (!isLast)
-                {
-                  evbuffer_add (data->out, ", ", data->doIndent ? 2 : 1);
-                  jsonIndent (data);
-                }
-              break;
-            }
+/* write whatever goes before the next key or value */
+static void
+jsonChildBegin (tr_json_writer * w)
+{
+  struct json_level * level = jsonLevel (w);
 
-          default:
-            break;
-        }
+  if (level == NULL)
+    return;
+
+  if (!level->isDict || !(level->childCount % 2))
+    {
+      if (level->childCount > 0)
+        evbuffer_add (w->out, ", ", w->doIndent ? 2 : 1);
+      jsonIndent (w);
     }
+
+  ++level->childCount;
 }
 
 static void
-jsonPushParent (struct jsonWalk  * data,
-                const tr_variant * v)
+jsonBegin (tr_json_writer * w, bool isDict)
 {
-  struct ParentState * pstate = tr_new (struct ParentState, 1);
+  struct json_level * level;
 
-  pstate->variantType = v->type;
-  pstate->childIndex = 0;
-  pstate->childCount = v->val.l.count;
-  if (tr_variantIsDict (v))
-    pstate->childCount *= 2;
+  assert (!jsonIsKeyNext (w));
 
-  tr_list_prepend (&data->parents, pstate);
+  jsonChildBegin (w);
+  evbuffer_add (w->out, isDict ? "{" : "[", 1);
+
+  if (w->depth == w->levelsAlloc)
+    {
+      w->levelsAlloc = MAX (8, w->levelsAlloc * 2);
+      w->levels = tr_renew (struct json_level, w->levels, w->levelsAlloc);
+    }
+
+  level = &w->levels[w->depth++];
+  level->isDict = isDict;
+  level->childCount = 0;
 }
 
-static void
-jsonPopParent (struct jsonWalk * data)
+void
+tr_jsonBeginDict (tr_json_writer * w)
 {
-  tr_free (tr_list_pop_front (&data->parents));
+  jsonBegin (w, true);
 }
 
-static void
-jsonIntFunc (const tr_variant * val, void * vdata)
+void
+tr_jsonBeginList (tr_json_writer * w)
 {
-  struct jsonWalk * data = vdata;
-  evbuffer_add_printf (data->out, "%" PRId64, val->val.i);
-  jsonChildFunc (data);
+  jsonBegin (w, false);
 }
 
-static void
-jsonBoolFunc (const tr_variant * val,
-              void             * vdata)
+void
+tr_jsonEnd (tr_json_writer * w)
 {
-  struct jsonWalk * data = vdata;
+  bool isDict;
 
-  if (val->val.b)
-    evbuffer_add (data->out, "true", 4);
-  else
-    evbuffer_add (data->out, "false", 5);
+  assert (w->depth > 0);
+  assert (!jsonLevel (w)->isDict || !(jsonLevel (w)->childCount % 2));
+
+  isDict = jsonLevel (w)->isDict;
+  --w->depth;
+
+  jsonIndent (w);
+  evbuffer_add (w->out, isDict ? "}" : "]", 1);
 
-  jsonChildFunc (data);
+  jsonMaybeDeflate (w);
 }
 
-static void
-jsonRealFunc (const tr_variant * val,
-              void             * vdata)
+void
+tr_jsonInt (tr_json_writer * w, int64_t i)
 {
-  struct jsonWalk * data = vdata;
+  assert (!jsonIsKeyNext (w));
 
-  if (fabs (val->val.d - (int)val->val.d) < 0.00001)
-    evbuffer_add_printf (data->out, "%d", (int)val->val.d);
-  else
-    evbuffer_add_printf (data->out, "%.4f", tr_truncd (val->val.d, 4));
+  jsonChildBegin (w);
+  evbuffer_add_printf (w->out, "%" PRId64, i);
+  jsonMaybeDeflate (w);
+}
 
-  jsonChildFunc (data);
+void
+tr_jsonBool (tr_json_writer * w, bool b)
+{
+  assert (!jsonIsKeyNext (w));
+
+  jsonChildBegin (w);
+  if (b)
+    evbuffer_add (w->out, "true", 4);
+  else
+    evbuffer_add (w->out, "false", 5);
+  jsonMaybeDeflate (w);
 }
 
+/* Like printf ("%.4f", tr_truncd (d, 4)), but always with a '.' decimal
+ * point. Writers can run in several threads at once, so this can't
+ * switch LC_NUMERIC; instead whatever separator the locale gave us is
+ * replaced with a '.' */
 static void
-jsonStringFunc (const tr_variant * val,
-                void             * vdata)
+jsonWriteTruncd (struct evbuffer * out, double d)
+{
+  const char * walk;
+  const char * frac;
+  char buf[128];
+  const int max_precision = (int) log10 (1.0 / DBL_EPSILON) - 1;
+
+  tr_snprintf (buf, sizeof (buf), "%.*f", max_precision, d);
+
+  /* the integer part, with its sign */
+  walk = buf;
+  if (*walk == '-')
+    ++walk;
+  while (isdigit ((unsigned char)*walk))
+    ++walk;
+
+  /* the separator can be more than one byte long */
+  frac = walk;
+  while ((*frac != '\0') && !isdigit ((unsigned char)*frac))
+    ++frac;
+
+  if ((walk == frac) || (strlen (frac) < 4)) /* "inf", "nan" */
+    {
+      evbuffer_add (out, buf, strlen (buf));
+      return;
+    }
+
+  evbuffer_add (out, buf, walk - buf);
+  evbuffer_add (out, ".", 1);
+  evbuffer_add (out, frac, 4);
+}
+
+void
+tr_jsonReal (tr_json_writer * w, double d)
+{
+  assert (!jsonIsKeyNext (w));
+
+  jsonChildBegin (w);
+  if (fabs (d - (int)d) < 0.00001)
+    evbuffer_add_printf (w->out, "%d", (int)d);
+  else
+    jsonWriteTruncd (w->out, d);
+  jsonMaybeDeflate (w);
+}
+
+/* in a dict, strings in the key positions are written as the keys */
+void
+tr_jsonStr (tr_json_writer * w, const char * str, int len)
 {
   char * out;
   char * outwalk;
   char * outend;
   struct evbuffer_iovec vec[1];
-  struct jsonWalk * data = vdata;
-  const char * str;
-  size_t len;
   const unsigned char * it;
   const unsigned char * end;
+  const bool isKey = jsonIsKeyNext (w);
+
+  if (len < 0)
+    len = strlen (str);
 
-  tr_variantGetStr (val, &str, &len);
   it = (const unsigned char *) str;
   end = it + len;
 
-  evbuffer_reserve_space (data->out, len * 4, vec, 1);
+  jsonChildBegin (w);
+
+  evbuffer_reserve_space (w->out, len * 4 + 4, vec, 1);
   out = vec[0].iov_base;
   outend = out + vec[0].iov_len;
 
@@ -572,53 +745,125 @@ jsonStringFunc (const tr_variant * val,
 
   *outwalk++ = '"';
   vec[0].iov_len = outwalk - out;
-  evbuffer_commit_space (data->out, vec, 1);
+  evbuffer_commit_space (w->out, vec, 1);
 
-  jsonChildFunc (data);
+  if (isKey)
+    evbuffer_add (w->out, ": ", w->doIndent ? 2 : 1);
+  else
+    jsonMaybeDeflate (w);
 }
 
-static void
-jsonDictBeginFunc (const tr_variant * val,
-                   void             * vdata)
+void
+tr_jsonKey (tr_json_writer * w, const tr_quark key)
 {
-  struct jsonWalk * data = vdata;
+  size_t len;
+  const char * str = tr_quark_get_string (key, &len);
+
+  assert (jsonIsKeyNext (w));
 
-  jsonPushParent (data, val);
-  evbuffer_add (data->out, "{", 1);
-  if (val->val.l.count)
-    jsonIndent (data);
+  tr_jsonStr (w, str, len);
 }
 
+void
+tr_jsonRawValue (tr_json_writer * w, struct evbuffer * json)
+{
+  assert (!jsonIsKeyNext (w));
+
+  jsonChildBegin (w);
+  evbuffer_add_buffer (w->out, json);
+  jsonMaybeDeflate (w);
+}
+
+void
+tr_jsonDictAddInt (tr_json_writer * w, const tr_quark key, int64_t i)
+{
+  tr_jsonKey (w, key);
+  tr_jsonInt (w, i);
+}
+
+void
+tr_jsonDictAddReal (tr_json_writer * w, const tr_quark key, double d)
+{
+  tr_jsonKey (w, key);
+  tr_jsonReal (w, d);
+}
+
+void
+tr_jsonDictAddBool (tr_json_writer * w, const tr_quark key, bool b)
+{
+  tr_jsonKey (w, key);
+  tr_jsonBool (w, b);
+}
+
+void
+tr_jsonDictAddStr (tr_json_writer * w, const tr_quark key, const char * str)
+{
+  tr_jsonKey (w, key);
+  tr_jsonStr (w, str ? str : "", -1);
+}
+
+void
+tr_jsonDictAddDict (tr_json_writer * w, const tr_quark key)
+{
+  tr_jsonKey (w, key);
+  tr_jsonBeginDict (w);
+}
+
+void
+tr_jsonDictAddList (tr_json_writer * w, const tr_quark key)
+{
+  tr_jsonKey (w, key);
+  tr_jsonBeginList (w);
+}
+
+/***
+****  Writing a tr_variant
+***/
+
 static void
-jsonListBeginFunc (const tr_variant * val,
-                   void             * vdata)
+jsonIntFunc (const tr_variant * val, void * w)
 {
-  const size_t nChildren = tr_variantListSize (val);
-  struct jsonWalk * data = vdata;
+  tr_jsonInt (w, val->val.i);
+}
 
-  jsonPushParent (data, val);
-  evbuffer_add (data->out, "[", 1);
-  if (nChildren)
-    jsonIndent (data);
+static void
+jsonBoolFunc (const tr_variant * val, void * w)
+{
+  tr_jsonBool (w, val->val.b);
 }
 
 static void
-jsonContainerEndFunc (const tr_variant * val,
-                      void             * vdata)
+jsonRealFunc (const tr_variant * val, void * w)
 {
-  struct jsonWalk * data = vdata;
-  int emptyContainer = false;
+  tr_jsonReal (w, val->val.d);
+}
 
-  jsonPopParent (data);
+static void
+jsonStringFunc (const tr_variant * val, void * w)
+{
+  size_t len;
+  const char * str;
+
+  tr_variantGetStr (val, &str, &len);
+  tr_jsonStr (w, str, len);
+}
+
+static void
+jsonDictBeginFunc (const tr_variant * val UNUSED, void * w)
+{
+  tr_jsonBeginDict (w);
+}
 
-  if (!emptyContainer)
-    jsonIndent (data);
-  if (tr_variantIsDict (val))
-    evbuffer_add (data->out, "}", 1);
-  else /* list */
-    evbuffer_add (data->out, "]", 1);
+static void
+jsonListBeginFunc (const tr_variant * val UNUSED, void * w)
+{
+  tr_jsonBeginList (w);
+}
 
-  jsonChildFunc (data);
+static void
+jsonContainerEndFunc (const tr_variant * val UNUSED, void * w)
+{
+  tr_jsonEnd (w);
 }
 
 static const struct VariantWalkFuncs walk_funcs = { jsonIntFunc,
@@ -630,15 +875,26 @@ static const struct VariantWalkFuncs walk_funcs = { jsonIntFunc,
                                                     jsonContainerEndFunc };
 
 void
-tr_variantToBufJson (const tr_variant * top, struct evbuffer * buf, bool lean)
+tr_jsonVariant (tr_json_writer * w, const tr_variant * v)
 {
-  struct jsonWalk data;
+  /* most values aren't containers, so they don't need a walk */
+  switch (v->type)
+    {
+      case TR_VARIANT_TYPE_INT:  jsonIntFunc (v, w); break;
+      case TR_VARIANT_TYPE_BOOL: jsonBoolFunc (v, w); break;
+      case TR_VARIANT_TYPE_REAL: jsonRealFunc (v, w); break;
+      case TR_VARIANT_TYPE_STR:  jsonStringFunc (v, w); break;
+      default: tr_variantWalk (v, &walk_funcs, w, false); break;
+    }
+}
 
-  data.doIndent = !lean;
-  data.out = buf;
-  data.parents = NULL;
+void
+tr_variantToBufJson (const tr_variant * top, struct evbuffer * buf, bool lean)
+{
+  tr_json_writer * w = tr_jsonWriterNew (buf, lean, false);
 
-  tr_variantWalk (top, &walk_funcs, &data, true);
+  tr_variantWalk (top, &walk_funcs, w, true);
+  tr_jsonWriterFree (w);
 
   if (evbuffer_get_length (buf))
     evbuffer_add_printf (buf, "\n");
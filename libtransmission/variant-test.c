@@ -527,6 +527,84 @@ testParse2 (void)
   return 0;
 }
 
+static int
+testArena (void)
+{
+  int i;
+  int len;
+  char * str;
+  size_t size;
+  int64_t intVal;
+  const char * strVal;
+  size_t strLen;
+  tr_variant top;
+  tr_variant * list;
+  tr_variant * dict;
+  tr_variant_arena * arena;
+  const char * long_str = "a string that's too long to be stored inline";
+  const char * benc = "d4:listli1ei2ei3ee4:name44:a string that's too long to be stored inline"
+                      "5:otherd1:ai1e1:b2:bbee";
+  const char * json = "{\"list\":[1,2,3],\"other\":{\"a\":1}}";
+  const tr_quark key_list = tr_quark_new ("list", 4);
+  const tr_quark key_name = tr_quark_new ("name", 4);
+  const tr_quark key_other = tr_quark_new ("other", 5);
+  const tr_quark key_heap = tr_quark_new ("heap", 4);
+
+  arena = tr_variantArenaNew ();
+  check_int_eq (0, tr_variantArenaSize (arena));
+
+  /* a parsed tree comes out the same as it went in */
+  check (!tr_variantFromBufArena (&top, TR_VARIANT_FMT_BENC, benc, strlen (benc), NULL, NULL, arena));
+  check (tr_variantArenaSize (arena) > 0);
+  check (tr_variantDictFindStr (&top, key_name, &strVal, &strLen));
+  check_int_eq (strlen (long_str), strLen);
+  check_streq (long_str, strVal);
+  str = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+  check_streq (benc, str);
+  tr_free (str);
+
+  /* so does a JSON one */
+  tr_variantArenaClear (arena);
+  check (!tr_variantFromBufArena (&top, TR_VARIANT_FMT_JSON, json, strlen (json), NULL, NULL, arena));
+  check (tr_variantDictFindList (&top, key_list, &list));
+  check_int_eq (3, tr_variantListSize (list));
+  check (tr_variantDictFindDict (&top, key_other, &dict));
+  check (tr_variantDictFindInt (dict, tr_quark_new ("a", 1), &intVal));
+  check_int_eq (1, intVal);
+
+  /* Clear keeps the memory for the next tree */
+  size = tr_variantArenaSize (arena);
+  tr_variantArenaClear (arena);
+  check (tr_variantArenaSize (arena) <= size);
+
+  /* trees built with the helpers stay in the arena, even as they grow */
+  tr_variantInitDictArena (&top, 0, arena);
+  list = tr_variantDictAddList (&top, key_list, 0);
+  for (i=0; i<10000; ++i)
+    tr_variantListAddInt (list, i);
+  for (i=0; i<100; ++i)
+    tr_variantListAddStr (tr_variantListAddList (list, 1), long_str);
+  tr_variantDictAddStr (&top, key_name, long_str);
+  dict = tr_variantDictAddDict (&top, key_other, 0);
+  tr_variantDictAddRaw (dict, key_name, long_str, strlen (long_str));
+  check (tr_variantDictRemove (dict, key_name));
+  check (tr_variantListRemove (list, 0));
+  check_int_eq (10099, tr_variantListSize (list));
+  check (tr_variantGetInt (tr_variantListChild (list, 9998), &intVal));
+  check_int_eq (9999, intVal);
+  check (tr_variantGetStr (tr_variantListChild (tr_variantListChild (list, 10098), 0), &strVal, NULL));
+  check_streq (long_str, strVal);
+
+  /* a child that's initialized directly is on the heap, and tr_variantFree () handles the mix */
+  tr_variantInitStr (tr_variantDictAdd (&top, key_heap), long_str, -1);
+  check (tr_variantDictFindStr (&top, key_heap, &strVal, NULL));
+  check_streq (long_str, strVal);
+  tr_variantFree (&top);
+
+  tr_variantArenaFree (arena);
+  return 0;
+}
+
 int
 main (void)
 {
@@ -537,6 +615,7 @@ main (void)
                                     testMerge,
                                     testBool,
                                     testParse2,
+                                    testArena,
                                     testStackSmash };
   return runTests (tests, NUM_TESTS (tests));
 }
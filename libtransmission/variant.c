@@ -47,16 +47,6 @@ tr_variantIsContainer (const tr_variant * v)
   return tr_variantIsList (v) || tr_variantIsDict (v);
 }
 
-static bool
-tr_variantIsSomething (const tr_variant * v)
-{
-  return tr_variantIsContainer (v)
-      || tr_variantIsInt (v)
-      || tr_variantIsString (v)
-      || tr_variantIsReal (v)
-      || tr_variantIsBool (v);
-}
-
 void
 tr_variantInit (tr_variant * v, char type)
 {
@@ -64,6 +54,192 @@ tr_variantInit (tr_variant * v, char type)
   memset (&v->val, 0, sizeof(v->val));
 }
 
+/***
+****  Arenas
+***/
+
+enum
+{
+  /* the first chunk's size. each new chunk is twice as big, up to the max */
+  ARENA_MIN_CHUNK = 4096,
+  ARENA_MAX_CHUNK = 1024 * 1024
+};
+
+/* align allocations well enough for a tr_variant */
+#define ARENA_ALIGN(n) (((n) + 7u) & ~(size_t)7u)
+
+struct arena_chunk
+{
+  struct arena_chunk * next;
+  size_t size;
+  size_t used;
+};
+
+struct tr_variant_arena
+{
+  /* the first chunk is the one that's being allocated from */
+  struct arena_chunk * chunks;
+  size_t next_size;
+};
+
+static inline char *
+chunkData (struct arena_chunk * chunk)
+{
+  return (char*)(chunk + 1);
+}
+
+static void *
+arenaAlloc (tr_variant_arena * arena, size_t size)
+{
+  struct arena_chunk * chunk = arena->chunks;
+
+  size = ARENA_ALIGN (size);
+
+  if ((chunk == NULL) || (chunk->used + size > chunk->size))
+    {
+      if (size > arena->next_size / 4)
+        {
+          /* give big blocks their own chunk, behind the current one,
+             so that the rest of the current chunk still gets used */
+          struct arena_chunk * big = tr_malloc (sizeof (struct arena_chunk) + size);
+          big->size = size;
+          big->used = size;
+
+          if (chunk == NULL)
+            {
+              big->next = NULL;
+              arena->chunks = big;
+            }
+          else
+            {
+              big->next = chunk->next;
+              chunk->next = big;
+            }
+
+          return chunkData (big);
+        }
+
+      chunk = tr_malloc (sizeof (struct arena_chunk) + arena->next_size);
+      chunk->size = arena->next_size;
+      chunk->used = 0;
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+      arena->next_size = MIN (arena->next_size * 2, ARENA_MAX_CHUNK);
+    }
+
+  chunk->used += size;
+  return chunkData (chunk) + chunk->used - size;
+}
+
+static void *
+arenaRealloc (tr_variant_arena * arena, void * ptr, size_t old_size, size_t new_size)
+{
+  int i;
+  void * ret;
+  struct arena_chunk ** link;
+  struct arena_chunk * chunk = arena->chunks;
+
+  old_size = ARENA_ALIGN (old_size);
+  new_size = ARENA_ALIGN (new_size);
+
+  /* if ptr was the last thing allocated and there's room, grow it in place.
+     lists of numbers are built this way, so they don't get copied as they grow */
+  if ((ptr != NULL)
+      && (chunk != NULL)
+      && ((char*)ptr + old_size == chunkData (chunk) + chunk->used)
+      && (chunk->used - old_size + new_size <= chunk->size))
+    {
+      chunk->used += new_size - old_size;
+      return ptr;
+    }
+
+  /* if ptr has a chunk to itself, as big blocks do, let the heap resize
+     the chunk. the newest big chunk is first or second in the list */
+  for (i=0, link=&arena->chunks; (i<2) && (*link!=NULL); ++i, link=&(*link)->next)
+    {
+      chunk = *link;
+
+      if ((ptr == chunkData (chunk)) && (chunk->used == old_size))
+        {
+          struct arena_chunk * grown;
+
+          grown = (struct arena_chunk*) tr_renew (char, chunk, sizeof (struct arena_chunk) + new_size);
+          if (grown == NULL) /* the old chunk is still intact */
+            break;
+
+          grown->size = new_size;
+          grown->used = new_size;
+          *link = grown;
+          return chunkData (grown);
+        }
+    }
+
+  ret = arenaAlloc (arena, new_size);
+  if (old_size > 0)
+    memcpy (ret, ptr, old_size);
+  return ret;
+}
+
+tr_variant_arena *
+tr_variantArenaNew (void)
+{
+  tr_variant_arena * arena = tr_new0 (tr_variant_arena, 1);
+  arena->next_size = ARENA_MIN_CHUNK;
+  return arena;
+}
+
+void
+tr_variantArenaClear (tr_variant_arena * arena)
+{
+  struct arena_chunk * walk;
+  struct arena_chunk * keep = NULL;
+
+  /* keep the biggest chunk for the next tree, unless it's huge */
+  for (walk=arena->chunks; walk!=NULL; walk=walk->next)
+    if ((walk->size <= ARENA_MAX_CHUNK) && ((keep == NULL) || (walk->size > keep->size)))
+      keep = walk;
+
+  walk = arena->chunks;
+  while (walk != NULL)
+    {
+      struct arena_chunk * next = walk->next;
+      if (walk != keep)
+        tr_free (walk);
+      walk = next;
+    }
+
+  if (keep != NULL)
+    {
+      keep->next = NULL;
+      keep->used = 0;
+    }
+
+  arena->chunks = keep;
+}
+
+void
+tr_variantArenaFree (tr_variant_arena * arena)
+{
+  if (arena != NULL)
+    {
+      tr_variantArenaClear (arena);
+      tr_free (arena->chunks);
+      tr_free (arena);
+    }
+}
+
+size_t
+tr_variantArenaSize (const tr_variant_arena * arena)
+{
+  size_t size = 0;
+  const struct arena_chunk * walk;
+
+  for (walk=arena->chunks; walk!=NULL; walk=walk->next)
+    size += sizeof (struct arena_chunk) + walk->size;
+
+  return size;
+}
+
 /***
 ****
 ***/
@@ -96,6 +272,7 @@ tr_variant_string_get_string (const struct tr_variant_string * str)
       case TR_STRING_TYPE_BUF: ret = str->str.buf; break;
       case TR_STRING_TYPE_HEAP: ret = str->str.str; break;
       case TR_STRING_TYPE_QUARK: ret = str->str.str; break;
+      case TR_STRING_TYPE_ARENA: ret = str->str.str; break;
       default: ret = NULL;
     }
 
@@ -113,10 +290,12 @@ tr_variant_string_set_quark (struct tr_variant_string  * str,
   str->str.str = tr_quark_get_string (quark, &str->len);
 }
 
+/* if arena isn't NULL, long strings are copied into it instead of the heap */
 static void
 tr_variant_string_set_string (struct tr_variant_string  * str,
                               const char                * bytes,
-                              int                         len)
+                              int                         len,
+                              tr_variant_arena          * arena)
 {
   tr_variant_string_clear (str);
 
@@ -134,10 +313,10 @@ tr_variant_string_set_string (struct tr_variant_string  * str,
     }
   else
     {
-      char * tmp = tr_new (char, len+1);
+      char * tmp = arena != NULL ? arenaAlloc (arena, len+1) : tr_new (char, len+1);
       memcpy (tmp, bytes, len);
       tmp[len] = '\0';
-      str->type = TR_STRING_TYPE_HEAP;
+      str->type = arena != NULL ? TR_STRING_TYPE_ARENA : TR_STRING_TYPE_HEAP;
       str->str.str = tmp;
       str->len = len;
     }
@@ -394,8 +573,7 @@ tr_variantDictFindRaw (tr_variant      * dict,
 void
 tr_variantInitRaw (tr_variant * v, const void * src, size_t byteCount)
 {
-  tr_variantInit (v, TR_VARIANT_TYPE_STR);
-  tr_variant_string_set_string (&v->val.s, src, byteCount);
+  tr_variantInitStrArena (v, src, byteCount, NULL);
 }
 
 void
@@ -407,9 +585,15 @@ tr_variantInitQuark (tr_variant * v, const tr_quark q)
 
 void
 tr_variantInitStr (tr_variant * v, const void * str, int len)
+{
+  tr_variantInitStrArena (v, str, len, NULL);
+}
+
+void
+tr_variantInitStrArena (tr_variant * v, const void * str, int len, tr_variant_arena * arena)
 {
   tr_variantInit (v, TR_VARIANT_TYPE_STR);
-  tr_variant_string_set_string (&v->val.s, str, len);
+  tr_variant_string_set_string (&v->val.s, str, len, arena);
 }
 
 void
@@ -435,8 +619,15 @@ tr_variantInitInt (tr_variant * v, int64_t value)
 
 void
 tr_variantInitList (tr_variant * v, size_t reserve_count)
+{
+  tr_variantInitListArena (v, reserve_count, NULL);
+}
+
+void
+tr_variantInitListArena (tr_variant * v, size_t reserve_count, tr_variant_arena * arena)
 {
   tr_variantInit (v, TR_VARIANT_TYPE_LIST);
+  v->val.l.arena = arena;
   tr_variantListReserve (v, reserve_count);
 }
 
@@ -454,7 +645,13 @@ containerReserve (tr_variant * v, size_t count)
       while (n < needed)
         n *= 2u;
 
-      v->val.l.vals = tr_renew (tr_variant, v->val.l.vals, n);
+      if (v->val.l.arena != NULL)
+        v->val.l.vals = arenaRealloc (v->val.l.arena, v->val.l.vals,
+                                      v->val.l.alloc * sizeof (tr_variant),
+                                      n * sizeof (tr_variant));
+      else
+        v->val.l.vals = tr_renew (tr_variant, v->val.l.vals, n);
+
       v->val.l.alloc = n;
     }
 }
@@ -468,8 +665,15 @@ tr_variantListReserve (tr_variant * list, size_t count)
 
 void
 tr_variantInitDict (tr_variant * v, size_t reserve_count)
+{
+  tr_variantInitDictArena (v, reserve_count, NULL);
+}
+
+void
+tr_variantInitDictArena (tr_variant * v, size_t reserve_count, tr_variant_arena * arena)
 {
   tr_variantInit (v, TR_VARIANT_TYPE_DICT);
+  v->val.l.arena = arena;
   tr_variantDictReserve (v, reserve_count);
 }
 
@@ -528,7 +732,7 @@ tr_variantListAddStr (tr_variant  * list,
                       const char  * val)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitStr (child, val, -1);
+  tr_variantInitStrArena (child, val, -1, list->val.l.arena);
   return child;
 }
 
@@ -547,7 +751,7 @@ tr_variantListAddRaw (tr_variant  * list,
                       size_t        len)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitRaw (child, val, len);
+  tr_variantInitStrArena (child, val, len, list->val.l.arena);
   return child;
 }
 
@@ -556,7 +760,7 @@ tr_variantListAddList (tr_variant  * list,
                        size_t        reserve_count)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitList (child, reserve_count);
+  tr_variantInitListArena (child, reserve_count, list->val.l.arena);
   return child;
 }
 
@@ -565,7 +769,7 @@ tr_variantListAddDict (tr_variant  * list,
                        size_t        reserve_count)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitDict (child, reserve_count);
+  tr_variantInitDictArena (child, reserve_count, list->val.l.arena);
   return child;
 }
 
@@ -657,7 +861,7 @@ tr_variantDictAddStr (tr_variant      * dict,
                       const char      * val)
 {
   tr_variant * child = dictFindOrAdd (dict, key, TR_VARIANT_TYPE_STR);
-  tr_variantInitStr (child, val, -1);
+  tr_variantInitStrArena (child, val, -1, dict->val.l.arena);
   return child;
 }
 
@@ -668,7 +872,7 @@ tr_variantDictAddRaw (tr_variant      * dict,
                       size_t            len)
 {
   tr_variant * child = dictFindOrAdd (dict, key, TR_VARIANT_TYPE_STR);
-  tr_variantInitRaw (child, src, len);
+  tr_variantInitStrArena (child, src, len, dict->val.l.arena);
   return child;
 }
 
@@ -678,7 +882,7 @@ tr_variantDictAddList (tr_variant     * dict,
                        size_t           reserve_count)
 {
   tr_variant * child = tr_variantDictAdd (dict, key);
-  tr_variantInitList (child, reserve_count);
+  tr_variantInitListArena (child, reserve_count, dict->val.l.arena);
   return child;
 }
 
@@ -688,7 +892,7 @@ tr_variantDictAddDict (tr_variant     * dict,
                        size_t           reserve_count)
 {
   tr_variant * child = tr_variantDictAdd (dict, key);
-  tr_variantInitDict (child, reserve_count);
+  tr_variantInitDictArena (child, reserve_count, dict->val.l.arena);
   return child;
 }
 
@@ -914,7 +1118,8 @@ freeStringFunc (const tr_variant * v, void * unused UNUSED)
 static void
 freeContainerEndFunc (const tr_variant * v, void * unused UNUSED)
 {
-  tr_free (v->val.l.vals);
+  if (v->val.l.arena == NULL)
+    tr_free (v->val.l.vals);
 }
 
 static const struct VariantWalkFuncs freeWalkFuncs = { freeDummyFunc,
@@ -928,8 +1133,11 @@ static const struct VariantWalkFuncs freeWalkFuncs = { freeDummyFunc,
 void
 tr_variantFree (tr_variant * v)
 {
-  if (tr_variantIsSomething (v))
+  /* strings and numbers don't need a walk */
+  if (tr_variantIsContainer (v))
     tr_variantWalk (v, &freeWalkFuncs, NULL, false);
+  else if (tr_variantIsString (v))
+    freeStringFunc (v, NULL);
 }
 
 /***
@@ -1242,6 +1450,15 @@ int
 tr_variantFromFile (tr_variant      * setme,
                     tr_variant_fmt    fmt,
                     const char      * filename)
+{
+  return tr_variantFromFileArena (setme, fmt, filename, NULL);
+}
+
+int
+tr_variantFromFileArena (tr_variant        * setme,
+                         tr_variant_fmt      fmt,
+                         const char        * filename,
+                         tr_variant_arena  * arena)
 {
   int err;
   size_t buflen;
@@ -1254,7 +1471,7 @@ tr_variantFromFile (tr_variant      * setme,
   if (errno)
     err = errno;
   else
-    err = tr_variantFromBuf (setme, fmt, buf, buflen, filename, NULL);
+    err = tr_variantFromBufArena (setme, fmt, buf, buflen, filename, NULL, arena);
 
   tr_free (buf);
   errno = old_errno;
@@ -1268,6 +1485,18 @@ tr_variantFromBuf (tr_variant      * setme,
                    size_t            buflen,
                    const char      * optional_source,
                    const char     ** setme_end)
+{
+  return tr_variantFromBufArena (setme, fmt, buf, buflen, optional_source, setme_end, NULL);
+}
+
+int
+tr_variantFromBufArena (tr_variant        * setme,
+                        tr_variant_fmt      fmt,
+                        const void        * buf,
+                        size_t              buflen,
+                        const char        * optional_source,
+                        const char       ** setme_end,
+                        tr_variant_arena  * arena)
 {
   int err;
   char lc_numeric[128];
@@ -1280,11 +1509,11 @@ tr_variantFromBuf (tr_variant      * setme,
     {
       case TR_VARIANT_FMT_JSON:
       case TR_VARIANT_FMT_JSON_LEAN:
-        err = tr_jsonParse (optional_source, buf, buflen, setme, setme_end);
+        err = tr_jsonParse (optional_source, buf, buflen, setme, setme_end, arena);
         break;
 
       case TR_VARIANT_FMT_BENC:
-        err = tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, setme_end);
+        err = tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, setme_end, arena);
         break;
     }
 
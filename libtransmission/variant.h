@@ -21,6 +21,7 @@ extern "C" {
 #include "quark.h"
 
 struct evbuffer;
+struct tr_variant_arena;
 
 /**
  * @addtogroup tr_variant Variant
@@ -38,7 +39,8 @@ typedef enum
 {
   TR_STRING_TYPE_QUARK,
   TR_STRING_TYPE_HEAP,
-  TR_STRING_TYPE_BUF
+  TR_STRING_TYPE_BUF,
+  TR_STRING_TYPE_ARENA
 }
 tr_string_type;
 
@@ -91,6 +93,7 @@ typedef struct tr_variant
           size_t alloc;
           size_t count;
           struct tr_variant * vals;
+          struct tr_variant_arena * arena; /* if not NULL, vals lives here */
         } l;
     }
   val;
@@ -183,6 +186,21 @@ tr_variantFromJson (tr_variant  * setme,
                             NULL,
                             NULL);
 }
+
+/* like tr_variantFromBuf (), but if arena isn't NULL the tree is built in it */
+int tr_variantFromBufArena (tr_variant              * setme,
+                            tr_variant_fmt            fmt,
+                            const void              * buf,
+                            size_t                    buflen,
+                            const char              * optional_source,
+                            const char             ** setme_end,
+                            struct tr_variant_arena * arena);
+
+int tr_variantFromFileArena (tr_variant              * setme,
+                             tr_variant_fmt            fmt,
+                             const char              * filename,
+                             struct tr_variant_arena * arena);
+
 static inline bool
 tr_variantIsType (const tr_variant * b, int type)
 {
@@ -416,6 +434,129 @@ bool         tr_variantDictFindRaw     (tr_variant       * dict,
 void         tr_variantMergeDicts      (tr_variant       * dict_target,
                                         const tr_variant * dict_source);
 
+/***
+****  Arenas
+****
+****  A tr_variant_arena holds a whole tree in a few big chunks instead of
+****  a heap block per container and per long string, and frees it all at
+****  once. This is for short-lived trees like parsed files, RPC requests,
+****  and RPC responses.
+****
+****  A container that's initialized in an arena keeps its children there.
+****  Values added to it with the tr_variantListAdd* () and
+****  tr_variantDictAdd* () helpers live in the arena too, so such a tree
+****  is freed by tr_variantArenaFree () alone and needs no tr_variantFree ().
+****  A child that's initialized directly, such as with
+****  tr_variantInitStr (tr_variantDictAdd (dict, key), ...), is still on
+****  the heap and still needs tr_variantFree (); calling tr_variantFree ()
+****  on a tree in an arena is always safe.
+****
+****  Arenas aren't thread-safe.
+***/
+
+typedef struct tr_variant_arena tr_variant_arena;
+
+tr_variant_arena * tr_variantArenaNew (void);
+
+/** @brief free the arena and every tree built in it */
+void         tr_variantArenaFree       (tr_variant_arena * arena);
+
+/** @brief free every tree built in the arena, but keep its biggest chunk for reuse */
+void         tr_variantArenaClear      (tr_variant_arena * arena);
+
+/** @brief how many bytes the arena has taken from the heap */
+size_t       tr_variantArenaSize       (const tr_variant_arena * arena);
+
+/* like tr_variantInitList (), but if arena isn't NULL the list lives in it */
+void         tr_variantInitListArena   (tr_variant       * list,
+                                        size_t             reserve_count,
+                                        tr_variant_arena * arena);
+
+/* like tr_variantInitDict (), but if arena isn't NULL the dict lives in it */
+void         tr_variantInitDictArena   (tr_variant       * dict,
+                                        size_t             reserve_count,
+                                        tr_variant_arena * arena);
+
+/***
+****  Writing JSON directly, without building a tr_variant first.
+****
+****  This is for big outputs like RPC responses: they're written into
+****  the evbuffer as they're generated, so the whole tree never has to
+****  be held in memory at once.
+***/
+
+typedef struct tr_json_writer tr_json_writer;
+
+/**
+ * @brief start writing JSON into `out'
+ * @param lean if true, omit all whitespace. Otherwise indent as tr_variantToBuf () does
+ * @param gzip if true, `out' gets the gzipped JSON, compressed as it's written.
+ *             This is ignored if libtransmission was built without zlib
+ */
+tr_json_writer * tr_jsonWriterNew  (struct evbuffer * out, bool lean, bool gzip);
+
+/** @brief finish the output, such as flushing the gzip stream, and free the writer */
+void         tr_jsonWriterFree     (tr_json_writer   * w);
+
+void         tr_jsonBeginDict      (tr_json_writer   * w);
+
+void         tr_jsonBeginList      (tr_json_writer   * w);
+
+/** @brief close the innermost dict or list */
+void         tr_jsonEnd            (tr_json_writer   * w);
+
+/** @brief in a dict, write a key. Its value is whatever's written next */
+void         tr_jsonKey            (tr_json_writer   * w,
+                                    const tr_quark     key);
+
+void         tr_jsonInt            (tr_json_writer   * w,
+                                    int64_t            i);
+
+void         tr_jsonReal           (tr_json_writer   * w,
+                                    double             d);
+
+void         tr_jsonBool           (tr_json_writer   * w,
+                                    bool               b);
+
+/* if len is negative, str's length is found with strlen () */
+void         tr_jsonStr            (tr_json_writer   * w,
+                                    const char       * str,
+                                    int                len);
+
+void         tr_jsonVariant        (tr_json_writer   * w,
+                                    const tr_variant * v);
+
+/**
+ * @brief write one complete JSON value that's already been serialized,
+ *        such as by another lean tr_json_writer. `json' is drained.
+ */
+void         tr_jsonRawValue       (tr_json_writer   * w,
+                                    struct evbuffer  * json);
+
+void         tr_jsonDictAddInt     (tr_json_writer   * w,
+                                    const tr_quark     key,
+                                    int64_t            i);
+
+void         tr_jsonDictAddReal    (tr_json_writer   * w,
+                                    const tr_quark     key,
+                                    double             d);
+
+void         tr_jsonDictAddBool    (tr_json_writer   * w,
+                                    const tr_quark     key,
+                                    bool               b);
+
+void         tr_jsonDictAddStr     (tr_json_writer   * w,
+                                    const tr_quark     key,
+                                    const char       * str);
+
+/** @brief write a key and open a dict as its value. Close it with tr_jsonEnd () */
+void         tr_jsonDictAddDict    (tr_json_writer   * w,
+                                    const tr_quark     key);
+
+/** @brief write a key and open a list as its value. Close it with tr_jsonEnd () */
+void         tr_jsonDictAddList    (tr_json_writer   * w,
+                                    const tr_quark     key);
+
 /***
 ****
 ****
@@ -23,6 +23,7 @@
 #include "transmission.h"
 #include "completion.h"
 #include "fdlimit.h"
+#include "inout.h" /* tr_ioFindFileLocation () */
 #include "list.h"
 #include "log.h"
 #include "platform.h" /* tr_lock () */
@@ -36,44 +37,144 @@
 
 enum
 {
-  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100,
+
+  /* how much data a worker hashes before going back for more work.
+   * large torrents are split into chunks of about this size so that
+   * several workers can verify different parts of them at once */
+  VERIFY_CHUNK_SIZE = (1024 * 1024 * 4),
+
+  /* sanity cap on the "verify-threads" setting */
+  MAX_VERIFY_THREADS = 64
 };
 
+struct verify_node
+{
+  tr_torrent          * torrent;
+  tr_verify_done_func   callback_func;
+  void                * callback_data;
+  uint64_t              current_size;
+
+  /* these fields are used once the node is being verified */
+  tr_piece_index_t      next_piece;
+  tr_piece_index_t      pieces_per_chunk;
+  int                   worker_count;
+  bool                  changed;
+  time_t                begin;
+
+  /* read by the workers without the verify lock, so use
+   * isNodeStopped () and stopNode () to get at it */
+  bool                  stop;
+};
+
+/* torrents waiting to be verified, sorted by compareVerifyByPriorityAndSize */
+static tr_list * verifyList = NULL;
+
+/* torrents being verified, in the order they were started */
+static tr_list * activeList = NULL;
+
+static int workerCount = 0;
+
+static tr_lock*
+getVerifyLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
 static bool
-verifyTorrent (tr_torrent * tor, bool * stopFlag)
+isNodeStopped (const struct verify_node * node)
+{
+  return __atomic_load_n (&node->stop, __ATOMIC_ACQUIRE);
+}
+
+static void
+stopNode (struct verify_node * node)
+{
+  __atomic_store_n (&node->stop, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Update the torrent's completion with the results for pieces [first..end).
+ * Workers call this once per chunk rather than once per piece so that
+ * they don't keep taking the verify lock away from each other.
+ */
+static void
+savePieces (struct verify_node  * node,
+            tr_piece_index_t      first,
+            tr_piece_index_t      end,
+            const bool          * hasPieces)
+{
+  tr_piece_index_t i;
+  tr_torrent * tor = node->torrent;
+
+  if (first >= end)
+    return;
+
+  /* other workers may be updating this torrent's completion too */
+  tr_lockLock (getVerifyLock ());
+  for (i=first; i<end; ++i)
+    {
+      const bool hasPiece = hasPieces[i - first];
+      const bool hadPiece = tr_cpPieceIsComplete (&tor->completion, i);
+
+      if (hasPiece || hadPiece)
+        {
+          tr_torrentSetHasPiece (tor, i, hasPiece);
+          node->changed |= hasPiece != hadPiece;
+        }
+      tr_torrentSetPieceChecked (tor, i);
+    }
+  tor->anyDate = tr_time ();
+  tr_lockUnlock (getVerifyLock ());
+
+  tr_torrentSetChanged (tor);
+}
+
+/**
+ * Hash pieces [first..last) of the node's torrent.
+ * This is called without the verify lock held.
+ */
+static void
+verifyPieces (struct verify_node  * node,
+              tr_piece_index_t      first,
+              tr_piece_index_t      last,
+              uint8_t             * buffer,
+              size_t                buflen,
+              time_t              * lastSleptAt)
 {
-  time_t end;
   SHA_CTX sha;
   int fd = -1;
-  int64_t filePos = 0;
-  bool changed = 0;
-  bool hadPiece = 0;
-  time_t lastSleptAt = 0;
+  uint64_t filePos;
   uint32_t piecePos = 0;
-  tr_file_index_t fileIndex = 0;
-  tr_file_index_t prevFileIndex = !fileIndex;
-  tr_piece_index_t pieceIndex = 0;
-  const time_t begin = tr_time ();
-  const size_t buflen = 1024 * 128; /* 128 KiB buffer */
-  uint8_t * buffer = tr_valloc (buflen);
+  tr_file_index_t fileIndex;
+  tr_file_index_t prevFileIndex;
+  tr_piece_index_t pieceIndex = first;
+  tr_torrent * tor = node->torrent;
+  bool * hasPieces;
+
+  if (first >= last)
+    return;
+
+  hasPieces = tr_new (bool, last - first);
+  tr_ioFindFileLocation (tor, first, 0, &fileIndex, &filePos);
+  prevFileIndex = !fileIndex;
 
   SHA1_Init (&sha);
 
-  tr_logAddTorDbg (tor, "%s", "verifying torrent...");
-  tr_torrentSetChecked (tor, 0);
-  while (!*stopFlag && (pieceIndex < tor->info.pieceCount))
+  while (!isNodeStopped (node) && (pieceIndex < last))
     {
       uint32_t leftInPiece;
       uint32_t bytesThisPass;
       uint64_t leftInFile;
       const tr_file * file = &tor->info.files[fileIndex];
 
-      /* if we're starting a new piece... */
-      if (piecePos == 0)
-        hadPiece = tr_cpPieceIsComplete (&tor->completion, pieceIndex);
-
       /* if we're starting a new file... */
-      if (!filePos && (fd<0) && (fileIndex!=prevFileIndex))
+      if ((fd<0) && (fileIndex!=prevFileIndex))
         {
           char * filename = tr_torrentFindFile (tor, fileIndex);
           fd = filename == NULL ? -1 : tr_open_file_for_scanning (filename);
@@ -110,28 +211,17 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
       /* if we're finishing a piece... */
       if (leftInPiece == 0)
         {
-          time_t now;
-          bool hasPiece;
+          const time_t now = tr_time ();
           uint8_t hash[SHA_DIGEST_LENGTH];
 
           SHA1_Final (hash, &sha);
-          hasPiece = !memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH);
-
-          if (hasPiece || hadPiece)
-            {
-              tr_torrentSetHasPiece (tor, pieceIndex, hasPiece);
-              changed |= hasPiece != hadPiece;
-            }
-
-          tr_torrentSetPieceChecked (tor, pieceIndex);
-          now = tr_time ();
-          tor->anyDate = now;
+          hasPieces[pieceIndex - first] = !memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH);
 
           /* sleeping even just a few msec per second goes a long
            * way towards reducing IO load... */
-          if (lastSleptAt != now)
+          if (*lastSleptAt != now)
             {
-              lastSleptAt = now;
+              *lastSleptAt = now;
               tr_wait_msec (MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
             }
 
@@ -153,87 +243,145 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
         }
     }
 
+  /* save whatever got hashed, even if we were stopped partway */
+  savePieces (node, first, pieceIndex, hasPieces);
+
   /* cleanup */
   if (fd >= 0)
     tr_close_file (fd);
-  free (buffer);
-
-  /* stopwatch */
-  end = tr_time ();
-  tr_logAddTorDbg (tor, "Verification is done. It took %d seconds to verify %"PRIu64" bytes (%"PRIu64" bytes per second)",
-             (int)(end-begin), tor->info.totalSize,
-             (uint64_t)(tor->info.totalSize/ (1+ (end-begin))));
-
-  return changed;
+  tr_free (hasPieces);
 }
 
 /***
 ****
 ***/
 
-struct verify_node
+static void
+startNode (struct verify_node * node)
 {
-  tr_torrent          * torrent;
-  tr_verify_done_func   callback_func;
-  void                * callback_data;
-  uint64_t              current_size;
-};
+  tr_torrent * tor = node->torrent;
+  const uint32_t pieceSize = MAX (1, tor->info.pieceSize);
 
-static struct verify_node currentNode;
-static tr_list * verifyList = NULL;
-static tr_thread * verifyThread = NULL;
-static bool stopCurrent = false;
+  node->next_piece = 0;
+  node->pieces_per_chunk = MAX (1, VERIFY_CHUNK_SIZE / pieceSize);
+  node->worker_count = 0;
+  node->changed = false;
+  node->stop = false; /* no workers have it yet */
+  node->begin = tr_time ();
 
-static tr_lock*
-getVerifyLock (void)
+  tr_logAddTorInfo (tor, "%s", _("Verifying torrent"));
+  tr_logAddTorDbg (tor, "%s", "verifying torrent...");
+  tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
+  tr_torrentSetChecked (tor, 0);
+}
+
+static void
+finishNode (struct verify_node * node)
 {
-  static tr_lock * lock = NULL;
+  tr_torrent * tor = node->torrent;
+  const time_t end = tr_time ();
 
-  if (lock == NULL)
-    lock = tr_lockNew ();
+  tr_logAddTorDbg (tor, "Verification is done. It took %d seconds to verify %"PRIu64" bytes (%"PRIu64" bytes per second)",
+             (int)(end-node->begin), tor->info.totalSize,
+             (uint64_t)(tor->info.totalSize/ (1+ (end-node->begin))));
 
-  return lock;
+  tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
+  assert (tr_isTorrent (tor));
+
+  if (!isNodeStopped (node) && node->changed)
+    tr_torrentSetDirty (tor);
+
+  if (node->callback_func)
+    (*node->callback_func)(tor, isNodeStopped (node), node->callback_data);
+}
+
+static bool
+nodeHasWorkLeft (const struct verify_node * node)
+{
+  return !isNodeStopped (node) && (node->next_piece < node->torrent->info.pieceCount);
+}
+
+/**
+ * Find the next range of pieces to hash.
+ *
+ * Torrents that are already being verified come first, so idle
+ * workers help finish a large torrent before starting the next one
+ * in verifyList. This must be called with the verify lock held.
+ */
+static struct verify_node *
+getNextWork (tr_piece_index_t * first, tr_piece_index_t * last)
+{
+  tr_list * l;
+  struct verify_node * node = NULL;
+
+  for (l=activeList; l!=NULL; l=l->next)
+    {
+      if (nodeHasWorkLeft (l->data))
+        {
+          node = l->data;
+          break;
+        }
+    }
+
+  if ((node == NULL) && (verifyList != NULL))
+    {
+      node = tr_list_pop_front (&verifyList);
+      tr_list_append (&activeList, node);
+      startNode (node);
+    }
+
+  if (node != NULL)
+    {
+      const tr_piece_index_t n = node->torrent->info.pieceCount;
+
+      *first = node->next_piece;
+      *last = MIN (n, *first + node->pieces_per_chunk);
+      node->next_piece = *last;
+      ++node->worker_count;
+    }
+
+  return node;
 }
 
 static void
 verifyThreadFunc (void * unused UNUSED)
 {
+  time_t lastSleptAt = 0;
+  const size_t buflen = 1024 * 128; /* 128 KiB buffer */
+  uint8_t * buffer = tr_valloc (buflen);
+  tr_lock * lock = getVerifyLock ();
+
+  tr_lockLock (lock);
+
   for (;;)
     {
-      int changed = 0;
-      tr_torrent * tor;
-      struct verify_node * node;
+      tr_piece_index_t first, last;
+      struct verify_node * node = getNextWork (&first, &last);
 
-      tr_lockLock (getVerifyLock ());
-      stopCurrent = false;
-      node = (struct verify_node*) verifyList ? verifyList->data : NULL;
       if (node == NULL)
-        {
-          currentNode.torrent = NULL;
-          break;
-        }
+        break;
 
-      currentNode = *node;
-      tor = currentNode.torrent;
-      tr_list_remove_data (&verifyList, node);
-      tr_free (node);
-      tr_lockUnlock (getVerifyLock ());
+      tr_lockUnlock (lock);
+      verifyPieces (node, first, last, buffer, buflen, &lastSleptAt);
+      tr_lockLock (lock);
 
-      tr_logAddTorInfo (tor, "%s", _("Verifying torrent"));
-      tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
-      changed = verifyTorrent (tor, &stopCurrent);
-      tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
-      assert (tr_isTorrent (tor));
-
-      if (!stopCurrent && changed)
-        tr_torrentSetDirty (tor);
+      /* the last worker out finishes up the torrent.
+       * it stays in activeList until its callback has been called
+       * so that tr_verifyRemove () knows to wait for it. */
+      if ((--node->worker_count == 0) && !nodeHasWorkLeft (node))
+        {
+          tr_lockUnlock (lock);
+          finishNode (node);
+          tr_lockLock (lock);
 
-      if (currentNode.callback_func)
-        (*currentNode.callback_func)(tor, stopCurrent, currentNode.callback_data);
+          tr_list_remove_data (&activeList, node);
+          tr_free (node);
+        }
     }
 
-  verifyThread = NULL;
-  tr_lockUnlock (getVerifyLock ());
+  --workerCount;
+  tr_lockUnlock (lock);
+  free (buffer);
 }
 
 static int
@@ -261,22 +409,29 @@ tr_verifyAdd (tr_torrent           * tor,
               tr_verify_done_func    callback_func,
               void                 * callback_data)
 {
+  int maxWorkers;
   struct verify_node * node;
 
   assert (tr_isTorrent (tor));
   tr_logAddTorInfo (tor, "%s", _("Queued for verification"));
 
-  node = tr_new (struct verify_node, 1);
+  node = tr_new0 (struct verify_node, 1);
   node->torrent = tor;
   node->callback_func = callback_func;
   node->callback_data = callback_data;
   node->current_size = tr_torrentGetCurrentSizeOnDisk (tor);
 
+  maxWorkers = tor->session->verifyThreadCount;
+  maxWorkers = MAX (1, MIN (maxWorkers, MAX_VERIFY_THREADS));
+
   tr_lockLock (getVerifyLock ());
   tr_torrentSetVerifyState (tor, TR_VERIFY_WAIT);
   tr_list_insert_sorted (&verifyList, node, compareVerifyByPriorityAndSize);
-  if (verifyThread == NULL)
-    verifyThread = tr_threadNew (verifyThreadFunc, NULL);
+  while (workerCount < maxWorkers)
+    {
+      ++workerCount;
+      tr_threadNew (verifyThreadFunc, NULL);
+    }
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -291,16 +446,18 @@ compareVerifyByTorrent (const void * va, const void * vb)
 void
 tr_verifyRemove (tr_torrent * tor)
 {
+  tr_list * l;
   tr_lock * lock = getVerifyLock ();
   tr_lockLock (lock);
 
   assert (tr_isTorrent (tor));
 
-  if (tor == currentNode.torrent)
+  if ((l = tr_list_find (activeList, tor, compareVerifyByTorrent)))
     {
-      stopCurrent = true;
+      stopNode (l->data);
 
-      while (stopCurrent)
+      /* wait for the workers to let go of it */
+      while (tr_list_find (activeList, tor, compareVerifyByTorrent))
         {
           tr_lockUnlock (lock);
           tr_wait_msec (100);
@@ -328,11 +485,23 @@ tr_verifyRemove (tr_torrent * tor)
 void
 tr_verifyClose (tr_session * session UNUSED)
 {
-  tr_lockLock (getVerifyLock ());
+  tr_list * l;
+  tr_lock * lock = getVerifyLock ();
+
+  tr_lockLock (lock);
 
-  stopCurrent = true;
+  for (l=activeList; l!=NULL; l=l->next)
+    stopNode (l->data);
   tr_list_free (&verifyList, tr_free);
 
-  tr_lockUnlock (getVerifyLock ());
-}
+  /* wait for the workers to finish up and exit, since the torrents
+   * they're looking at are about to be freed */
+  while (workerCount > 0)
+    {
+      tr_lockUnlock (lock);
+      tr_wait_msec (100);
+      tr_lockLock (lock);
+    }
 
+  tr_lockUnlock (lock);
+}
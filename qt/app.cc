@@ -179,6 +179,9 @@ MyApp :: MyApp (int& argc, char ** argv):
   connect (mySession, SIGNAL (torrentsRemoved (tr_variant*)), myModel, SLOT (removeTorrents (tr_variant*)));
   // when the session source gets changed, request a full refresh
   connect (mySession, SIGNAL (sourceChanged ()), this, SLOT (onSessionSourceChanged ()));
+  // when the session can tell us what changed, stop polling it and listen instead
+  connect (mySession, SIGNAL (watchingChanged (bool)), this, SLOT (onWatchingChanged (bool)));
+  connect (mySession, SIGNAL (changesPending (bool,bool)), this, SLOT (onChangesPending (bool,bool)));
   // when the model sees a torrent for the first time, ask the session for full info on it
   connect (myModel, SIGNAL (torrentsAdded (QSet<int>)), mySession, SLOT (initTorrents (QSet<int>)));
   connect (myModel, SIGNAL (torrentsAdded (QSet<int>)), this, SLOT (onTorrentsAdded (QSet<int>)));
@@ -402,6 +405,34 @@ MyApp :: onSessionSourceChanged ()
   mySession->initTorrents ();
   mySession->refreshSessionStats ();
   mySession->refreshSessionInfo ();
+  mySession->watchChanges ();
+}
+
+void
+MyApp :: onWatchingChanged (bool isWatching)
+{
+  // the stats aren't watched, since they're always changing,
+  // so myStatsTimer keeps polling them either way
+  if (isWatching)
+    {
+      myModelTimer.stop ();
+      mySessionTimer.stop ();
+    }
+  else
+    {
+      myModelTimer.start ();
+      mySessionTimer.start ();
+    }
+}
+
+void
+MyApp :: onChangesPending (bool torrentsChanged, bool sessionChanged)
+{
+  if (torrentsChanged)
+    mySession->refreshActiveTorrents ();
+
+  if (sessionChanged)
+    mySession->refreshSessionInfo ();
 }
 
 void
@@ -409,9 +440,14 @@ MyApp :: refreshTorrents ()
 {
   // usually we just poll the torrents that have shown recent activity,
   // but we also periodically ask for updates on the others to ensure
-  // nothing's falling through the cracks.
+  // nothing's falling through the cracks. Servers that track changes
+  // for us don't let anything fall through.
   const time_t now = time (NULL);
-  if (myLastFullUpdateTime + 60 >= now)
+
+  // if we lost the session's watch, try to get it back
+  mySession->watchChanges ();
+
+  if (mySession->hasTorrentChanges () || (myLastFullUpdateTime + 60 >= now))
     {
       mySession->refreshActiveTorrents ();
     }
@@ -60,6 +60,8 @@ class MyApp: public QApplication
     void onSessionSourceChanged ();
     void refreshPref (int key);
     void refreshTorrents ();
+    void onWatchingChanged (bool isWatching);
+    void onChangesPending (bool torrentsChanged, bool sessionChanged);
     void onTorrentsAdded (QSet<int>);
     void onTorrentCompleted (int);
     void onNewTorrentChanged (int);
@@ -64,6 +64,14 @@ namespace
 
     FIRST_UNIQUE_TAG
   };
+
+  enum
+  {
+    // how long session-watch waits for more changes after the first one.
+    // this keeps busy sessions from being refreshed more often than
+    // MyApp used to poll them
+    WATCH_WINDOW_MSEC = 3000
+  };
 }
 
 /***
@@ -255,6 +263,11 @@ Session :: updatePref (int key)
 Session :: Session (const char * configDir, Prefs& prefs):
   nextUniqueTag (FIRST_UNIQUE_TAG),
   myBlocklistSize (-1),
+  myTorrentsSeq (-1),
+  myWatchTag (-1),
+  myWatchSeq (-1),
+  myIsWatching (false),
+  myCanWatch (true),
   myPrefs (prefs),
   mySession (0),
   myConfigDir (QString::fromUtf8 (configDir)),
@@ -310,6 +323,11 @@ Session :: stop ()
     }
 
     myUrl.clear ();
+    myTorrentsSeq = -1;
+    myWatchTag = -1;
+    myWatchSeq = -1;
+    myCanWatch = true;
+    setWatching (false);
 
   if (mySession)
     {
@@ -409,6 +427,65 @@ namespace
           tr_variantListAddInt (idList, i);
       }
   }
+
+  void
+  copyVariant (tr_variant * initme, tr_variant * src)
+  {
+    bool b;
+    double d;
+    int64_t i;
+    size_t len;
+    const char * str;
+
+    if (tr_variantIsInt (src) && tr_variantGetInt (src, &i))
+      tr_variantInitInt (initme, i);
+    else if (tr_variantIsBool (src) && tr_variantGetBool (src, &b))
+      tr_variantInitBool (initme, b);
+    else if (tr_variantIsReal (src) && tr_variantGetReal (src, &d))
+      tr_variantInitReal (initme, d);
+    else if (tr_variantGetStr (src, &str, &len))
+      tr_variantInitStr (initme, str, len);
+    else if (tr_variantIsList (src))
+      {
+        const size_t n (tr_variantListSize (src));
+        tr_variantInitList (initme, n);
+        for (size_t j=0; j<n; ++j)
+          copyVariant (tr_variantListAdd (initme), tr_variantListChild (src, j));
+      }
+    else
+      {
+        tr_variantInitDict (initme, 0);
+        if (tr_variantIsDict (src))
+          tr_variantMergeDicts (initme, src);
+      }
+  }
+
+  // turns a "table" format torrent-get response into the usual list of dicts
+  void
+  tableToDicts (tr_variant * table, tr_variant * initme)
+  {
+    tr_variant * keys (tr_variantListChild (table, 0));
+    const size_t keyCount (tr_variantListSize (keys));
+    const size_t rowCount (tr_variantListSize (table));
+
+    tr_variantInitList (initme, rowCount);
+
+    for (size_t i=1; i<rowCount; ++i)
+      {
+        tr_variant * row (tr_variantListChild (table, i));
+        tr_variant * dict (tr_variantListAddDict (initme, keyCount));
+
+        for (size_t j=0; j<keyCount; ++j)
+          {
+            size_t len;
+            const char * str;
+            tr_variant * val (tr_variantListChild (row, j));
+
+            if ((val != 0) && tr_variantGetStr (tr_variantListChild (keys, j), &str, &len))
+              copyVariant (tr_variantDictAdd (dict, tr_quark_new (str, len)), val);
+          }
+      }
+  }
 }
 
 void
@@ -538,6 +615,7 @@ Session :: refreshTorrents (const QSet<int>& ids)
       tr_variantDictAddQuark (&top, TR_KEY_method, TR_KEY_torrent_get);
       tr_variantDictAddInt (&top, TR_KEY_tag, TAG_SOME_TORRENTS);
       tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 2));
+      tr_variantDictAddStr (args, TR_KEY_format, "table");
       addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys ());
       addOptionalIds (args, ids);
       exec (&top);
@@ -554,6 +632,7 @@ Session :: refreshExtraStats (const QSet<int>& ids)
   tr_variantDictAddInt (&top, TR_KEY_tag, TAG_SOME_TORRENTS);
   tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 2));
   addOptionalIds (args, ids);
+  tr_variantDictAddStr (args, TR_KEY_format, "table");
   addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys () + getExtraStatKeys ());
   exec (&top);
   tr_variantFree (&top);
@@ -588,7 +667,11 @@ Session :: refreshActiveTorrents ()
   tr_variantDictAddQuark (&top, TR_KEY_method, TR_KEY_torrent_get);
   tr_variantDictAddInt (&top, TR_KEY_tag, TAG_SOME_TORRENTS);
   tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 2));
-  tr_variantDictAddStr (args, TR_KEY_ids, "recently-active");
+  if (myTorrentsSeq >= 0)
+    tr_variantDictAddInt (args, TR_KEY_since, myTorrentsSeq);
+  else
+    tr_variantDictAddStr (args, TR_KEY_ids, "recently-active");
+  tr_variantDictAddStr (args, TR_KEY_format, "table");
   addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys ());
   exec (&top);
   tr_variantFree (&top);
@@ -601,7 +684,9 @@ Session :: refreshAllTorrents ()
   tr_variantInitDict (&top, 3);
   tr_variantDictAddQuark (&top, TR_KEY_method, TR_KEY_torrent_get);
   tr_variantDictAddInt (&top, TR_KEY_tag, TAG_ALL_TORRENTS);
-  tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 1));
+  tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 2));
+  tr_variantDictAddInt (args, TR_KEY_since, 0); // start tracking changes from here
+  tr_variantDictAddStr (args, TR_KEY_format, "table");
   addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys ());
   exec (&top);
   tr_variantFree (&top);
@@ -614,11 +699,79 @@ Session :: initTorrents (const QSet<int>& ids)
   const int tag (ids.isEmpty () ? TAG_ALL_TORRENTS : TAG_SOME_TORRENTS);
   tr_variant * args (buildRequest ("torrent-get", top, tag));
   addOptionalIds (args, ids);
+  if (ids.isEmpty ())
+    tr_variantDictAddInt (args, TR_KEY_since, 0); // start tracking changes from here
+  tr_variantDictAddStr (args, TR_KEY_format, "table");
   addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys ()+getInfoKeys ());
   exec (&top);
   tr_variantFree (&top);
 }
 
+void
+Session :: watchChanges ()
+{
+  // one at a time, and not with servers that can't
+  if ((myWatchTag >= 0) || !myCanWatch || (!mySession && myUrl.isEmpty ()))
+    return;
+
+  myWatchTag = getUniqueTag ();
+
+  tr_variant top;
+  tr_variantInitDict (&top, 3);
+  tr_variantDictAddStr (&top, TR_KEY_method, "session-watch");
+  tr_variantDictAddInt (&top, TR_KEY_tag, myWatchTag);
+  tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 3));
+  const int64_t since (myWatchSeq >= 0 ? myWatchSeq : myTorrentsSeq);
+  if (since >= 0)
+    tr_variantDictAddInt (args, TR_KEY_since, since);
+  // the first one comes right back, so that we know whether the server can do this
+  if (!myIsWatching)
+    tr_variantDictAddInt (args, TR_KEY_timeout, 0);
+  tr_variantDictAddInt (args, TR_KEY_window, WATCH_WINDOW_MSEC);
+  exec (&top);
+  tr_variantFree (&top);
+}
+
+void
+Session :: setWatching (bool watching)
+{
+  if (myIsWatching != watching)
+    {
+      myIsWatching = watching;
+      emit watchingChanged (watching);
+    }
+}
+
+void
+Session :: parseWatchResponse (const char * result, tr_variant * args)
+{
+  myWatchTag = -1;
+
+  if (!result || strcmp (result, "success") || !args)
+    {
+      // an older server that doesn't know session-watch. keep polling it
+      myCanWatch = false;
+      setWatching (false);
+      return;
+    }
+
+  int64_t seq;
+  tr_variant * list;
+  bool torrentsChanged (false);
+  bool sessionChanged (false);
+  if (tr_variantDictFindInt (args, TR_KEY_seq, &seq))
+    myWatchSeq = seq;
+  if (tr_variantDictFindList (args, TR_KEY_torrents, &list) && tr_variantListSize (list))
+    torrentsChanged = true;
+  if (tr_variantDictFindList (args, TR_KEY_removed, &list) && tr_variantListSize (list))
+    torrentsChanged = true;
+  tr_variantDictFindBool (args, TR_KEY_session_changed, &sessionChanged);
+
+  setWatching (true);
+  emit changesPending (torrentsChanged, sessionChanged);
+  watchChanges ();
+}
+
 void
 Session :: refreshSessionStats ()
 {
@@ -738,6 +891,20 @@ Session :: onFinished (QNetworkReply * reply)
     else if (reply->error () != QNetworkReply::NoError)
     {
         std::cerr << "http error: " << qPrintable (reply->errorString ()) << std::endl;
+
+        // if it was our watch that failed, go back to polling
+        tr_variant top;
+        int64_t tag;
+        const QByteArray requestData (reply->property (REQUEST_DATA_PROPERTY_KEY).toByteArray ());
+        if (!tr_variantFromJson (&top, requestData.constData (), requestData.size ()))
+        {
+            if (tr_variantDictFindInt (&top, TR_KEY_tag, &tag) && (tag == myWatchTag))
+            {
+                myWatchTag = -1;
+                setWatching (false);
+            }
+            tr_variantFree (&top);
+        }
     }
     else
     {
@@ -774,6 +941,9 @@ Session :: parseResponse (const char * json, size_t jsonLength)
 
         emit executed (tag, result, args);
 
+        if ((tag >= 0) && (tag == myWatchTag))
+            parseWatchResponse (result, args);
+
         tr_variant * torrents;
         const char * str;
 
@@ -784,8 +954,20 @@ Session :: parseResponse (const char * json, size_t jsonLength)
                 case TAG_SOME_TORRENTS:
                 case TAG_ALL_TORRENTS:
                     if (tr_variantDictFindDict (&top, TR_KEY_arguments, &args)) {
-                        if (tr_variantDictFindList (args, TR_KEY_torrents, &torrents))
-                            emit torrentsUpdated (torrents, tag==TAG_ALL_TORRENTS);
+                        int64_t seq;
+                        if (tr_variantDictFindInt (args, TR_KEY_seq, &seq))
+                            myTorrentsSeq = seq;
+                        if (tr_variantDictFindList (args, TR_KEY_torrents, &torrents)) {
+                            // servers that don't know the table format send dicts
+                            if (tr_variantIsList (tr_variantListChild (torrents, 0))) {
+                                tr_variant dicts;
+                                tableToDicts (torrents, &dicts);
+                                emit torrentsUpdated (&dicts, tag==TAG_ALL_TORRENTS);
+                                tr_variantFree (&dicts);
+                            } else {
+                                emit torrentsUpdated (torrents, tag==TAG_ALL_TORRENTS);
+                            }
+                        }
                         if (tr_variantDictFindList (args, TR_KEY_removed, &torrents))
                             emit torrentsRemoved (torrents);
                     }
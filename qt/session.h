@@ -73,10 +73,18 @@ class Session: public QObject
     /** returns true if isServer () is true or if the remote address is the localhost */
     bool isLocal () const;
 
+    /** returns true if refreshActiveTorrents () gets every change, not just recent activity */
+    bool hasTorrentChanges () const { return myTorrentsSeq >= 0; }
+
+    /** returns true if the session tells us when something changes, so that we needn't poll it */
+    bool isWatching () const { return myIsWatching; }
+
   private:
     void updateStats (struct tr_variant * args);
     void updateInfo (struct tr_variant * args);
     void parseResponse (const char * json, size_t len);
+    void parseWatchResponse (const char * result, struct tr_variant * args);
+    void setWatching (bool watching);
     static void localSessionCallback (tr_session *, struct evbuffer *, void *);
 
   public:
@@ -117,6 +125,7 @@ class Session: public QObject
     void refreshActiveTorrents ();
     void refreshAllTorrents ();
     void initTorrents (const QSet<int>& ids = QSet<int> ());
+    void watchChanges ();
     void addNewlyCreatedTorrent (const QString& filename, const QString& localPath);
     void addTorrent (const AddData& addme);
     void removeTorrents (const QSet<int>& torrentIds, bool deleteFiles=false);
@@ -142,6 +151,8 @@ class Session: public QObject
     void blocklistUpdated (int);
     void torrentsUpdated (struct tr_variant * torrentList, bool completeList);
     void torrentsRemoved (struct tr_variant * torrentList);
+    void watchingChanged (bool isWatching);
+    void changesPending (bool torrentsChanged, bool sessionChanged);
     void dataReadProgress ();
     void dataSendProgress ();
     void httpAuthenticationRequired ();
@@ -149,6 +160,11 @@ class Session: public QObject
   private:
     int64_t nextUniqueTag;
     int64_t myBlocklistSize;
+    int64_t myTorrentsSeq;
+    int64_t myWatchTag;
+    int64_t myWatchSeq;
+    bool myIsWatching;
+    bool myCanWatch;
     Prefs& myPrefs;
     tr_session * mySession;
     QString myConfigDir;
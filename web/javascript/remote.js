@@ -113,15 +113,74 @@ TransmissionRemote.prototype =
 		var o = {
 			method: 'torrent-get',
 				'arguments': {
-				'fields': fields
+				'fields': fields,
+				'format': 'table'
 			}
 		};
 		if (torrentIds)
 			o['arguments'].ids = torrentIds;
 		this.sendRequest(o, function(response) {
 			var args = response['arguments'];
-			callback.call(context,args.torrents,args.removed);
-		});
+			callback.call(context,this.tableToObjects(args.torrents),args.removed);
+		}, this);
+	},
+
+	// wait for the server to say what changed after `since'.
+	// a watch that fails calls `errback' instead of ajaxError(), since
+	// the caller can fall back to polling rather than giving up
+	watchChanges: function(since, timeout, window, callback, errback, context) {
+		var token,
+		    remote = this,
+		    o = {
+			method: 'session-watch',
+			'arguments': {
+				'timeout': timeout,
+				'window': window
+			}
+		    };
+		if (since !== undefined)
+			o['arguments'].since = since;
+
+		var ajaxSettings = {
+			url: RPC._Root,
+			type: 'POST',
+			contentType: 'json',
+			dataType: 'json',
+			cache: false,
+			data: JSON.stringify(o),
+			beforeSend: function(XHR){ remote.appendSessionId(XHR); },
+			error: function(request, error_string, exception){
+				if (request.status === 409 && (token = request.getResponseHeader('X-Transmission-Session-Id'))) {
+					remote._token = token;
+					$.ajax(ajaxSettings);
+					return;
+				}
+				errback.call(context);
+			},
+			success: callback,
+			context: context
+		};
+
+		$.ajax(ajaxSettings);
+	},
+
+	// turn a "table" torrent-get response back into one object per torrent.
+	// older servers ignore the format and send the objects themselves.
+	tableToObjects: function(torrents) {
+		var i, j, o, row, keys, objects;
+
+		if (!torrents || !torrents.length || !$.isArray(torrents[0]))
+			return torrents;
+
+		keys = torrents[0];
+		objects = [];
+		for (i=1; row=torrents[i]; ++i) {
+			o = {};
+			for (j=0; j<keys.length; ++j)
+				o[keys[j]] = row[j];
+			objects.push(o);
+		}
+		return objects;
 	},
 
 	getFreeSpace: function(dir, callback, context) {
@@ -105,6 +105,7 @@ Transmission.prototype =
 		this.initializeTorrents();
 		this.refreshTorrents();
 		this.togglePeriodicSessionRefresh(true);
+		this.watchChanges();
 
 		this.updateButtonsSoon();
 	},
@@ -811,9 +812,68 @@ Transmission.prototype =
 		// send a request right now
 		this.updateTorrents('recently-active', fields);
 
-		// schedule the next request
+		// schedule the next request, unless the server tells us when to
 		clearTimeout(this.refreshTorrentsTimeout);
-		this.refreshTorrentsTimeout = setTimeout(callback, msec);
+		if (!this.watching)
+			this.refreshTorrentsTimeout = setTimeout(callback, msec);
+	},
+
+	// ask the server to tell us when something changes instead of polling it.
+	// the first request comes right back, so we know whether it can.
+	watchChanges: function(since)
+	{
+		this.remote.watchChanges(since, this.watching ? 30 : 0,
+		                         this[Prefs._RefreshRate] * 1000,
+		                         this.onWatchResponse, this.onWatchError, this);
+	},
+
+	// the watch failed or timed out, so go back to polling and
+	// try to get it back later, waiting longer each time it fails
+	onWatchError: function()
+	{
+		var callback = $.proxy(this.watchChanges,this);
+
+		if (this.watching) {
+			this.watching = false;
+			this.refreshTorrents();
+			this.togglePeriodicSessionRefresh(true);
+		}
+
+		this.watchRetryMsec = Math.min((this.watchRetryMsec || 1000) * 2, 60000);
+		clearTimeout(this.watchRetryTimeout);
+		this.watchRetryTimeout = setTimeout(callback, this.watchRetryMsec);
+	},
+
+	onWatchResponse: function(response)
+	{
+		var args = response['arguments'],
+		    fields = ['id'].concat(Torrent.Fields.Stats);
+
+		// older servers don't know how, so keep polling them
+		if (response.result !== 'success') {
+			if (this.watching)
+				this.onWatchError();
+			return;
+		}
+
+		delete this.watchRetryMsec;
+
+		if (!this.watching) {
+			this.watching = true;
+			clearTimeout(this.refreshTorrentsTimeout);
+			this.togglePeriodicSessionRefresh(false);
+			// catch up on anything that changed before we started watching
+			this.updateTorrents('recently-active', fields);
+		}
+
+		if (args.torrents.length)
+			this.updateTorrents(args.torrents, fields);
+		if (args.removed.length)
+			this.updateFromTorrentGet([], args.removed);
+		if (args['session-changed'])
+			this.loadDaemonPrefs();
+
+		this.watchChanges(args.seq);
 	},
 
 	initializeTorrents: function()